@@ -0,0 +1,235 @@
+/*
+ * Lua RTOS, graphic display dirty tiles
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_GDISPLAY
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <gdisplay/dirty.h>
+
+// A run of dirty tiles, in tile units, with inclusive bounds
+typedef struct {
+	uint16_t c0;
+	uint16_t r0;
+	uint16_t c1;
+	uint16_t r1;
+} tile_run_t;
+
+static uint32_t *tiles = NULL; // Dirty tiles bitmap, one bit per tile, row by row
+static int words = 0;          // Words per tile row in bitmap
+static int cols = 0;           // Tile columns
+static int rows = 0;           // Tile rows
+static int width = 0;          // Display width
+static int height = 0;         // Display height
+static int dirty = 0;          // Number of dirty tiles
+
+// Runs open in the previous / current tile row, used by gdisplay_dirty_take
+static tile_run_t *prev_runs = NULL;
+static tile_run_t *curr_runs = NULL;
+
+#define tile_is_dirty(c, r) (tiles[(r) * words + ((c) >> 5)] & (1 << ((c) & 0x1f)))
+
+static inline void tile_mark(int c, int r) {
+	uint32_t *word = &tiles[r * words + (c >> 5)];
+	uint32_t mask = (1 << (c & 0x1f));
+
+	if (!(*word & mask)) {
+		*word |= mask;
+		dirty++;
+	}
+}
+
+int gdisplay_dirty_init(int nwidth, int nheight) {
+	int ncols = (nwidth + GDISPLAY_TILE_SIZE - 1) >> GDISPLAY_TILE_SHIFT;
+	int nrows = (nheight + GDISPLAY_TILE_SIZE - 1) >> GDISPLAY_TILE_SHIFT;
+	int nwords = (ncols + 31) >> 5;
+
+	if (tiles && (ncols == cols) && (nrows == rows)) {
+		width = nwidth;
+		height = nheight;
+
+		memset(tiles, 0, sizeof(uint32_t) * words * rows);
+		dirty = 0;
+
+		return 0;
+	}
+
+	free(tiles);
+	free(prev_runs);
+	free(curr_runs);
+
+	// At most (cols + 1) / 2 runs in a tile row
+	tiles = calloc(nwords * nrows, sizeof(uint32_t));
+	prev_runs = calloc((ncols + 1) / 2, sizeof(tile_run_t));
+	curr_runs = calloc((ncols + 1) / 2, sizeof(tile_run_t));
+
+	if (!tiles || !prev_runs || !curr_runs) {
+		free(tiles);
+		free(prev_runs);
+		free(curr_runs);
+
+		tiles = NULL;
+		prev_runs = NULL;
+		curr_runs = NULL;
+		cols = rows = 0;
+
+		return -1;
+	}
+
+	words = nwords;
+	cols = ncols;
+	rows = nrows;
+	width = nwidth;
+	height = nheight;
+	dirty = 0;
+
+	return 0;
+}
+
+void gdisplay_dirty_mark(int x0, int y0, int x1, int y1) {
+	int c, r;
+
+	if (!tiles) return;
+
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 >= width) x1 = width - 1;
+	if (y1 >= height) y1 = height - 1;
+
+	if ((x0 > x1) || (y0 > y1)) return;
+
+	for(r = (y0 >> GDISPLAY_TILE_SHIFT);r <= (y1 >> GDISPLAY_TILE_SHIFT);r++) {
+		for(c = (x0 >> GDISPLAY_TILE_SHIFT);c <= (x1 >> GDISPLAY_TILE_SHIFT);c++) {
+			tile_mark(c, r);
+		}
+	}
+}
+
+void gdisplay_dirty_mark_pixel(int x, int y) {
+	if (!tiles || (x < 0) || (y < 0) || (x >= width) || (y >= height)) return;
+
+	tile_mark(x >> GDISPLAY_TILE_SHIFT, y >> GDISPLAY_TILE_SHIFT);
+}
+
+int gdisplay_dirty_pending() {
+	return dirty;
+}
+
+// Store a run as a rectangle in pixels
+static void add_rect(gdisplay_rect_t *rects, int *n, int max, tile_run_t *run) {
+	gdisplay_rect_t rect;
+
+	rect.x0 = run->c0 << GDISPLAY_TILE_SHIFT;
+	rect.y0 = run->r0 << GDISPLAY_TILE_SHIFT;
+	rect.x1 = ((run->c1 + 1) << GDISPLAY_TILE_SHIFT) - 1;
+	rect.y1 = ((run->r1 + 1) << GDISPLAY_TILE_SHIFT) - 1;
+
+	if (rect.x1 >= width) rect.x1 = width - 1;
+	if (rect.y1 >= height) rect.y1 = height - 1;
+
+	if (*n < max) {
+		rects[(*n)++] = rect;
+	} else {
+		// No more room, merge into the last rectangle
+		gdisplay_rect_t *last = &rects[max - 1];
+
+		if (rect.x0 < last->x0) last->x0 = rect.x0;
+		if (rect.y0 < last->y0) last->y0 = rect.y0;
+		if (rect.x1 > last->x1) last->x1 = rect.x1;
+		if (rect.y1 > last->y1) last->y1 = rect.y1;
+	}
+}
+
+int gdisplay_dirty_take(gdisplay_rect_t *rects, int max) {
+	tile_run_t *prev = prev_runs;
+	tile_run_t *curr = curr_runs;
+	tile_run_t *tmp;
+	int nprev = 0, ncurr;
+	int n = 0;
+	int c, r, c0, i, j;
+
+	if (!tiles || !dirty) return 0;
+
+	for(r = 0;r < rows;r++) {
+		ncurr = 0;
+		j = 0;
+
+		// Runs are found from left to right, and so are the runs of the
+		// previous row, so each run is matched in a single pass
+		for(c = 0;c < cols;) {
+			if (!tile_is_dirty(c, r)) {
+				c++;
+				continue;
+			}
+
+			c0 = c;
+			while ((c < cols) && tile_is_dirty(c, r)) c++;
+
+			// Close runs of the previous row that end before this one
+			while ((j < nprev) && (prev[j].c0 < c0)) {
+				add_rect(rects, &n, max, &prev[j++]);
+			}
+
+			if ((j < nprev) && (prev[j].c0 == c0) && (prev[j].c1 == c - 1)) {
+				// Same bounds, extend the previous run down
+				curr[ncurr] = prev[j++];
+				curr[ncurr++].r1 = r;
+			} else {
+				curr[ncurr].c0 = c0;
+				curr[ncurr].c1 = c - 1;
+				curr[ncurr].r0 = r;
+				curr[ncurr++].r1 = r;
+			}
+		}
+
+		// Close runs of the previous row not continued
+		for(i = j;i < nprev;i++) {
+			add_rect(rects, &n, max, &prev[i]);
+		}
+
+		tmp = prev;
+		prev = curr;
+		curr = tmp;
+		nprev = ncurr;
+	}
+
+	for(i = 0;i < nprev;i++) {
+		add_rect(rects, &n, max, &prev[i]);
+	}
+
+	memset(tiles, 0, sizeof(uint32_t) * words * rows);
+	dirty = 0;
+
+	return n;
+}
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Lua RTOS, graphic display dirty tiles
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+/*
+ * Dirty region tracker for buffered displays.
+ *
+ * The display is split into tiles of GDISPLAY_TILE_SIZE x GDISPLAY_TILE_SIZE pixels,
+ * and each drawing operation marks the tiles that it touches. When the display is
+ * updated, the dirty tiles are merged into rectangles, so only the rectangles are
+ * sent to the display.
+ *
+ */
+
+#ifndef GDISPLAY_DIRTY_H_
+#define GDISPLAY_DIRTY_H_
+
+#include <stdint.h>
+
+#define GDISPLAY_TILE_SHIFT 4
+#define GDISPLAY_TILE_SIZE  (1 << GDISPLAY_TILE_SHIFT)
+
+// A rectangle, in pixels, with inclusive bounds
+typedef struct {
+	uint16_t x0;
+	uint16_t y0;
+	uint16_t x1;
+	uint16_t y1;
+} gdisplay_rect_t;
+
+/**
+ * @brief Allocate the tracker for a display, or reallocate it if the display
+ *        size changes. All tiles are marked as clean.
+ *
+ * @param width Display width, in pixels.
+ * @param height Display height, in pixels.
+ *
+ * @return -1 if not enough memory, 0 if ok
+ */
+int gdisplay_dirty_init(int width, int height);
+
+/**
+ * @brief Mark as dirty the tiles that overlap a rectangle. The rectangle is clipped
+ *        to the display bounds.
+ *
+ * @param x0, y0 Top-left corner, in pixels.
+ * @param x1, y1 Bottom-right corner, in pixels (inclusive).
+ */
+void gdisplay_dirty_mark(int x0, int y0, int x1, int y1);
+
+/**
+ * @brief Mark as dirty the tile that contains a pixel.
+ */
+void gdisplay_dirty_mark_pixel(int x, int y);
+
+/**
+ * @brief Get the number of dirty tiles.
+ */
+int gdisplay_dirty_pending();
+
+/**
+ * @brief Merge the dirty tiles into rectangles, and mark all tiles as clean. Tiles
+ *        are merged horizontally into runs, and runs with the same bounds in
+ *        consecutive tile rows are merged vertically. If there are more than
+ *        max rectangles, the last one is the union of the remaining ones.
+ *
+ * @param rects Array where rectangles are stored.
+ * @param max Number of elements in rects (must be > 0).
+ *
+ * @return Number of rectangles stored in rects.
+ */
+int gdisplay_dirty_take(gdisplay_rect_t *rects, int max);
+
+#endif /* GDISPLAY_DIRTY_H_ */
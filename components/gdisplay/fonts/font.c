@@ -68,6 +68,7 @@ static uint8_t *userfont = NULL;
 static int load_file_font(const char * fontfile, int info)
 {
 	if (userfont != NULL) {
+		gdisplay_glyph_flush(userfont);
 		free(userfont);
 		userfont = NULL;
 	}
@@ -445,6 +446,205 @@ static int getStringWidth(char* str) {
   }
 }
 
+// Adjust x, y for the special positions (RIGHT, CENTER, BOTTOM) of a w x h text
+static void alignText(int *x, int *y, int w, int h) {
+	gdisplay_caps_t *caps = gdisplay_ll_get_caps();
+
+	if (*x == RIGHT)
+		*x = caps->width - w - 2;
+	if (*x == CENTER)
+		*x = (caps->width - w - 2) / 2;
+	if (*y == BOTTOM)
+		*y = caps->height - h - 2;
+	if (*y == CENTER)
+		*y = (caps->height - (h / 2) - 2) / 2;
+}
+
+/*
+ * Glyph atlas and text cache (see glyph.h)
+ *
+ */
+
+// Can the current text be drawn from the glyph atlas? Glyphs are stored in
+// the frame buffer's pixel format and copied as blocks, so only opaque and
+// unrotated text, in a 16-bit frame buffer, is drawn from the atlas.
+static int useAtlas() {
+	gdisplay_caps_t *caps = gdisplay_ll_get_caps();
+
+	return (
+		(cfont.bitmap == 1) && (caps->bytes_per_pixel == 2) && gdisplay_get_buffered() &&
+		(gdisplay_get_rotation() == 0) && !gdisplay_get_transparency()
+	);
+}
+
+// Is a w x h block at x, y inside the clip window?
+static int insideClip(int x, int y, int w, int h) {
+	int x1, y1, x2, y2;
+
+	gdisplay_get_clip_window(&x1, &y1, &x2, &y2);
+
+	return ((x >= x1) && (y >= y1) && (x + w - 1 <= x2) && (y + h - 1 <= y2));
+}
+
+// Get a character of the current font from the atlas, rendering it on a miss.
+// The glyph is the whole character cell, background included, so its width is
+// the advance of the character.
+static gdisplay_glyph_t *getGlyph(uint8_t c, int color, int fill) {
+	gdisplay_glyph_t *glyph;
+	uint16_t fg, bg;
+	uint16_t ptr, temp;
+	uint8_t ch = 0, mask, fz;
+	int w, h, i, j, k, cx, cy;
+
+	glyph = gdisplay_glyph_get(cfont.font, c, color, fill, gdisplay_get_force_fixed());
+	if (glyph) {
+		return glyph;
+	}
+
+	if (cfont.x_size == 0) {
+		if (!getCharPtr(c)) {
+			return NULL;
+		}
+
+		w = fontChar.xDelta + 1;
+	} else {
+		w = cfont.x_size;
+	}
+
+	h = cfont.y_size;
+
+	glyph = gdisplay_glyph_put(cfont.font, c, color, fill, gdisplay_get_force_fixed(), w, h);
+	if (!glyph) {
+		return NULL;
+	}
+
+	// Get foreground and background in native format
+	gdisplay_set_bitmap_pixel(0, 0, color, (uint8_t *)glyph->pixels, w, h);
+	fg = glyph->pixels[0];
+
+	gdisplay_set_bitmap_pixel(0, 0, fill, (uint8_t *)glyph->pixels, w, h);
+	bg = glyph->pixels[0];
+
+	for(i = 0;i < w * h;i++) {
+		glyph->pixels[i] = bg;
+	}
+
+	// Decode the character, as printProportionalChar / printChar does. Characters
+	// with pixels out of its cell are not cached.
+	if (cfont.x_size == 0) {
+		ptr = fontChar.dataPtr;
+		mask = 0x80;
+
+		for (j = 0; j < fontChar.height; j++) {
+			for (i = 0; i < fontChar.width; i++) {
+				if (((i + (j * fontChar.width)) % 8) == 0) {
+					mask = 0x80;
+					ch = cfont.font[ptr++];
+				}
+
+				if ((ch & mask) != 0) {
+					cx = fontChar.xOffset + i;
+					cy = j + fontChar.adjYOffset;
+
+					if ((cx >= w) || (cy >= h)) {
+						gdisplay_glyph_drop(glyph);
+						return NULL;
+					}
+
+					glyph->pixels[cy * w + cx] = fg;
+				}
+				mask >>= 1;
+			}
+		}
+	} else {
+		fz = cfont.x_size / 8;
+		if (cfont.x_size % 8)
+			fz++;
+
+		temp = ((c - cfont.offset) * ((fz) * cfont.y_size)) + 4;
+
+		for (j = 0; j < cfont.y_size; j++) {
+			for (k = 0; k < fz; k++) {
+				ch = cfont.font[temp + k];
+				mask = 0x80;
+				for (i = 0; i < 8; i++) {
+					if ((ch & mask) != 0) {
+						cx = i + (k * 8);
+
+						if (cx >= w) {
+							gdisplay_glyph_drop(glyph);
+							return NULL;
+						}
+
+						glyph->pixels[j * w + cx] = fg;
+					}
+					mask >>= 1;
+				}
+			}
+			temp += (fz);
+		}
+	}
+
+	return glyph;
+}
+
+// Copy a character from the atlas. Returns the character advance, or 0 if
+// the character must be drawn pixel by pixel.
+static int blitChar(uint8_t c, int x, int y, int color, int fill) {
+	gdisplay_glyph_t *glyph = getGlyph(c, color, fill);
+
+	if (!glyph || !insideClip(x, y, glyph->w, glyph->h)) {
+		return 0;
+	}
+
+	gdisplay_set_bitmap(x, y, (uint8_t *)glyph->pixels, glyph->w, glyph->h);
+
+	return glyph->w;
+}
+
+// Get a string from the text cache, composing it from the atlas on a miss.
+// Only single line strings are cached.
+static gdisplay_glyph_t *getText(const char *st, int color, int fill) {
+	gdisplay_glyph_t *text, *glyph;
+	const char *c;
+	uint8_t ch;
+	int x, j;
+
+	if (strpbrk(st, "\r\n")) {
+		return NULL;
+	}
+
+	text = gdisplay_text_get(cfont.font, st, color, fill, gdisplay_get_force_fixed());
+	if (text) {
+		return text;
+	}
+
+	text = gdisplay_text_put(cfont.font, st, color, fill, gdisplay_get_force_fixed(), getStringWidth((char *)st), cfont.y_size);
+	if (!text) {
+		return NULL;
+	}
+
+	for(c = st, x = 0;*c;c++) {
+		ch = *c;
+		if ((cfont.x_size != 0) && ((ch < cfont.offset) || ((ch - cfont.offset) > cfont.numchars)))
+			ch = cfont.offset;
+
+		glyph = getGlyph(ch, color, fill);
+		if (!glyph || (x + glyph->w > text->w)) {
+			gdisplay_glyph_drop(text);
+			return NULL;
+		}
+
+		for(j = 0;j < text->h;j++) {
+			memcpy(&text->pixels[j * text->w + x], &glyph->pixels[j * glyph->w], glyph->w * sizeof(uint16_t));
+		}
+
+		x += glyph->w;
+	}
+
+	return text;
+}
+
 /*
  * Operation functions
  */
@@ -514,8 +714,8 @@ driver_error_t *gdisplay_get_font_height(int *height) {
 }
 
 driver_error_t *gdisplay_print(int x, int y, char *st, int color, int fill) {
-	int stl, i, tmpw, tmph, fh;
-	uint8_t ch;
+	int stl, i, tmpw, tmph, fh, adv;
+	uint8_t ch, atlas;
 
 	// Sanity checks
 	if (!gdisplay_is_init()) {
@@ -532,6 +732,28 @@ driver_error_t *gdisplay_print(int x, int y, char *st, int color, int fill) {
 	if ((gdisplay_get_rotation() != 0) && ((x < -2) || (y < -2)))
 		return NULL;
 
+	// Single line strings are copied from the text cache, if possible
+	atlas = useAtlas();
+	if (atlas) {
+		gdisplay_glyph_t *text = getText(st, color, fill);
+
+		if (text) {
+			int tx = x, ty = y;
+
+			alignText(&tx, &ty, text->w, text->h);
+
+			if (((tx + text->w) <= caps->width) && insideClip(tx, ty, text->w, text->h)) {
+				gdisplay_begin();
+				gdisplay_set_bitmap(tx, ty, (uint8_t *)text->pixels, text->w, text->h);
+				gdisplay_end();
+
+				gdisplay_set_cursor(tx + text->w, ty);
+
+				return NULL;
+			}
+		}
+	}
+
 	stl = strlen(st); // number of characters in string to print
 
 	// set CENTER or RIGHT possition
@@ -542,14 +764,7 @@ driver_error_t *gdisplay_print(int x, int y, char *st, int color, int fill) {
 		fh = (3 * (2 * cfont.y_size + 1)) + (2 * cfont.x_size); // character height
 	}
 
-	if (x == RIGHT)
-		x = caps->width - tmpw - 2;
-	if (x == CENTER)
-		x = (caps->width - tmpw - 2) / 2;
-	if (y == BOTTOM)
-		y = caps->height - fh - 2;
-	if (y == CENTER)
-		y = (caps->height - (fh / 2) - 2) / 2;
+	alignText(&x, &y, tmpw, fh);
 
 	int cursorx = x;
 	int cursory = y;
@@ -611,7 +826,10 @@ driver_error_t *gdisplay_print(int x, int y, char *st, int color, int fill) {
 			if (cfont.x_size == 0) {
 				// == proportional font
 				if (gdisplay_get_rotation() == 0) {
-					cursorx += printProportionalChar(cursorx, cursory, color, fill) + 1;
+					if (atlas && (adv = blitChar(ch, cursorx, cursory, color, fill)))
+						cursorx += adv;
+					else
+						cursorx += printProportionalChar(cursorx, cursory, color, fill) + 1;
 				} else {
 					offset += rotatePropChar(x, y, offset, color, fill);
 					gdisplay_set_offset(offset);
@@ -624,7 +842,8 @@ driver_error_t *gdisplay_print(int x, int y, char *st, int color, int fill) {
 							|| ((ch - cfont.offset) > cfont.numchars))
 						ch = cfont.offset;
 					if (gdisplay_get_rotation() == 0) {
-						printChar(ch, cursorx, cursory, color, fill);
+						if (!atlas || !blitChar(ch, cursorx, cursory, color, fill))
+							printChar(ch, cursorx, cursory, color, fill);
 						cursorx += tmpw;
 					} else
 						rotateChar(ch, x, y, i, color, fill);
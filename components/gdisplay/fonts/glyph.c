@@ -0,0 +1,264 @@
+/*
+ * Lua RTOS, glyph atlas and text cache
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_GDISPLAY
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <gdisplay/fonts/glyph.h>
+
+#define GLYPH_BUCKETS 32
+
+typedef struct {
+	gdisplay_glyph_t *head;                   // Most recently used
+	gdisplay_glyph_t *tail;                   // Least recently used
+	gdisplay_glyph_t *bucket[GLYPH_BUCKETS];
+	uint32_t max;                             // Max bytes
+	uint32_t bytes;                           // Used bytes
+	uint32_t count;
+	uint32_t hits;
+	uint32_t misses;
+} glyph_cache_t;
+
+static glyph_cache_t atlas = {.max = CONFIG_LUA_RTOS_GDISPLAY_GLYPH_ATLAS};
+static glyph_cache_t strings = {.max = CONFIG_LUA_RTOS_GDISPLAY_TEXT_CACHE};
+static uint32_t evictions = 0;
+
+/*
+ * Helper functions
+ */
+
+// FNV-1a
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t *)data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+static uint32_t hash_key(const uint8_t *font, uint32_t code, const char *text, uint32_t color, uint32_t fill, uint8_t fixed) {
+	uint32_t hash = 2166136261U;
+
+	hash = hash_bytes(hash, &font, sizeof(font));
+	if (text) {
+		hash = hash_bytes(hash, text, strlen(text));
+	} else {
+		hash = hash_bytes(hash, &code, sizeof(code));
+	}
+	hash = hash_bytes(hash, &color, sizeof(color));
+	hash = hash_bytes(hash, &fill, sizeof(fill));
+	hash = hash_bytes(hash, &fixed, sizeof(fixed));
+
+	return hash;
+}
+
+static void lru_unlink(glyph_cache_t *cache, gdisplay_glyph_t *glyph) {
+	if (glyph->prev) glyph->prev->next = glyph->next;
+	else cache->head = glyph->next;
+
+	if (glyph->next) glyph->next->prev = glyph->prev;
+	else cache->tail = glyph->prev;
+
+	glyph->prev = NULL;
+	glyph->next = NULL;
+}
+
+static void lru_push(glyph_cache_t *cache, gdisplay_glyph_t *glyph) {
+	glyph->prev = NULL;
+	glyph->next = cache->head;
+
+	if (cache->head) cache->head->prev = glyph;
+	else cache->tail = glyph;
+
+	cache->head = glyph;
+}
+
+static void remove_entry(glyph_cache_t *cache, gdisplay_glyph_t *glyph) {
+	gdisplay_glyph_t **link = &cache->bucket[glyph->hash % GLYPH_BUCKETS];
+
+	while (*link && (*link != glyph)) {
+		link = &(*link)->chain;
+	}
+
+	if (*link) {
+		*link = glyph->chain;
+	}
+
+	lru_unlink(cache, glyph);
+
+	cache->bytes -= glyph->size;
+	cache->count--;
+
+	free(glyph);
+}
+
+static gdisplay_glyph_t *lookup(glyph_cache_t *cache, const uint8_t *font, uint32_t code, const char *text, uint32_t color, uint32_t fill, uint8_t fixed) {
+	uint32_t hash = hash_key(font, code, text, color, fill, fixed);
+	gdisplay_glyph_t *glyph;
+
+	for(glyph = cache->bucket[hash % GLYPH_BUCKETS];glyph;glyph = glyph->chain) {
+		if (
+			(glyph->hash == hash) && (glyph->font == font) && (glyph->color == color) &&
+			(glyph->fill == fill) && (glyph->fixed == fixed) &&
+			(text?(strcmp(glyph->text, text) == 0):(glyph->code == code))
+		) {
+			// Most recently used goes first
+			if (cache->head != glyph) {
+				lru_unlink(cache, glyph);
+				lru_push(cache, glyph);
+			}
+
+			cache->hits++;
+
+			return glyph;
+		}
+	}
+
+	cache->misses++;
+
+	return NULL;
+}
+
+static gdisplay_glyph_t *insert(glyph_cache_t *cache, const uint8_t *font, uint32_t code, const char *text, uint32_t color, uint32_t fill, uint8_t fixed, int w, int h) {
+	gdisplay_glyph_t *glyph;
+	uint32_t pixels, size;
+
+	if ((w <= 0) || (h <= 0)) {
+		return NULL;
+	}
+
+	// Entry, pixels and text are allocated in a single block
+	pixels = (((sizeof(gdisplay_glyph_t) + 3) / 4) * 4);
+	size = pixels + w * h * sizeof(uint16_t) + (text?(strlen(text) + 1):0);
+
+	if (size > cache->max) {
+		return NULL;
+	}
+
+	// Evict least recently used entries until the new one fits
+	while (cache->tail && (cache->bytes + size > cache->max)) {
+		remove_entry(cache, cache->tail);
+		evictions++;
+	}
+
+	glyph = malloc(size);
+	if (!glyph) {
+		return NULL;
+	}
+
+	memset(glyph, 0, sizeof(gdisplay_glyph_t));
+
+	glyph->w = w;
+	glyph->h = h;
+	glyph->pixels = (uint16_t *)((uint8_t *)glyph + pixels);
+	glyph->hash = hash_key(font, code, text, color, fill, fixed);
+	glyph->size = size;
+	glyph->font = font;
+	glyph->code = code;
+	glyph->color = color;
+	glyph->fill = fill;
+	glyph->fixed = fixed;
+
+	if (text) {
+		glyph->text = (char *)glyph->pixels + w * h * sizeof(uint16_t);
+		strcpy((char *)glyph->text, text);
+	}
+
+	glyph->chain = cache->bucket[glyph->hash % GLYPH_BUCKETS];
+	cache->bucket[glyph->hash % GLYPH_BUCKETS] = glyph;
+
+	lru_push(cache, glyph);
+
+	cache->bytes += size;
+	cache->count++;
+
+	return glyph;
+}
+
+static void flush(glyph_cache_t *cache, const uint8_t *font) {
+	gdisplay_glyph_t *glyph, *next;
+
+	for(glyph = cache->head;glyph;glyph = next) {
+		next = glyph->next;
+
+		if (!font || (glyph->font == font)) {
+			remove_entry(cache, glyph);
+		}
+	}
+}
+
+/*
+ * Operation functions
+ */
+
+gdisplay_glyph_t *gdisplay_glyph_get(const uint8_t *font, uint32_t code, uint32_t color, uint32_t fill, uint8_t fixed) {
+	return lookup(&atlas, font, code, NULL, color, fill, fixed);
+}
+
+gdisplay_glyph_t *gdisplay_glyph_put(const uint8_t *font, uint32_t code, uint32_t color, uint32_t fill, uint8_t fixed, int w, int h) {
+	return insert(&atlas, font, code, NULL, color, fill, fixed, w, h);
+}
+
+gdisplay_glyph_t *gdisplay_text_get(const uint8_t *font, const char *text, uint32_t color, uint32_t fill, uint8_t fixed) {
+	return lookup(&strings, font, 0, text, color, fill, fixed);
+}
+
+gdisplay_glyph_t *gdisplay_text_put(const uint8_t *font, const char *text, uint32_t color, uint32_t fill, uint8_t fixed, int w, int h) {
+	return insert(&strings, font, 0, text, color, fill, fixed, w, h);
+}
+
+void gdisplay_glyph_drop(gdisplay_glyph_t *glyph) {
+	remove_entry(glyph->text?&strings:&atlas, glyph);
+}
+
+void gdisplay_glyph_flush(const uint8_t *font) {
+	flush(&atlas, font);
+	flush(&strings, font);
+}
+
+void gdisplay_glyph_stats(gdisplay_glyph_stats_t *stats) {
+	stats->glyph_hits = atlas.hits;
+	stats->glyph_misses = atlas.misses;
+	stats->glyphs = atlas.count;
+	stats->glyph_bytes = atlas.bytes;
+	stats->text_hits = strings.hits;
+	stats->text_misses = strings.misses;
+	stats->texts = strings.count;
+	stats->text_bytes = strings.bytes;
+	stats->evictions = evictions;
+}
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * Lua RTOS, glyph atlas and text cache
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+/*
+ * Glyph atlas and text cache.
+ *
+ * The atlas holds glyphs already expanded to the display's native pixel format,
+ * keyed by (font, character, color, background), so a character can be copied
+ * to the frame buffer as a block instead of being decoded bit by bit. The text
+ * cache holds whole rendered strings, keyed by (font, text, color, background),
+ * so redrawing the same string is a single copy.
+ *
+ * Both caches are bounded in bytes, and the least recently used entries are
+ * evicted first.
+ *
+ */
+
+#ifndef GDISPLAY_GLYPH_H_
+#define GDISPLAY_GLYPH_H_
+
+#include <stdint.h>
+
+typedef struct gdisplay_glyph {
+	uint16_t w;                    // Width, in pixels
+	uint16_t h;                    // Height, in pixels
+	uint16_t *pixels;              // w * h pixels, row by row, in native format
+
+	// Internal
+	struct gdisplay_glyph *prev;   // LRU list, most recently used first
+	struct gdisplay_glyph *next;
+	struct gdisplay_glyph *chain;  // Hash bucket chain
+	uint32_t hash;
+	uint32_t size;                 // Allocated bytes
+	const uint8_t *font;
+	uint32_t code;                 // Character code, for glyphs
+	const char *text;              // Text, for strings
+	uint32_t color;
+	uint32_t fill;
+	uint8_t fixed;                 // Forced fixed width?
+} gdisplay_glyph_t;
+
+typedef struct {
+	uint32_t glyph_hits;
+	uint32_t glyph_misses;
+	uint32_t glyphs;       // Glyphs in the atlas
+	uint32_t glyph_bytes;  // Bytes used by the atlas
+	uint32_t text_hits;
+	uint32_t text_misses;
+	uint32_t texts;        // Strings in the text cache
+	uint32_t text_bytes;   // Bytes used by the text cache
+	uint32_t evictions;
+} gdisplay_glyph_stats_t;
+
+/**
+ * @brief Look up a glyph in the atlas.
+ *
+ * @return The glyph, or NULL if it is not in the atlas.
+ */
+gdisplay_glyph_t *gdisplay_glyph_get(const uint8_t *font, uint32_t code, uint32_t color, uint32_t fill, uint8_t fixed);
+
+/**
+ * @brief Add a glyph to the atlas, evicting the least recently used glyphs if
+ *        needed. The pixels are not initialized, the caller must render them.
+ *
+ * @return The glyph, or NULL if it doesn't fit in the atlas or there is not
+ *         enough memory.
+ */
+gdisplay_glyph_t *gdisplay_glyph_put(const uint8_t *font, uint32_t code, uint32_t color, uint32_t fill, uint8_t fixed, int w, int h);
+
+/**
+ * @brief Look up a rendered string in the text cache.
+ *
+ * @return The string, or NULL if it is not in the cache.
+ */
+gdisplay_glyph_t *gdisplay_text_get(const uint8_t *font, const char *text, uint32_t color, uint32_t fill, uint8_t fixed);
+
+/**
+ * @brief Add a rendered string to the text cache, evicting the least recently
+ *        used strings if needed. The pixels are not initialized, the caller must
+ *        render them.
+ *
+ * @return The string, or NULL if it doesn't fit in the cache or there is not
+ *         enough memory.
+ */
+gdisplay_glyph_t *gdisplay_text_put(const uint8_t *font, const char *text, uint32_t color, uint32_t fill, uint8_t fixed, int w, int h);
+
+/**
+ * @brief Remove a glyph or string returned by a put function, if it can't be
+ *        rendered.
+ */
+void gdisplay_glyph_drop(gdisplay_glyph_t *glyph);
+
+/**
+ * @brief Remove all the glyphs and strings of a font, for example when a user
+ *        font is unloaded. If font is NULL, both caches are emptied.
+ */
+void gdisplay_glyph_flush(const uint8_t *font);
+
+/**
+ * @brief Get the cache statistics.
+ */
+void gdisplay_glyph_stats(gdisplay_glyph_stats_t *stats);
+
+#endif /* GDISPLAY_GLYPH_H_ */
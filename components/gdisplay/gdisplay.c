@@ -61,6 +61,7 @@ static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
 static uint8_t *buffer = NULL;     // Frame buffer, if used
 static int bbx1, bbx2, bby1, bby2; // Frame buffer bounding box to update
 static uint8_t nested = 0;		   // Display is only updated when nested == 0
+static uint8_t tiles = 0;          // Dirty tiles are tracked for the frame buffer? (see dirty.h)
 
 // Supported display devices
 static const gdisplay_t displaydevs[] = {
@@ -116,7 +117,9 @@ DRIVER_REGISTER_END(GDISPLAY,gdisplay,NULL,NULL,NULL);
  * Helper functions
  */
 static void gdisplay_update() {
-	if (buffer) {
+	if (buffer && tiles) {
+		gdisplay_ll_flush((uint8_t *)buffer);
+	} else if (buffer) {
 		gdisplay_ll_update(bbx1, bby1, bbx2, bby2, (uint8_t *)buffer);
 	} else {
 		gdisplay_ll_update(bbx1, bby1, bbx2, bby2, NULL);
@@ -148,6 +151,10 @@ void gdisplay_set_bitmap(int x, int y, uint8_t *buff, int buffw, int buffh) {
 	if (y < bby1) bby1 = y;
 	if (y + buffh - 1 > bby2) bby2 = y + buffh - 1;
 
+	if (tiles) {
+		gdisplay_dirty_mark(x, y, x + buffw - 1, y + buffh - 1);
+	}
+
 	gdisplay_ll_set_bitmap(x, y, buffer?buffer:NULL, buff, buffw, buffh);
 }
 
@@ -167,6 +174,10 @@ driver_error_t *gdisplay_set_pixel(int x, int y, uint32_t color) {
 		if (x > bbx2) bbx2 = x;
 		if (y < bby1) bby1 = y;
 		if (y > bby2) bby2 = y;
+
+		if (tiles) {
+			gdisplay_dirty_mark_pixel(x, y);
+		}
 	}
 
 	gdisplay_begin();
@@ -176,6 +187,66 @@ driver_error_t *gdisplay_set_pixel(int x, int y, uint32_t color) {
 	return NULL;
 }
 
+/*
+ * Spans
+ *
+ * Primitives are rasterized into horizontal and vertical spans. A span is
+ * clipped to the display window, and accounted in the bounding box / dirty
+ * tiles once, instead of once per pixel.
+ *
+ */
+void gdisplay_hspan(int x0, int x1, int y, uint32_t color) {
+	if (x0 > x1) swap(x0, x1);
+
+	// Clip to the display window
+	if ((y < dispWin.y1) || (y > dispWin.y2)) return;
+	if (x0 < dispWin.x1) x0 = dispWin.x1;
+	if (x1 > dispWin.x2) x1 = dispWin.x2;
+	if (x0 > x1) return;
+
+	// Update bound box, only if frame buffer is used
+	if (buffer) {
+		if (x0 < bbx1) bbx1 = x0;
+		if (x1 > bbx2) bbx2 = x1;
+		if (y < bby1) bby1 = y;
+		if (y > bby2) bby2 = y;
+
+		if (tiles) {
+			gdisplay_dirty_mark(x0, y, x1, y);
+		}
+	}
+
+	gdisplay_begin();
+	gdisplay_ll_hspan(x0, x1, y, color, buffer?buffer:NULL);
+	gdisplay_end();
+}
+
+void gdisplay_vspan(int x, int y0, int y1, uint32_t color) {
+	if (y0 > y1) swap(y0, y1);
+
+	// Clip to the display window
+	if ((x < dispWin.x1) || (x > dispWin.x2)) return;
+	if (y0 < dispWin.y1) y0 = dispWin.y1;
+	if (y1 > dispWin.y2) y1 = dispWin.y2;
+	if (y0 > y1) return;
+
+	// Update bound box, only if frame buffer is used
+	if (buffer) {
+		if (x < bbx1) bbx1 = x;
+		if (x > bbx2) bbx2 = x;
+		if (y0 < bby1) bby1 = y0;
+		if (y1 > bby2) bby2 = y1;
+
+		if (tiles) {
+			gdisplay_dirty_mark(x, y0, x, y1);
+		}
+	}
+
+	gdisplay_begin();
+	gdisplay_ll_vspan(x, y0, y1, color, buffer?buffer:NULL);
+	gdisplay_end();
+}
+
 driver_error_t *gdisplay_get_pixel(int x, int y, uint32_t *color) {
 	// Avoid pixels out of the display window
 	if ((x < dispWin.x1) || (y < dispWin.y1) || (x > dispWin.x2) || (y > dispWin.y2)) {
@@ -266,6 +337,15 @@ driver_error_t *gdisplay_init(uint8_t chipset, uint8_t orient, uint8_t buffered,
 		bbx2 = -1;
 		bby1 = 5000;
 		bby2 = -1;
+
+		// Only changed tiles are sent to color SPI displays. If there is
+		// not enough memory for the tracker, the bounding box is sent.
+		if ((caps->bytes_per_pixel == 2) && (caps->interface == GDisplaySPIInterface)) {
+			tiles = (gdisplay_dirty_init(caps->width, caps->height) == 0);
+			if (tiles) {
+				gdisplay_ll_flush_setup();
+			}
+		}
 	}
 
 	orientation = orient;
@@ -583,6 +663,10 @@ uint8_t gdisplay_get_wrap() {
 	return wrap;
 }
 
+uint8_t gdisplay_get_buffered() {
+	return (buffer != NULL);
+}
+
 int gdisplay_get_offset() {
 	return offset;
 }
@@ -611,6 +695,11 @@ driver_error_t *gdisplay_set_orientation(uint16_t orient) {
 	orientation = orient;
 	gdisplay_ll_set_orientation(orient);
 
+	// Width and height can be swapped
+	if (tiles) {
+		tiles = (gdisplay_dirty_init(caps->width, caps->height) == 0);
+	}
+
 	dispWin.x1 = 0;
 	dispWin.y1 = 0;
 	dispWin.x2 = caps->width - 1;
@@ -36,7 +36,9 @@
 
 #include <gdisplay/primitives/primitives.h>
 #include <gdisplay/fonts/font.h>
+#include <gdisplay/fonts/glyph.h>
 #include <gdisplay/image/image.h>
+#include <gdisplay/dirty.h>
 
 #include <sys/driver.h>
 
@@ -188,6 +190,8 @@ void gdisplay_end();
 
 driver_error_t *gdisplay_get_pixel(int x, int y, uint32_t *color);
 driver_error_t *gdisplay_set_pixel(int x, int y, uint32_t color);
+void gdisplay_hspan(int x0, int x1, int y, uint32_t color);
+void gdisplay_vspan(int x, int y0, int y1, uint32_t color);
 driver_error_t *gdisplay_set_font(uint8_t font, const char *file);
 driver_error_t *gdisplay_write_char(int x, int y, char c);
 driver_error_t *gdisplay_write(int x, int y, const char *str);
@@ -214,6 +218,7 @@ void gdisplay_set_transparency(uint8_t ntransparent);
 uint8_t gdisplay_get_transparency();
 void gdisplay_set_wrap(uint8_t nwrap);
 uint8_t gdisplay_get_wrap();
+uint8_t gdisplay_get_buffered();
 int gdisplay_get_offset();
 void gdisplay_set_offset(int offset);
 uint16_t gdisplay_get_rotation();
@@ -83,4 +83,65 @@ driver_error_t *gdisplay_image_type(const char *fname, image_type *type) {
 
 }
 
+// Copy a block of pixels, in native format, clipped to the display window
+void gdisplay_image_blit(int x, int y, uint16_t *pixels, int w, int h) {
+	int x1, y1, x2, y2;
+	int cx0, cy0, cx1, cy1;
+	int row;
+
+	gdisplay_get_clip_window(&x1, &y1, &x2, &y2);
+
+	cx0 = max(x, x1);
+	cy0 = max(y, y1);
+	cx1 = min(x + w - 1, x2);
+	cy1 = min(y + h - 1, y2);
+
+	if ((cx0 > cx1) || (cy0 > cy1)) {
+		return;
+	}
+
+	gdisplay_begin();
+
+	if ((cx0 == x) && (cx1 == x + w - 1)) {
+		// Whole rows are visible, copy them as a single block
+		gdisplay_set_bitmap(x, cy0, (uint8_t *)(pixels + (cy0 - y) * w), w, cy1 - cy0 + 1);
+	} else {
+		for(row = cy0;row <= cy1;row++) {
+			gdisplay_set_bitmap(cx0, row, (uint8_t *)(pixels + (row - y) * w + (cx0 - x)), cx1 - cx0 + 1, 1);
+		}
+	}
+
+	gdisplay_end();
+}
+
+driver_error_t *gdisplay_image_draw(int x, int y, gdisplay_image_t *image) {
+	// Sanity checks
+	if (!gdisplay_is_init()) {
+		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IS_NOT_SETUP, "init display first");
+	}
+
+	gdisplay_caps_t *caps = gdisplay_ll_get_caps();
+
+	if (x == CENTER)
+		x = (caps->width - image->width) / 2;
+	else if (x == RIGHT)
+		x = caps->width - image->width;
+
+	if (y == CENTER)
+		y = (caps->height - image->height) / 2;
+	else if (y == BOTTOM)
+		y = caps->height - image->height;
+
+	gdisplay_image_blit(x, y, image->pixels, image->width, image->height);
+
+	return NULL;
+}
+
+void gdisplay_image_free(gdisplay_image_t *image) {
+	if (image) {
+		free(image->pixels);
+		free(image);
+	}
+}
+
 #endif
@@ -48,8 +48,21 @@ typedef struct {
     uint8_t *membuff;	// memory buffer containing the image
     uint32_t bufsize;	// size of the memory buffer
     uint32_t bufptr;	// memory buffer current possition
+    uint16_t *band;		// output buffer, a band of MCU rows or the whole image
+    uint16_t bandw;		// output buffer width
+    uint16_t bandh;		// output buffer height
+    int bandy;			// image row of the band's first row, -1 if band is empty
+    uint16_t rows;		// rows in band
+    uint8_t offscreen;	// output buffer is an offscreen image?
 } JPGIODEV;
 
+// An image decoded into RAM, in the display's native pixel format
+typedef struct {
+	uint16_t width;
+	uint16_t height;
+	uint16_t *pixels;
+} gdisplay_image_t;
+
 typedef enum {
 	UNKNOWImage,
 	BMPImage,
@@ -60,5 +73,9 @@ driver_error_t *gdisplay_image_type(const char *fname, image_type *type);
 driver_error_t *gdisplay_image_bmp(int x, int y, const char *fname);
 driver_error_t *gdisplay_image_jpg(int x, int y, int8_t maxscale, const char *fname);
 driver_error_t *gdisplay_image_raw(int x, int y, int xsize, int ysize, const char *fname);
+driver_error_t *gdisplay_image_jpg_load(const char *fname, int8_t maxscale, int maxw, int maxh, gdisplay_image_t **image);
+driver_error_t *gdisplay_image_draw(int x, int y, gdisplay_image_t *image);
+void gdisplay_image_free(gdisplay_image_t *image);
+void gdisplay_image_blit(int x, int y, uint16_t *pixels, int w, int h);
 
 #endif
@@ -52,8 +52,17 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <machine/endian.h>
+
 #include <sys/stat.h>
 
+#include "esp_heap_caps.h"
+
+// Size of the stdio buffer used to read the image file. TJpgDec reads the
+// stream in chunks of JD_SZBUF bytes, so larger reads from the VFS are done
+// by stdio.
+#define JPG_READ_BUFFER 4096
+
 static UINT tjd_input (
 	JDEC* jd,		// Decompression object
 	BYTE* buff,		// Pointer to the read buffer (NULL:skip)
@@ -78,29 +87,6 @@ static UINT tjd_input (
 	}
 }
 
-static UINT tjd_buf_input (
-	JDEC* jd,		// Decompression object
-	BYTE* buff,		// Pointer to the read buffer (NULL:skip)
-	UINT nd			// Number of bytes to read/skip from input stream
-)
-{
-	// Device identifier for the session (5th argument of jd_prepare function)
-	JPGIODEV *dev = (JPGIODEV*)jd->device;
-	if (!dev->membuff) return 0;
-	if (dev->bufptr >= (dev->bufsize + 2)) return 0; // end of stream
-
-	if ((dev->bufptr + nd) > (dev->bufsize + 2)) nd = (dev->bufsize + 2) - dev->bufptr;
-
-	if (buff) {	// Read nd bytes from the input strem
-		memcpy(buff, dev->membuff + dev->bufptr, nd);
-		dev->bufptr += nd;
-		return nd;	// Returns number of bytes read
-	} else {	// Remove nd bytes from the input stream
-		dev->bufptr += nd;
-		return nd;
-	}
-}
-
 static UINT tjd_output (
 	JDEC* jd,		// Decompression object of current session
 	void* bitmap,	// Bitmap data to be output
@@ -139,9 +125,125 @@ static UINT tjd_output (
 	return 1;	// Continue to decompression
 }
 
+// Send the rows of the band to the display, in a single block
+static void tjd_band_flush(JPGIODEV *dev) {
+	if (dev->rows > 0) {
+		gdisplay_image_blit(dev->x, dev->y + dev->bandy, dev->band, dev->bandw, dev->rows);
+	}
+
+	dev->bandy = -1;
+	dev->rows = 0;
+}
+
+// Put a MCU block into the band, converted to the display's native pixel format.
+// MCU blocks come from left to right, and from top to bottom, so when a block
+// of a new MCU row arrives, the band holds a complete MCU row that is sent to
+// the display. For offscreen images the band is the whole image.
+static UINT tjd_band_output (
+	JDEC* jd,		// Decompression object of current session
+	void* bitmap,	// Bitmap data to be output
+	JRECT* rect		// Rectangular region to output
+)
+{
+	JPGIODEV *dev = (JPGIODEV*)jd->device;
+	gdisplay_caps_t *caps = gdisplay_ll_get_caps();
+
+	uint8_t *src = (uint8_t*)bitmap;
+	uint16_t *dst;
+	uint16_t color;
+	int x, y, row;
+
+	if (dev->offscreen) {
+		dev->bandy = 0;
+	} else {
+		if ((dev->bandy >= 0) && (rect->top != dev->bandy)) {
+			tjd_band_flush(dev);
+		}
+
+		if (dev->bandy < 0) {
+			dev->bandy = rect->top;
+		}
+	}
+
+	row = rect->top - dev->bandy;
+
+	if ((rect->right >= dev->bandw) || (row + rect->bottom - rect->top >= dev->bandh)) {
+		return 0;	// Interrupt decompression
+	}
+
+	for (y = rect->top; y <= rect->bottom; y++) {
+		dst = dev->band + (y - dev->bandy) * dev->bandw + rect->left;
+
+		for (x = rect->left; x <= rect->right; x++) {
+			// Convert color to display color (see gdisplay_rgb_to_color)
+			color = (
+				((src[0] >> (8 - caps->rdepth)) << (caps->gdepth + caps->bdepth)) |
+				((src[1] >> (8 - caps->gdepth)) << (caps->bdepth)) |
+				(src[2] >> (8 - caps->bdepth))
+			);
+
+			// Take care about endianness
+			if (BYTE_ORDER == LITTLE_ENDIAN) {
+				color = (color >> 8) | (color << 8);
+			}
+
+			*dst++ = color;
+			src += 3;
+		}
+	}
+
+	if (row + rect->bottom - rect->top + 1 > dev->rows) {
+		dev->rows = row + rect->bottom - rect->top + 1;
+	}
+
+	return 1;	// Continue to decompression
+}
+
+// Open a JPEG file, and prepare the decompression
+static driver_error_t *jpg_open(const char *fname, JPGIODEV *dev, JDEC *jd, char **work) {
+	UINT sz_work = 3800;	// Size of the working buffer
+
+	memset(dev, 0, sizeof(JPGIODEV));
+
+	dev->bandy = -1;
+
+	dev->fhndl = fopen(fname, "r");
+	if (!dev->fhndl) {
+		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IMAGE, strerror(errno));
+	}
+
+	// Read from the VFS in large chunks
+	setvbuf(dev->fhndl, NULL, _IOFBF, JPG_READ_BUFFER);
+
+	*work = malloc(sz_work);
+	if (!*work) {
+		fclose(dev->fhndl);
+		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	if (jd_prepare(jd, tjd_input, (void *)*work, sz_work, dev) != JDR_OK) {
+		free(*work);
+		fclose(dev->fhndl);
+		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IMG_PROCESSING_ERROR, "prepare error");
+	}
+
+	return NULL;
+}
+
+// Get the lowest scale, up to maxscale, at which the image fits in w x h
+static BYTE jpg_fit(JDEC *jd, int8_t maxscale, int w, int h) {
+	BYTE scale;
+
+	for (scale = 0; scale < maxscale; scale++) {
+		if (((jd->width >> scale) <= w) && ((jd->height >> scale) <= h)) break;
+	}
+
+	return scale;
+}
+
 driver_error_t *gdisplay_image_jpg(int x, int y, int8_t maxscale, const char *fname) {
+	driver_error_t *error;
 	char *work;				// Pointer to the working buffer (must be 4-byte aligned)
-	UINT sz_work = 3800;	// Size of the working buffer (must be power of 2)
 	JDEC jd;				// Decompression object (70 bytes)
 	JRESULT rc;
 	BYTE scale = 0;
@@ -161,122 +263,166 @@ driver_error_t *gdisplay_image_jpg(int x, int y, int8_t maxscale, const char *fn
 		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IMAGE, "display only support 2 colors");
 	}
 
-	// Image from file
-    dev.membuff = NULL;
-    dev.bufsize = 0;
-
-    dev.fhndl = fopen(fname, "r");
-    if (!dev.fhndl) {
-		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IMAGE, strerror(errno));
-    }
-
 	// Adjust position
 	if ((x < 0) && (x != CENTER) && (x != RIGHT)) x = 0;
 	if ((y < 0) && (y != CENTER) && (y != BOTTOM)) y = 0;
 	if (x > (caps->width-5)) x = caps->width - 5;
 	if (y > (caps->height-5)) y = caps->height - 5;
 
-	work = malloc(sz_work);
-	if (!work) {
-		fclose(dev.fhndl);
-		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_NOT_ENOUGH_MEMORY, NULL);
-	}
-
-	gdisplay_begin();
-
-	if (dev.membuff) {
-		rc = jd_prepare(&jd, tjd_buf_input, (void *)work, sz_work, &dev);
-	}
-	else {
-		rc = jd_prepare(&jd, tjd_input, (void *)work, sz_work, &dev);
+	// Image from file
+	if ((error = jpg_open(fname, &dev, &jd, &work))) {
+		return error;
 	}
 
-	if (rc == JDR_OK) {
-		if (x == CENTER) {
-			x = caps->width - (jd.width >> scale);
-			if (x < 0) {
-				if (maxscale) {
-					for (scale = 0; scale <= maxscale; scale++) {
-						if (((jd.width >> scale) <= (caps->width)) && ((jd.height >> scale) <= (caps->height))) break;
-						if (scale == maxscale) break;
-					}
-					x = caps->width - (jd.width >> scale);
-					if (x < 0) x = 0;
-					else x >>= 1;
-					maxscale = 0;
-				}
-				else x = 0;
+	if (x == CENTER) {
+		x = caps->width - (jd.width >> scale);
+		if (x < 0) {
+			if (maxscale) {
+				scale = jpg_fit(&jd, maxscale, caps->width, caps->height);
+				x = caps->width - (jd.width >> scale);
+				if (x < 0) x = 0;
+				else x >>= 1;
+				maxscale = 0;
 			}
-			else x >>= 1;
-		}
-		if (y == CENTER) {
-			y = caps->height - (jd.height >> scale);
-			if (y < 0) {
-				if (maxscale) {
-					for (scale = 0; scale <= maxscale; scale++) {
-						if (((jd.width >> scale) <= (caps->width)) && ((jd.height >> scale) <= (caps->height))) break;
-						if (scale == maxscale) break;
-					}
-					y = caps->height - (jd.height >> scale);
-					if (y < 0) y = 0;
-					else y >>= 1;
-					maxscale = 0;
-				}
-				else y = 0;
-			}
-			else y >>= 1;
-		}
-		if (x == RIGHT) {
-			x = 0;
-			radj = 1;
-		}
-		if (y == BOTTOM) {
-			y = 0;
-			badj = 1;
+			else x = 0;
 		}
-		// Determine scale factor
-		if (maxscale) {
-			for (scale = 0; scale <= maxscale; scale++) {
-				if (((jd.width >> scale) <= (caps->width-x)) && ((jd.height >> scale) <= (caps->height-y))) break;
-				if (scale == maxscale) break;
+		else x >>= 1;
+	}
+	if (y == CENTER) {
+		y = caps->height - (jd.height >> scale);
+		if (y < 0) {
+			if (maxscale) {
+				scale = jpg_fit(&jd, maxscale, caps->width, caps->height);
+				y = caps->height - (jd.height >> scale);
+				if (y < 0) y = 0;
+				else y >>= 1;
+				maxscale = 0;
 			}
+			else y = 0;
 		}
+		else y >>= 1;
+	}
+	if (x == RIGHT) {
+		x = 0;
+		radj = 1;
+	}
+	if (y == BOTTOM) {
+		y = 0;
+		badj = 1;
+	}
+	// Determine scale factor
+	if (maxscale) {
+		scale = jpg_fit(&jd, maxscale, caps->width - x, caps->height - y);
+	}
 
-		if (radj) {
-			x = caps->width - (jd.width >> scale);
-			if (x < 0) x = 0;
-		}
-		if (badj) {
-			y = caps->height - (jd.height >> scale);
-			if (y < 0) y = 0;
+	if (radj) {
+		x = caps->width - (jd.width >> scale);
+		if (x < 0) x = 0;
+	}
+	if (badj) {
+		y = caps->height - (jd.height >> scale);
+		if (y < 0) y = 0;
+	}
+	dev.x = x;
+	dev.y = y;
+
+	// Decoded MCU rows are assembled into a band, that is sent to the display as
+	// a single block. If there is not enough memory for the band, MCU blocks are
+	// drawn pixel by pixel.
+	dev.bandw = jd.width >> scale;
+	dev.bandh = (jd.msy * 8) >> scale;
+
+	if ((dev.bandw > 0) && (dev.bandh > 0)) {
+		dev.band = heap_caps_malloc(dev.bandw * dev.bandh * sizeof(uint16_t), MALLOC_CAP_DMA);
+	}
+
+	gdisplay_begin();
+
+	// Start to decompress the JPEG file
+	if (dev.band) {
+		rc = jd_decomp(&jd, tjd_band_output, scale);
+		if (rc == JDR_OK) {
+			tjd_band_flush(&dev);
 		}
-		dev.x = x;
-		dev.y = y;
 
-		// Start to decompress the JPEG file
+		heap_caps_free(dev.band);
+	} else {
 		rc = jd_decomp(&jd, tjd_output, scale);
-		if (rc != JDR_OK) {
-			fclose(dev.fhndl);
-			free(work);
-			if (dev.membuff) free(dev.membuff);
-			return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IMG_PROCESSING_ERROR, "decompression error");
-		}
 	}
-	else {
-		fclose(dev.fhndl);
+
+	gdisplay_end();
+
+	free(work);
+	fclose(dev.fhndl);
+
+	if (rc != JDR_OK) {
+		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IMG_PROCESSING_ERROR, "decompression error");
+	}
+
+	return NULL;
+}
+
+driver_error_t *gdisplay_image_jpg_load(const char *fname, int8_t maxscale, int maxw, int maxh, gdisplay_image_t **image) {
+	driver_error_t *error;
+	gdisplay_image_t *img;
+	char *work;
+	JDEC jd;
+	JRESULT rc;
+	BYTE scale;
+	JPGIODEV dev;
+
+	// Sanity checks
+	if (!gdisplay_is_init()) {
+		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IS_NOT_SETUP, "init display first");
+	}
+	if ((maxscale < 0) || (maxscale > 3)) maxscale = 3;
+
+	gdisplay_caps_t *caps = gdisplay_ll_get_caps();
+
+	if (caps->bytes_per_pixel == 0) {
+		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IMAGE, "display only support 2 colors");
+	}
+
+	if ((error = jpg_open(fname, &dev, &jd, &work))) {
+		return error;
+	}
+
+	// Scale to fit in maxw x maxh
+	scale = jpg_fit(&jd, maxscale, maxw, maxh);
+
+	img = calloc(1, sizeof(gdisplay_image_t));
+	if (img) {
+		img->width = jd.width >> scale;
+		img->height = jd.height >> scale;
+		img->pixels = calloc(img->width * img->height, sizeof(uint16_t));
+	}
+
+	if (!img || !img->pixels) {
+		gdisplay_image_free(img);
 		free(work);
-		if (dev.membuff) free(dev.membuff);
-		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IMG_PROCESSING_ERROR, "prepare error");
+		fclose(dev.fhndl);
+		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_NOT_ENOUGH_MEMORY, NULL);
 	}
 
-	free(work);  // free work buffer
+	// Decode into the image
+	dev.band = img->pixels;
+	dev.bandw = img->width;
+	dev.bandh = img->height;
+	dev.offscreen = 1;
 
-	gdisplay_end();
+	rc = jd_decomp(&jd, tjd_band_output, scale);
+
+	free(work);
+	fclose(dev.fhndl);
+
+	if (rc != JDR_OK) {
+		gdisplay_image_free(img);
+		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IMG_PROCESSING_ERROR, "decompression error");
+	}
 
-    if (dev.fhndl) fclose(dev.fhndl);  // close input file
-    if (dev.membuff) free(dev.membuff);
+	*image = img;
 
-    return NULL;
+	return NULL;
 }
 
 #endif
@@ -109,6 +109,38 @@ void _gdisplay_circle_fill_helper(int x0, int y0, int r, uint8_t cornername, int
 	}
 }
 
+// Filled circle as horizontal spans. It's the transposed version of
+// _gdisplay_circle_fill_helper, and fills the same pixels.
+static void _gdisplay_circle_fill_spans(int x0, int y0, int r, uint32_t color) {
+	int16_t f = 1 - r;
+	int16_t ddF_x = 1;
+	int16_t ddF_y = -2 * r;
+	int16_t x = 0;
+	int16_t y = r;
+	int16_t ylm = y0 - r;
+
+	gdisplay_hspan(x0 - r, x0 + r, y0, color);
+
+	while (x < y) {
+		if (f >= 0) {
+			gdisplay_hspan(x0 - x, x0 + x, y0 + y, color);
+			gdisplay_hspan(x0 - x, x0 + x, y0 - y, color);
+			ylm = y0 - y;
+			y--;
+			ddF_y += 2;
+			f += ddF_y;
+		}
+		x++;
+		ddF_x += 2;
+		f += ddF_x;
+
+		if ((y0 - x) > ylm) {
+			gdisplay_hspan(x0 - y, x0 + y, y0 + x, color);
+			gdisplay_hspan(x0 - y, x0 + y, y0 - x, color);
+		}
+	}
+}
+
 /*
  * Operation functions
  */
@@ -168,8 +200,7 @@ driver_error_t *gdisplay_circle_fill(int x, int y, int radius, uint32_t color, u
 
 	gdisplay_begin();
 
-	gdisplay_vline(x, y-radius, 2*radius+1, fill);
-	_gdisplay_circle_fill_helper(x, y, radius, 3, 0, fill);
+	_gdisplay_circle_fill_spans(x, y, radius, fill);
 
 	gdisplay_circle(x, y, radius, color);
 
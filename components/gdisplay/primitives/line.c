@@ -50,8 +50,6 @@
  * Operation functions
  */
 driver_error_t *gdisplay_hline(int x0, int y0, int w, uint32_t color) {
-	int x;
-
 	if (w < 0) {
 		w = -1 * w;
 		x0 = x0 - w;
@@ -62,20 +60,14 @@ driver_error_t *gdisplay_hline(int x0, int y0, int w, uint32_t color) {
 		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IS_NOT_SETUP, "init display first");
 	}
 
-	gdisplay_begin();
-
-	for (x = x0; x < x0 + w; x++) {
-		gdisplay_set_pixel(x,y0,color);
+	if (w > 0) {
+		gdisplay_hspan(x0, x0 + w - 1, y0, color);
 	}
 
-	gdisplay_end();
-
 	return NULL;
 }
 
 driver_error_t *gdisplay_vline(int x0, int y0, int h, uint32_t color) {
-	int y;
-
 	// Sanity checks
 	if (!gdisplay_is_init()) {
 		return driver_error(GDISPLAY_DRIVER, GDISPLAY_ERR_IS_NOT_SETUP, "init display first");
@@ -86,14 +78,10 @@ driver_error_t *gdisplay_vline(int x0, int y0, int h, uint32_t color) {
 		y0 = y0 - h;
 	}
 
-	gdisplay_begin();
-
-	for (y = y0; y < y0 + h; y++) {
-		gdisplay_set_pixel(x0,y,color);
+	if (h > 0) {
+		gdisplay_vspan(x0, y0, y0 + h - 1, color);
 	}
 
-	gdisplay_end();
-
 	return NULL;
 }
 
@@ -31,6 +31,7 @@
 #if CONFIG_LUA_RTOS_USE_HTTP_SERVER
 
 #include "preprocessor.h"
+#include "pagecache.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -46,10 +47,16 @@
 #include <pthread.h>
 #include <esp_wifi.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/syslog.h>
 
 #include <openssl/ssl.h>
@@ -66,6 +73,11 @@
 #define PROTOCOL       "HTTP/1.1"
 #define RFC1123FMT     "%a, %d %b %Y %H:%M:%S GMT"
 #define HTTP_BUFF_SIZE 1024
+#define HTTP_ETAG_SIZE 32
+#define HTTP_DATE_SIZE 32
+#define HTTP_HASH_CACHE_SIZE 16
+#define HTTP_READ_BUFF_SIZE 512
+#define HTTP_SELECT_INTERVAL 50 // In milliseconds
 #define CAPTIVE_SERVER_NAME	"config-esp32-settings"
 
 #include "lua.h"
@@ -92,25 +104,73 @@ static char ip4addr[IP4ADDR_STRLEN_MAX];
 static int socket_server_normal = 0;
 static int socket_server_secure = 0;
 
+// Lua pages are executed in the shared LL state, one at a time
+static pthread_mutex_t http_lua_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Content hashes of static files without modification time, used as entity tags
+typedef struct {
+  char *path;
+  off_t size;
+  ino_t ino;                // st_ino, changes when the file is modified (SPIFFS)
+  uint32_t hash;
+} http_file_hash;
+
+static http_file_hash http_hashes[HTTP_HASH_CACHE_SIZE];
+static int http_hashes_next = 0;    // next entry to replace
+static pthread_mutex_t http_hashes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 typedef struct {
   int port;
   int *server; //socket
   const int secure;
   char *certificate;
   char *private_key;
+  SSL_CTX *ctx;
+  xQueueHandle work;  // connections ready to be processed by a worker
+  xQueueHandle idle;  // keep-alive connections given back by workers
+  int connections;    // open connections
 } http_server_config;
 
-#define HTTP_Normal_initializer { CONFIG_LUA_RTOS_HTTP_SERVER_PORT, &socket_server_normal, 0, NULL, NULL }
-#define HTTP_Secure_initializer { CONFIG_LUA_RTOS_HTTP_SERVER_PORT_SSL, &socket_server_secure, 1, NULL, NULL } //cert and privkey need to be supplied from lua
+#define HTTP_Normal_initializer { CONFIG_LUA_RTOS_HTTP_SERVER_PORT, &socket_server_normal, 0, NULL, NULL, NULL, NULL, NULL, 0 }
+#define HTTP_Secure_initializer { CONFIG_LUA_RTOS_HTTP_SERVER_PORT_SSL, &socket_server_secure, 1, NULL, NULL, NULL, NULL, NULL, 0 } //cert and privkey need to be supplied from lua
 
+// A client connection, that can serve many requests if keep-alive is used
 typedef struct {
   http_server_config *config;
-  FILE *file;
+  int socket;
   SSL *ssl;
+  int keepalive;            // keep the connection open after the response
+  int requests;             // requests served on this connection
+  TickType_t start;         // tick count when the current request started
+  TickType_t idle;          // tick count when the connection became idle
+  int rpos;                 // read position in rbuf
+  int rlen;                 // bytes in rbuf
+  char rbuf[HTTP_READ_BUFF_SIZE];
 } http_request_handle;
 
-#define HTTP_Request_Normal_initializer { config, stream, NULL };
-#define HTTP_Request_Secure_initializer { config, NULL, ssl };
+// Server counters
+typedef struct {
+  uint32_t connections;     // accepted connections
+  uint32_t rejected;        // connections rejected because the server is busy
+  uint32_t requests;        // served requests
+  uint32_t reused;          // requests served on a kept-alive connection
+  uint32_t time;            // total time spent in requests, in milliseconds
+  uint32_t max_time;        // max time spent in a request, in milliseconds
+} http_server_stats;
+
+static http_server_stats http_stats;
+
+// Request headers used for serve static files
+typedef struct {
+  int range;                              // Range header found
+  long range_start;                       // First byte of range, -1 for a suffix range
+  long range_end;                         // Last byte of range, -1 if not present
+  int gzip;                               // Client accepts gzip encoding
+  char if_none_match[HTTP_ETAG_SIZE];     // If-None-Match header
+  char if_modified_since[HTTP_DATE_SIZE]; // If-Modified-Since header
+  char if_range[HTTP_ETAG_SIZE];          // If-Range header
+  int connection;                         // Connection header: 1 = keep-alive, 0 = close, -1 = not present
+} http_request_headers;
 
 static http_server_config http_normal = HTTP_Normal_initializer;
 static http_server_config http_secure = HTTP_Secure_initializer;
@@ -146,8 +206,28 @@ char *get_mime_type(char *name) {
 	return NULL;
 }
 
+// Write a buffer to the socket (or to the TLS session). Returns 0 if all the
+// buffer was written, -1 on error. On error the connection is not kept alive.
 static int request_write(http_request_handle *request, char *buffer, int length) {
-	return (request->config->secure) ? SSL_write(request->ssl, buffer, length) : fwrite(buffer, 1, length, request->file);
+	int n;
+
+	while (length > 0) {
+		if (request->config->secure) {
+			n = SSL_write(request->ssl, buffer, length);
+		} else {
+			n = send(request->socket, buffer, length, 0);
+		}
+
+		if (n <= 0) {
+			request->keepalive = 0;
+			return -1;
+		}
+
+		buffer += n;
+		length -= n;
+	}
+
+	return 0;
 }
 
 static int do_printf(http_request_handle *request, const char *fmt, ...) {
@@ -173,30 +253,60 @@ static int do_printf(http_request_handle *request, const char *fmt, ...) {
 	return ret;
 }
 
-char *do_gets(char *s, int size, http_request_handle *request) {
+// Fill the read buffer of a connection. Returns the number of bytes read,
+// 0 if the connection is closed, or < 0 on error / timeout.
+static int request_fill(http_request_handle *request) {
+	int n;
+
+	if (request->config->secure) {
+		n = SSL_read(request->ssl, request->rbuf, sizeof(request->rbuf));
+	} else {
+		n = recv(request->socket, request->rbuf, sizeof(request->rbuf), 0);
+	}
+
+	request->rpos = 0;
+	request->rlen = (n > 0) ? n : 0;
+
+	return n;
+}
 
-	if (0 == request->config->secure)
-		return fgets(s, size, request->file);
+// Check if there is data ready to read on a connection, without blocking
+static int request_pending(http_request_handle *request) {
+	struct timeval tv = {0, 0};
+	fd_set rset;
 
-	int rc;
+	if (request->rpos < request->rlen) return 1;
+	if (request->config->secure && (SSL_pending(request->ssl) > 0)) return 1;
+
+	FD_ZERO(&rset);
+	FD_SET(request->socket, &rset);
+
+	return (select(request->socket + 1, &rset, NULL, NULL, &tv) > 0);
+}
+
+char *do_gets(char *s, int size, http_request_handle *request) {
 	char *c = s;
 	int done = 0;
+
 	while (c < (s + size - 1) && !done) {
-  	rc = SSL_read(request->ssl, c, 1);
-  	if (rc>0) {
-  		if (*c == '\n') done=1;
-  		c++;
-  	}
-  	else if (rc==0) {
-  		//no data received or connection is closed
-  		done=1;
-  	}
-  	else {
-  		return NULL; //discard half-received data
-  	}
-  }
-  *c = 0;
-  return (c == s ? 0 : s);
+		if (request->rpos >= request->rlen) {
+			int rc = request_fill(request);
+
+			if (rc == 0) {
+				//no data received or connection is closed
+				break;
+			} else if (rc < 0) {
+				return NULL; //discard half-received data
+			}
+		}
+
+		*c = request->rbuf[request->rpos++];
+		if (*c == '\n') done = 1;
+		c++;
+	}
+
+	*c = 0;
+	return (c == s ? 0 : s);
 }
 
 void send_headers(http_request_handle *request, int status, char *title, char *extra, char *mime, int length) {
@@ -211,11 +321,11 @@ void send_headers(http_request_handle *request, int status, char *title, char *e
 		do_printf(request, "Transfer-Encoding: chunked\r\n");
 	}
 
-	do_printf(request, "Connection: close\r\n");
+	do_printf(request, "Connection: %s\r\n", request->keepalive ? "keep-alive" : "close");
 
 	do_printf(request, "Cache-Control: no-cache, no-store, must-revalidate\r\n");
-	do_printf(request, "no-cache\r\n");
-	do_printf(request, "0\r\n");
+	do_printf(request, "Pragma: no-cache\r\n");
+	do_printf(request, "Expires: 0\r\n");
 
 	do_printf(request, "\r\n");
 }
@@ -292,19 +402,373 @@ int http_print(lua_State* L) {
     return 0;
 }
 
-void send_file(http_request_handle *request, char *path, struct stat *statbuf, char *requestdata) {
-	int n;
+// Check if a file has a precompressed sibling (path + ".gz"). path must have a
+// size of HTTP_BUFF_SIZE, and it's restored before return. Returns 1 if the
+// sibling exists, 0 if not.
+static int gzip_sibling(char *path, struct stat *statbuf) {
+	int len = strlen(path);
+	int found;
+
+	if (len + 4 > HTTP_BUFF_SIZE) {
+		return 0;
+	}
+
+	strcpy(path + len, ".gz");
+	found = ((stat(path, statbuf) >= 0) && S_ISREG(statbuf->st_mode));
+	path[len] = 0;
+
+	return found;
+}
+
+// Parse the value of a Range header. Only a single byte range is supported,
+// in other case the header is ignored and the whole file is sent.
+static void parse_range(const char *value, http_request_headers *headers) {
+	char *end;
+
+	if (strncasecmp(value, "bytes=", 6) != 0) return;
+	value += 6;
+
+	if (strchr(value, ',')) return;
+
+	if (*value == '-') {
+		// Suffix range (last n bytes)
+		headers->range_start = -1;
+		headers->range_end = strtol(value + 1, &end, 10);
+		if ((end == value + 1) || (headers->range_end <= 0)) return;
+	} else {
+		headers->range_start = strtol(value, &end, 10);
+		if ((end == value) || (*end != '-') || (headers->range_start < 0)) return;
+
+		value = end + 1;
+		if ((*value == '\0') || (*value == '\r') || (*value == '\n')) {
+			headers->range_end = -1;
+		} else {
+			headers->range_end = strtol(value, &end, 10);
+			if ((end == value) || (headers->range_end < headers->range_start)) return;
+		}
+	}
+
+	headers->range = 1;
+}
+
+// Copy the value of a header, without trailing spaces / line terminators
+static void header_value(char *dst, const char *value, int size) {
+	int len;
+
+	while (*value == ' ') value++;
+
+	strncpy(dst, value, size - 1);
+	dst[size - 1] = 0;
+
+	len = strlen(dst);
+	while ((len > 0) && ((dst[len - 1] == '\r') || (dst[len - 1] == '\n') || (dst[len - 1] == ' '))) {
+		dst[--len] = 0;
+	}
+}
+
+static void parse_header(char *line, http_request_headers *headers) {
+	if (strncasecmp(line, "Range:", 6) == 0) {
+		char value[HTTP_ETAG_SIZE];
+
+		header_value(value, line + 6, sizeof(value));
+		parse_range(value, headers);
+	} else if (strncasecmp(line, "Accept-Encoding:", 16) == 0) {
+		headers->gzip = (strcasestr(line + 16, "gzip") != NULL);
+	} else if (strncasecmp(line, "If-None-Match:", 14) == 0) {
+		header_value(headers->if_none_match, line + 14, sizeof(headers->if_none_match));
+	} else if (strncasecmp(line, "If-Modified-Since:", 18) == 0) {
+		header_value(headers->if_modified_since, line + 18, sizeof(headers->if_modified_since));
+	} else if (strncasecmp(line, "If-Range:", 9) == 0) {
+		header_value(headers->if_range, line + 9, sizeof(headers->if_range));
+	} else if (strncasecmp(line, "Connection:", 11) == 0) {
+		if (strcasestr(line + 11, "close")) {
+			headers->connection = 0;
+		} else if (strcasestr(line + 11, "keep-alive")) {
+			headers->connection = 1;
+		}
+	}
+}
+
+// Get the FNV-1a hash of the content of an open file, and rewind it. buffer
+// must have CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE bytes.
+//
+// The file is only read when it's path, size, or st_ino have changed since the
+// last time it was hashed. On SPIFFS st_ino changes each time the file is
+// modified. If st_ino is 0 the file system can't tell if the file has changed,
+// and the hash is not cached.
+static int file_hash(const char *path, struct stat *statbuf, int fd, char *buffer, uint32_t *hash) {
+	http_file_hash *entry;
+	char *cpath;
+	int n, i;
+
+	if (statbuf->st_ino != 0) {
+		pthread_mutex_lock(&http_hashes_mutex);
+
+		for(i = 0;i < HTTP_HASH_CACHE_SIZE;i++) {
+			entry = &http_hashes[i];
+
+			if (entry->path && (entry->size == statbuf->st_size) && (entry->ino == statbuf->st_ino) && (strcmp(entry->path, path) == 0)) {
+				*hash = entry->hash;
+				pthread_mutex_unlock(&http_hashes_mutex);
+				return 0;
+			}
+		}
+
+		pthread_mutex_unlock(&http_hashes_mutex);
+	}
+
+	*hash = 2166136261u;
+	while ((n = read(fd, buffer, CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE)) > 0) {
+		for(i = 0;i < n;i++) {
+			*hash = (*hash ^ (uint8_t)buffer[i]) * 16777619u;
+		}
+	}
+
+	if ((n < 0) || (lseek(fd, 0, SEEK_SET) != 0)) {
+		return -1;
+	}
+
+	if ((statbuf->st_ino == 0) || !(cpath = strdup(path))) {
+		return 0;
+	}
+
+	// Cache the hash, replacing the entry of the same path, or the oldest one
+	pthread_mutex_lock(&http_hashes_mutex);
+
+	for(i = 0;i < HTTP_HASH_CACHE_SIZE;i++) {
+		if (http_hashes[i].path && (strcmp(http_hashes[i].path, path) == 0)) {
+			break;
+		}
+	}
+
+	if (i == HTTP_HASH_CACHE_SIZE) {
+		i = http_hashes_next;
+		http_hashes_next = (http_hashes_next + 1) % HTTP_HASH_CACHE_SIZE;
+	}
+
+	entry = &http_hashes[i];
+
+	free(entry->path);
+	entry->path = cpath;
+	entry->size = statbuf->st_size;
+	entry->ino = statbuf->st_ino;
+	entry->hash = *hash;
+
+	pthread_mutex_unlock(&http_hashes_mutex);
+
+	return 0;
+}
+
+static void file_hash_flush() {
+	int i;
+
+	pthread_mutex_lock(&http_hashes_mutex);
+
+	for(i = 0;i < HTTP_HASH_CACHE_SIZE;i++) {
+		free(http_hashes[i].path);
+		http_hashes[i].path = NULL;
+	}
+
+	pthread_mutex_unlock(&http_hashes_mutex);
+}
+
+// Send a static file. The file is read in blocks of CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE
+// bytes, aligned to the block size, and each block is written directly to the socket (or to the
+// TLS session).
+static void send_static_file(http_request_handle *request, char *path, struct stat *statbuf, http_request_headers *headers) {
+	char gzpath[HTTP_BUFF_SIZE];
+	char etag[HTTP_ETAG_SIZE];
+	char date[HTTP_DATE_SIZE];
+	char vary[32];
+	struct stat gzstatbuf;
+	const char *encoding = NULL;
+	char *fpath = path;
+	char *mime;
 	char *data;
+	long start, end, size;
+	uint32_t hash;
+	int status = 200;
+	int fd, n, len;
+
+	// If there is a precompressed sibling the response depends on the Accept-Encoding
+	// header. If client accepts gzip encoding, serve the sibling.
+	*vary = 0;
+	if (gzip_sibling(path, &gzstatbuf)) {
+		strcpy(vary, "Vary: Accept-Encoding\r\n");
+
+		if (headers->gzip) {
+			snprintf(gzpath, sizeof(gzpath), "%s.gz", path);
+			fpath = gzpath;
+			statbuf = &gzstatbuf;
+			encoding = "gzip";
+		}
+	}
+
+	if (!S_ISREG(statbuf->st_mode)) {
+		send_error(request, 403, "Forbidden", NULL, "Access denied.");
+		return;
+	}
+
+	size = statbuf->st_size;
+
+	fd = open(fpath, O_RDONLY);
+	if (fd < 0) {
+		send_error(request, 403, "Forbidden", NULL, "Access denied.");
+		return;
+	}
+
+	data = malloc(CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE);
+	if (!data) {
+		close(fd);
+		send_error(request, 500, "Internal Server Error", NULL, "Not enough memory.");
+		return;
+	}
+
+	// Validators. Without modification time (st_mtime is 0, as in SPIFFS) the entity
+	// tag is derived from the file content, and there is no Last-Modified date. The
+	// content hash is cached, so the file is only read again when it changes.
+	if (statbuf->st_mtime != 0) {
+		snprintf(etag, sizeof(etag), "\"%lx-%lx%s\"", (unsigned long)statbuf->st_mtime, (unsigned long)size, encoding ? "-gz" : "");
+		strftime(date, sizeof(date), RFC1123FMT, gmtime(&statbuf->st_mtime));
+	} else if (file_hash(fpath, statbuf, fd, data, &hash) == 0) {
+		snprintf(etag, sizeof(etag), "\"h%08x-%lx%s\"", (unsigned int)hash, (unsigned long)size, encoding ? "-gz" : "");
+		*date = 0;
+	} else {
+		send_error(request, 500, "Internal Server Error", NULL, "Can't read file.");
+		goto exit;
+	}
+
+	if (*headers->if_none_match) {
+		if ((strcmp(headers->if_none_match, etag) == 0) || (strcmp(headers->if_none_match, "*") == 0)) {
+			status = 304;
+		}
+	} else if (*date && *headers->if_modified_since && (strcmp(headers->if_modified_since, date) == 0)) {
+		status = 304;
+	}
+
+	if (status == 304) {
+		do_printf(request,
+			"%s 304 Not Modified\r\n"
+			"Server: %s\r\n"
+			"ETag: %s\r\n"
+			"%s%s%s"
+			"%s"
+			"Connection: %s\r\n"
+			"\r\n", PROTOCOL, SERVER_ID, etag,
+			*date ? "Last-Modified: " : "", date, *date ? "\r\n" : "",
+			vary, request->keepalive ? "keep-alive" : "close");
+		goto exit;
+	}
+
+	// Compute range
+	start = 0;
+	end = size - 1;
+
+	if (headers->range && (!*headers->if_range || (strcmp(headers->if_range, etag) == 0))) {
+		if (headers->range_start < 0) {
+			start = (headers->range_end < size) ? size - headers->range_end : 0;
+		} else {
+			start = headers->range_start;
+			if ((headers->range_end >= 0) && (headers->range_end < end)) {
+				end = headers->range_end;
+			}
+		}
+
+		if (start >= size) {
+			do_printf(request,
+				"%s 416 Range Not Satisfiable\r\n"
+				"Server: %s\r\n"
+				"Content-Range: bytes */%ld\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: %s\r\n"
+				"\r\n", PROTOCOL, SERVER_ID, size, request->keepalive ? "keep-alive" : "close");
+			goto exit;
+		}
+
+		status = 206;
+	}
+
+	// Send all headers in one write
+	mime = get_mime_type(path);
+
+	len = snprintf(data, CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE,
+		"%s %d %s\r\n"
+		"Server: %s\r\n"
+		"%s%s%s"
+		"Content-Length: %ld\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: %s\r\n",
+		PROTOCOL, status, (status == 206) ? "Partial Content" : "OK",
+		SERVER_ID,
+		mime ? "Content-Type: " : "", mime ? mime : "", mime ? "\r\n" : "",
+		end - start + 1, request->keepalive ? "keep-alive" : "close");
+
+	len += snprintf(data + len, CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE - len, "ETag: %s\r\n%s", etag, vary);
+
+	if (*date) {
+		len += snprintf(data + len, CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE - len, "Last-Modified: %s\r\n", date);
+	}
+
+	if (encoding) {
+		len += snprintf(data + len, CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE - len, "Content-Encoding: %s\r\n", encoding);
+	}
+
+	if (status == 206) {
+		len += snprintf(data + len, CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE - len, "Content-Range: bytes %ld-%ld/%ld\r\n", start, end, size);
+	}
+
+	len += snprintf(data + len, CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE - len, "\r\n");
+
+	if (request_write(request, data, len) < 0) {
+		goto exit;
+	}
+
+	if ((start > 0) && (lseek(fd, start, SEEK_SET) != start)) {
+		goto exit;
+	}
+
+	// Send body. First block is read up to the next block boundary, so next reads are aligned.
+	size = end - start + 1;
+	len = CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE - (start % CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE);
+
+	while (size > 0) {
+		if (len > size) len = size;
+
+		n = read(fd, data, len);
+		if (n <= 0) {
+			// Content-Length can't be honored, so connection must be closed
+			request->keepalive = 0;
+			break;
+		}
+
+		if (request_write(request, data, n) < 0) break;
+
+		size -= n;
+		len = CONFIG_LUA_RTOS_HTTP_SERVER_FILE_BUFFER_SIZE;
+	}
+
+exit:
+	free(data);
+	close(fd);
+}
+
+void send_file(http_request_handle *request, char *path, struct stat *statbuf, char *requestdata, http_request_headers *headers) {
+	if (!is_lua(path)) {
+		send_static_file(request, path, statbuf, headers);
+		return;
+	}
 
 	FILE *file = fopen(path, "r");
 
 	if (!file) {
 		send_error(request, 403, "Forbidden", NULL, "Access denied.");
-	} else if (is_lua(path)) {
+	} else {
 		fclose(file);
 
 		send_headers(request, 200, "OK", NULL, "text/html", -1);
-		if (!request->config->secure) fflush(request->file);
+
+		pthread_mutex_lock(&http_lua_mutex);
 
 		lua_pushstring(LL, (requestdata && *requestdata) ? requestdata:"");
 		lua_setglobal(LL, "http_request");
@@ -318,35 +782,23 @@ void send_file(http_request_handle *request, char *path, struct stat *statbuf, c
 		lua_pushinteger(LL, request->config->secure);
 		lua_setglobal(LL, "http_secure");
 
-		char ppath[PATH_MAX];
-
-		strcpy(ppath, path);
-		if (strlen(ppath) < PATH_MAX - 1) {
-			strcat(ppath, "p");
+		int rc = http_page_load(LL, path, statbuf);
+		if (rc == LUA_OK) {
+			rc = lua_pcall(LL, 0, 0, 0);
 		}
 
-		http_process_lua_page(path,ppath);
-
-		int rc = luaL_dofile(LL, ppath);
-		(void) rc;
-
-		if (!request->config->secure) fflush(request->file);
+		if (rc != LUA_OK) {
+			syslog(LOG_ERR, "http: %s\n", lua_tostring(LL, -1));
+			lua_pop(LL, 1);
+		}
 
 		do_printf(request, "0\r\n\r\n");
 
 		lua_pushlightuserdata(LL, (void*)0);
 		lua_setglobal(LL, "http_stream_handle");
 
-	} else {
-		data = calloc(1, HTTP_BUFF_SIZE);
-		if (data) {
-			int length = S_ISREG(statbuf->st_mode) ? statbuf->st_size : -1;
-			send_headers(request, 200, "OK", NULL, get_mime_type(path), length);
-			while ((n = fread(data, 1, sizeof (data), file)) > 0) request_write(request, data, n);
-			fclose(file);
+		pthread_mutex_unlock(&http_lua_mutex);
 
-			free(data);
-		}
 	}
 }
 
@@ -471,13 +923,22 @@ int process(http_request_handle *request) {
 	char *protocol;
 	struct stat statbuf;
 	char pathbuf[HTTP_BUFF_SIZE];
+	http_request_headers headers;
+	int complete = 0;
 	int len;
 
+	request->keepalive = 0;
+
 	if (!do_gets(buf, sizeof (buf), request) || 0 == strlen(buf) ) {
+		//a kept-alive connection closed by the client, or idle, is not an error
+		if (request->requests > 0) return -1;
+
 		send_error(request, 400, "Bad Request", NULL, "Got empty request buffer.");
 		return 0;
 	}
 
+	request->start = xTaskGetTickCount();
+
 	method = strtok(buf, " ");
 	path = strtok(NULL, " ");
 	protocol = strtok(NULL, "\r");
@@ -509,49 +970,66 @@ int process(http_request_handle *request) {
 	  }
 	}
 
-	//only in AP mode we redirect arbitrary host names to our own host name
-	if (wifi_mode == WIFI_MODE_AP) {
-		//find the Host: header and check if it matches our IP or captive server name
-		while (do_gets(pathbuf, sizeof (pathbuf), request) && strlen(pathbuf)>0 ) {
-
-			//quick check if the first char matches, only then do strcasestr
-			if(pathbuf[0]=='h' || pathbuf[0]=='H') {
-				host = strcasestr(pathbuf, "Host:");
-
-				//check if the line begins with "Host:"
-				if (host==(char *)pathbuf) {
-					host = strtok(host, ":");  //Host:
-					host = strtok(NULL, "\r"); //the actual host
-					while(*host==' ') host++;  //skip spaces after the :
-
-					if (0 == strcasecmp(CAPTIVE_SERVER_NAME, host) ||
-							0 == strcasecmp(ip4addr, host)) {
-						break; //done parsing headers
-					}
-					else {
-						//redirect
-						snprintf(pathbuf, sizeof (pathbuf), "Location: http://%s/", CAPTIVE_SERVER_NAME);
-						send_headers(request, 302, "Found", pathbuf, NULL, 0);
-						return 0;
-					}
+	memset(&headers, 0, sizeof(headers));
+	headers.connection = -1;
+
+	//parse headers, only if the protocol was given (HTTP/0.9 requests don't have headers)
+	while (protocol) {
+		if (!do_gets(pathbuf, sizeof (pathbuf), request)) break;
+
+		if ((pathbuf[0] == '\r') || (pathbuf[0] == '\n')) {
+			complete = 1;
+			break;
+		}
+
+		//only in AP mode we redirect arbitrary host names to our own host name
+		//quick check if the first char matches, only then do strcasestr
+		if ((wifi_mode == WIFI_MODE_AP) && (pathbuf[0]=='h' || pathbuf[0]=='H')) {
+			host = strcasestr(pathbuf, "Host:");
+
+			//check if the line begins with "Host:"
+			if (host==(char *)pathbuf) {
+				host = strtok(host, ":");  //Host:
+				host = strtok(NULL, "\r"); //the actual host
+				while(host && *host==' ') host++;  //skip spaces after the :
+
+				if (!host ||
+						0 == strcasecmp(CAPTIVE_SERVER_NAME, host) ||
+						0 == strcasecmp(ip4addr, host)) {
+					continue;
+				}
+				else {
+					//redirect
+					snprintf(pathbuf, sizeof (pathbuf), "Location: http://%s/", CAPTIVE_SERVER_NAME);
+					send_headers(request, 302, "Found", pathbuf, NULL, 0);
+					return 0;
 				}
 			}
+		}
 
-		} // while
-	} // AP mode
+		parse_header(pathbuf, &headers);
+	} // while
+
+	//HTTP/1.1 connections are persistent by default, HTTP/1.0 connections only if requested
+	if (complete) {
+		if (strncmp(protocol, "HTTP/1.1", 8) == 0) {
+			request->keepalive = (headers.connection != 0);
+		} else {
+			request->keepalive = (headers.connection == 1);
+		}
+	}
 
 	if (!method || !path) return -1; //protocol may be omitted
 	syslog(LOG_DEBUG, "http: %s %s %s\r", method, path, protocol ? protocol:"");
 
-	if (!request->config->secure) fseek(request->file, 0, SEEK_CUR); // force change of stream direction
-
 	if (strcasecmp(method, "GET") != 0) {
 		syslog(LOG_DEBUG, "http: %s not supported\r", method);
+		request->keepalive = 0; //request body is not read
 		send_error(request, 501, "Not supported", NULL, "Method is not supported.");
 	} else if (!filepath_merge(pathbuf, CONFIG_LUA_RTOS_HTTP_SERVER_DOCUMENT_ROOT, path, NULL)) {
 		send_error(request, 404, "Not Found", NULL, "File not found.");
 		syslog(LOG_DEBUG, "http: invalid path requested: %s\r", path);
-	} else if (stat(pathbuf, &statbuf) < 0) {
+	} else if ((stat(pathbuf, &statbuf) < 0) && !(headers.gzip && gzip_sibling(pathbuf, &statbuf))) {
 		send_error(request, 404, "Not Found", NULL, "File not found.");
 		syslog(LOG_DEBUG, "http: %s Not found\r", pathbuf);
 	} else if (S_ISDIR(statbuf.st_mode)) {
@@ -563,11 +1041,11 @@ int process(http_request_handle *request) {
 		} else {
 			filepath_merge(pathbuf, CONFIG_LUA_RTOS_HTTP_SERVER_DOCUMENT_ROOT, path, "index.lua");
 			if (stat(pathbuf, &statbuf) >= 0) {
-				send_file(request, pathbuf, &statbuf, data);
+				send_file(request, pathbuf, &statbuf, data, &headers);
 			} else {
 			      filepath_merge(pathbuf, CONFIG_LUA_RTOS_HTTP_SERVER_DOCUMENT_ROOT, path, "index.html");
 				  if (stat(pathbuf, &statbuf) >= 0) {
-					  send_file(request, pathbuf, &statbuf, data);
+					  send_file(request, pathbuf, &statbuf, data, &headers);
 				  } else {
 					  DIR *dir;
 					  struct dirent *de;
@@ -617,7 +1095,7 @@ int process(http_request_handle *request) {
 			   }
 		}
 	} else {
-		send_file(request, pathbuf, &statbuf, data);
+		send_file(request, pathbuf, &statbuf, data, &headers);
 	}
 
 	return 0;
@@ -669,13 +1147,124 @@ static void mbedtls_zeroize( void *v, size_t n ) {
     volatile unsigned char *p = v; while( n-- ) *p++ = 0;
 }
 
+static void http_thread_attr(pthread_attr_t *attr) {
+	struct sched_param sched;
+
+	// Init thread attributes
+	pthread_attr_init(attr);
+
+	// Set stack size
+	pthread_attr_setstacksize(attr, CONFIG_LUA_RTOS_HTTP_SERVER_STACK_SIZE);
+
+	// Set priority
+	sched.sched_priority = CONFIG_LUA_RTOS_HTTP_SERVER_TASK_PRIORITY;
+	pthread_attr_setschedparam(attr, &sched);
+
+	// Set CPU
+	cpu_set_t cpu_set = CPU_INITIALIZER;
+
+	CPU_SET(CONFIG_LUA_RTOS_HTTP_SERVER_TASK_CPU, &cpu_set);
+
+	pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &cpu_set);
+}
+
+static void http_connection_close(http_request_handle *request) {
+	http_server_config *config = request->config;
+
+	if (request->ssl) {
+		SSL_shutdown(request->ssl);
+		SSL_free(request->ssl);
+	}
+
+	close(request->socket);
+	free(request);
+
+	__sync_fetch_and_sub(&config->connections, 1);
+}
+
+static void *http_worker(void *arg) {
+	http_server_config *config = (http_server_config*) arg;
+	http_request_handle *request;
+	TickType_t elapsed;
+
+	for(;;) {
+		xQueueReceive(config->work, &request, portMAX_DELAY);
+		if (!request) {
+			// Server is shutting down
+			break;
+		}
+
+		if (config->secure && !request->ssl) {
+			request->ssl = SSL_new(config->ctx);
+			if (!request->ssl) {
+				syslog(LOG_ERR, "couldn't create SSL session\n");
+				http_connection_close(request);
+				continue;
+			}
+
+			SSL_set_fd(request->ssl, request->socket);
+
+			if (!SSL_accept(request->ssl)) {
+				syslog(LOG_ERR, "couldn't accept SSL connection\n");
+				http_connection_close(request);
+				continue;
+			}
+		}
+
+		// Process requests while the client has sent them (pipelining)
+		do {
+			if (process(request) < 0) {
+				request->keepalive = 0;
+				break;
+			}
+
+			elapsed = (xTaskGetTickCount() - request->start) * portTICK_PERIOD_MS;
+
+			__sync_fetch_and_add(&http_stats.requests, 1);
+			__sync_fetch_and_add(&http_stats.time, elapsed);
+			if (request->requests > 0) {
+				__sync_fetch_and_add(&http_stats.reused, 1);
+			}
+
+			uint32_t max_time = http_stats.max_time;
+			while ((elapsed > max_time) && !__sync_bool_compare_and_swap(&http_stats.max_time, max_time, elapsed)) {
+				max_time = http_stats.max_time;
+			}
+
+			request->requests++;
+			if (request->requests >= CONFIG_LUA_RTOS_HTTP_SERVER_KEEPALIVE_MAX) {
+				request->keepalive = 0;
+			}
+		} while (request->keepalive && !http_shutdown && request_pending(request));
+
+		if (request->keepalive && !http_shutdown) {
+			// Give the connection back to the server, until the client sends a new request
+			request->idle = xTaskGetTickCount();
+			xQueueSend(config->idle, &request, portMAX_DELAY);
+		} else {
+			http_connection_close(request);
+		}
+	}
+
+	return NULL;
+}
+
 static void *http_thread(void *arg) {
 	http_server_config *config = (http_server_config*) arg;
+	http_request_handle *idle[CONFIG_LUA_RTOS_HTTP_SERVER_MAX_CONNECTIONS];
+	pthread_t workers[CONFIG_LUA_RTOS_HTTP_SERVER_WORKERS];
+	http_request_handle *request;
 	struct sockaddr_in6 sin;
-  SSL_CTX *ctx = NULL;
-  SSL *ssl = NULL;
-
-  	net_init();
+	struct timeval tv;
+	pthread_attr_t attr;
+	TickType_t now;
+	fd_set rset;
+	int nidle = 0;
+	int nworkers = 0;
+	int maxfd;
+	int i, n;
+
+	net_init();
 	if(0 == *config->server) {
 		*config->server = socket(AF_INET6, SOCK_STREAM, 0);
 		if(0 > *config->server) {
@@ -702,17 +1291,11 @@ static void *http_thread(void *arg) {
 			syslog(LOG_ERR, "couldn't listen on port %d\n", config->port);
 			return NULL;
 		}
-
-		// Set the timeout for accept
-		struct timeval timeout;
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
-		setsockopt(*config->server, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 	}
 
 	if (config->secure) {
-		ctx = SSL_CTX_new(TLS_server_method());
-		if (!ctx) {
+		config->ctx = SSL_CTX_new(TLS_server_method());
+		if (!config->ctx) {
 			syslog(LOG_ERR, "couldn't create SSL context\n");
 			return NULL;
 		}
@@ -722,16 +1305,16 @@ static void *http_thread(void *arg) {
 		unsigned char *certificate_buf;
 		if( mbedtls_pk_load_file( config->certificate, &certificate_buf, &certificate_bytes ) != 0 ) {
 			syslog(LOG_ERR, "couldn't load SSL certificate\n");
-		  SSL_CTX_free(ctx);
-		  ctx = NULL;
+		  SSL_CTX_free(config->ctx);
+		  config->ctx = NULL;
 			return NULL;
 		}
-		if (!SSL_CTX_use_certificate_ASN1(ctx, certificate_bytes, certificate_buf)) {
+		if (!SSL_CTX_use_certificate_ASN1(config->ctx, certificate_bytes, certificate_buf)) {
 			syslog(LOG_ERR, "couldn't set SSL certificate\n");
 			mbedtls_zeroize( certificate_buf, certificate_bytes );
 			mbedtls_free( certificate_buf );
-		  SSL_CTX_free(ctx);
-		  ctx = NULL;
+		  SSL_CTX_free(config->ctx);
+		  config->ctx = NULL;
 			return NULL;
 		}
 		mbedtls_zeroize( certificate_buf, certificate_bytes );
@@ -742,40 +1325,114 @@ static void *http_thread(void *arg) {
 		unsigned char *private_key_buf;
 		if( mbedtls_pk_load_file( config->private_key, &private_key_buf, &private_key_bytes ) != 0 ) {
 			syslog(LOG_ERR, "couldn't load SSL certificate\n");
-		  SSL_CTX_free(ctx);
-		  ctx = NULL;
+		  SSL_CTX_free(config->ctx);
+		  config->ctx = NULL;
 			return NULL;
 		}
-		if (!SSL_CTX_use_PrivateKey_ASN1(0, ctx, private_key_buf, private_key_bytes)) {
+		if (!SSL_CTX_use_PrivateKey_ASN1(0, config->ctx, private_key_buf, private_key_bytes)) {
 			syslog(LOG_ERR, "couldn't load SSL private key\n");
 			mbedtls_zeroize( private_key_buf, private_key_bytes );
 			mbedtls_free( private_key_buf );
-		  SSL_CTX_free(ctx);
-		  ctx = NULL;
+		  SSL_CTX_free(config->ctx);
+		  config->ctx = NULL;
 			return NULL;
 		}
 		mbedtls_zeroize( private_key_buf, private_key_bytes );
 		mbedtls_free( private_key_buf );
 	}
 
+	// Create the queues for pass connections between server and workers. As the
+	// number of open connections is limited, these queues never are full.
+	config->work = xQueueCreate(CONFIG_LUA_RTOS_HTTP_SERVER_MAX_CONNECTIONS + CONFIG_LUA_RTOS_HTTP_SERVER_WORKERS, sizeof(http_request_handle *));
+	config->idle = xQueueCreate(CONFIG_LUA_RTOS_HTTP_SERVER_MAX_CONNECTIONS, sizeof(http_request_handle *));
+	if (!config->work || !config->idle) {
+		syslog(LOG_ERR, "couldn't create http queues\n");
+		goto exit;
+	}
+
+	// Create workers
+	http_thread_attr(&attr);
+
+	for(nworkers = 0;nworkers < CONFIG_LUA_RTOS_HTTP_SERVER_WORKERS;nworkers++) {
+		if (pthread_create(&workers[nworkers], &attr, http_worker, config)) {
+			syslog(LOG_ERR, "couldn't start http worker\n");
+			break;
+		}
+
+		pthread_setname_np(workers[nworkers], config->secure ? "ssl_http_wrk" : "http_wrk");
+	}
+
+	if (nworkers == 0) {
+		goto exit;
+	}
+
 	syslog(LOG_INFO, "http: server listening on port %d\n", config->port);
 
 	http_refcount++;
 	while (!http_shutdown) {
-		int client;
+		// Take back the connections given back by workers
+		while ((nidle < CONFIG_LUA_RTOS_HTTP_SERVER_MAX_CONNECTIONS) && (xQueueReceive(config->idle, &idle[nidle], 0) == pdTRUE)) {
+			nidle++;
+		}
 
-		if (config->secure) {
-		  ssl = SSL_new(ctx);
-		  if (!ssl) {
-				syslog(LOG_ERR, "couldn't create SSL session\n");
-				break; //exit the loop to shutdown the server
+		// Wait for a new connection, or for a new request on an idle connection
+		FD_ZERO(&rset);
+		FD_SET(*config->server, &rset);
+		maxfd = *config->server;
+
+		for(i = 0;i < nidle;i++) {
+			FD_SET(idle[i]->socket, &rset);
+			if (idle[i]->socket > maxfd) maxfd = idle[i]->socket;
+		}
+
+		tv.tv_sec = 0;
+		tv.tv_usec = HTTP_SELECT_INTERVAL * 1000;
+
+		n = select(maxfd + 1, &rset, NULL, NULL, &tv);
+		if (n < 0) {
+			delay(HTTP_SELECT_INTERVAL);
+			continue;
+		}
+
+		now = xTaskGetTickCount();
+
+		// Dispatch idle connections with data, and close expired ones. New
+		// connections wait for their first request up to the server timeout.
+		for(i = nidle - 1;i >= 0;i--) {
+			request = idle[i];
+
+			if ((n > 0) && FD_ISSET(request->socket, &rset)) {
+				xQueueSend(config->work, &request, portMAX_DELAY);
+			} else if ((now - request->idle) * portTICK_PERIOD_MS >= (request->requests ? CONFIG_LUA_RTOS_HTTP_SERVER_KEEPALIVE_TIMEOUT : CONFIG_LUA_RTOS_HTTP_SERVER_TIMEOUT) * 1000) {
+				http_connection_close(request);
+			} else {
+				continue;
 			}
+
+			idle[i] = idle[--nidle];
 		}
 
-		// Wait for a request ...
-		if ((client = accept(*config->server, NULL, NULL)) != -1) {
+		if ((n > 0) && FD_ISSET(*config->server, &rset)) {
+			int client;
 
-			// We wait for send all data before close socket's stream
+			if ((client = accept(*config->server, NULL, NULL)) == -1) {
+				continue;
+			}
+
+			__sync_fetch_and_add(&http_stats.connections, 1);
+
+			if (config->connections >= CONFIG_LUA_RTOS_HTTP_SERVER_MAX_CONNECTIONS) {
+				if (!config->secure) {
+					const char *busy = PROTOCOL " 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+					send(client, busy, strlen(busy), 0);
+				}
+
+				__sync_fetch_and_add(&http_stats.rejected, 1);
+				close(client);
+				continue;
+			}
+
+			// We wait for send all data before close the socket
 			struct linger so_linger;
 			so_linger.l_onoff  = 1;
 			so_linger.l_linger = 2;
@@ -783,45 +1440,63 @@ static void *http_thread(void *arg) {
 
 			// Set a timeout for send / receive
 			struct timeval tout;
-			tout.tv_sec = 10;
+			tout.tv_sec = CONFIG_LUA_RTOS_HTTP_SERVER_TIMEOUT;
 			tout.tv_usec = 0;
 			setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tout, sizeof(tout));
 			setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tout, sizeof(tout));
 
-			if (config->secure) {
-				SSL_set_fd(ssl, client);
+			request = (http_request_handle *)calloc(1, sizeof(http_request_handle));
+			if (!request) {
+				close(client);
+				continue;
+			}
 
-				if (!SSL_accept(ssl)) {
-					syslog(LOG_ERR, "couldn't accept SSL connection\n");
-				} else {
-					http_request_handle request = HTTP_Request_Secure_initializer;
-					process(&request);
-				}
+			request->config = config;
+			request->socket = client;
+			request->idle = xTaskGetTickCount();
 
-				SSL_shutdown(ssl);
-			}
-			else
-			{
-				// Create the socket stream
-				FILE *stream = fdopen(client, "a+");
-				http_request_handle request = HTTP_Request_Normal_initializer;
-				process(&request);
-				fclose(stream);
-			}
+			__sync_fetch_and_add(&config->connections, 1);
 
-			close(client);
-			client = -1;
+			// Don't hold a worker until the client sends something
+			idle[nidle++] = request;
 		}
+	}
 
-		if (config->secure) {
-			SSL_free(ssl);
-			ssl = NULL;
-		}
+	// Stop workers
+	request = NULL;
+	for(i = 0;i < nworkers;i++) {
+		xQueueSend(config->work, &request, portMAX_DELAY);
+	}
+
+	for(i = 0;i < nworkers;i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	// Close idle connections
+	for(i = 0;i < nidle;i++) {
+		http_connection_close(idle[i]);
+	}
+
+	while (xQueueReceive(config->idle, &request, 0) == pdTRUE) {
+		http_connection_close(request);
+	}
+
+exit:
+	if (config->work) {
+		vQueueDelete(config->work);
+		config->work = NULL;
+	}
+
+	if (config->idle) {
+		vQueueDelete(config->idle);
+		config->idle = NULL;
 	}
 
 	if (config->secure) {
-		SSL_CTX_free(ctx);
-		ctx = NULL;
+		if (config->ctx) {
+			SSL_CTX_free(config->ctx);
+			config->ctx = NULL;
+		}
 
 		free(config->certificate);
 		config->certificate = NULL;
@@ -830,6 +1505,10 @@ static void *http_thread(void *arg) {
 		config->private_key = NULL;
 	}
 
+	if (nworkers == 0) {
+		return NULL;
+	}
+
 	syslog(LOG_INFO, "http: server shutting down on port %d\n", config->port);
 
 	/* it's not ideal to keep the server_socket open as it is blocked
@@ -848,6 +1527,13 @@ static void *http_thread(void *arg) {
 	http_refcount--;
 
 	if (0 == http_refcount) {
+		//last one frees the lua page cache
+		pthread_mutex_lock(&http_lua_mutex);
+		http_page_flush();
+		pthread_mutex_unlock(&http_lua_mutex);
+
+		file_hash_flush();
+
 		//last one needs to unregister the callback
 		driver_error_t *error;
 		if ((error = net_event_unregister_callback(http_net_callback))) {
@@ -864,7 +1550,6 @@ int http_start(lua_State* L) {
 
 	if(!http_refcount) {
 		pthread_attr_t attr;
-		struct sched_param sched;
 		pthread_t thread_normal;
 		pthread_t thread_secure;
 		ifconfig_t info;
@@ -894,21 +1579,7 @@ int http_start(lua_State* L) {
 		}
 
 		// Init thread attributes
-		pthread_attr_init(&attr);
-
-		// Set stack size
-		pthread_attr_setstacksize(&attr, CONFIG_LUA_RTOS_HTTP_SERVER_STACK_SIZE);
-
-		// Set priority
-		sched.sched_priority = CONFIG_LUA_RTOS_HTTP_SERVER_TASK_PRIORITY;
-		pthread_attr_setschedparam(&attr, &sched);
-
-		// Set CPU
-		cpu_set_t cpu_set = CPU_INITIALIZER;
-
-		CPU_SET(CONFIG_LUA_RTOS_HTTP_SERVER_TASK_CPU, &cpu_set);
-
-		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpu_set);
+		http_thread_attr(&attr);
 
 		// Create threads
 		http_shutdown = 0;
@@ -935,13 +1606,42 @@ int http_start(lua_State* L) {
 				return luaL_error(L, "couldn't start secure http_thread");
 			}
 
-			pthread_setname_np(thread_normal, "ssl_http");
+			pthread_setname_np(thread_secure, "ssl_http");
 		}
 	}
 
 	return 0;
 }
 
+int http_stats_get(lua_State* L) {
+	uint32_t requests = http_stats.requests;
+
+	lua_createtable(L, 0, 8);
+
+	lua_pushinteger(L, http_stats.connections);
+	lua_setfield(L, -2, "connections");
+
+	lua_pushinteger(L, http_normal.connections + http_secure.connections);
+	lua_setfield(L, -2, "open");
+
+	lua_pushinteger(L, http_stats.rejected);
+	lua_setfield(L, -2, "rejected");
+
+	lua_pushinteger(L, requests);
+	lua_setfield(L, -2, "requests");
+
+	lua_pushinteger(L, http_stats.reused);
+	lua_setfield(L, -2, "keepalive");
+
+	lua_pushinteger(L, requests ? http_stats.time / requests : 0);
+	lua_setfield(L, -2, "avgtime");
+
+	lua_pushinteger(L, http_stats.max_time);
+	lua_setfield(L, -2, "maxtime");
+
+	return 1;
+}
+
 void http_stop() {
 	if(http_refcount) {
 		http_shutdown++;
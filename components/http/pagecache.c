@@ -0,0 +1,271 @@
+/*
+ * Lua RTOS, http lua page cache
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+/*
+ * Lua pages are preprocessed and compiled once, and the resulting bytecode is
+ * kept in RAM, up to CONFIG_LUA_RTOS_HTTP_SERVER_PAGE_CACHE_SIZE bytes. When
+ * the budget is exceeded the least recently used pages are evicted.
+ *
+ * A cached page is valid while it's source path, modification time, size and
+ * st_ino don't change. SPIFFS has no modification time, but it changes st_ino
+ * each time a file is modified. Only on file systems that have neither of them
+ * (st_mtime and st_ino are 0) a hash of the page source is also checked. If the
+ * cache size is 0 pages are compiled on each request, without hashing them.
+ *
+ * These functions are not thread safe, and must be called with the lua page
+ * mutex held.
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_USE_HTTP_SERVER
+
+#include "pagecache.h"
+#include "preprocessor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+// Memory used by a page in the cache
+#define HTTP_PAGE_SIZE(page) (sizeof(http_page_t) + strlen((page)->path) + 1 + (page)->len)
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+} http_page_writer_t;
+
+static http_page_t *pages = NULL; // Cached pages, in LRU order
+static size_t cached = 0;         // Bytes used by cached pages
+
+static void http_page_free(http_page_t *page) {
+	cached -= HTTP_PAGE_SIZE(page);
+
+	free(page->chunk);
+	free(page->path);
+	free(page);
+}
+
+// Get the FNV-1a hash of a file
+static int http_page_hash(const char *path, uint32_t *hash) {
+	char buffer[128];
+	FILE *fp;
+	size_t n, i;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		return -1;
+	}
+
+	*hash = 2166136261u;
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+		for(i = 0;i < n;i++) {
+			*hash = (*hash ^ (uint8_t)buffer[i]) * 16777619u;
+		}
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static int http_page_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	http_page_writer_t *writer = (http_page_writer_t *)ud;
+	char *data;
+
+	if (writer->len + sz > writer->size) {
+		size_t size = writer->size ? writer->size : 512;
+
+		while (size < writer->len + sz) {
+			size <<= 1;
+		}
+
+		data = realloc(writer->data, size);
+		if (!data) {
+			return 1;
+		}
+
+		writer->data = data;
+		writer->size = size;
+	}
+
+	memcpy(writer->data + writer->len, p, sz);
+	writer->len += sz;
+
+	return 0;
+}
+
+// Add a compiled page to the cache, evicting the least recently used pages
+// if needed. If the page can't be cached it's freed.
+static void http_page_add(http_page_t *page) {
+	http_page_t **cpage;
+	size_t size = HTTP_PAGE_SIZE(page);
+
+	if (size > CONFIG_LUA_RTOS_HTTP_SERVER_PAGE_CACHE_SIZE) {
+		free(page->chunk);
+		free(page->path);
+		free(page);
+		return;
+	}
+
+	while (pages && (cached + size > CONFIG_LUA_RTOS_HTTP_SERVER_PAGE_CACHE_SIZE)) {
+		// Evict the last page
+		cpage = &pages;
+		while ((*cpage)->next) {
+			cpage = &(*cpage)->next;
+		}
+
+		http_page_free(*cpage);
+		*cpage = NULL;
+	}
+
+	page->next = pages;
+	pages = page;
+	cached += size;
+}
+
+// Compile a page, and leave the compiled function on the top of the stack
+static int http_page_compile(lua_State *L, const char *path, struct stat *statbuf, uint32_t hash) {
+	http_page_writer_t writer = {NULL, 0, 0};
+	http_page_t *page;
+	size_t len;
+	char *code;
+	int status;
+
+	if (http_preprocess_lua_page(path, &code, &len) < 0) {
+		lua_pushfstring(L, "cannot preprocess %s", path);
+		return LUA_ERRFILE;
+	}
+
+	lua_pushfstring(L, "@%s", path);
+	status = luaL_loadbufferx(L, code, len, lua_tostring(L, -1), "t");
+	lua_remove(L, -2);
+	free(code);
+
+	if ((status != LUA_OK) || (CONFIG_LUA_RTOS_HTTP_SERVER_PAGE_CACHE_SIZE == 0)) {
+		return status;
+	}
+
+	// Dump the compiled function, and cache it
+	if (lua_dump(L, http_page_writer, &writer, 0) != 0) {
+		free(writer.data);
+		return LUA_OK;
+	}
+
+	page = (http_page_t *)calloc(1, sizeof(http_page_t));
+	if (!page) {
+		free(writer.data);
+		return LUA_OK;
+	}
+
+	page->path = strdup(path);
+	if (!page->path) {
+		free(writer.data);
+		free(page);
+		return LUA_OK;
+	}
+
+	page->mtime = statbuf->st_mtime;
+	page->size = statbuf->st_size;
+	page->ino = statbuf->st_ino;
+	page->hash = hash;
+	page->chunk = writer.data;
+	page->len = writer.len;
+
+	http_page_add(page);
+
+	return LUA_OK;
+}
+
+int http_page_load(lua_State *L, const char *path, struct stat *statbuf) {
+	http_page_t **cpage;
+	http_page_t *page;
+	uint32_t hash = 0;
+	int status;
+
+#if CONFIG_LUA_RTOS_HTTP_SERVER_PAGE_CACHE_SIZE == 0
+	// Cache is disabled
+	return http_page_compile(L, path, statbuf, hash);
+#endif
+
+	// Without modification time and st_ino, the source hash is used to detect changes
+	if ((statbuf->st_mtime == 0) && (statbuf->st_ino == 0) && (http_page_hash(path, &hash) < 0)) {
+		lua_pushfstring(L, "cannot open %s", path);
+		return LUA_ERRFILE;
+	}
+
+	// Search in cache
+	cpage = &pages;
+	while (*cpage) {
+		page = *cpage;
+
+		if (strcmp(page->path, path) == 0) {
+			// Remove from the LRU list
+			*cpage = page->next;
+
+			if ((page->mtime == statbuf->st_mtime) && (page->size == statbuf->st_size) &&
+				(page->ino == statbuf->st_ino) && (page->hash == hash)) {
+				// Hit, move page to the head of the LRU list
+				page->next = pages;
+				pages = page;
+
+				lua_pushfstring(L, "@%s", path);
+				status = luaL_loadbufferx(L, page->chunk, page->len, lua_tostring(L, -1), "b");
+				lua_remove(L, -2);
+
+				return status;
+			}
+
+			// Page has changed
+			http_page_free(page);
+			break;
+		}
+
+		cpage = &page->next;
+	}
+
+	return http_page_compile(L, path, statbuf, hash);
+}
+
+void http_page_flush() {
+	http_page_t *page;
+
+	while (pages) {
+		page = pages;
+		pages = page->next;
+
+		http_page_free(page);
+	}
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Lua RTOS, http lua page cache
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_USE_HTTP_SERVER
+
+#ifndef HTTP_PAGECACHE_H_
+#define HTTP_PAGECACHE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include "lua.h"
+
+typedef struct http_page {
+	struct http_page *next; // Next page, in LRU order (most recently used first)
+	char *path;             // Page path
+	time_t mtime;           // Page source modification time
+	off_t size;             // Page source size
+	ino_t ino;              // Page source st_ino, changes when the file is modified (SPIFFS)
+	uint32_t hash;          // Page source hash, only if file system has neither mtime nor st_ino
+	size_t len;             // Compiled chunk length
+	char *chunk;            // Compiled chunk
+} http_page_t;
+
+int http_page_load(lua_State *L, const char *path, struct stat *statbuf);
+void http_page_flush();
+
+#endif
+
+#endif
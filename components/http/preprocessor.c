@@ -32,13 +32,14 @@
 #if CONFIG_LUA_RTOS_USE_HTTP_SERVER
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <sys/syslog.h>
 
-int http_process_lua_page(const char *ipath, const char *opath) {
-    FILE *ifp; // Input file
-    FILE *ofp; // Output file
+#include "preprocessor.h"
 
+// Preprocess a lua page, reading from ifp, and writing the resulting lua code to ofp
+static void http_preprocess(FILE *ifp, FILE *ofp) {
     int c;
     int nested = 0;
     int print = 0;
@@ -56,20 +57,6 @@ int http_process_lua_page(const char *ipath, const char *opath) {
     const char *cet = et;
     char *cbuff = buff;
 
-    // Open input file
-    ifp = fopen(ipath,"r");
-    if (!ifp) {
-        return -1;
-    }
-
-    // Open output file
-    ofp = fopen(opath,"w+");
-    if (!ofp) {
-		fclose(ifp);
-
-        return -1;
-    }
-
 	string = 0;
 	*cbuff = '\0';
 
@@ -210,10 +197,38 @@ int http_process_lua_page(const char *ipath, const char *opath) {
     }
 
 	fprintf(ofp, "end");
+}
+
+int http_preprocess_lua_page(const char *ipath, char **buffer, size_t *size) {
+    FILE *ifp; // Input file
+    FILE *ofp; // Output stream, in memory
+
+    *buffer = NULL;
+    *size = 0;
+
+    // Open input file
+    ifp = fopen(ipath,"r");
+    if (!ifp) {
+        return -1;
+    }
+
+    // Open output stream
+    ofp = open_memstream(buffer, size);
+    if (!ofp) {
+		fclose(ifp);
+
+        return -1;
+    }
+
+    http_preprocess(ifp, ofp);
 
     fclose(ifp);
     fclose(ofp);
 
+    if (!*buffer) {
+    	return -1;
+    }
+
     return 0;
 }
 
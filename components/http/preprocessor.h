@@ -34,7 +34,9 @@
 #ifndef HTTP_PREPROCESSOR_H_
 #define HTTP_PREPROCESSOR_H_
 
-int http_process_lua_page(const char *ipath, const char *opath);
+#include <stddef.h>
+
+int http_preprocess_lua_page(const char *ipath, char **buffer, size_t *size);
 
 #endif
 
@@ -73,6 +73,20 @@ typedef struct
   const TValue value;
 } luaR_entry;
 
+/* Number of rotables that can be indexed (must be a power of 2) */
+#define LUA_ROTABLE_INDEX_DIR_SIZE    256
+
+/* Rotables with less entries than this are searched linearly */
+#define LUA_ROTABLE_INDEX_MIN_ENTRIES 8
+
+/* Hash index of the string keys of a rotable */
+typedef struct
+{
+  const luaR_entry *rotable; /* Indexed rotable */
+  uint32_t mask;             /* Number of slots - 1, 0 if rotable is not indexed */
+  uint16_t slots[];          /* Entry position + 1 for each slot, 0 if slot is free */
+} luaR_index_t;
+
 const TValue* luaR_findglobal(const char *key);
 int luaR_findfunction(lua_State *L, const luaR_entry *ptable);
 const TValue* luaR_findentry(const void *pentry, const char *strkey, luaR_numkey numkey, unsigned *ppos);
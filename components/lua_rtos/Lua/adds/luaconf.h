@@ -11,18 +11,33 @@
 #define LUA_OS_VER "beta 0.1"
 	
 #if LUA_USE_LUA_LOCK
+	void LuaLockOpen(lua_State *L);
+	void LuaLockClose(lua_State *L);
 	void LuaLock(lua_State *L);
 	void LuaUnlock(lua_State *L);
+	int  LuaTryLock(lua_State *L);
 
 	#define lua_lock(L)          LuaLock(L)
 	#define lua_unlock(L)        LuaUnlock(L)
 	#define luai_threadyield(L) {lua_unlock(L); lua_lock(L);}
+
+	// Each Lua state has it's own lock, created / destroyed when the
+	// state is opened / closed
+	#define luai_userstateopen(L)  LuaLockOpen(L)
+	#define luai_userstateclose(L) LuaLockClose(L)
 #else
 	#define lua_lock(L)
 	#define lua_unlock(L)        
 	#define luai_threadyield(L) 
+	#define LuaTryLock(L)       1
 #endif
 
+// Account each Lua allocator operation to the running task, for
+// thread.list's heap counters
+void uxAccountAlloc(size_t osize, size_t nsize);
+
+#define luai_useralloc(osize, nsize) uxAccountAlloc(osize, nsize)
+
 #undef  LUA_PROMPT
 #define LUA_PROMPT		"> "
 
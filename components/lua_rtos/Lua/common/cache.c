@@ -35,153 +35,121 @@
 
 #include "esp_attr.h"
 
+#include "freertos/FreeRTOS.h"
+
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * The cache is a direct mapped array of slots for each CPU core, keyed by the rotable
+ * address and the key address (Lua short strings are interned, so the same key has
+ * always the same address while it's alive).
+ *
+ * Each core only access to it's own slots, so no mutex is needed. The access is done
+ * with interrupts disabled in the current core, that avoids a task switch (or a core
+ * migration) while a slot is read or written, and is cheaper than take a mutex.
+ *
+ * As a key address can be reused by another string after a garbage collection, a hit
+ * is only accepted if the key of the cached entry matches the searched key.
+ */
+static rotable_cache_slot_t cache[portNUM_PROCESSORS][ROTABLE_CACHE_SLOTS];
+static rotable_cache_stats_t stats[portNUM_PROCESSORS];
 
-static rotable_cache_t cache;
-
-void rotable_cache_dump() {
-	struct rotable_cache_entry *entry = cache.first;
-	int i = 0;
+static inline uint32_t IRAM_ATTR rotable_cache_hash(const luaR_entry *rotable, const char *strkey) {
+	uint32_t hash = ((uint32_t)rotable >> 2) ^ ((uint32_t)strkey >> 2);
 
-	mtx_lock(&cache.mtx);
+	return (hash ^ (hash >> 7)) & (ROTABLE_CACHE_SLOTS - 1);
+}
 
-	while (entry) {
-		printf("[%d]: used %d ", i, entry->used);
+int rotable_cache_init() {
+	unsigned int state = portENTER_CRITICAL_NESTED();
 
-		if (entry->rotable) {
-			if (entry->entry->key.len) {
-				printf("%s\r\n", entry->entry->key.id.strkey);
-			}
-		} else {
-			printf("emppty\r\n");
-		}
+	memset(cache, 0, sizeof(cache));
+	memset(stats, 0, sizeof(stats));
 
-		entry = entry->next;
-		i++;
-	}
+	portEXIT_CRITICAL_NESTED(state);
 
-	printf("\r\n");
+	return 0;
+}
 
-	printf("hit: %d, miss: %d\r\n", cache.hit, cache.miss);
+void rotable_cache_stats(rotable_cache_stats_t *total) {
+	unsigned int state;
+	int core;
 
-	mtx_unlock(&cache.mtx);
+	memset(total, 0, sizeof(rotable_cache_stats_t));
 
-	printf("\r\n\r\n");
-}
+	for(core = 0;core < portNUM_PROCESSORS;core++) {
+		state = portENTER_CRITICAL_NESTED();
 
-int rotable_cache_init() {
-	struct rotable_cache_entry *entries;
-	int i;
+		total->hit   += stats[core].hit;
+		total->miss  += stats[core].miss;
+		total->evict += stats[core].evict;
 
-	// Allocate space for cache entries
-	entries = (struct rotable_cache_entry *)calloc(ROTABLE_CACHE_LENGTH, sizeof(struct rotable_cache_entry));
-	if (!entries) {
-		return 1;
+		portEXIT_CRITICAL_NESTED(state);
 	}
+}
 
-	cache.first = entries;
+const IRAM_ATTR TValue *rotable_cache_get(const luaR_entry *rotable, const char *strkey) {
+	const luaR_entry *entry = NULL;
+	rotable_cache_slot_t *slot;
+	unsigned int state;
+	int core;
+
+	uint32_t hash = rotable_cache_hash(rotable, strkey);
 
-	// Initialize linked list
-	entries->previous = NULL;
+	state = portENTER_CRITICAL_NESTED();
 
-	for(i = 0;i < ROTABLE_CACHE_LENGTH;i++) {
-		entries->next = (entries + 1);
+	core = xPortGetCoreID();
+	slot = &cache[core][hash];
 
-		if (i > 0) {
-			entries->previous = (entries - 1);
-		}
-		entries++;
+	if ((slot->rotable == rotable) && (slot->strkey == strkey)) {
+		entry = slot->entry;
 	}
 
-	entries--;
+	portEXIT_CRITICAL_NESTED(state);
 
-	entries->next = NULL;
+	if (entry && (strcmp(entry->key.id.strkey, strkey) != 0)) {
+		// The key address is reused by another string
+		entry = NULL;
+	}
 
-	cache.last = entries;
+	state = portENTER_CRITICAL_NESTED();
 
-	// Init mutex
-	mtx_init(&cache.mtx, NULL, NULL, 0);
+	core = xPortGetCoreID();
 
-	return 0;
-}
-
-const IRAM_ATTR TValue *rotable_cache_get(const luaR_entry *rotable, const char *strkey) {
-	struct rotable_cache_entry *entry = cache.first;
-
-	mtx_lock(&cache.mtx);
-
-	// rotable strkey is cached?
-	while (entry) {
-		if ((entry->rotable == rotable) && (!strcmp(entry->entry->key.id.strkey, strkey))) {
-			// hit
-			cache.hit++;
-			entry->used++;
-
-			// Promote this entry to the head
-			if (entry != cache.first) {
-				if (entry != cache.last) {
-					entry->previous->next = entry->next;
-					entry->next->previous = entry->previous;
-					cache.first->previous = entry;
-					entry->next = cache.first;
-					cache.first = entry;
-				} else {
-					cache.last->previous->next = NULL;
-					cache.last = cache.last->previous;
-					entry->next = cache.first;
-					entry->previous = NULL;
-					cache.first->previous = entry;
-					cache.first = entry;
-				}
-			}
-
-			mtx_unlock(&cache.mtx);
-			return &entry->entry->value;
-			break;
-		}
-
-		entry = entry->next;
+	if (entry) {
+		stats[core].hit++;
+	} else {
+		stats[core].miss++;
 	}
 
-	// miss
-	cache.miss++;
+	portEXIT_CRITICAL_NESTED(state);
 
-	mtx_unlock(&cache.mtx);
-
-	return NULL;
+	return entry ? &entry->value : NULL;
 }
 
-void IRAM_ATTR rotable_cache_put(const luaR_entry *rotable, const luaR_entry *entry) {
-	mtx_lock(&cache.mtx);
-
-	struct rotable_cache_entry *first  = cache.last;
-	struct rotable_cache_entry *second = cache.first;
-	struct rotable_cache_entry *last   = cache.last->previous;
+void IRAM_ATTR rotable_cache_put(const luaR_entry *rotable, const char *strkey, const luaR_entry *entry) {
+	rotable_cache_slot_t *slot;
+	unsigned int state;
+	int core;
 
-	first->next      = second;
-	first->previous  = NULL;
-	second->previous = first;
-	last->next       = NULL;
+	uint32_t hash = rotable_cache_hash(rotable, strkey);
 
-	first->rotable = (luaR_entry *)rotable;
-	first->entry = (luaR_entry *)entry;
+	state = portENTER_CRITICAL_NESTED();
 
-	cache.first = first;
-	cache.first->used = 1;
-	cache.last = last;
-
-	mtx_unlock(&cache.mtx);
-}
+	core = xPortGetCoreID();
+	slot = &cache[core][hash];
 
-/*
+	if (slot->rotable) {
+		stats[core].evict++;
+	}
 
-bisect, 10000 times
+	slot->rotable = rotable;
+	slot->strkey = strkey;
+	slot->entry = entry;
 
-cache = 0, 6.441 secs
-cache = 8, 5.055 secs
+	portEXIT_CRITICAL_NESTED(state);
+}
 
-*/
 #endif
@@ -36,32 +36,27 @@
 #ifndef ROTABLE_CACHE_H
 #define ROTABLE_CACHE_H
 
-#define ROTABLE_CACHE_LENGTH 8
+// Number of cache slots per CPU core (must be a power of 2)
+#define ROTABLE_CACHE_SLOTS 32
 
-#include <sys/mutex.h>
+#include <stdint.h>
 
-struct rotable_cache_entry {
-	struct rotable_cache_entry *previous; // Previous entry
-	struct rotable_cache_entry *next;     // Next entry
-
-	luaR_entry *rotable; // cached rotable
-	luaR_entry *entry;   // cached entry
-	uint32_t used;
-};
+typedef struct {
+	const luaR_entry *rotable; // cached rotable
+	const char *strkey;        // cached key
+	const luaR_entry *entry;   // cached entry
+} rotable_cache_slot_t;
 
 typedef struct {
-	uint32_t miss;  // Number of cache misses
 	uint32_t hit;   // Number of cache hits
-	struct mtx mtx; // Mutex for protect cache entries
-
-	struct rotable_cache_entry *first; // First entry
-	struct rotable_cache_entry *last;  // Last entry
-} rotable_cache_t;
+	uint32_t miss;  // Number of cache misses
+	uint32_t evict; // Number of cache evictions
+} rotable_cache_stats_t;
 
-void rotable_cache_dump();
 int rotable_cache_init();
+void rotable_cache_stats(rotable_cache_stats_t *total);
 const TValue *rotable_cache_get(const luaR_entry *rotable, const char *strkey);
-void rotable_cache_put(const luaR_entry *rotable, const luaR_entry *entry);
+void rotable_cache_put(const luaR_entry *rotable, const char *strkey, const luaR_entry *entry);
 
 #endif
 
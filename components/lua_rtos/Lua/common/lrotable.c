@@ -14,6 +14,8 @@
 #include "cache.h"
 #include "lstring.h"
 #include "lua.h"
+
+#include <stdlib.h>
 #include <string.h>
 
 /* Externally defined read-only table array */
@@ -22,6 +24,134 @@ extern const luaR_entry lua_rotable[];
 static const TValue *luaR_auxfind(const luaR_entry *pentry, const char *strkey,
 		luaR_numkey numkey, unsigned *ppos);
 
+#if CONFIG_LUA_RTOS_LUA_USE_ROTABLE_INDEX
+/*
+ * Rotable hash indexes
+ *
+ * Rotables are defined in C source code, so it's entries can't be sorted, or hashed at
+ * build time. Instead of this, the first time that a rotable is accessed by a string key
+ * an open addressing hash index of it's string keys is built, and published in a directory
+ * of indexes, keyed by the rotable address.
+ *
+ * Indexes are never modified after their publication, and are published with an atomic
+ * compare and swap, so lookups don't need any lock.
+ */
+
+// Directory of rotable indexes
+static luaR_index_t *volatile luaR_indexes[LUA_ROTABLE_INDEX_DIR_SIZE];
+
+// FNV-1a hash of a string key, returning also the key length
+static inline uint32_t IRAM_ATTR luaR_hash(const char *k, int *len) {
+	const char *c = k;
+	uint32_t hash = 2166136261U;
+
+	while (*c) {
+		hash = (hash ^ (uint8_t)*c++) * 16777619U;
+	}
+
+	*len = c - k;
+
+	return hash;
+}
+
+static luaR_index_t *luaR_buildindex(const luaR_entry *pentry) {
+	const luaR_entry *entry;
+	luaR_index_t *index;
+	uint32_t slot;
+	int entries = 0;
+	int slots;
+	int len;
+
+	// Count entries
+	for(entry = pentry; entry->key.id.strkey; entry++) {
+		entries++;
+	}
+
+	if ((entries < LUA_ROTABLE_INDEX_MIN_ENTRIES) || (entries > 0xfffe)) {
+		// Not worth to be indexed (or can't be indexed), use a linear search
+		slots = 0;
+	} else {
+		// Keep load factor under 2/3
+		slots = 1;
+		while (slots < entries + (entries >> 1)) {
+			slots <<= 1;
+		}
+	}
+
+	index = (luaR_index_t *)calloc(1, sizeof(luaR_index_t) + slots * sizeof(uint16_t));
+	if (!index) {
+		return NULL;
+	}
+
+	index->rotable = pentry;
+	index->mask = slots ? (slots - 1) : 0;
+
+	if (slots) {
+		for(entry = pentry; entry->key.id.strkey; entry++) {
+			if (entry->key.type != LUA_TSTRING) {
+				continue;
+			}
+
+			slot = luaR_hash(entry->key.id.strkey, &len) & index->mask;
+			while (index->slots[slot]) {
+				slot = (slot + 1) & index->mask;
+			}
+
+			index->slots[slot] = (entry - pentry) + 1;
+		}
+	}
+
+	return index;
+}
+
+// Get the index of a rotable, building it if it's not indexed yet
+static const luaR_index_t *IRAM_ATTR luaR_getindex(const luaR_entry *pentry) {
+	luaR_index_t *index = NULL;
+	luaR_index_t *current;
+	uint32_t slot;
+	int probes;
+
+	slot = (((uint32_t)pentry) >> 2) & (LUA_ROTABLE_INDEX_DIR_SIZE - 1);
+
+	for(probes = 0; probes < LUA_ROTABLE_INDEX_DIR_SIZE; probes++) {
+		current = luaR_indexes[slot];
+
+		if (current == NULL) {
+			if (!index) {
+				index = luaR_buildindex(pentry);
+				if (!index) {
+					return NULL;
+				}
+			}
+
+			if (__sync_bool_compare_and_swap(&luaR_indexes[slot], NULL, index)) {
+				return index;
+			}
+
+			// Another thread has published an index in this slot, check again
+			current = luaR_indexes[slot];
+		}
+
+		if (current->rotable == pentry) {
+			if (index) {
+				free(index);
+			}
+
+			return current;
+		}
+
+		slot = (slot + 1) & (LUA_ROTABLE_INDEX_DIR_SIZE - 1);
+	}
+
+	// Directory is full
+	if (index) {
+		free(index);
+	}
+
+	return NULL;
+}
+#endif
+
 /*
  * Only for debug purposes.
  */
@@ -66,6 +196,32 @@ static const IRAM_ATTR TValue *luaR_auxfind(const luaR_entry *pentry, const char
 	int i = 0;
 
 	if (k) {
+		#if CONFIG_LUA_RTOS_LUA_USE_ROTABLE_INDEX
+		const luaR_index_t *index = luaR_getindex(pentry);
+
+		if (index && index->mask) {
+			uint32_t slot;
+			int kl;
+
+			slot = luaR_hash(k, &kl) & index->mask;
+			while (index->slots[slot]) {
+				entry = pentry + index->slots[slot] - 1;
+
+				if ((entry->key.type == LUA_TSTRING) && (entry->key.len == kl) && (!memcmp(entry->key.id.strkey, k, kl))) {
+					if (ppos) {
+						*ppos = index->slots[slot] - 1;
+					}
+
+					return &entry->value;
+				}
+
+				slot = (slot + 1) & index->mask;
+			}
+
+			return NULL;
+		}
+		#endif
+
 		// Try to get from cache
 		#if CONFIG_LUA_RTOS_LUA_USE_ROTABLE_CACHE
 		res = rotable_cache_get(pentry, k);
@@ -80,7 +236,7 @@ static const IRAM_ATTR TValue *luaR_auxfind(const luaR_entry *pentry, const char
 			if ((entry->key.type == LUA_TSTRING) && (entry->key.len == kl) && (!strncmp(entry->key.id.strkey, k, kl))) {
 				#if CONFIG_LUA_RTOS_LUA_USE_ROTABLE_CACHE
 				// Put in cache
-				rotable_cache_put(pentry, entry);
+				rotable_cache_put(pentry, k, entry);
 				#endif
 
 				res = &entry->value;
@@ -117,6 +273,9 @@ static const IRAM_ATTR TValue *luaR_auxfind(const luaR_entry *pentry, const char
  *
  */
 const IRAM_ATTR TValue *luaR_findglobal(const char *name) {
+	#if CONFIG_LUA_RTOS_LUA_USE_ROTABLE_INDEX
+	return luaR_auxfind(lua_rotable, name, 0, NULL);
+	#else
 	// Try to get from cache
 	#if CONFIG_LUA_RTOS_LUA_USE_ROTABLE_CACHE
 	const TValue *res = NULL;
@@ -134,7 +293,7 @@ const IRAM_ATTR TValue *luaR_findglobal(const char *name) {
 		if ((entry->key.len == len) && (!strncmp(entry->key.id.strkey, name, len))) {
 			#if CONFIG_LUA_RTOS_LUA_USE_ROTABLE_CACHE
 			// Put in cache
-			rotable_cache_put(lua_rotable, entry);
+			rotable_cache_put(lua_rotable, name, entry);
 			#endif
 
 			return &entry->value;
@@ -143,6 +302,7 @@ const IRAM_ATTR TValue *luaR_findglobal(const char *name) {
 	}
 
 	return NULL;
+	#endif
 }
 
 int IRAM_ATTR luaR_findfunction(lua_State *L, const luaR_entry *ptable) {
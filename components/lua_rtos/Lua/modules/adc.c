@@ -31,6 +31,8 @@
 
 #if CONFIG_LUA_RTOS_LUA_USE_ADC
 
+#include "freertos/FreeRTOS.h"
+
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -40,6 +42,7 @@
 #include "modules.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
@@ -105,6 +108,8 @@ static int ladc_attach( lua_State* L ) {
 
     adc_userdata *adc = (adc_userdata *)lua_newuserdata(L, sizeof(adc_userdata));
 
+    adc->stream = 0;
+
     if ((error = adc_setup(id, channel, 0, vref, max, res, &adc->h))) {
     	return luaL_driver_error(L, error);
     }
@@ -133,6 +138,134 @@ static int ladc_read( lua_State* L ) {
     }
 }
 
+static int ladc_start( lua_State* L ) {
+    driver_error_t *error;
+    adc_userdata *adc = NULL;
+
+    adc = (adc_userdata *)luaL_checkudata(L, 1, "adc.chan");
+    luaL_argcheck(L, adc, 1, "adc expected");
+
+    int timer = luaL_checkinteger(L, 2);
+    int rate = luaL_checkinteger(L, 3);
+    int decimation = luaL_optinteger(L, 4, 1);
+    int filter = luaL_optinteger(L, 5, ADC_FILTER_NONE);
+    int size = luaL_optinteger(L, 6, 1024);
+
+    luaL_argcheck(L, (decimation > 0) && (decimation <= 0xffff), 4, "invalid decimation");
+    luaL_argcheck(L, size > 0, 6, "must be greater than 0");
+
+    if ((error = adc_stream_start(&adc->h, timer, rate, decimation, filter, size))) {
+    	return luaL_driver_error(L, error);
+    }
+
+    adc->stream = 1;
+
+    return 0;
+}
+
+static int ladc_stop( lua_State* L ) {
+    driver_error_t *error;
+    adc_userdata *adc = NULL;
+
+    adc = (adc_userdata *)luaL_checkudata(L, 1, "adc.chan");
+    luaL_argcheck(L, adc, 1, "adc expected");
+
+    adc->stream = 0;
+
+    if ((error = adc_stream_stop(&adc->h))) {
+    	return luaL_driver_error(L, error);
+    }
+
+    return 0;
+}
+
+// Destructor
+static int ladc_chan_gc( lua_State* L ) {
+    driver_error_t *error;
+    adc_userdata *adc = NULL;
+
+    adc = (adc_userdata *)luaL_testudata(L, 1, "adc.chan");
+    if (adc && adc->stream) {
+    	// Stop continuous sampling started from this channel, to release
+    	// the timer and the sampler task
+    	adc->stream = 0;
+
+    	if ((error = adc_stream_stop(&adc->h))) {
+    		free(error);
+    	}
+    }
+
+    return 0;
+}
+
+// Returns a block of raw samples as a string of 16-bit unsigned integers, in
+// the native byte order (use string.unpack("I2", ...) to get each sample)
+static int ladc_samples( lua_State* L ) {
+    driver_error_t *error;
+    adc_userdata *adc = NULL;
+    luaL_Buffer b;
+    int read;
+
+    adc = (adc_userdata *)luaL_checkudata(L, 1, "adc.chan");
+    luaL_argcheck(L, adc, 1, "adc expected");
+
+    int samples = luaL_checkinteger(L, 2);
+    int timeout = luaL_optinteger(L, 3, 0xffffffff);
+
+    luaL_argcheck(L, samples > 0, 2, "must be greater than 0");
+
+    if (timeout == 0xffffffff) {
+    	timeout = portMAX_DELAY;
+    }
+
+    uint16_t *buff = (uint16_t *)luaL_buffinitsize(L, &b, samples * sizeof(uint16_t));
+
+    if ((error = adc_stream_read(&adc->h, buff, samples, timeout, &read))) {
+    	return luaL_driver_error(L, error);
+    }
+
+    if (read > 0) {
+    	luaL_pushresultsize(&b, read * sizeof(uint16_t));
+    } else {
+    	lua_pushnil(L);
+    }
+
+    return 1;
+}
+
+static int ladc_stats( lua_State* L ) {
+    driver_error_t *error;
+    adc_userdata *adc = NULL;
+    adc_stream_stats_t stats;
+    int pending;
+
+    adc = (adc_userdata *)luaL_checkudata(L, 1, "adc.chan");
+    luaL_argcheck(L, adc, 1, "adc expected");
+
+    if ((error = adc_stream_stats(&adc->h, &stats, &pending))) {
+    	return luaL_driver_error(L, error);
+    }
+
+	lua_createtable(L, 0, 5);
+
+	lua_pushinteger(L, stats.samples);
+	lua_setfield (L, -2, "samples");
+
+	lua_pushinteger(L, stats.overruns);
+	lua_setfield (L, -2, "overruns");
+
+	lua_pushinteger(L, stats.missed);
+	lua_setfield (L, -2, "missed");
+
+	lua_pushinteger(L, stats.errors);
+	lua_setfield (L, -2, "errors");
+
+	lua_pushinteger(L, pending);
+	lua_setfield (L, -2, "pending");
+
+    return 1;
+}
+
 static const LUA_REG_TYPE ladc_map[] = {
 	{ LSTRKEY( "calibrate"),	  LFUNCVAL( ladc_calib  ) },
     { LSTRKEY( "attach"),		  LFUNCVAL( ladc_attach  ) },
@@ -161,14 +294,23 @@ static const LUA_REG_TYPE ladc_map[] = {
 	ADC_ADC_CH5
 	ADC_ADC_CH6
 	ADC_ADC_CH7
+    { LSTRKEY( "FILTERNONE" ),	  LINTVAL( ADC_FILTER_NONE ) },
+    { LSTRKEY( "FILTERAVG" ),	  LINTVAL( ADC_FILTER_AVG ) },
+    { LSTRKEY( "FILTERMIN" ),	  LINTVAL( ADC_FILTER_MIN ) },
+    { LSTRKEY( "FILTERMAX" ),	  LINTVAL( ADC_FILTER_MAX ) },
 	DRIVER_REGISTER_LUA_ERRORS(adc)
 	{ LNILKEY, LNILVAL }
 };
 
 static const LUA_REG_TYPE ladc_chan_map[] = {
   	{ LSTRKEY( "read"        ),	  LFUNCVAL( ladc_read          ) },
+  	{ LSTRKEY( "start"       ),	  LFUNCVAL( ladc_start         ) },
+  	{ LSTRKEY( "stop"        ),	  LFUNCVAL( ladc_stop          ) },
+  	{ LSTRKEY( "samples"     ),	  LFUNCVAL( ladc_samples       ) },
+  	{ LSTRKEY( "stats"       ),	  LFUNCVAL( ladc_stats         ) },
     { LSTRKEY( "__metatable" ),	  LROVAL  ( ladc_chan_map      ) },
 	{ LSTRKEY( "__index"     ),   LROVAL  ( ladc_chan_map      ) },
+	{ LSTRKEY( "__gc"        ),   LFUNCVAL( ladc_chan_gc       ) },
 	{ LNILKEY, LNILVAL }
 };
 
@@ -35,6 +35,7 @@
 
 typedef struct {
     adc_channel_h_t h;
+    uint8_t stream;          // Continuous sampling started from this channel
 } adc_userdata;
 
 #ifdef CPU_ADC0
@@ -0,0 +1,837 @@
+/*
+ * Lua RTOS, array module
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+/*
+ * Typed numeric arrays. Elements are stored contiguous in the userdata, instead
+ * of one TValue per element in a Lua table, and all the operations are done in C
+ * loops.
+ *
+ * Integer arrays use integer arithmetic, saturating to the range of the type.
+ * Float arrays use single precision arithmetic.
+ *
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_ARRAY
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "llimits.h"
+#include "lrotable.h"
+#include "modules.h"
+#include "array.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+// Element-wise operations
+#define ARRAY_OP_ADD  0
+#define ARRAY_OP_SUB  1
+#define ARRAY_OP_MUL  2
+#define ARRAY_OP_DIV  3
+
+typedef struct {
+	uint8_t  size;  // Element size, in bytes
+	int32_t  min;   // Min value (integer types)
+	int32_t  max;   // Max value (integer types)
+} array_type_t;
+
+static const array_type_t array_types[] = {
+	{1, INT8_MIN,  INT8_MAX  },
+	{1, 0,         UINT8_MAX },
+	{2, INT16_MIN, INT16_MAX },
+	{2, 0,         UINT16_MAX},
+	{4, INT32_MIN, INT32_MAX },
+	{4, 0,         0         },
+};
+
+static const LUA_REG_TYPE array_inst_map[];
+
+// Run BODY with T defined as the C type of the elements of array a
+#define ARRAY_FOREACH_TYPE(a, BODY) \
+	switch ((a)->type) { \
+		case ARRAY_INT8:   {typedef int8_t   T; BODY} break; \
+		case ARRAY_UINT8:  {typedef uint8_t  T; BODY} break; \
+		case ARRAY_INT16:  {typedef int16_t  T; BODY} break; \
+		case ARRAY_UINT16: {typedef uint16_t T; BODY} break; \
+		case ARRAY_INT32:  {typedef int32_t  T; BODY} break; \
+		case ARRAY_FLOAT:  {typedef float    T; BODY} break; \
+	}
+
+/*
+ * Helper functions
+ */
+
+static inline int64_t array_sat(uint8_t type, int64_t v) {
+	if (v < array_types[type].min) return array_types[type].min;
+	if (v > array_types[type].max) return array_types[type].max;
+
+	return v;
+}
+
+// Get element i as an integer
+static int64_t array_get_i(array_userdata_t *a, uint32_t i) {
+	float f;
+
+	switch (a->type) {
+		case ARRAY_INT8:   return ((int8_t   *)a->data)[i];
+		case ARRAY_UINT8:  return ((uint8_t  *)a->data)[i];
+		case ARRAY_INT16:  return ((int16_t  *)a->data)[i];
+		case ARRAY_UINT16: return ((uint16_t *)a->data)[i];
+		case ARRAY_INT32:  return ((int32_t  *)a->data)[i];
+		default:
+			f = ((float *)a->data)[i];
+			if (f <= (float)INT32_MIN) return INT32_MIN;
+			if (f >= (float)INT32_MAX) return INT32_MAX;
+			return (int64_t)f;
+	}
+}
+
+// Get element i as a float
+static float array_get_f(array_userdata_t *a, uint32_t i) {
+	if (a->type == ARRAY_FLOAT) {
+		return ((float *)a->data)[i];
+	}
+
+	return (float)array_get_i(a, i);
+}
+
+// Set element i from a Lua value at the given stack index, saturating to the
+// range of the type
+static void array_set_lua(lua_State *L, array_userdata_t *a, uint32_t i, int idx) {
+	int64_t v;
+
+	if (a->type == ARRAY_FLOAT) {
+		((float *)a->data)[i] = luaL_checknumber(L, idx);
+		return;
+	}
+
+	if (lua_isinteger(L, idx)) {
+		v = lua_tointeger(L, idx);
+	} else {
+		lua_Number n = luaL_checknumber(L, idx);
+
+		if (n <= (lua_Number)INT32_MIN) {
+			v = INT32_MIN;
+		} else if (n >= (lua_Number)INT32_MAX) {
+			v = INT32_MAX;
+		} else {
+			v = (int64_t)n;
+		}
+	}
+
+	v = array_sat(a->type, v);
+
+	switch (a->type) {
+		case ARRAY_INT8:   ((int8_t   *)a->data)[i] = v; break;
+		case ARRAY_UINT8:  ((uint8_t  *)a->data)[i] = v; break;
+		case ARRAY_INT16:  ((int16_t  *)a->data)[i] = v; break;
+		case ARRAY_UINT16: ((uint16_t *)a->data)[i] = v; break;
+		case ARRAY_INT32:  ((int32_t  *)a->data)[i] = v; break;
+	}
+}
+
+// Push element i
+static void array_push(lua_State *L, array_userdata_t *a, uint32_t i) {
+	if (a->type == ARRAY_FLOAT) {
+		lua_pushnumber(L, ((float *)a->data)[i]);
+	} else {
+		lua_pushinteger(L, array_get_i(a, i));
+	}
+}
+
+// Push an integer result, as a number if it doesn't fit in a Lua integer
+static void array_push_int64(lua_State *L, int64_t v) {
+	if ((v >= LUA_MININTEGER) && (v <= LUA_MAXINTEGER)) {
+		lua_pushinteger(L, v);
+	} else {
+		lua_pushnumber(L, v);
+	}
+}
+
+// Convert n elements of array src into dst, that has the given type
+static void array_convert(uint8_t type, void *dst, array_userdata_t *src) {
+	uint32_t i;
+
+	if (type == src->type) {
+		memcpy(dst, src->data, src->len * array_types[type].size);
+		return;
+	}
+
+	for(i = 0;i < src->len;i++) {
+		switch (type) {
+			case ARRAY_INT8:   ((int8_t   *)dst)[i] = array_sat(type, array_get_i(src, i)); break;
+			case ARRAY_UINT8:  ((uint8_t  *)dst)[i] = array_sat(type, array_get_i(src, i)); break;
+			case ARRAY_INT16:  ((int16_t  *)dst)[i] = array_sat(type, array_get_i(src, i)); break;
+			case ARRAY_UINT16: ((uint16_t *)dst)[i] = array_sat(type, array_get_i(src, i)); break;
+			case ARRAY_INT32:  ((int32_t  *)dst)[i] = array_get_i(src, i); break;
+			case ARRAY_FLOAT:  ((float    *)dst)[i] = array_get_f(src, i); break;
+		}
+	}
+}
+
+// Max number of elements of an array of a type, so that it's length fits in
+// an uint32_t, and it's size in a size_t
+static size_t array_max_len(uint8_t type) {
+	size_t max = (MAX_SIZET - sizeof(array_userdata_t)) / array_types[type].size;
+
+	return (max > UINT32_MAX)?UINT32_MAX:max;
+}
+
+// Create a new array, with zeroed elements, and push it
+static array_userdata_t *array_create(lua_State *L, uint8_t type, size_t len) {
+	size_t size;
+	array_userdata_t *a;
+
+	if (len > array_max_len(type)) {
+		luaL_error(L, "array too large");
+	}
+
+	size = len * array_types[type].size;
+
+	a = (array_userdata_t *)lua_newuserdata(L, sizeof(array_userdata_t) + size);
+
+	a->type = type;
+	a->len = len;
+	a->data = (void *)(a + 1);
+	a->parent = LUA_NOREF;
+
+	memset(a->data, 0, size);
+
+	luaL_getmetatable(L, "array.arr");
+	lua_setmetatable(L, -2);
+
+	return a;
+}
+
+static array_userdata_t *array_check(lua_State *L, int idx) {
+	array_userdata_t *a = (array_userdata_t *)luaL_checkudata(L, idx, "array.arr");
+	luaL_argcheck(L, a, idx, "array expected");
+
+	return a;
+}
+
+static uint8_t array_check_type(lua_State *L, int idx) {
+	int type = luaL_checkinteger(L, idx);
+
+	luaL_argcheck(L, (type >= ARRAY_INT8) && (type <= ARRAY_FLOAT), idx, "invalid type");
+
+	return type;
+}
+
+/*
+ * Kernels
+ */
+
+// Element-wise operation d[i] = d[i] op s[i * step], saturating integer results
+#define ARRAY_OP_LOOP(EXPR) \
+	for(i = 0;i < n;i++, s += step) { \
+		v = (EXPR); \
+		d[i] = ARRAY_CLAMP(v); \
+	}
+
+#define ARRAY_OP_KERNEL(name, T, WIDE) \
+static void name(T *d, const T *s, int step, uint32_t n, int op, WIDE lo, WIDE hi) { \
+	uint32_t i; \
+	WIDE v; \
+	switch (op) { \
+		case ARRAY_OP_ADD: ARRAY_OP_LOOP((WIDE)d[i] + *s); break; \
+		case ARRAY_OP_SUB: ARRAY_OP_LOOP((WIDE)d[i] - *s); break; \
+		case ARRAY_OP_MUL: ARRAY_OP_LOOP((WIDE)d[i] * *s); break; \
+		case ARRAY_OP_DIV: ARRAY_OP_LOOP(ARRAY_DIV((WIDE)d[i], (WIDE)*s)); break; \
+	} \
+}
+
+// Integer kernels, division by 0 saturates
+#define ARRAY_CLAMP(v) (((v) < lo)?lo:(((v) > hi)?hi:(v)))
+#define ARRAY_DIV(a, b) ((b)?((a) / (b)):(((a) < 0)?lo:(((a) > 0)?hi:0)))
+
+ARRAY_OP_KERNEL(array_op_int8,   int8_t,   int64_t)
+ARRAY_OP_KERNEL(array_op_uint8,  uint8_t,  int64_t)
+ARRAY_OP_KERNEL(array_op_int16,  int16_t,  int64_t)
+ARRAY_OP_KERNEL(array_op_uint16, uint16_t, int64_t)
+ARRAY_OP_KERNEL(array_op_int32,  int32_t,  int64_t)
+
+#undef ARRAY_CLAMP
+#undef ARRAY_DIV
+
+// Float kernel, IEEE semantics
+#define ARRAY_CLAMP(v) (v)
+#define ARRAY_DIV(a, b) ((a) / (b))
+
+ARRAY_OP_KERNEL(array_op_float,  float,    float)
+
+#undef ARRAY_CLAMP
+#undef ARRAY_DIV
+
+/*
+ * Module functions
+ */
+
+// array.new(type, n | table | string | array)
+static int larray_new( lua_State* L ) {
+	uint8_t type = array_check_type(L, 1);
+	array_userdata_t *a, *src;
+	const char *s;
+	lua_Integer n;
+	size_t len;
+	uint32_t i;
+
+	switch (lua_type(L, 2)) {
+		case LUA_TNUMBER:
+			n = luaL_checkinteger(L, 2);
+			luaL_argcheck(L, (n >= 0) && ((lua_Unsigned)n <= array_max_len(type)), 2, "invalid length");
+
+			array_create(L, type, n);
+			break;
+
+		case LUA_TTABLE:
+			n = luaL_len(L, 2);
+			luaL_argcheck(L, (lua_Unsigned)n <= array_max_len(type), 2, "too many elements");
+
+			len = n;
+
+			a = array_create(L, type, len);
+			for(i = 0;i < len;i++) {
+				lua_rawgeti(L, 2, i + 1);
+				array_set_lua(L, a, i, -1);
+				lua_pop(L, 1);
+			}
+			break;
+
+		case LUA_TSTRING:
+			// Binary string, elements in native byte order
+			s = lua_tolstring(L, 2, &len);
+			luaL_argcheck(L, (len % array_types[type].size) == 0, 2, "length is not multiple of element size");
+
+			a = array_create(L, type, len / array_types[type].size);
+			memcpy(a->data, s, len);
+			break;
+
+		default:
+			src = array_check(L, 2);
+
+			a = array_create(L, type, src->len);
+			array_convert(type, a->data, src);
+	}
+
+	return 1;
+}
+
+static int larray_index( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+	lua_Integer i;
+
+	if (lua_isinteger(L, 2)) {
+		i = lua_tointeger(L, 2);
+		if ((i < 1) || (i > a->len)) {
+			lua_pushnil(L);
+		} else {
+			array_push(L, a, i - 1);
+		}
+
+		return 1;
+	}
+
+	// Method
+	lua_pushrotable(L, (void *)array_inst_map);
+	lua_pushvalue(L, 2);
+	lua_gettable(L, -2);
+
+	return 1;
+}
+
+static int larray_newindex( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, (i >= 1) && (i <= a->len), 2, "index out of bounds");
+
+	array_set_lua(L, a, i - 1, 3);
+
+	return 0;
+}
+
+static int larray_len( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+
+	lua_pushinteger(L, a->len);
+
+	return 1;
+}
+
+static int larray_type( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+
+	lua_pushinteger(L, a->type);
+
+	return 1;
+}
+
+// a:slice(i [, j]), a view of elements i to j, that shares the elements with a.
+// Negative indexes are relative to the end, as in string.sub.
+static int larray_slice( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+	array_userdata_t *s;
+	lua_Integer i = luaL_checkinteger(L, 2);
+	lua_Integer j = luaL_optinteger(L, 3, -1);
+
+	if (i < 0) i = a->len + i + 1;
+	if (j < 0) j = a->len + j + 1;
+	if (i < 1) i = 1;
+	if (j > a->len) j = a->len;
+	if (j < i) j = i - 1;
+
+	s = (array_userdata_t *)lua_newuserdata(L, sizeof(array_userdata_t));
+
+	s->type = a->type;
+	s->len = j - i + 1;
+	s->data = (uint8_t *)a->data + (i - 1) * array_types[a->type].size;
+
+	// Keep the array that holds the elements alive while the slice exists
+	lua_pushvalue(L, 1);
+	s->parent = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	luaL_getmetatable(L, "array.arr");
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static int larray_copy( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+	array_userdata_t *c;
+
+	c = array_create(L, a->type, a->len);
+	memcpy(c->data, a->data, a->len * array_types[a->type].size);
+
+	return 1;
+}
+
+static int larray_fill( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+	uint32_t i;
+
+	if (a->len > 0) {
+		array_set_lua(L, a, 0, 2);
+
+		ARRAY_FOREACH_TYPE(a, {
+			T *d = (T *)a->data;
+
+			for(i = 1;i < a->len;i++) {
+				d[i] = d[0];
+			}
+		});
+	}
+
+	lua_settop(L, 1);
+
+	return 1;
+}
+
+static int larray_totable( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+	uint32_t i;
+
+	lua_createtable(L, a->len, 0);
+
+	for(i = 0;i < a->len;i++) {
+		array_push(L, a, i);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	return 1;
+}
+
+// Binary string, elements in native byte order, that can be used with
+// string.unpack, or to create a new array
+static int larray_tostring( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+
+	lua_pushlstring(L, (const char *)a->data, a->len * array_types[a->type].size);
+
+	return 1;
+}
+
+// a:op(b), where b is an array of the same length, or a number. Operation is done
+// in place, and returns a.
+static int larray_op(lua_State* L, int op) {
+	array_userdata_t *a = array_check(L, 1);
+	array_userdata_t *b;
+	void *s, *tmp = NULL;
+	int step;
+	union {
+		int8_t   i8;
+		uint8_t  u8;
+		int16_t  i16;
+		uint16_t u16;
+		int32_t  i32;
+		float    f;
+	} scalar;
+
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		// Broadcast the scalar, stored in the type of a
+		array_userdata_t sa = {a->type, 1, &scalar, LUA_NOREF};
+
+		array_set_lua(L, &sa, 0, 2);
+
+		s = &scalar;
+		step = 0;
+	} else {
+		b = array_check(L, 2);
+		luaL_argcheck(L, b->len == a->len, 2, "arrays have different length");
+
+		if (b->type == a->type) {
+			s = b->data;
+		} else {
+			// Convert operand to the type of a
+			tmp = malloc(b->len * array_types[a->type].size);
+			if (!tmp) {
+				return luaL_error(L, "not enough memory");
+			}
+
+			array_convert(a->type, tmp, b);
+			s = tmp;
+		}
+
+		step = 1;
+	}
+
+	int64_t lo = array_types[a->type].min;
+	int64_t hi = array_types[a->type].max;
+
+	switch (a->type) {
+		case ARRAY_INT8:   array_op_int8(a->data, s, step, a->len, op, lo, hi); break;
+		case ARRAY_UINT8:  array_op_uint8(a->data, s, step, a->len, op, lo, hi); break;
+		case ARRAY_INT16:  array_op_int16(a->data, s, step, a->len, op, lo, hi); break;
+		case ARRAY_UINT16: array_op_uint16(a->data, s, step, a->len, op, lo, hi); break;
+		case ARRAY_INT32:  array_op_int32(a->data, s, step, a->len, op, lo, hi); break;
+		case ARRAY_FLOAT:  array_op_float(a->data, s, step, a->len, op, -FLT_MAX, FLT_MAX); break;
+	}
+
+	free(tmp);
+
+	lua_settop(L, 1);
+
+	return 1;
+}
+
+static int larray_add( lua_State* L ) {
+	return larray_op(L, ARRAY_OP_ADD);
+}
+
+static int larray_sub( lua_State* L ) {
+	return larray_op(L, ARRAY_OP_SUB);
+}
+
+static int larray_mul( lua_State* L ) {
+	return larray_op(L, ARRAY_OP_MUL);
+}
+
+static int larray_div( lua_State* L ) {
+	return larray_op(L, ARRAY_OP_DIV);
+}
+
+static int larray_sum( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+	uint32_t i;
+
+	if (a->type == ARRAY_FLOAT) {
+		float *d = (float *)a->data;
+		double sum = 0;
+
+		for(i = 0;i < a->len;i++) {
+			sum += d[i];
+		}
+
+		lua_pushnumber(L, sum);
+	} else {
+		int64_t sum = 0;
+
+		ARRAY_FOREACH_TYPE(a, {
+			T *d = (T *)a->data;
+
+			for(i = 0;i < a->len;i++) {
+				sum += d[i];
+			}
+		});
+
+		array_push_int64(L, sum);
+	}
+
+	return 1;
+}
+
+// Returns the min / max value, and it's index
+static int larray_minmax( lua_State* L, int max ) {
+	array_userdata_t *a = array_check(L, 1);
+	uint32_t i, idx = 0;
+
+	if (a->len == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	ARRAY_FOREACH_TYPE(a, {
+		T *d = (T *)a->data;
+		T v = d[0];
+
+		if (max) {
+			for(i = 1;i < a->len;i++) {
+				if (d[i] > v) {
+					v = d[i];
+					idx = i;
+				}
+			}
+		} else {
+			for(i = 1;i < a->len;i++) {
+				if (d[i] < v) {
+					v = d[i];
+					idx = i;
+				}
+			}
+		}
+	});
+
+	array_push(L, a, idx);
+	lua_pushinteger(L, idx + 1);
+
+	return 2;
+}
+
+static int larray_min( lua_State* L ) {
+	return larray_minmax(L, 0);
+}
+
+static int larray_max( lua_State* L ) {
+	return larray_minmax(L, 1);
+}
+
+static double array_mean(array_userdata_t *a) {
+	double sum = 0;
+	int64_t isum = 0;
+	uint32_t i;
+
+	if (a->len == 0) {
+		return 0;
+	}
+
+	if (a->type == ARRAY_FLOAT) {
+		float *d = (float *)a->data;
+
+		for(i = 0;i < a->len;i++) {
+			sum += d[i];
+		}
+	} else {
+		ARRAY_FOREACH_TYPE(a, {
+			T *d = (T *)a->data;
+
+			for(i = 0;i < a->len;i++) {
+				isum += d[i];
+			}
+		});
+
+		sum = isum;
+	}
+
+	return sum / a->len;
+}
+
+static int larray_mean( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+
+	lua_pushnumber(L, array_mean(a));
+
+	return 1;
+}
+
+// Population standard deviation
+static int larray_stddev( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+	double mean, sum = 0;
+	float fmean, diff;
+	uint32_t i;
+
+	if (a->len == 0) {
+		lua_pushnumber(L, 0);
+		return 1;
+	}
+
+	mean = array_mean(a);
+	fmean = mean;
+
+	ARRAY_FOREACH_TYPE(a, {
+		T *d = (T *)a->data;
+
+		for(i = 0;i < a->len;i++) {
+			diff = d[i] - fmean;
+			sum += diff * diff;
+		}
+	});
+
+	lua_pushnumber(L, sqrt(sum / a->len));
+
+	return 1;
+}
+
+// a:fir(coefficients), FIR filter, coefficients is an array or a table. Returns a new
+// float array, with the same length as a. Samples before the first element of a are
+// taken as 0.
+static int larray_fir( lua_State* L ) {
+	array_userdata_t *a = array_check(L, 1);
+	array_userdata_t *y, *c;
+	float *h, *x, *out, acc;
+	lua_Integer count;
+	uint32_t taps, n, k, i;
+
+	// Get coefficients
+	if (lua_istable(L, 2)) {
+		count = luaL_len(L, 2);
+	} else {
+		c = array_check(L, 2);
+		count = c->len;
+	}
+
+	luaL_argcheck(L, count > 0, 2, "no coefficients");
+	luaL_argcheck(L, (lua_Unsigned)count <= array_max_len(ARRAY_FLOAT), 2, "too many coefficients");
+
+	taps = count;
+
+	// Scratch buffers are userdata, so they are collected if an error is raised
+	h = (float *)lua_newuserdata(L, taps * sizeof(float));
+
+	if (lua_istable(L, 2)) {
+		for(i = 0;i < taps;i++) {
+			lua_rawgeti(L, 2, i + 1);
+			h[i] = luaL_checknumber(L, -1);
+			lua_pop(L, 1);
+		}
+	} else {
+		array_convert(ARRAY_FLOAT, h, c);
+	}
+
+	// Get input as float
+	if (a->type == ARRAY_FLOAT) {
+		x = (float *)a->data;
+	} else {
+		x = (float *)lua_newuserdata(L, a->len * sizeof(float));
+		array_convert(ARRAY_FLOAT, x, a);
+	}
+
+	y = array_create(L, ARRAY_FLOAT, a->len);
+	out = (float *)y->data;
+
+	for(n = 0;n < a->len;n++) {
+		acc = 0;
+
+		k = (n + 1 < taps)?(n + 1):taps;
+		for(i = 0;i < k;i++) {
+			acc += h[i] * x[n - i];
+		}
+
+		out[n] = acc;
+	}
+
+	return 1;
+}
+
+// Destructor
+static int larray_gc( lua_State* L ) {
+	array_userdata_t *a = (array_userdata_t *)luaL_checkudata(L, 1, "array.arr");
+
+	if (a && (a->parent != LUA_NOREF)) {
+		luaL_unref(L, LUA_REGISTRYINDEX, a->parent);
+		a->parent = LUA_NOREF;
+	}
+
+	return 0;
+}
+
+static const LUA_REG_TYPE array_map[] = {
+	{ LSTRKEY( "new"     ),	 LFUNCVAL( larray_new ) },
+	{ LSTRKEY( "INT8"    ),	 LINTVAL ( ARRAY_INT8 ) },
+	{ LSTRKEY( "UINT8"   ),	 LINTVAL ( ARRAY_UINT8 ) },
+	{ LSTRKEY( "INT16"   ),	 LINTVAL ( ARRAY_INT16 ) },
+	{ LSTRKEY( "UINT16"  ),	 LINTVAL ( ARRAY_UINT16 ) },
+	{ LSTRKEY( "INT32"   ),	 LINTVAL ( ARRAY_INT32 ) },
+	{ LSTRKEY( "FLOAT"   ),	 LINTVAL ( ARRAY_FLOAT ) },
+	{ LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE array_inst_map[] = {
+	{ LSTRKEY( "type"        ),	 LFUNCVAL( larray_type     ) },
+	{ LSTRKEY( "slice"       ),	 LFUNCVAL( larray_slice    ) },
+	{ LSTRKEY( "copy"        ),	 LFUNCVAL( larray_copy     ) },
+	{ LSTRKEY( "fill"        ),	 LFUNCVAL( larray_fill     ) },
+	{ LSTRKEY( "totable"     ),	 LFUNCVAL( larray_totable  ) },
+	{ LSTRKEY( "tostring"    ),	 LFUNCVAL( larray_tostring ) },
+	{ LSTRKEY( "add"         ),	 LFUNCVAL( larray_add      ) },
+	{ LSTRKEY( "sub"         ),	 LFUNCVAL( larray_sub      ) },
+	{ LSTRKEY( "mul"         ),	 LFUNCVAL( larray_mul      ) },
+	{ LSTRKEY( "div"         ),	 LFUNCVAL( larray_div      ) },
+	{ LSTRKEY( "sum"         ),	 LFUNCVAL( larray_sum      ) },
+	{ LSTRKEY( "min"         ),	 LFUNCVAL( larray_min      ) },
+	{ LSTRKEY( "max"         ),	 LFUNCVAL( larray_max      ) },
+	{ LSTRKEY( "mean"        ),	 LFUNCVAL( larray_mean     ) },
+	{ LSTRKEY( "stddev"      ),	 LFUNCVAL( larray_stddev   ) },
+	{ LSTRKEY( "fir"         ),	 LFUNCVAL( larray_fir      ) },
+	{ LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE array_meta_map[] = {
+	{ LSTRKEY( "__metatable" ),	 LROVAL  ( array_meta_map   ) },
+	{ LSTRKEY( "__index"     ),	 LFUNCVAL( larray_index     ) },
+	{ LSTRKEY( "__newindex"  ),	 LFUNCVAL( larray_newindex  ) },
+	{ LSTRKEY( "__len"       ),	 LFUNCVAL( larray_len       ) },
+	{ LSTRKEY( "__gc"        ),	 LFUNCVAL( larray_gc        ) },
+	{ LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_array( lua_State *L ) {
+	luaL_newmetarotable(L,"array.arr", (void *)array_meta_map);
+	return 0;
+}
+
+MODULE_REGISTER_MAPPED(ARRAY, array, array_map, luaopen_array);
+
+#endif
+
+/*
+
+a = array.new(array.INT16, {1, 2, 3, 4})
+b = array.new(array.INT16, 4):fill(10)
+a:add(b):mul(2)
+print(a:sum(), a:mean(), a:stddev(), a:max())
+f = a:fir({0.5, 0.5})
+
+*/
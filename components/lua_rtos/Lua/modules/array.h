@@ -0,0 +1,53 @@
+/*
+ * Lua RTOS, array module
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+#ifndef _LUA_ARRAY_H
+#define	_LUA_ARRAY_H
+
+#include <stdint.h>
+
+// Array types
+#define ARRAY_INT8    0
+#define ARRAY_UINT8   1
+#define ARRAY_INT16   2
+#define ARRAY_UINT16  3
+#define ARRAY_INT32   4
+#define ARRAY_FLOAT   5
+
+typedef struct {
+	uint8_t  type;    // Element type
+	uint32_t len;     // Number of elements
+	void    *data;    // Elements
+	int      parent;  // For slices, reference to the array that holds the elements
+} array_userdata_t;
+
+// Size in bytes of the elements of an array
+#define ARRAY_SIZE(a) ((a)->len * (((a)->type >= ARRAY_INT32)?4:(((a)->type >= ARRAY_INT16)?2:1)))
+
+#endif	/* _LUA_ARRAY_H */
@@ -0,0 +1,728 @@
+/*
+ * Lua RTOS, async module
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+/*
+ * Cooperative scheduler for Lua coroutines. All the tasks spawned with
+ * async.spawn run as coroutines inside the thread that calls async.run, so
+ * a task only costs a Lua thread, instead of a FreeRTOS task with it's own
+ * stack.
+ *
+ * A task runs until it calls one of the waiting functions of this module
+ * (sleep, yield, wait, read), then the scheduler resumes the next ready task.
+ * Sleeping tasks, and waits with a timeout, are kept in a min-heap ordered by
+ * deadline. When no task is ready the scheduler blocks on the event waiter of
+ * it's thread, so an event broadcast, or a new spawned task, wakes it up at
+ * once. UART reads are polled every CONFIG_LUA_RTOS_LUA_ASYNC_POLL_PERIOD
+ * milliseconds while some task is waiting for them.
+ */
+
+#include "luartos.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_ASYNC
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+#include "modules.h"
+#include "event.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sys/mutex.h>
+
+#include <drivers/cpu.h>
+#include <drivers/uart.h>
+
+#include <pthread.h>
+
+// Task states
+#define ASYNC_READY 0 // In the run queue
+#define ASYNC_SLEEP 1 // Sleeping, in the heap
+#define ASYNC_EVENT 2 // Waiting for an event
+#define ASYNC_UART  3 // Waiting for data from an UART
+
+typedef struct async_task {
+	lua_State *co;              // Coroutine
+	int ref;                    // Reference to the coroutine in the registry
+	uint8_t state;              // Task state
+	int nargs;                  // Number of values to pass on next resume
+	int heap;                   // Position in the heap, -1 if not in the heap
+	TickType_t deadline;        // Wake up time, if in the heap
+	struct async_task *next;    // Next task in the run queue
+	struct async_task *io_prev; // Previous task in the I/O wait list
+	struct async_task *io_next; // Next task in the I/O wait list
+
+	union {
+		struct {
+			event_userdata_t *udata;
+			listener_data_t *listener;
+		} event;
+
+		struct {
+			int8_t unit;
+			int len;
+		} uart;
+	} wait;
+} async_task_t;
+
+typedef struct {
+	struct mtx mtx;           // Mutex for protect the run queue, spawns can come from other threads
+	async_task_t *head;       // Run queue head
+	async_task_t *tail;       // Run queue tail
+	int tasks;                // Number of alive tasks
+	async_task_t **heap;      // Min-heap of tasks by deadline
+	int heap_len;             // Number of tasks in the heap
+	int heap_size;            // Allocated size of the heap
+	async_task_t *io;         // Tasks waiting for I/O
+	int polling;              // Number of tasks waiting for I/O that must be polled
+	async_task_t *current;    // Running task
+	event_waiter_t *waiter;   // Waiter of the scheduler thread
+	uint8_t running;          // If 1 the scheduler is running
+} async_sched_t;
+
+static async_sched_t sched;
+
+#define async_before(a, b) ((int32_t)((a) - (b)) < 0)
+
+/*
+ * Heap
+ */
+static void heap_swap(int i, int j) {
+	async_task_t *t = sched.heap[i];
+
+	sched.heap[i] = sched.heap[j];
+	sched.heap[j] = t;
+
+	sched.heap[i]->heap = i;
+	sched.heap[j]->heap = j;
+}
+
+static void heap_up(int i) {
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (!async_before(sched.heap[i]->deadline, sched.heap[parent]->deadline)) {
+			break;
+		}
+
+		heap_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void heap_down(int i) {
+	for(;;) {
+		int min = i;
+		int l = 2 * i + 1;
+		int r = l + 1;
+
+		if ((l < sched.heap_len) && async_before(sched.heap[l]->deadline, sched.heap[min]->deadline)) {
+			min = l;
+		}
+
+		if ((r < sched.heap_len) && async_before(sched.heap[r]->deadline, sched.heap[min]->deadline)) {
+			min = r;
+		}
+
+		if (min == i) {
+			break;
+		}
+
+		heap_swap(i, min);
+		i = min;
+	}
+}
+
+static int heap_push(async_task_t *task) {
+	if (sched.heap_len == sched.heap_size) {
+		int size = sched.heap_size?(sched.heap_size * 2):16;
+		async_task_t **heap = realloc(sched.heap, size * sizeof(async_task_t *));
+		if (!heap) {
+			return -1;
+		}
+
+		sched.heap = heap;
+		sched.heap_size = size;
+	}
+
+	task->heap = sched.heap_len++;
+	sched.heap[task->heap] = task;
+	heap_up(task->heap);
+
+	return 0;
+}
+
+static void heap_remove(async_task_t *task) {
+	int i = task->heap;
+
+	if (i < 0) {
+		return;
+	}
+
+	task->heap = -1;
+
+	if (i == --sched.heap_len) {
+		return;
+	}
+
+	sched.heap[i] = sched.heap[sched.heap_len];
+	sched.heap[i]->heap = i;
+
+	heap_up(i);
+	heap_down(sched.heap[i]->heap);
+}
+
+/*
+ * Run queue and I/O wait list
+ */
+static void async_ready(async_task_t *task) {
+	task->state = ASYNC_READY;
+	task->next = NULL;
+
+	mtx_lock(&sched.mtx);
+
+	if (sched.tail) {
+		sched.tail->next = task;
+	} else {
+		sched.head = task;
+	}
+
+	sched.tail = task;
+
+	mtx_unlock(&sched.mtx);
+}
+
+static async_task_t *async_next() {
+	async_task_t *task;
+
+	mtx_lock(&sched.mtx);
+
+	task = sched.head;
+	if (task) {
+		sched.head = task->next;
+		if (!sched.head) {
+			sched.tail = NULL;
+		}
+	}
+
+	mtx_unlock(&sched.mtx);
+
+	return task;
+}
+
+static void io_add(async_task_t *task) {
+	task->io_prev = NULL;
+	task->io_next = sched.io;
+
+	if (sched.io) {
+		sched.io->io_prev = task;
+	}
+
+	sched.io = task;
+
+	if (task->state == ASYNC_UART) {
+		sched.polling++;
+	}
+}
+
+static void io_remove(async_task_t *task) {
+	if (task->io_prev) {
+		task->io_prev->io_next = task->io_next;
+	} else {
+		sched.io = task->io_next;
+	}
+
+	if (task->io_next) {
+		task->io_next->io_prev = task->io_prev;
+	}
+
+	if (task->state == ASYNC_UART) {
+		sched.polling--;
+	}
+}
+
+/*
+ * Get the running task. Waiting functions can only be called from the
+ * coroutine of the task, not from a coroutine created by the task.
+ */
+static async_task_t *async_current(lua_State *L) {
+	if (!sched.current || (sched.current->co != L)) {
+		luaL_error(L, "not in an async task");
+	}
+
+	return sched.current;
+}
+
+static TickType_t async_timeout(lua_State* L, int idx) {
+	if (lua_isnoneornil(L, idx)) {
+		return portMAX_DELAY;
+	}
+
+	lua_Integer timeout = luaL_checkinteger(L, idx);
+	luaL_argcheck(L, timeout >= 0, idx, "invalid timeout");
+
+	return (TickType_t)(timeout / portTICK_PERIOD_MS);
+}
+
+// Put the current task to wait, with an optional timeout
+static int async_suspend(lua_State* L, async_task_t *task, uint8_t state, TickType_t timeout) {
+	task->state = state;
+
+	if (timeout != portMAX_DELAY) {
+		task->deadline = xTaskGetTickCount() + timeout;
+		if (heap_push(task) < 0) {
+			task->state = ASYNC_READY;
+			return luaL_error(L, "not enough memory");
+		}
+	}
+
+	if ((state == ASYNC_EVENT) || (state == ASYNC_UART)) {
+		io_add(task);
+	}
+
+	return lua_yield(L, 0);
+}
+
+// Read the data that is available for a task waiting for an UART, and push it into L
+static void async_uart_read(lua_State *L, async_task_t *task, int avail) {
+	luaL_Buffer b;
+	int len = task->wait.uart.len;
+
+	if (avail < len) {
+		len = avail;
+	}
+
+	char *buff = luaL_buffinitsize(L, &b, len);
+	len = uart_read_bytes(task->wait.uart.unit, buff, len, 0);
+	if (len < 0) {
+		// Framing is enabled
+		len = 0;
+	}
+
+	luaL_pushresultsize(&b, len);
+}
+
+// Wake up tasks whose deadline has expired
+static void async_timers() {
+	TickType_t now = xTaskGetTickCount();
+	async_task_t *task;
+
+	while (sched.heap_len > 0) {
+		task = sched.heap[0];
+		if (async_before(now, task->deadline)) {
+			break;
+		}
+
+		heap_remove(task);
+
+		switch (task->state) {
+			case ASYNC_SLEEP:
+				task->nargs = 0;
+				break;
+
+			case ASYNC_EVENT:
+				io_remove(task);
+				lua_pushboolean(task->co, 0);
+				task->nargs = 1;
+				break;
+
+			case ASYNC_UART:
+				io_remove(task);
+				lua_pushnil(task->co);
+				task->nargs = 1;
+				break;
+		}
+
+		async_ready(task);
+	}
+}
+
+/*
+ * Wake up all the tasks waiting for an event. Listeners belong to the scheduler
+ * thread, so a broadcast is received once for all the tasks.
+ */
+static void async_event(event_userdata_t *udata) {
+	async_task_t *task, *next;
+
+	task = sched.io;
+	while (task) {
+		next = task->io_next;
+
+		if ((task->state == ASYNC_EVENT) && (task->wait.event.udata == udata)) {
+			heap_remove(task);
+			io_remove(task);
+			lua_pushboolean(task->co, 1);
+			task->nargs = 1;
+			async_ready(task);
+		}
+
+		task = next;
+	}
+}
+
+// Wake up tasks whose I/O is ready
+static void async_io(lua_State *L) {
+	async_task_t *task, *next;
+	int avail;
+
+	task = sched.io;
+	while (task) {
+		next = task->io_next;
+
+		switch (task->state) {
+			case ASYNC_EVENT:
+				if (event_poll(task->wait.event.udata, task->wait.event.listener)) {
+					async_event(task->wait.event.udata);
+
+					// Other tasks may be removed from the list, start again
+					next = sched.io;
+				}
+				break;
+
+			case ASYNC_UART:
+				avail = uart_rx_available(task->wait.uart.unit);
+				if (avail > 0) {
+					heap_remove(task);
+					io_remove(task);
+					async_uart_read(L, task, avail);
+					lua_xmove(L, task->co, 1);
+					task->nargs = 1;
+					async_ready(task);
+				}
+				break;
+		}
+
+		task = next;
+	}
+}
+
+// Resume a task, and put it in the right place after it yields
+static void async_resume(lua_State *L, async_task_t *task) {
+	int status;
+
+	sched.current = task;
+	task->state = ASYNC_READY;
+
+	status = lua_resume(task->co, L, task->nargs);
+
+	sched.current = NULL;
+	task->nargs = 0;
+
+	if (status == LUA_YIELD) {
+		// Discard yielded values
+		lua_settop(task->co, 0);
+
+		// A task that yields with coroutine.yield, or with async.yield, goes to
+		// the end of the run queue
+		if (task->state == ASYNC_READY) {
+			async_ready(task);
+		}
+
+		return;
+	}
+
+	if (status != LUA_OK) {
+		lua_writestringerror("%s\n", lua_tostring(task->co, -1));
+	}
+
+	// Task is finished
+	luaL_unref(L, LUA_REGISTRYINDEX, task->ref);
+	free(task);
+
+	mtx_lock(&sched.mtx);
+	sched.tasks--;
+	mtx_unlock(&sched.mtx);
+}
+
+static int lasync_spawn( lua_State* L ) {
+	async_task_t *task;
+	int nargs = lua_gettop(L) - 1;
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+
+	task = (async_task_t *)calloc(1, sizeof(async_task_t));
+	if (!task) {
+		return luaL_error(L, "not enough memory");
+	}
+
+	// Create the coroutine, and move the function and it's arguments to it
+	task->co = lua_newthread(L);
+	lua_insert(L, 1);
+	lua_xmove(L, task->co, nargs + 1);
+	task->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	task->nargs = nargs;
+	task->heap = -1;
+
+	mtx_lock(&sched.mtx);
+	sched.tasks++;
+	mtx_unlock(&sched.mtx);
+
+	async_ready(task);
+
+	// Wake up the scheduler, if it's waiting
+	if (sched.running && sched.waiter) {
+		xEventGroupSetBits(sched.waiter->group, EVENT_WAKE_BIT);
+	}
+
+	return 0;
+}
+
+static int lasync_run( lua_State* L ) {
+	async_task_t *task, *last;
+	TickType_t ticks, now;
+	int tasks, done;
+
+	if (sched.running) {
+		return luaL_error(L, "scheduler is running");
+	}
+
+	sched.waiter = event_waiter_get(pthread_self());
+	if (!sched.waiter) {
+		return luaL_error(L, "not enough memory");
+	}
+
+	sched.running = 1;
+
+	for(;;) {
+		mtx_lock(&sched.mtx);
+		tasks = sched.tasks;
+		mtx_unlock(&sched.mtx);
+
+		if (!tasks) {
+			break;
+		}
+
+		async_timers();
+		async_io(L);
+
+		// Run the tasks that are ready now. Tasks that become ready while
+		// running them wait for the next round, so timers and I/O are
+		// checked between rounds.
+		mtx_lock(&sched.mtx);
+		last = sched.tail;
+		mtx_unlock(&sched.mtx);
+
+		if (last) {
+			do {
+				task = async_next();
+				done = (task == last);
+				async_resume(L, task);
+			} while (!done);
+
+			continue;
+		}
+
+		// No task is ready, so block until the next deadline, or until
+		// something wakes up the scheduler
+		ticks = portMAX_DELAY;
+
+		if (sched.heap_len > 0) {
+			now = xTaskGetTickCount();
+			if (async_before(now, sched.heap[0]->deadline)) {
+				ticks = sched.heap[0]->deadline - now;
+			} else {
+				ticks = 0;
+			}
+		}
+
+		if (sched.polling && (ticks > CONFIG_LUA_RTOS_LUA_ASYNC_POLL_PERIOD / portTICK_PERIOD_MS)) {
+			ticks = CONFIG_LUA_RTOS_LUA_ASYNC_POLL_PERIOD / portTICK_PERIOD_MS;
+		}
+
+		if (ticks > 0) {
+			xEventGroupWaitBits(sched.waiter->group, EVENT_WAKE_BIT, pdTRUE, pdFALSE, ticks);
+		}
+	}
+
+	sched.running = 0;
+
+	event_waiter_release(sched.waiter);
+	sched.waiter = NULL;
+
+	return 0;
+}
+
+static int lasync_sleep( lua_State* L ) {
+	async_task_t *task = async_current(L);
+	lua_Integer ms = luaL_checkinteger(L, 1);
+
+	luaL_argcheck(L, ms >= 0, 1, "invalid time");
+
+	if (ms == 0) {
+		return lua_yield(L, 0);
+	}
+
+	return async_suspend(L, task, ASYNC_SLEEP, ms / portTICK_PERIOD_MS);
+}
+
+static int lasync_yield( lua_State* L ) {
+	async_current(L);
+
+	return lua_yield(L, 0);
+}
+
+static int lasync_wait( lua_State* L ) {
+	async_task_t *task = async_current(L);
+	event_userdata_t *udata;
+	listener_data_t *listener;
+
+	udata = (event_userdata_t *)luaL_checkudata(L, 1, "event.ins");
+	TickType_t timeout = async_timeout(L, 2);
+
+	// Listeners are owned by the thread, so all the tasks share the listener
+	// of the scheduler thread
+	event_listener(L, udata, &listener);
+
+	if (event_poll(udata, listener)) {
+		// Wake up the other tasks waiting for the same event
+		async_event(udata);
+
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	if (timeout == 0) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	task->wait.event.udata = udata;
+	task->wait.event.listener = listener;
+
+	return async_suspend(L, task, ASYNC_EVENT, timeout);
+}
+
+static int lasync_read( lua_State* L ) {
+	async_task_t *task = async_current(L);
+	int unit = luaL_checkinteger(L, 1);
+	int len = luaL_checkinteger(L, 2);
+	int avail;
+
+	if ((unit < CPU_FIRST_UART) || (unit > CPU_LAST_UART)) {
+		return luaL_error(L, "UART%d does not exist", unit);
+	}
+
+	if (!uart_is_setup(unit)) {
+		return luaL_error(L, "UART%d is not setup", unit);
+	}
+
+	luaL_argcheck(L, len > 0, 2, "invalid length");
+
+	TickType_t timeout = async_timeout(L, 3);
+
+	task->wait.uart.unit = unit;
+	task->wait.uart.len = len;
+
+	avail = uart_rx_available(unit);
+	if (avail > 0) {
+		async_uart_read(L, task, avail);
+		return 1;
+	}
+
+	if (timeout == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	return async_suspend(L, task, ASYNC_UART, timeout);
+}
+
+static int lasync_tasks( lua_State* L ) {
+	mtx_lock(&sched.mtx);
+	lua_pushinteger(L, sched.tasks);
+	mtx_unlock(&sched.mtx);
+
+	return 1;
+}
+
+static const LUA_REG_TYPE lasync_map[] = {
+	{ LSTRKEY( "spawn" ),			LFUNCVAL( lasync_spawn ) },
+	{ LSTRKEY( "run"   ),			LFUNCVAL( lasync_run   ) },
+	{ LSTRKEY( "sleep" ),			LFUNCVAL( lasync_sleep ) },
+	{ LSTRKEY( "yield" ),			LFUNCVAL( lasync_yield ) },
+	{ LSTRKEY( "wait"  ),			LFUNCVAL( lasync_wait  ) },
+	{ LSTRKEY( "read"  ),			LFUNCVAL( lasync_read  ) },
+	{ LSTRKEY( "tasks" ),			LFUNCVAL( lasync_tasks ) },
+	{ LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_async( lua_State *L ) {
+	static uint8_t init = 0;
+
+	if (!init) {
+		mtx_init(&sched.mtx, NULL, NULL, 0);
+		init = 1;
+	}
+
+	return 0;
+}
+
+MODULE_REGISTER_MAPPED(ASYNC, async, lasync_map, luaopen_async);
+
+#endif
+
+/*
+
+e = event.create()
+
+for i=1,100 do
+  async.spawn(function(n)
+	while true do
+	  async.sleep(100 * n)
+	  print("tick "..n)
+	end
+  end, i)
+end
+
+async.spawn(function()
+  while true do
+	if async.wait(e, 5000) then
+	  print("event")
+	end
+  end
+end)
+
+async.spawn(function()
+  while true do
+	local data = async.read(uart.UART2, 64)
+	print(data)
+  end
+end)
+
+thread.start(async.run)
+
+e:broadcast()
+
+*/
@@ -61,9 +61,15 @@ LUALIB_API int (luaopen_lora) (lua_State* L);
 #define AUXLIB_PACK     "pack"
 LUALIB_API int (luaopen_pack) (lua_State* L);
 
+#define AUXLIB_ARRAY    "array"
+LUALIB_API int (luaopen_array) (lua_State* L);
+
 #define AUXLIB_NVS      "nvs"
 LUALIB_API int (luaopen_nvs) (lua_State* L);
 
+#define AUXLIB_ASYNC    "async"
+LUALIB_API int (luaopen_async) (lua_State* L);
+
 // Helper macros
 #define MOD_CHECK_ID( mod, id )\
   if( !platform_ ## mod ## _exists( id ) )\
@@ -32,7 +32,7 @@
 #if CONFIG_LUA_RTOS_LUA_USE_EVENT
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+#include "freertos/event_groups.h"
 
 #include "lua.h"
 #include "lualib.h"
@@ -42,18 +42,41 @@
 #include "event.h"
 #include "modules.h"
 
+#include "esp_timer.h"
+
+#include <stdlib.h>
 #include <string.h>
 
 #include <sys/driver.h>
 
 #include <pthread.h>
+#include <pthread/_pthread.h>
+
+// Max number of events that can be passed to event.waitany
+#define EVENT_WAITANY_MAX 16
 
 #define EVENT_ERR_NOT_ENOUGH_MEMORY (DRIVER_EXCEPTION_BASE(EVENT_DRIVER_ID) |  0)
 
 // Register driver and messages
-DRIVER_REGISTER_BEGIN(EVENT,event,NULL,NULL,NULL);
+static void _event_init();
+
+DRIVER_REGISTER_BEGIN(EVENT,event,NULL,_event_init,NULL);
 	DRIVER_REGISTER_ERROR(EVENT, event, NotEnoughtMemory, "not enough memory", EVENT_ERR_NOT_ENOUGH_MEMORY);
-DRIVER_REGISTER_END(EVENT,event,NULL,NULL,NULL);
+DRIVER_REGISTER_END(EVENT,event,NULL,_event_init,NULL);
+
+// List of waiters, one for each thread that is listening some event. When
+// both are needed, waiters_mtx is taken before the event's mutex.
+static struct list waiters;
+static struct mtx waiters_mtx;
+
+static void _event_init() {
+	mtx_init(&waiters_mtx, NULL, NULL, 0);
+	list_init(&waiters, 1);
+}
+
+static uint64_t event_now() {
+	return (uint64_t)esp_timer_get_time();
+}
 
 static int has_pending_events(event_userdata_t *udata) {
 	int pending;
@@ -65,11 +88,165 @@ static int has_pending_events(event_userdata_t *udata) {
     return pending;
 }
 
+static event_waiter_t *event_waiter_find(pthread_t thread) {
+	event_waiter_t *waiter;
+	int idx;
+
+	idx = list_first(&waiters);
+	while (idx >= 0) {
+		list_get(&waiters, idx, (void **)&waiter);
+
+		if (waiter->thread == thread) {
+			return waiter;
+		}
+
+		idx = list_next(&waiters, idx);
+	}
+
+	return NULL;
+}
+
+static void event_waiter_free(event_waiter_t *waiter) {
+	list_remove(&waiters, waiter->id, 0);
+	list_destroy(&waiter->listeners, 0);
+	vEventGroupDelete(waiter->group);
+	free(waiter);
+}
+
+static void event_thread_cleanup(void *args) {
+	event_thread_exit(*((pthread_t *)args));
+}
+
+/*
+ * Get the waiter of a thread, creating it if the thread has not a waiter yet.
+ * Must be called with waiters_mtx taken.
+ */
+static event_waiter_t *event_waiter_get_locked(pthread_t thread) {
+	event_waiter_t *waiter;
+	pthread_t *args;
+
+	waiter = event_waiter_find(thread);
+	if (waiter) {
+		waiter->refs++;
+		return waiter;
+	}
+
+	waiter = (event_waiter_t *)calloc(1, sizeof(event_waiter_t));
+	if (!waiter) {
+		return NULL;
+	}
+
+	waiter->group = xEventGroupCreate();
+	if (!waiter->group) {
+		free(waiter);
+		return NULL;
+	}
+
+	if (list_add(&waiters, waiter, &waiter->id)) {
+		vEventGroupDelete(waiter->group);
+		free(waiter);
+		return NULL;
+	}
+
+	list_init(&waiter->listeners, 0);
+
+	waiter->thread = thread;
+	waiter->refs = 1;
+
+	// Release the listeners of the thread when it exits. The waiter is kept
+	// until then, so the cleanup is registered once.
+	if ((thread == pthread_self()) && _pthread_get(thread)) {
+		args = malloc(sizeof(pthread_t));
+		if (args) {
+			*args = thread;
+			pthread_cleanup_push(event_thread_cleanup, args);
+			waiter->exit_hook = 1;
+		}
+	}
+
+	return waiter;
+}
+
+static void event_waiter_release_locked(event_waiter_t *waiter) {
+	if ((--waiter->refs == 0) && !waiter->exit_hook) {
+		event_waiter_free(waiter);
+	}
+}
+
+/*
+ * Get the waiter of a thread, creating it if the thread has not a waiter yet.
+ * Each call must be paired with an event_waiter_release call.
+ */
+event_waiter_t *event_waiter_get(pthread_t thread) {
+	event_waiter_t *waiter;
+
+	mtx_lock(&waiters_mtx);
+	waiter = event_waiter_get_locked(thread);
+	mtx_unlock(&waiters_mtx);
+
+	return waiter;
+}
+
+void event_waiter_release(event_waiter_t *waiter) {
+	mtx_lock(&waiters_mtx);
+	event_waiter_release_locked(waiter);
+	mtx_unlock(&waiters_mtx);
+}
+
+/*
+ * Release the listeners and the waiter of a thread that exits, or that is stopped.
+ * If the thread has not received a broadcast(true) yet, it's no longer waited for.
+ */
+void event_thread_exit(pthread_t thread) {
+	event_userdata_t *udata;
+	listener_data_t *listener_data;
+	event_waiter_t *waiter;
+	int idx, next;
+
+	mtx_lock(&waiters_mtx);
+
+	waiter = event_waiter_find(thread);
+	if (!waiter) {
+		mtx_unlock(&waiters_mtx);
+		return;
+	}
+
+	idx = list_first(&waiter->listeners);
+	while (idx >= 0) {
+		list_get(&waiter->listeners, idx, (void **)&listener_data);
+		next = list_next(&waiter->listeners, idx);
+		list_remove(&waiter->listeners, idx, 0);
+		idx = next;
+
+		udata = listener_data->udata;
+
+		mtx_lock(&udata->mtx);
+
+		if (listener_data->is_waiting && (udata->pending > 0) && (--udata->pending == 0)) {
+			xEventGroupSetBits(udata->group, EVENT_DONE_BIT);
+		}
+
+		list_remove(&udata->listeners, listener_data->id, 1);
+
+		mtx_unlock(&udata->mtx);
+
+		waiter->refs--;
+	}
+
+	// Other references to the waiter (as the async scheduler one) release it later
+	waiter->exit_hook = 0;
+	if (waiter->refs == 0) {
+		event_waiter_free(waiter);
+	}
+
+	mtx_unlock(&waiters_mtx);
+}
+
 /*
  * Get the listener that corresponds to the current thread. If current thread has not
  * a listener, create it.
  */
-static int get_listener(lua_State* L, event_userdata_t *udata, listener_data_t **listener_data) {
+int event_listener(lua_State* L, event_userdata_t *udata, listener_data_t **listener_data) {
 	listener_data_t *clistener;
 
 	*listener_data = NULL;
@@ -80,62 +257,160 @@ static int get_listener(lua_State* L, event_userdata_t *udata, listener_data_t *
 	mtx_lock(&udata->mtx);
 
     // Search for listener
-    int idx = 1;
-    int listener_id = 0;
-    while (idx >= 1) {
-        if (list_get(&udata->listeners, idx, (void **)&clistener)) {
-        	break;
-        }
+    int idx = list_first(&udata->listeners);
+    while (idx >= 0) {
+        list_get(&udata->listeners, idx, (void **)&clistener);
 
         if (clistener->thread == thread) {
-        	listener_id = idx;
-        	break;
+        	*listener_data = clistener;
+        	mtx_unlock(&udata->mtx);
+
+        	return 0;
         }
 
         // Next listener
         idx = list_next(&udata->listeners, idx);
     }
 
-	// If not found, create a new listener for the current thread
-    if (!listener_id) {
-    	// Listener not found
-    	// Allocate space for the new listener
-    	clistener = (listener_data_t *)calloc(1,sizeof(listener_data_t));
-    	if (!clistener) {
-    		mtx_unlock(&udata->mtx);
-    		return luaL_exception(L, EVENT_ERR_NOT_ENOUGH_MEMORY);
-    	}
+	mtx_unlock(&udata->mtx);
 
-		// Create a queue for the listener
-		clistener->q = xQueueCreate(1, sizeof(uint8_t));
-		if (!clistener->q) {
-			free(clistener);
-			mtx_unlock(&udata->mtx);
-			return luaL_exception(L, EVENT_ERR_NOT_ENOUGH_MEMORY);
-		}
+	// Listener not found, create a new listener for the current thread. Only
+	// the current thread creates its listeners, so it can't be added meanwhile.
+	clistener = (listener_data_t *)calloc(1,sizeof(listener_data_t));
+	if (!clistener) {
+		return luaL_exception(L, EVENT_ERR_NOT_ENOUGH_MEMORY);
+	}
 
-		clistener->thread = thread;
+	mtx_lock(&waiters_mtx);
 
-		//Add listener data
-		int id;
+	// Get the waiter for the current thread
+	clistener->waiter = event_waiter_get_locked(thread);
+	if (!clistener->waiter) {
+		mtx_unlock(&waiters_mtx);
+		free(clistener);
+		return luaL_exception(L, EVENT_ERR_NOT_ENOUGH_MEMORY);
+	}
 
-		if (list_add(&udata->listeners, clistener, &id)) {
-			free(clistener);
-			mtx_unlock(&udata->mtx);
-			return luaL_exception(L, EVENT_ERR_NOT_ENOUGH_MEMORY);
-		}
-    } else {
-    	// Listener found
-        list_get(&udata->listeners, listener_id, (void **)&clistener);
-    }
+	clistener->thread = thread;
+	clistener->udata = udata;
 
-    *listener_data = clistener;
+	// Add listener data to the waiter, and to the event
+	if (list_add(&clistener->waiter->listeners, clistener, &clistener->wid)) {
+		event_waiter_release_locked(clistener->waiter);
+		mtx_unlock(&waiters_mtx);
+		free(clistener);
+		return luaL_exception(L, EVENT_ERR_NOT_ENOUGH_MEMORY);
+	}
+
+	mtx_lock(&udata->mtx);
+
+	if (list_add(&udata->listeners, clistener, &clistener->id)) {
+		mtx_unlock(&udata->mtx);
+		list_remove(&clistener->waiter->listeners, clistener->wid, 0);
+		event_waiter_release_locked(clistener->waiter);
+		mtx_unlock(&waiters_mtx);
+		free(clistener);
+		return luaL_exception(L, EVENT_ERR_NOT_ENOUGH_MEMORY);
+	}
 
 	mtx_unlock(&udata->mtx);
+	mtx_unlock(&waiters_mtx);
+
+    *listener_data = clistener;
 
     return 0;
 }
 
+/*
+ * Consume the signal of a listener, if any, updating the latency counters.
+ * Must be called with the event's mutex taken.
+ */
+static int event_receive(event_userdata_t *udata, listener_data_t *listener_data, uint64_t now) {
+	uint32_t latency;
+
+	if (!listener_data->signaled) {
+		return 0;
+	}
+
+	listener_data->signaled = 0;
+
+	latency = (uint32_t)(now - listener_data->stamp);
+
+	udata->stats.deliveries++;
+	udata->stats.latency_sum += latency;
+	if (latency > udata->stats.latency_max) {
+		udata->stats.latency_max = latency;
+	}
+
+	return 1;
+}
+
+/*
+ * Consume the signal of a listener without blocking. Returns 1 if the event was
+ * received.
+ */
+int event_poll(event_userdata_t *udata, listener_data_t *listener_data) {
+	int received;
+
+	mtx_lock(&udata->mtx);
+	received = event_receive(udata, listener_data, event_now());
+	mtx_unlock(&udata->mtx);
+
+	return received;
+}
+
+/*
+ * Wait until one of the events is received by the current thread, or until timeout.
+ * All the listeners must belong to the current thread, so all share the same waiter.
+ *
+ * Returns the index (starting from 1) of the received event, or 0 on timeout.
+ */
+static int event_wait_any(event_userdata_t **udata, listener_data_t **listener_data, int n, TickType_t timeout) {
+	EventGroupHandle_t group = listener_data[0]->waiter->group;
+	TickType_t start = xTaskGetTickCount();
+	TickType_t elapsed;
+	uint64_t now;
+	int i, received;
+
+	for(;;) {
+		now = event_now();
+
+		for(i = 0;i < n;i++) {
+			mtx_lock(&udata[i]->mtx);
+			received = event_receive(udata[i], listener_data[i], now);
+			mtx_unlock(&udata[i]->mtx);
+
+			if (received) {
+				return i + 1;
+			}
+		}
+
+		if (timeout != portMAX_DELAY) {
+			elapsed = xTaskGetTickCount() - start;
+			if (elapsed >= timeout) {
+				return 0;
+			}
+
+			xEventGroupWaitBits(group, EVENT_WAKE_BIT, pdTRUE, pdFALSE, timeout - elapsed);
+		} else {
+			xEventGroupWaitBits(group, EVENT_WAKE_BIT, pdTRUE, pdFALSE, portMAX_DELAY);
+		}
+	}
+
+	return 0;
+}
+
+static TickType_t event_timeout(lua_State* L, int idx) {
+	if (lua_isnoneornil(L, idx)) {
+		return portMAX_DELAY;
+	}
+
+	lua_Integer timeout = luaL_checkinteger(L, idx);
+	luaL_argcheck(L, timeout >= 0, idx, "invalid timeout");
+
+	return (TickType_t)(timeout / portTICK_PERIOD_MS);
+}
+
 static int levent_create( lua_State* L ) {
 	// Create user data
     event_userdata_t *udata = (event_userdata_t *)lua_newuserdata(L, sizeof(event_userdata_t));
@@ -145,21 +420,19 @@ static int levent_create( lua_State* L ) {
 
     memset(udata,0, sizeof(event_userdata_t));
 
+    // Create an event group for sync this event with the termination of the
+    // listeners, when using broadcast(true)
+    udata->group = xEventGroupCreate();
+	if (!udata->group) {
+		return luaL_exception(L, EVENT_ERR_NOT_ENOUGH_MEMORY);
+	}
+
     // Init mutex
     mtx_init(&udata->mtx, NULL, NULL, 0);
 
     // Create the listener list
     list_init(&udata->listeners, 1);
 
-    // Create a queue for sync this event with the termination of the
-    // listeners, when using broadcast(true)
-    udata->q = xQueueCreate(10, sizeof(uint8_t));
-	if (!udata->q) {
-		mtx_destroy(&udata->mtx);
-		free(udata);
-		return luaL_exception(L, EVENT_ERR_NOT_ENOUGH_MEMORY);
-	}
-
     luaL_getmetatable(L, "event.ins");
     lua_setmetatable(L, -2);
 
@@ -174,14 +447,51 @@ static int levent_wait( lua_State* L ) {
     udata = (event_userdata_t *)luaL_checkudata(L, 1, "event.ins");
     luaL_argcheck(L, udata, 1, "event expected");
 
+    TickType_t timeout = event_timeout(L, 2);
+
     // Get an existing listener for the current thread
-    get_listener(L, udata, &listener_data);
+    event_listener(L, udata, &listener_data);
 
     // Wait for broadcast
-    uint8_t d = 0;
-    xQueueReceive(listener_data->q, &d, portMAX_DELAY);
+    lua_pushboolean(L, event_wait_any(&udata, &listener_data, 1, timeout));
 
-    return 0;
+    return 1;
+}
+
+static int levent_waitany( lua_State* L ) {
+	event_userdata_t *udata[EVENT_WAITANY_MAX];
+    listener_data_t *listener_data[EVENT_WAITANY_MAX];
+    int i, n, received;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    n = lua_rawlen(L, 1);
+    luaL_argcheck(L, (n > 0) && (n <= EVENT_WAITANY_MAX), 1, "invalid number of events");
+
+    TickType_t timeout = event_timeout(L, 2);
+
+    for(i = 0;i < n;i++) {
+    	lua_rawgeti(L, 1, i + 1);
+    	udata[i] = (event_userdata_t *)luaL_testudata(L, -1, "event.ins");
+    	lua_pop(L, 1);
+
+    	luaL_argcheck(L, udata[i], 1, "event expected");
+
+        // Get an existing listener for the current thread
+        event_listener(L, udata[i], &listener_data[i]);
+    }
+
+    // Wait for broadcast
+    received = event_wait_any(udata, listener_data, n, timeout);
+    if (!received) {
+    	lua_pushnil(L);
+    	return 1;
+    }
+
+    lua_pushinteger(L, received);
+    lua_rawgeti(L, 1, received);
+
+    return 2;
 }
 
 static int levent_done( lua_State* L ) {
@@ -193,13 +503,16 @@ static int levent_done( lua_State* L ) {
     luaL_argcheck(L, udata, 1, "event expected");
 
     // Get an existing listener for the current thread
-    get_listener(L, udata, &listener_data);
+    event_listener(L, udata, &listener_data);
 
 	mtx_lock(&udata->mtx);
 
 	if (listener_data->is_waiting) {
-		uint8_t d = 0;
-		xQueueSend((xQueueHandle)udata->q, &d, portMAX_DELAY);
+		listener_data->is_waiting = 0;
+
+		if ((udata->pending > 0) && (--udata->pending == 0)) {
+			xEventGroupSetBits(udata->group, EVENT_DONE_BIT);
+		}
 	}
 
 	mtx_unlock(&udata->mtx);
@@ -234,71 +547,111 @@ static int levent_broadcast( lua_State* L ) {
 		wait = lua_toboolean(L, 2);
 	}
 
+	uint64_t now = event_now();
+
 	mtx_lock(&udata->mtx);
 
-	// Unblock threads that are waiting for this event
-    int idx = 1;
+	udata->stats.broadcasts++;
 
-    while (idx >= 1) {
-    	// Get queue
-        if (list_get(&udata->listeners, idx, (void **)&listener_data)) {
-        	break;
-        }
+	// Signal listeners. This never blocks: if a listener has not received a
+	// previous broadcast yet, both are merged.
+    int idx = list_first(&udata->listeners);
+    while (idx >= 0) {
+        list_get(&udata->listeners, idx, (void **)&listener_data);
 
-        listener_data->is_waiting = wait;
+        if (listener_data->signaled) {
+        	udata->stats.coalesced++;
+        } else {
+        	listener_data->signaled = 1;
+        	listener_data->stamp = now;
+        }
 
-        if (wait) {
+        if (wait && !listener_data->is_waiting) {
+        	listener_data->is_waiting = 1;
             udata->pending++;
     	}
 
         // Unblock
-    	uint8_t d = 0;
-    	xQueueSend((xQueueHandle)listener_data->q, &d, portMAX_DELAY);
+        xEventGroupSetBits(listener_data->waiter->group, EVENT_WAKE_BIT);
 
         // Next listener
         idx = list_next(&udata->listeners, idx);
     }
 
+    if (wait && (udata->pending > 0)) {
+    	xEventGroupClearBits(udata->group, EVENT_DONE_BIT);
+    }
+
     mtx_unlock(&udata->mtx);
 
     if (wait) {
     	// If broadcast with waiting, wait for the termination of all threads
-    	uint8_t d;
     	while (has_pending_events(udata)) {
-    	    xQueueReceive(udata->q, &d, portMAX_DELAY);
-
-    	    mtx_lock(&udata->mtx);
-    	    udata->pending--;
-    	    mtx_unlock(&udata->mtx);
+    		xEventGroupWaitBits(udata->group, EVENT_DONE_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
     	}
     }
 
     return 0;
 }
 
+static int levent_stats( lua_State* L ) {
+    event_userdata_t *udata = NULL;
+    event_stats_t stats;
+
+    // Get user data
+    udata = (event_userdata_t *)luaL_checkudata(L, 1, "event.ins");
+    luaL_argcheck(L, udata, 1, "event expected");
+
+    mtx_lock(&udata->mtx);
+    stats = udata->stats;
+    mtx_unlock(&udata->mtx);
+
+    lua_createtable(L, 0, 5);
+
+    lua_pushinteger(L, stats.broadcasts);
+    lua_setfield(L, -2, "broadcasts");
+
+    lua_pushinteger(L, stats.deliveries);
+    lua_setfield(L, -2, "deliveries");
+
+    lua_pushinteger(L, stats.coalesced);
+    lua_setfield(L, -2, "coalesced");
+
+    lua_pushinteger(L, stats.deliveries?(lua_Integer)(stats.latency_sum / stats.deliveries):0);
+    lua_setfield(L, -2, "latency_avg");
+
+    lua_pushinteger(L, stats.latency_max);
+    lua_setfield(L, -2, "latency_max");
+
+    return 1;
+}
+
 // Destructor
 static int levent_ins_gc (lua_State *L) {
     event_userdata_t *udata = NULL;
     listener_data_t *listener_data;
-    int res;
-    int idx = 1;
+    int idx, next;
 
     udata = (event_userdata_t *)luaL_checkudata(L, 1, "event.ins");
 	if (udata) {
 	    // Destroy all listeners
+		mtx_lock(&waiters_mtx);
+
+	    idx = list_first(&udata->listeners);
 	    while (idx >= 0) {
-	        res = list_get(&udata->listeners, idx, (void **)&listener_data);
-	        if (res) {
-	        	break;
-	        }
+	        list_get(&udata->listeners, idx, (void **)&listener_data);
+	        next = list_next(&udata->listeners, idx);
 
-	        vQueueDelete((xQueueHandle)listener_data->q);
+	        list_remove(&listener_data->waiter->listeners, listener_data->wid, 0);
+	        event_waiter_release_locked(listener_data->waiter);
 
 	        list_remove(&udata->listeners, idx, 1);
-	        idx = list_next(&udata->listeners, idx);
+	        idx = next;
 	    }
 
-	    vQueueDelete((xQueueHandle)udata->q);
+		mtx_unlock(&waiters_mtx);
+
+	    vEventGroupDelete(udata->group);
 
 	    mtx_destroy(&udata->mtx);
 	    list_destroy(&udata->listeners, 0);
@@ -309,6 +662,7 @@ static int levent_ins_gc (lua_State *L) {
 
 static const LUA_REG_TYPE levent_map[] = {
     { LSTRKEY( "create"  ),			LFUNCVAL( levent_create   ) },
+    { LSTRKEY( "waitany" ),			LFUNCVAL( levent_waitany  ) },
 	DRIVER_REGISTER_LUA_ERRORS(event)
     { LNILKEY, LNILVAL }
 };
@@ -318,6 +672,7 @@ static const LUA_REG_TYPE levent_ins_map[] = {
 	{ LSTRKEY( "done"        ),		LFUNCVAL( levent_done        ) },
 	{ LSTRKEY( "pending"     ),		LFUNCVAL( levent_pending     ) },
   	{ LSTRKEY( "broadcast"   ),		LFUNCVAL( levent_broadcast   ) },
+  	{ LSTRKEY( "stats"       ),		LFUNCVAL( levent_stats       ) },
 	{ LSTRKEY( "__metatable" ),    	LROVAL  ( levent_ins_map     ) },
 	{ LSTRKEY( "__index"     ),   	LROVAL  ( levent_ins_map     ) },
 	{ LSTRKEY( "__gc"        ),   	LFUNCVAL( levent_ins_gc      ) },
@@ -384,4 +739,25 @@ end)
 
 e1:broadcast(true)
 
+----
+
+e1 = event.create()
+e2 = event.create()
+
+thread.start(function()
+  while true do
+	  local i, e = event.waitany({e1, e2}, 1000)
+	  if i then
+		  print("event "..i)
+	  else
+		  print("timeout")
+	  end
+  end
+end)
+
+e2:broadcast()
+e1:broadcast()
+
+print(e1:stats().latency_avg)
+
 */
@@ -37,24 +37,69 @@
 #include "lua.h"
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+
+#include <stdint.h>
 
 #include <sys/mutex.h>
 #include <sys/list.h>
 
 #include <pthread.h>
 
+// Bit set in a waiter's event group when one of it's listeners is signaled
+#define EVENT_WAKE_BIT (1 << 0)
+
+// Bit set in the event's event group when all listeners called done
+#define EVENT_DONE_BIT (1 << 0)
+
+/*
+ * A waiter is the object a thread blocks on. It's shared by all the listeners
+ * of the same thread, so a thread can wait for many events at once. Waiters are
+ * keyed by thread id, and never reference the thread's task, so a broadcast
+ * to a listener whose thread is gone is harmless.
+ */
+typedef struct {
+	pthread_t thread;         // Thread id
+	EventGroupHandle_t group; // Event group used for wake up the thread
+	int refs;                 // Number of listeners that use this waiter
+	int id;                   // Index in the waiter list
+	uint8_t exit_hook;        // If 1 the waiter is freed when the thread exits
+	struct list listeners;    // Listeners of the thread, released when the thread exits
+} event_waiter_t;
+
+struct event_userdata;
+
 typedef struct {
-	pthread_t thread;   // Thread id
-	uint8_t is_waiting; // If 1 the caller is waiting for the termination of all subscribers
-	xQueueHandle q;     // Queue for sync listener thread with this event
+	pthread_t thread;       // Thread id
+	event_waiter_t *waiter; // Waiter of the thread
+	struct event_userdata *udata; // Event
+	int id;                 // Index in the event's listener list
+	int wid;                // Index in the waiter's listener list
+	uint8_t signaled;       // If 1 the event was broadcasted, and not yet received
+	uint8_t is_waiting;     // If 1 the caller is waiting for the termination of all subscribers
+	uint64_t stamp;         // Time of the broadcast that signaled the listener, in usecs
 } listener_data_t;
 
 typedef struct {
-	struct mtx mtx;        // Mutex for protect the listeners list and the queue
-	struct list listeners; // List of listeners for this event
-	uint8_t pending;       // Number of listeners that are processing the event
-	xQueueHandle q;        // This is used by the listener for inform the caller that event is processed
+	uint32_t broadcasts;  // Number of broadcasts
+	uint32_t deliveries;  // Number of times a listener received the event
+	uint32_t coalesced;   // Number of broadcasts merged into a not yet received one
+	uint32_t latency_max; // Max time from broadcast to reception, in usecs
+	uint64_t latency_sum; // Sum of all latencies, in usecs
+} event_stats_t;
+
+typedef struct event_userdata {
+	struct mtx mtx;           // Mutex for protect the listeners list and the counters
+	struct list listeners;    // List of listeners for this event
+	uint16_t pending;         // Number of listeners that are processing the event
+	EventGroupHandle_t group; // This is used by the listener for inform the caller that event is processed
+	event_stats_t stats;      // Counters
 } event_userdata_t;
 
+event_waiter_t *event_waiter_get(pthread_t thread);
+void event_waiter_release(event_waiter_t *waiter);
+int event_listener(lua_State* L, event_userdata_t *udata, listener_data_t **listener_data);
+int event_poll(event_userdata_t *udata, listener_data_t *listener_data);
+void event_thread_exit(pthread_t thread);
+
 #endif	/* LEVENT_H */
@@ -40,6 +40,10 @@
 #define GDISPLAY_CURR_FILL       3
 #define GDISPLAY_CUSTOM          4
 
+typedef struct {
+	gdisplay_image_t *image;
+} gdisplay_image_userdata;
+
 // Default colors
 static uint32_t background;
 static uint32_t foreground;
@@ -383,6 +387,44 @@ static int lgdisplay_getfontwidtht( lua_State* L ) {
 	return 1;
 }
 
+//=====================================
+static int lgdisplay_fontcache( lua_State* L ) {
+	gdisplay_glyph_stats_t stats;
+
+	gdisplay_glyph_stats(&stats);
+
+	lua_createtable(L, 0, 9);
+
+	lua_pushinteger(L, stats.glyph_hits);
+	lua_setfield (L, -2, "glyph_hits");
+
+	lua_pushinteger(L, stats.glyph_misses);
+	lua_setfield (L, -2, "glyph_misses");
+
+	lua_pushinteger(L, stats.glyphs);
+	lua_setfield (L, -2, "glyphs");
+
+	lua_pushinteger(L, stats.glyph_bytes);
+	lua_setfield (L, -2, "glyph_bytes");
+
+	lua_pushinteger(L, stats.text_hits);
+	lua_setfield (L, -2, "text_hits");
+
+	lua_pushinteger(L, stats.text_misses);
+	lua_setfield (L, -2, "text_misses");
+
+	lua_pushinteger(L, stats.texts);
+	lua_setfield (L, -2, "texts");
+
+	lua_pushinteger(L, stats.text_bytes);
+	lua_setfield (L, -2, "text_bytes");
+
+	lua_pushinteger(L, stats.evictions);
+	lua_setfield (L, -2, "evictions");
+
+	return 1;
+}
+
 //===============================
 static int lgdisplay_on( lua_State* L ) {
 	driver_error_t *error;
@@ -1043,6 +1085,97 @@ static int lgdisplay_image( lua_State* L ) {
 	return 0;
 }
 
+// Decode an image into RAM, to draw it later without decoding it again
+static int lgdisplay_loadimage( lua_State* L ) {
+	driver_error_t *error;
+	image_type type;
+	int width, height;
+
+	const char *fname = luaL_checkstring( L, 1 );
+
+	// By default, the image is scaled down as needed (up to 1/8) to fit in the
+	// width and height. With a max scale of 0 a big image is decoded at full
+	// size, and doesn't fit in RAM.
+	int max_scale = luaL_optinteger( L, 2, 3 );
+
+	error = gdisplay_width(&width);
+    if (error) {
+        return luaL_driver_error(L, error);
+    }
+
+	error = gdisplay_height(&height);
+    if (error) {
+        return luaL_driver_error(L, error);
+    }
+
+	// By default, scale to fit in the display
+	width = luaL_optinteger( L, 3, width );
+	height = luaL_optinteger( L, 4, height );
+
+	error = gdisplay_image_type(fname, &type);
+	if (error) {
+		return luaL_driver_error(L, error);
+	}
+
+	if (type != JPGImage) {
+		return luaL_exception_extended(L, GDISPLAY_ERR_IMAGE, "only JPG images can be loaded");
+	}
+
+	gdisplay_image_userdata *userdata = (gdisplay_image_userdata *)lua_newuserdata(L, sizeof(gdisplay_image_userdata));
+	userdata->image = NULL;
+
+	luaL_getmetatable(L, "gdisplay.img");
+	lua_setmetatable(L, -2);
+
+	error = gdisplay_image_jpg_load(fname, max_scale, width, height, &userdata->image);
+	if (error) {
+		return luaL_driver_error(L, error);
+	}
+
+	return 1;
+}
+
+static int lgdisplay_image_draw( lua_State* L ) {
+	gdisplay_image_userdata *userdata = (gdisplay_image_userdata *)luaL_checkudata(L, 1, "gdisplay.img");
+	driver_error_t *error;
+	int x, y;
+
+	if (!userdata->image) {
+		return luaL_exception_extended(L, GDISPLAY_ERR_IMAGE, "image is released");
+	}
+
+	lgdisplay_get_point(L, 2, &x, &y);
+
+	error = gdisplay_image_draw(x, y, userdata->image);
+	if (error) {
+		return luaL_driver_error(L, error);
+	}
+
+	return 0;
+}
+
+static int lgdisplay_image_getsize( lua_State* L ) {
+	gdisplay_image_userdata *userdata = (gdisplay_image_userdata *)luaL_checkudata(L, 1, "gdisplay.img");
+
+	if (!userdata->image) {
+		return luaL_exception_extended(L, GDISPLAY_ERR_IMAGE, "image is released");
+	}
+
+	lua_pushinteger(L, userdata->image->width);
+	lua_pushinteger(L, userdata->image->height);
+
+	return 2;
+}
+
+static int lgdisplay_image_release( lua_State* L ) {
+	gdisplay_image_userdata *userdata = (gdisplay_image_userdata *)luaL_checkudata(L, 1, "gdisplay.img");
+
+	gdisplay_image_free(userdata->image);
+	userdata->image = NULL;
+
+	return 0;
+}
+
 //--------------------------------------------
 static int lgdisplay_set_angleOffset(lua_State *L) {
 	float angle = luaL_checknumber(L, 1);
@@ -1152,6 +1285,16 @@ static int lgdisplay_init( lua_State* L ) {
 
 #include "modules.h"
 
+static const LUA_REG_TYPE gdisplay_image_map[] = {
+	{ LSTRKEY( "draw" ),			LFUNCVAL( lgdisplay_image_draw    ) },
+	{ LSTRKEY( "getsize" ),			LFUNCVAL( lgdisplay_image_getsize ) },
+	{ LSTRKEY( "release" ),			LFUNCVAL( lgdisplay_image_release ) },
+    { LSTRKEY( "__metatable" ),	    LROVAL  ( gdisplay_image_map      ) },
+	{ LSTRKEY( "__index"     ),     LROVAL  ( gdisplay_image_map      ) },
+    { LSTRKEY( "__gc" ),	 	    LFUNCVAL( lgdisplay_image_release ) },
+    { LNILKEY, LNILVAL }
+};
+
 static const LUA_REG_TYPE gdisplay_map[] = {
     { LSTRKEY( "init" ),			LFUNCVAL( lgdisplay_init ) },
     { LSTRKEY( "attach" ),			LFUNCVAL( lgdisplay_init ) },
@@ -1172,6 +1315,7 @@ static const LUA_REG_TYPE gdisplay_map[] = {
 	{ LSTRKEY( "getfontsize" ),		LFUNCVAL( lgdisplay_getfontsize )},
 	{ LSTRKEY( "getfontheight" ),	LFUNCVAL( lgdisplay_getfontheight )},
 	{ LSTRKEY( "getfontwidtht" ),	LFUNCVAL( lgdisplay_getfontwidtht )},
+	{ LSTRKEY( "fontcache" ),		LFUNCVAL( lgdisplay_fontcache )},
 	{ LSTRKEY( "gettype" ),			LFUNCVAL( lgdisplay_gettype )},
 	{ LSTRKEY( "setrot" ),			LFUNCVAL( lgdisplay_setrot )},
 	{ LSTRKEY( "setorient" ),		LFUNCVAL( lgdisplay_setorient )},
@@ -1202,6 +1346,7 @@ static const LUA_REG_TYPE gdisplay_map[] = {
 	{ LSTRKEY( "write" ),			LFUNCVAL( lgdisplay_write )},
 	{ LSTRKEY( "stringpos" ),		LFUNCVAL( lgdisplay_writepos )},
 	{ LSTRKEY( "image" ),			LFUNCVAL( lgdisplay_image )},
+	{ LSTRKEY( "loadimage" ),		LFUNCVAL( lgdisplay_loadimage )},
 	{ LSTRKEY( "hsb2rgb" ),			LFUNCVAL( lgdisplay_HSBtoRGB )},
 	{ LSTRKEY( "setbrightness" ),	LFUNCVAL( lgdisplay_set_brightness )},
 	{ LSTRKEY( "gettouch" ),		LFUNCVAL( lgdisplay_read_touch )},
@@ -1268,6 +1413,8 @@ static const LUA_REG_TYPE gdisplay_map[] = {
 };
 
 int luaopen_gdisplay(lua_State* L) {
+    luaL_newmetarotable(L,"gdisplay.img", (void *)gdisplay_image_map);
+
     return 0;
 }
 
@@ -45,8 +45,13 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #if CONFIG_LUA_RTOS_LUA_USE_PACK
+
+#if CONFIG_LUA_RTOS_LUA_USE_ARRAY
+#include "array.h"
+#endif
 #define PACK_NUMBER   0b0000
 #define PACK_INTEGER  0b0001
 #define PACK_NIL      0b0010
@@ -426,15 +431,540 @@ static int l_unpack(lua_State *L) {
 
 }
 
+/*
+ * Compiled formats
+ *
+ * pack.compile(fmt) parses a binary format once, and returns a descriptor that
+ * encodes / decodes values directly to / from a binary string, a hex string, or
+ * an array, without parsing the format on each call. Format options are:
+ *
+ *   <  little endian (default)
+ *   >  big endian
+ *   b  int8          B  uint8
+ *   h  int16         H  uint16
+ *   i  int32         I  uint32
+ *   f  float         d  double
+ *   cn fixed size string of n bytes, zero padded
+ *   z  zero terminated string
+ *   x  one zero byte of padding
+ *
+ */
+
+#define PACK_FIELD_INT    0
+#define PACK_FIELD_UINT   1
+#define PACK_FIELD_FLOAT  2
+#define PACK_FIELD_DOUBLE 3
+#define PACK_FIELD_CHARS  4
+#define PACK_FIELD_ZSTR   5
+#define PACK_FIELD_PAD    6
+
+typedef struct {
+	uint8_t  kind;   // Field kind (PACK_FIELD_XXX)
+	uint8_t  big;    // Big endian?
+	uint16_t size;   // Size in bytes, 0 for zero terminated strings
+} pack_field_t;
+
+typedef struct {
+	uint16_t nfields; // Number of fields
+	uint16_t nvalues; // Number of values (fields, except padding)
+	uint16_t size;    // Size in bytes of the fixed size fields
+	uint8_t  fixed;   // All the fields have a fixed size?
+	pack_field_t field[];
+} pack_desc_t;
+
+static const LUA_REG_TYPE pack_fmt_map[];
+
+// Check that the value at idx is a compiled format. The metatable is compared
+// with pack_fmt_map, instead of using luaL_checkudata, that must get the
+// metatable from the registry by name on each call.
+static pack_desc_t *pack_check_desc(lua_State *L, int idx) {
+	pack_desc_t *desc = (pack_desc_t *)lua_touserdata(L, idx);
+	int valid = 0;
+
+	if (desc && lua_getmetatable(L, idx)) {
+		valid = (lua_topointer(L, -1) == (const void *)pack_fmt_map);
+		lua_pop(L, 1);
+	}
+
+	luaL_argcheck(L, valid, idx, "format expected");
+
+	return desc;
+}
+
+// Store value v of size bytes in buff, with the required endianness
+static void pack_put(uint8_t *buff, uint64_t v, int size, int big) {
+	int i;
+
+	if (big) {
+		for(i = size - 1;i >= 0;i--) {
+			buff[i] = v & 0xff;
+			v >>= 8;
+		}
+	} else {
+		for(i = 0;i < size;i++) {
+			buff[i] = v & 0xff;
+			v >>= 8;
+		}
+	}
+}
+
+// Get a value of size bytes from buff, with the required endianness
+static uint64_t pack_get(const uint8_t *buff, int size, int big) {
+	uint64_t v = 0;
+	int i;
+
+	if (big) {
+		for(i = 0;i < size;i++) {
+			v = (v << 8) | buff[i];
+		}
+	} else {
+		for(i = size - 1;i >= 0;i--) {
+			v = (v << 8) | buff[i];
+		}
+	}
+
+	return v;
+}
+
+static int pack_nibble(char c) {
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+
+	return -1;
+}
+
+// Compute the encoded size for the values starting at stack index first
+static size_t pack_encoded_size(lua_State *L, pack_desc_t *desc, int first) {
+	size_t size = desc->size;
+	size_t len;
+	int i, arg = first;
+
+	if (desc->fixed) {
+		return size;
+	}
+
+	for(i = 0;i < desc->nfields;i++) {
+		if (desc->field[i].kind == PACK_FIELD_ZSTR) {
+			luaL_checklstring(L, arg, &len);
+			size += len + 1;
+		}
+
+		if (desc->field[i].kind != PACK_FIELD_PAD) {
+			arg++;
+		}
+	}
+
+	return size;
+}
+
+// Encode the values starting at stack index first into buff, that must have
+// enough space
+static void pack_encode(lua_State *L, pack_desc_t *desc, int first, uint8_t *buff) {
+	pack_field_t *field;
+	const char *str;
+	size_t len;
+	int i, arg = first;
+	union {
+		float f;
+		uint32_t u;
+	} f32;
+	union {
+		double d;
+		uint64_t u;
+	} f64;
+
+	for(i = 0;i < desc->nfields;i++) {
+		field = &desc->field[i];
+
+		switch (field->kind) {
+			case PACK_FIELD_INT:
+				pack_put(buff, (uint64_t)luaL_checkinteger(L, arg), field->size, field->big);
+				break;
+
+			case PACK_FIELD_UINT:
+				// Values that don't fit in a Lua integer are numbers
+				if (lua_isinteger(L, arg)) {
+					pack_put(buff, (uint64_t)lua_tointeger(L, arg), field->size, field->big);
+				} else {
+					pack_put(buff, (uint64_t)luaL_checknumber(L, arg), field->size, field->big);
+				}
+				break;
+
+			case PACK_FIELD_FLOAT:
+				f32.f = luaL_checknumber(L, arg);
+				pack_put(buff, f32.u, 4, field->big);
+				break;
+
+			case PACK_FIELD_DOUBLE:
+				f64.d = luaL_checknumber(L, arg);
+				pack_put(buff, f64.u, 8, field->big);
+				break;
+
+			case PACK_FIELD_CHARS:
+				str = luaL_checklstring(L, arg, &len);
+				luaL_argcheck(L, len <= field->size, arg, "string longer than field size");
+
+				memcpy(buff, str, len);
+				memset(buff + len, 0, field->size - len);
+				break;
+
+			case PACK_FIELD_ZSTR:
+				str = luaL_checklstring(L, arg, &len);
+				memcpy(buff, str, len + 1);
+				buff += len + 1;
+				arg++;
+				continue;
+
+			case PACK_FIELD_PAD:
+				*buff++ = 0;
+				continue;
+		}
+
+		buff += field->size;
+		arg++;
+	}
+}
+
+// Decode the values from buff, of len bytes, and push them. Returns the number of
+// decoded bytes.
+static size_t pack_decode(lua_State *L, pack_desc_t *desc, const uint8_t *buff, size_t len) {
+	const uint8_t *start = buff;
+	const uint8_t *end = buff + len;
+	pack_field_t *field;
+	uint64_t v;
+	size_t slen;
+	int i;
+	union {
+		float f;
+		uint32_t u;
+	} f32;
+	union {
+		double d;
+		uint64_t u;
+	} f64;
+
+	luaL_checkstack(L, desc->nvalues + 1, "too many values");
+
+	for(i = 0;i < desc->nfields;i++) {
+		field = &desc->field[i];
+
+		if (field->kind == PACK_FIELD_ZSTR) {
+			slen = strnlen((const char *)buff, end - buff);
+			if (buff + slen >= end) {
+				luaL_error(L, "data string too short");
+			}
+
+			lua_pushlstring(L, (const char *)buff, slen);
+			buff += slen + 1;
+			continue;
+		}
+
+		if (buff + field->size > end) {
+			luaL_error(L, "data string too short");
+		}
+
+		switch (field->kind) {
+			case PACK_FIELD_INT:
+				v = pack_get(buff, field->size, field->big);
+
+				// Sign extension
+				if ((field->size < 8) && (v & ((uint64_t)1 << (field->size * 8 - 1)))) {
+					v |= ~(uint64_t)0 << (field->size * 8);
+				}
+
+				lua_pushinteger(L, (int64_t)v);
+				break;
+
+			case PACK_FIELD_UINT:
+				v = pack_get(buff, field->size, field->big);
+				if (v > (uint64_t)LUA_MAXINTEGER) {
+					lua_pushnumber(L, (lua_Number)v);
+				} else {
+					lua_pushinteger(L, v);
+				}
+				break;
+
+			case PACK_FIELD_FLOAT:
+				f32.u = pack_get(buff, 4, field->big);
+				lua_pushnumber(L, f32.f);
+				break;
+
+			case PACK_FIELD_DOUBLE:
+				f64.u = pack_get(buff, 8, field->big);
+				lua_pushnumber(L, f64.d);
+				break;
+
+			case PACK_FIELD_CHARS:
+				slen = strnlen((const char *)buff, field->size);
+				lua_pushlstring(L, (const char *)buff, slen);
+				break;
+		}
+
+		buff += field->size;
+	}
+
+	return buff - start;
+}
+
+// pack.compile(fmt)
+static int l_compile(lua_State *L) {
+	const char *fmt = luaL_checkstring(L, 1);
+	const char *c;
+	pack_desc_t *desc;
+	pack_field_t *field;
+	uint32_t size = 0;
+	int nfields = 0;
+	int big = 0;
+	int n;
+
+	// Count fields
+	for(c = fmt;*c;c++) {
+		if (strchr("bBhHiIfdczx", *c)) {
+			nfields++;
+		}
+	}
+
+	desc = (pack_desc_t *)lua_newuserdata(L, sizeof(pack_desc_t) + nfields * sizeof(pack_field_t));
+
+	desc->nfields = nfields;
+	desc->nvalues = 0;
+	desc->fixed = 1;
+
+	field = desc->field;
+
+	for(c = fmt;*c;c++) {
+		switch (*c) {
+			case '<': big = 0; continue;
+			case '>': big = 1; continue;
+			case ' ': continue;
+
+			case 'b': field->kind = PACK_FIELD_INT;    field->size = 1; break;
+			case 'B': field->kind = PACK_FIELD_UINT;   field->size = 1; break;
+			case 'h': field->kind = PACK_FIELD_INT;    field->size = 2; break;
+			case 'H': field->kind = PACK_FIELD_UINT;   field->size = 2; break;
+			case 'i': field->kind = PACK_FIELD_INT;    field->size = 4; break;
+			case 'I': field->kind = PACK_FIELD_UINT;   field->size = 4; break;
+			case 'f': field->kind = PACK_FIELD_FLOAT;  field->size = 4; break;
+			case 'd': field->kind = PACK_FIELD_DOUBLE; field->size = 8; break;
+			case 'x': field->kind = PACK_FIELD_PAD;    field->size = 1; break;
+
+			case 'z':
+				field->kind = PACK_FIELD_ZSTR;
+				field->size = 0;
+				desc->fixed = 0;
+				break;
+
+			case 'c':
+				n = 0;
+				while ((c[1] >= '0') && (c[1] <= '9')) {
+					n = n * 10 + (*++c - '0');
+					if (n > 0xffff) {
+						return luaL_error(L, "invalid format option 'c', size too large");
+					}
+				}
+
+				if (n == 0) {
+					return luaL_error(L, "missing size for format option 'c'");
+				}
+
+				field->kind = PACK_FIELD_CHARS;
+				field->size = n;
+				break;
+
+			default:
+				return luaL_error(L, "invalid format option '%c'", *c);
+		}
+
+		field->big = big;
+		size += field->size;
+
+		if (field->kind != PACK_FIELD_PAD) {
+			desc->nvalues++;
+		}
+
+		field++;
+	}
+
+	if (size > 0xffff) {
+		return luaL_error(L, "format too large");
+	}
+
+	desc->size = size;
+
+	luaL_getmetatable(L, "pack.fmt");
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+// d:pack(...), returns a binary string
+static int l_fmt_pack(lua_State *L) {
+	pack_desc_t *desc = pack_check_desc(L, 1);
+	luaL_Buffer b;
+	size_t size;
+	char *buff;
+
+	size = pack_encoded_size(L, desc, 2);
+
+	buff = luaL_buffinitsize(L, &b, size);
+	pack_encode(L, desc, 2, (uint8_t *)buff);
+	luaL_pushresultsize(&b, size);
+
+	return 1;
+}
+
+// d:packhex(...), returns an hex string
+static int l_fmt_packhex(lua_State *L) {
+	static const char hex[] = "0123456789ABCDEF";
+	pack_desc_t *desc = pack_check_desc(L, 1);
+	luaL_Buffer b;
+	size_t size;
+	uint8_t *data;
+	char *buff;
+	int i;
+
+	size = pack_encoded_size(L, desc, 2);
+
+	// Encode in the second half of the buffer, and expand to hex from
+	// the start, so no extra buffer is needed
+	buff = luaL_buffinitsize(L, &b, size * 2);
+	data = (uint8_t *)buff + size;
+
+	pack_encode(L, desc, 2, data);
+
+	for(i = 0;i < size;i++) {
+		buff[i * 2]     = hex[data[i] >> 4];
+		buff[i * 2 + 1] = hex[data[i] & 0x0f];
+	}
+
+	luaL_pushresultsize(&b, size * 2);
+
+	return 1;
+}
+
+#if CONFIG_LUA_RTOS_LUA_USE_ARRAY
+// d:packinto(array, offset, ...), encodes into the elements of an array, starting
+// at byte offset (0 based), and returns the offset after the encoded data
+static int l_fmt_packinto(lua_State *L) {
+	pack_desc_t *desc = pack_check_desc(L, 1);
+	array_userdata_t *a = (array_userdata_t *)luaL_checkudata(L, 2, "array.arr");
+	lua_Integer offset = luaL_checkinteger(L, 3);
+	size_t size;
+
+	size = pack_encoded_size(L, desc, 4);
+
+	luaL_argcheck(L, (offset >= 0) && (offset + size <= ARRAY_SIZE(a)), 3, "not enough space in array");
+
+	pack_encode(L, desc, 4, (uint8_t *)a->data + offset);
+
+	lua_pushinteger(L, offset + size);
+
+	return 1;
+}
+#endif
+
+// d:unpack(data [, offset]), decodes from a binary string, or from an array,
+// starting at byte offset (0 based). Returns the values, and the offset after
+// the decoded data.
+static int l_fmt_unpack(lua_State *L) {
+	pack_desc_t *desc = pack_check_desc(L, 1);
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	const uint8_t *data;
+	size_t len;
+
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		data = (const uint8_t *)lua_tolstring(L, 2, &len);
+	} else {
+#if CONFIG_LUA_RTOS_LUA_USE_ARRAY
+		array_userdata_t *a = (array_userdata_t *)luaL_checkudata(L, 2, "array.arr");
+
+		data = (const uint8_t *)a->data;
+		len = ARRAY_SIZE(a);
+#else
+		data = (const uint8_t *)luaL_checklstring(L, 2, &len);
+#endif
+	}
+
+	luaL_argcheck(L, (offset >= 0) && (offset <= len), 3, "offset out of string");
+
+	offset += pack_decode(L, desc, data + offset, len - offset);
+
+	lua_pushinteger(L, offset);
+
+	return desc->nvalues + 1;
+}
+
+// d:unpackhex(hex), decodes from an hex string
+static int l_fmt_unpackhex(lua_State *L) {
+	pack_desc_t *desc = pack_check_desc(L, 1);
+	const char *hex;
+	luaL_Buffer b;
+	size_t len;
+	uint8_t *data;
+	int i, hi, lo;
+
+	hex = luaL_checklstring(L, 2, &len);
+	luaL_argcheck(L, (len % 2) == 0, 2, "invalid hex string");
+
+	len = len / 2;
+
+	// The buffer is left on the stack while decoding, and released with it
+	data = (uint8_t *)luaL_buffinitsize(L, &b, len);
+
+	for(i = 0;i < len;i++) {
+		hi = pack_nibble(hex[i * 2]);
+		lo = pack_nibble(hex[i * 2 + 1]);
+		luaL_argcheck(L, (hi >= 0) && (lo >= 0), 2, "invalid hex string");
+
+		data[i] = (hi << 4) | lo;
+	}
+
+	pack_decode(L, desc, data, len);
+
+	return desc->nvalues;
+}
+
+// d:size(), size in bytes of the encoded data, or nil if the format has variable size fields
+static int l_fmt_size(lua_State *L) {
+	pack_desc_t *desc = pack_check_desc(L, 1);
+
+	if (desc->fixed) {
+		lua_pushinteger(L, desc->size);
+	} else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+}
+
 static const LUA_REG_TYPE pack_map[] = 
 {
-  { LSTRKEY( "pack"   ),    LFUNCVAL( l_pack   ) },
+  { LSTRKEY( "pack"    ),    LFUNCVAL( l_pack    ) },
 //  { LSTRKEY( "b64"    ),    LFUNCVAL( l_b64    ) },
-  { LSTRKEY( "unpack" ),    LFUNCVAL( l_unpack ) },
+  { LSTRKEY( "unpack"  ),    LFUNCVAL( l_unpack  ) },
+  { LSTRKEY( "compile" ),    LFUNCVAL( l_compile ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE pack_fmt_map[] =
+{
+  { LSTRKEY( "pack"        ),    LFUNCVAL( l_fmt_pack      ) },
+  { LSTRKEY( "packhex"     ),    LFUNCVAL( l_fmt_packhex   ) },
+#if CONFIG_LUA_RTOS_LUA_USE_ARRAY
+  { LSTRKEY( "packinto"    ),    LFUNCVAL( l_fmt_packinto  ) },
+#endif
+  { LSTRKEY( "unpack"      ),    LFUNCVAL( l_fmt_unpack    ) },
+  { LSTRKEY( "unpackhex"   ),    LFUNCVAL( l_fmt_unpackhex ) },
+  { LSTRKEY( "size"        ),    LFUNCVAL( l_fmt_size      ) },
+  { LSTRKEY( "__metatable" ),    LROVAL  ( pack_fmt_map    ) },
+  { LSTRKEY( "__index"     ),    LROVAL  ( pack_fmt_map    ) },
   { LNILKEY, LNILVAL }
 };
 
 int luaopen_pack(lua_State *L) {
+	luaL_newmetarotable(L,"pack.fmt", (void *)pack_fmt_map);
+
 	#if !LUA_USE_ROTABLE
 	luaL_newlib(L, pack_map);
 	return 1;
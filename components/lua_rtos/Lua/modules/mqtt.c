@@ -39,6 +39,7 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 
 #include <errno.h>
 #include <string.h>
@@ -53,6 +54,8 @@
 #include <sys/syslog.h>
 #include <sys/mount.h>
 
+#include "mqtt_topic.h"
+
 #define MQTT_MAX_RECONNECT_RETRIES 10
 
 void MQTTClient_init();
@@ -79,82 +82,236 @@ DRIVER_REGISTER_END(MQTT,mqtt,NULL,NULL,NULL);
 
 static int client_inited = 0;
 
+// Default size of the queue of received messages
+#define MQTT_QUEUE_SIZE 16
+
+// Max time that the network thread waits for room in the queue, in the
+// MQTT_QUEUE_BLOCK policy, before dropping the message
+#define MQTT_QUEUE_BLOCK_TIMEOUT 1000
+
+// Max number of subscriptions that a received message is dispatched to. A
+// message is counted as dropped for the other matching subscriptions.
+#define MQTT_MAX_MATCHES 8
+
+// What to do when a message arrives and the queue is full
+#define MQTT_QUEUE_DROP_NEW 0 // Drop the received message
+#define MQTT_QUEUE_DROP_OLD 1 // Drop the oldest queued message
+#define MQTT_QUEUE_BLOCK    2 // Wait for room, up to MQTT_QUEUE_BLOCK_TIMEOUT
+
+// A received message, with the subscriptions that it matches
 typedef struct {
-    char *topic;
-    int callback;
-    void *next;
-} mqtt_subs_callback;
+    int matches;
+    mqtt_topic_t *match[MQTT_MAX_MATCHES];
+    int payloadlen;
+    char *payload;
+    char topic[];
+} mqtt_msg_t;
+
+// State shared between the Lua side, the network thread and the dispatcher
+// task. It's released by the dispatcher task, when the client is destroyed.
+typedef struct {
+    lua_State *L;             // main thread of the Lua state that created the client
+    struct mtx mtx;           // protects the trie, closing and inflight
+    mqtt_topic_t root;
+    xQueueHandle queue;       // queue of mqtt_msg_t pointers, NULL stops the task
+    TaskHandle_t task;
+    int callbacks;            // reference to the table of callbacks, indexed by filter
+    uint8_t overflow;
+    uint8_t closing;
+    uint8_t inflight;
+    uint32_t received;
+    uint32_t dropped;
+} mqtt_dispatch_t;
 
 typedef struct {
-    lua_State *L;
     struct mtx callback_mtx;
 
     MQTTClient_connectOptions conn_opts;
     MQTTClient_SSLOptions ssl_opts;
     MQTTClient client;
 
-    mqtt_subs_callback *callbacks;
+    mqtt_dispatch_t *dispatch;
     const char *ca_file;
 
     int secure;
     int persistence;
 } mqtt_userdata;
 
-static int add_subs_callback(mqtt_userdata *mqtt, const char *topic, int call) {
-    mqtt_subs_callback *callback;
+// Add the nodes of the subscription filter to the trie
+static int add_subs_topic(mqtt_dispatch_t *dispatch, const char *filter) {
+    int res;
+
+    mtx_lock(&dispatch->mtx);
+    res = mqtt_topic_add(&dispatch->root, filter);
+    mtx_unlock(&dispatch->mtx);
+
+    return res;
+}
+
+static void msg_dropped(mqtt_dispatch_t *dispatch, mqtt_msg_t *msg) {
+    int i;
+
+    for(i=0;i < msg->matches;i++) {
+        msg->match[i]->dropped++;
+    }
+
+    dispatch->dropped++;
+
+    free(msg);
+}
+
+// Call the Lua callbacks for the messages in the queue. Callbacks are
+// called without holding the dispatcher's mutex, because the Lua side
+// takes it with the Lua lock held.
+static void dispatch_task(void *arg) {
+    mqtt_dispatch_t *dispatch = (mqtt_dispatch_t *)arg;
+    mqtt_msg_t *msg;
+    lua_State *TL;
+    int tref;
+    int i;
+
+    for(;;) {
+        xQueueReceive(dispatch->queue, &msg, portMAX_DELAY);
+        if (!msg) {
+            break;
+        }
+
+        mtx_lock(&dispatch->mtx);
+        if (dispatch->closing) {
+            mtx_unlock(&dispatch->mtx);
+            free(msg);
+            continue;
+        }
+
+        // Don't release the callbacks table until we have it in the stack
+        dispatch->inflight = 1;
+        mtx_unlock(&dispatch->mtx);
 
-    // Create and populate callback structure
-    callback = (mqtt_subs_callback *)malloc(sizeof(mqtt_subs_callback));
-    if (!callback) {
-        errno = ENOMEM;
-        return -1;
+        TL = lua_newthread(dispatch->L);
+        tref = luaL_ref(dispatch->L, LUA_REGISTRYINDEX);
+
+        lua_rawgeti(TL, LUA_REGISTRYINDEX, dispatch->callbacks);
+
+        mtx_lock(&dispatch->mtx);
+        dispatch->inflight = 0;
+        mtx_unlock(&dispatch->mtx);
+
+        for(i=0;i < msg->matches;i++) {
+            lua_getfield(TL, 1, msg->match[i]->filter);
+            if (!lua_isfunction(TL, -1)) {
+                lua_pop(TL, 1);
+                continue;
+            }
+
+            lua_pushinteger(TL, msg->payloadlen);
+            lua_pushlstring(TL, msg->payload, msg->payloadlen);
+            lua_pushstring(TL, msg->topic);
+
+            if (lua_pcall(TL, 3, 0, 0) != LUA_OK) {
+                syslog(LOG_ERR, "mqtt: %s\n", lua_tostring(TL, -1));
+                lua_pop(TL, 1);
+            }
+        }
+
+        luaL_unref(TL, LUA_REGISTRYINDEX, tref);
+
+        free(msg);
     }
 
-    callback->topic = (char *)malloc(strlen(topic) + 1);
-    if (!callback->topic) {
-        errno = ENOMEM;
-        free(callback);
-        return -1;
+    // Client is destroyed, release the dispatcher
+    if (dispatch->callbacks != LUA_NOREF) {
+        luaL_unref(dispatch->L, LUA_REGISTRYINDEX, dispatch->callbacks);
     }
 
-    strcpy(callback->topic, topic);
+    mqtt_topic_free(&dispatch->root);
+    vQueueDelete(dispatch->queue);
+    mtx_destroy(&dispatch->mtx);
+    free(dispatch);
+
+    vTaskDelete(NULL);
+}
+
+// Stop calling the callbacks. If the dispatcher is getting the callbacks
+// table, it releases the table when it ends.
+static void dispatch_close(lua_State *L, mqtt_dispatch_t *dispatch) {
+    mtx_lock(&dispatch->mtx);
+    dispatch->closing = 1;
+    if (!dispatch->inflight) {
+        luaL_unref(L, LUA_REGISTRYINDEX, dispatch->callbacks);
+        dispatch->callbacks = LUA_NOREF;
+    }
+    mtx_unlock(&dispatch->mtx);
+}
 
-    callback->callback = call;
+// End the dispatcher task, that releases the dispatcher. Must be called
+// when no more messages can arrive.
+static void dispatch_stop(mqtt_dispatch_t *dispatch) {
+    mqtt_msg_t *msg;
 
-    mtx_lock(&mqtt->callback_mtx);
-    callback->next = mqtt->callbacks;
-    mqtt->callbacks = callback;
-    mtx_unlock(&mqtt->callback_mtx);
+    while (xQueueReceive(dispatch->queue, &msg, 0) == pdPASS) {
+        free(msg);
+    }
 
-    return 0;
+    msg = NULL;
+    xQueueSend(dispatch->queue, &msg, portMAX_DELAY);
 }
 
+// Called by the network thread, so the message is only matched and queued
 static int messageArrived(void *context, char * topicName, int topicLen, MQTTClient_message* m) {
     mqtt_userdata *mqtt = (mqtt_userdata *)context;
-    if (mqtt) {
-
-      mqtt_subs_callback *callback;
-      int call = 0;
-
-      mtx_lock(&mqtt->callback_mtx);
-
-      callback = mqtt->callbacks;
-      while (callback) {
-          if (strcmp(callback->topic, topicName) == 0) {
-              call = callback->callback;
-              if (call != LUA_NOREF) {
-                  lua_rawgeti(mqtt->L, LUA_REGISTRYINDEX, call);
-                  lua_pushinteger(mqtt->L, m->payloadlen);
-                  lua_pushlstring(mqtt->L, m->payload, m->payloadlen);
-                  lua_call(mqtt->L, 2, 0);
+    if (mqtt && mqtt->dispatch) {
+
+      mqtt_dispatch_t *dispatch = mqtt->dispatch;
+      mqtt_msg_t *msg;
+      mqtt_msg_t *old;
+
+      if (topicLen == 0) {
+          topicLen = strlen(topicName);
+      }
+
+      msg = (mqtt_msg_t *)malloc(sizeof(mqtt_msg_t) + topicLen + 1 + m->payloadlen);
+      if (msg) {
+          msg->matches = 0;
+          msg->payloadlen = m->payloadlen;
+          msg->payload = msg->topic + topicLen + 1;
+
+          memcpy(msg->topic, topicName, topicLen);
+          msg->topic[topicLen] = '\0';
+          memcpy(msg->payload, m->payload, m->payloadlen);
+
+          mtx_lock(&dispatch->mtx);
+          msg->matches = mqtt_topic_match(&dispatch->root, msg->topic, msg->match, MQTT_MAX_MATCHES);
+          dispatch->received++;
+
+          if (msg->matches == 0) {
+              free(msg);
+          } else if (dispatch->overflow == MQTT_QUEUE_BLOCK) {
+              // Wait without holding the mutex
+              mtx_unlock(&dispatch->mtx);
+              if (xQueueSend(dispatch->queue, &msg, MQTT_QUEUE_BLOCK_TIMEOUT / portTICK_PERIOD_MS) != pdPASS) {
+                  mtx_lock(&dispatch->mtx);
+                  msg_dropped(dispatch, msg);
+              } else {
+                  mtx_lock(&dispatch->mtx);
+              }
+          } else {
+              while (xQueueSend(dispatch->queue, &msg, 0) != pdPASS) {
+                  if ((dispatch->overflow == MQTT_QUEUE_DROP_OLD) && (xQueueReceive(dispatch->queue, &old, 0) == pdPASS)) {
+                      msg_dropped(dispatch, old);
+                  } else if (dispatch->overflow != MQTT_QUEUE_DROP_OLD) {
+                      msg_dropped(dispatch, msg);
+                      break;
+                  }
               }
           }
 
-          callback = callback->next;
+          mtx_unlock(&dispatch->mtx);
+      } else {
+          mtx_lock(&dispatch->mtx);
+          dispatch->dropped++;
+          mtx_unlock(&dispatch->mtx);
       }
 
-      mtx_unlock(&mqtt->callback_mtx);
-
       MQTTClient_freeMessage(&m);
       MQTTClient_free(topicName);
 
@@ -202,6 +359,7 @@ static void connectionLost(void* context, char* cause) {
 static int lmqtt_client( lua_State* L ){
     int rc = 0;
     size_t lenClientId, lenHost;
+    mqtt_dispatch_t *dispatch;
     mqtt_userdata *mqtt;
     char url[250];
 
@@ -218,11 +376,47 @@ static int lmqtt_client( lua_State* L ){
 
     const char *ca_file = luaL_optstring( L, 7, NULL );
 
+    int queue_size = luaL_optinteger( L, 8, MQTT_QUEUE_SIZE );
+    luaL_argcheck(L, queue_size > 0, 8, "invalid queue size");
+
+    int overflow = luaL_optinteger( L, 9, MQTT_QUEUE_DROP_NEW );
+    luaL_argcheck(L, (overflow >= MQTT_QUEUE_DROP_NEW) && (overflow <= MQTT_QUEUE_BLOCK), 9, "invalid overflow policy");
+
+    // Allocate dispatcher, and start it
+    dispatch = (mqtt_dispatch_t *)calloc(1, sizeof(mqtt_dispatch_t));
+    if (!dispatch) {
+      return luaL_exception(L, LUA_MQTT_ERR_CANT_CREATE_CLIENT);
+    }
+
+    dispatch->queue = xQueueCreate(queue_size, sizeof(mqtt_msg_t *));
+    if (!dispatch->queue) {
+      free(dispatch);
+      return luaL_exception(L, LUA_MQTT_ERR_CANT_CREATE_CLIENT);
+    }
+
+    mtx_init(&dispatch->mtx, NULL, NULL, 0);
+    dispatch->overflow = overflow;
+
+    // Callbacks are called in the main thread of the Lua state
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    dispatch->L = lua_tothread(L, -1);
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    dispatch->callbacks = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    if (xTaskCreatePinnedToCore(dispatch_task, "mqtt", CONFIG_LUA_RTOS_LUA_THREAD_STACK_SIZE, dispatch, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY, &dispatch->task, xPortGetCoreID()) != pdPASS) {
+      luaL_unref(L, LUA_REGISTRYINDEX, dispatch->callbacks);
+      vQueueDelete(dispatch->queue);
+      mtx_destroy(&dispatch->mtx);
+      free(dispatch);
+      return luaL_exception(L, LUA_MQTT_ERR_CANT_CREATE_CLIENT);
+    }
+
     // Allocate mqtt structure and initialize
     mqtt = (mqtt_userdata *)lua_newuserdata(L, sizeof(mqtt_userdata));
-    mqtt->L = L;
     mqtt->client = NULL;
-    mqtt->callbacks = NULL;
+    mqtt->dispatch = dispatch;
     mqtt->secure = secure;
     mqtt->persistence = persistence;
     mqtt->ca_file = (ca_file ? strdup(ca_file):NULL); //save for use during mqtt_connect
@@ -243,11 +437,15 @@ static int lmqtt_client( lua_State* L ){
     //url is being strdup'd in MQTTClient_connectURI
     rc = MQTTClient_create(&mqtt->client, url, clientId, persistence, (char*)persistence_folder);
     if (rc < 0){
+      dispatch_close(L, dispatch);
+      dispatch_stop(dispatch);
       return luaL_exception(L, LUA_MQTT_ERR_CANT_CREATE_CLIENT);
     }
 
     rc = MQTTClient_setCallbacks(mqtt->client, mqtt, connectionLost, messageArrived, NULL);
     if (rc < 0){
+      dispatch_close(L, dispatch);
+      dispatch_stop(dispatch);
       return luaL_exception(L, LUA_MQTT_ERR_CANT_SET_CALLBACKS);
     }
 
@@ -317,7 +515,6 @@ static int lmqtt_subscribe( lua_State* L ) {
     int rc;
     int qos;
     const char *topic;
-    int callback = 0;
 
     mqtt_userdata *mqtt = NULL;
 
@@ -334,10 +531,15 @@ static int lmqtt_subscribe( lua_State* L ) {
     luaL_checktype(L, 4, LUA_TFUNCTION);
     // Copy argument (function) to the top of stack
     lua_pushvalue(L, 4);
-    // Copy function reference
-    callback = luaL_ref(L, LUA_REGISTRYINDEX);
+    // Store function into the callbacks table, indexed by topic
+    lua_rawgeti(L, LUA_REGISTRYINDEX, mqtt->dispatch->callbacks);
+    lua_insert(L, -2);
+    lua_setfield(L, -2, topic);
+    lua_pop(L, 1);
 
-    add_subs_callback(mqtt, topic, callback);
+    if (add_subs_topic(mqtt->dispatch, topic) < 0) {
+      return luaL_exception(L, LUA_MQTT_ERR_CANT_SUBSCRIBE);
+    }
 
     rc = MQTTClient_subscribe(mqtt->client, topic, qos);
     if (rc == 0) {
@@ -395,27 +597,61 @@ static int lmqtt_disconnect( lua_State* L ) {
     }
 }
 
+static void push_counters(lua_State *L, uint32_t received, uint32_t dropped) {
+    lua_createtable(L, 0, 2);
+
+    lua_pushinteger(L, received);
+    lua_setfield (L, -2, "received");
+
+    lua_pushinteger(L, dropped);
+    lua_setfield (L, -2, "dropped");
+}
+
+static void push_topic_counters(lua_State *L, mqtt_topic_t *node) {
+    mqtt_topic_t *child;
+
+    for(child = node->child;child;child = child->next) {
+        if (child->filter) {
+            push_counters(L, child->received, child->dropped);
+            lua_setfield(L, -2, child->filter);
+        }
+
+        push_topic_counters(L, child);
+    }
+}
+
+static int lmqtt_stats( lua_State* L ) {
+    mqtt_userdata *mqtt = NULL;
+    mqtt_dispatch_t *dispatch;
+
+    mqtt = (mqtt_userdata *)luaL_checkudata(L, 1, "mqtt.cli");
+    luaL_argcheck(L, mqtt, 1, "mqtt expected");
+
+    // Nodes are never removed, and are linked when they are ready, so they
+    // are read without locking
+    dispatch = mqtt->dispatch;
+
+    push_counters(L, dispatch->received, dispatch->dropped);
+
+    lua_pushinteger(L, uxQueueMessagesWaiting(dispatch->queue));
+    lua_setfield (L, -2, "pending");
+
+    lua_newtable(L);
+    push_topic_counters(L, &dispatch->root);
+    lua_setfield (L, -2, "topics");
+
+    return 1;
+}
+
 // Destructor
 static int lmqtt_client_gc (lua_State *L) {
     mqtt_userdata *mqtt = NULL;
-    mqtt_subs_callback *callback;
-    mqtt_subs_callback *nextcallback;
 
     mqtt = (mqtt_userdata *)luaL_testudata(L, 1, "mqtt.cli");
     if (mqtt && mqtt->callback_mtx.sem) {
         // Destroy callbacks
         mtx_lock(&mqtt->callback_mtx);
-
-        callback = mqtt->callbacks;
-        while (callback) {
-            luaL_unref(L, LUA_REGISTRYINDEX, callback->callback);
-            nextcallback = callback->next;
-
-            free(callback);
-            callback = nextcallback;
-        }
-        mqtt->callbacks = NULL;
-
+        dispatch_close(L, mqtt->dispatch);
         mtx_unlock(&mqtt->callback_mtx);
 
         // Disconnect and destroy client
@@ -425,6 +661,9 @@ static int lmqtt_client_gc (lua_State *L) {
         MQTTClient_destroy(&mqtt->client);
         mqtt->client = NULL;
 
+        dispatch_stop(mqtt->dispatch);
+        mqtt->dispatch = NULL;
+
         mtx_destroy(&mqtt->callback_mtx);
         //mtx_destroy does mqtt->callback_mtx.sem = 0;
 
@@ -457,6 +696,10 @@ static const LUA_REG_TYPE lmqtt_map[] = {
   { LSTRKEY("PERSISTENCE_NONE"), LINTVAL(MQTTCLIENT_PERSISTENCE_NONE) },
   { LSTRKEY("PERSISTENCE_USER"), LINTVAL(MQTTCLIENT_PERSISTENCE_USER) },
 
+  { LSTRKEY("QUEUE_DROP_NEW"), LINTVAL(MQTT_QUEUE_DROP_NEW) },
+  { LSTRKEY("QUEUE_DROP_OLD"), LINTVAL(MQTT_QUEUE_DROP_OLD) },
+  { LSTRKEY("QUEUE_BLOCK"), LINTVAL(MQTT_QUEUE_BLOCK) },
+
   // Error definitions
   DRIVER_REGISTER_LUA_ERRORS(mqtt)
   { LNILKEY, LNILVAL }
@@ -468,6 +711,7 @@ static const LUA_REG_TYPE lmqtt_client_map[] = {
   { LSTRKEY( "disconnect"  ),   LFUNCVAL( lmqtt_disconnect ) },
   { LSTRKEY( "subscribe"   ),   LFUNCVAL( lmqtt_subscribe  ) },
   { LSTRKEY( "publish"     ),   LFUNCVAL( lmqtt_publish    ) },
+  { LSTRKEY( "stats"       ),   LFUNCVAL( lmqtt_stats      ) },
   { LSTRKEY( "__metatable" ),   LROVAL  ( lmqtt_client_map ) },
   { LSTRKEY( "__index"     ),   LROVAL  ( lmqtt_client_map ) },
   { LSTRKEY( "__gc"        ),   LFUNCVAL( lmqtt_client_gc  ) },
@@ -0,0 +1,191 @@
+/*
+ * Lua RTOS, MQTT topic trie
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L. & CSS IBÉRICA, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+#include "luartos.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_MQTT
+
+#include "mqtt_topic.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Matches of a topic, while the trie is walked
+typedef struct {
+    mqtt_topic_t **match;
+    int matches;
+    int max;
+} topic_matches_t;
+
+static mqtt_topic_t *topic_child(mqtt_topic_t *node, const char *level, int len) {
+    mqtt_topic_t *child;
+
+    for(child = node->child;child;child = child->next) {
+        if ((strlen(child->level) == len) && (strncmp(child->level, level, len) == 0)) {
+            return child;
+        }
+    }
+
+    child = (mqtt_topic_t *)calloc(1, sizeof(mqtt_topic_t) + len + 1);
+    if (!child) {
+        return NULL;
+    }
+
+    child->level = (char *)(child + 1);
+    memcpy(child->level, level, len);
+    child->level[len] = '\0';
+
+    child->next = node->child;
+
+    // Link the node when it's ready
+    __sync_synchronize();
+    node->child = child;
+
+    return child;
+}
+
+int mqtt_topic_add(mqtt_topic_t *root, const char *filter) {
+    mqtt_topic_t *node;
+    const char *level;
+    int len;
+
+    node = root;
+    level = filter;
+
+    for(;;) {
+        len = strcspn(level, "/");
+
+        node = topic_child(node, level, len);
+        if (!node) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if (level[len] == '\0') {
+            break;
+        }
+
+        level += len + 1;
+    }
+
+    if (!node->filter) {
+        node->filter = strdup(filter);
+        if (!node->filter) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void topic_matched(mqtt_topic_t *node, topic_matches_t *matches) {
+    if (!node->filter) {
+        return;
+    }
+
+    node->received++;
+
+    if (matches->matches < matches->max) {
+        matches->match[matches->matches++] = node;
+    } else {
+        // No room for more subscriptions, the message is lost for this one
+        node->dropped++;
+    }
+}
+
+// topic points to the current level, or is NULL when all levels have been
+// matched. As the MQTT specification says, wildcards in the first level
+// don't match topics starting with $, and "a/#" also matches "a".
+static void topic_match(mqtt_topic_t *node, const char *topic, int first, topic_matches_t *matches) {
+    mqtt_topic_t *child;
+    const char *next = NULL;
+    int wildcards;
+    int len = 0;
+
+    wildcards = !first || !topic || (*topic != '$');
+
+    if (topic) {
+        len = strcspn(topic, "/");
+        next = (topic[len] == '/') ? topic + len + 1 : NULL;
+    }
+
+    for(child = node->child;child;child = child->next) {
+        if (strcmp(child->level, "#") == 0) {
+            if (wildcards) {
+                topic_matched(child, matches);
+            }
+
+            continue;
+        }
+
+        if (!topic) {
+            continue;
+        }
+
+        if ((wildcards && (strcmp(child->level, "+") == 0)) ||
+            ((strlen(child->level) == len) && (strncmp(child->level, topic, len) == 0))) {
+            if (!next) {
+                topic_matched(child, matches);
+            }
+
+            topic_match(child, next, 0, matches);
+        }
+    }
+}
+
+int mqtt_topic_match(mqtt_topic_t *root, const char *topic, mqtt_topic_t **match, int max) {
+    topic_matches_t matches;
+
+    matches.match = match;
+    matches.matches = 0;
+    matches.max = max;
+
+    topic_match(root, topic, 1, &matches);
+
+    return matches.matches;
+}
+
+void mqtt_topic_free(mqtt_topic_t *root) {
+    mqtt_topic_t *child;
+    mqtt_topic_t *next;
+
+    for(child = root->child;child;child = next) {
+        next = child->next;
+
+        mqtt_topic_free(child);
+        free(child->filter);
+        free(child);
+    }
+
+    root->child = NULL;
+}
+
+#endif
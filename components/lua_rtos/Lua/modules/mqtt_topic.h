@@ -0,0 +1,85 @@
+/*
+ * Lua RTOS, MQTT topic trie
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L. & CSS IBÉRICA, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+/*
+ * Subscriptions of a MQTT client, kept in a trie with one node per topic
+ * level.
+ */
+
+#ifndef LMQTT_TOPIC_H
+#define	LMQTT_TOPIC_H
+
+#include <stdint.h>
+
+// A node of the subscriptions trie. Children are kept in a linked list.
+// Nodes are never removed until the trie is freed, so they can be
+// referenced by queued messages.
+typedef struct mqtt_topic {
+    char *level;              // topic level, "+" or "#"
+    char *filter;             // subscription ending at this node, or NULL
+    uint32_t received;        // messages that matched the subscription
+    uint32_t dropped;         // matched messages dropped because queue was full
+    struct mqtt_topic *child;
+    struct mqtt_topic *next;
+} mqtt_topic_t;
+
+/**
+ * @brief Add a subscription filter to the trie. The caller must serialize
+ *        the changes of the trie.
+ *
+ * @param root Root node of the trie.
+ * @param filter Subscription filter.
+ *
+ * @return 0 if ok, -1 if not enough memory (errno is set to ENOMEM)
+ */
+int mqtt_topic_add(mqtt_topic_t *root, const char *filter);
+
+/**
+ * @brief Find the subscriptions that match a topic, following the MQTT rules
+ *        for + and # wildcards. The received counter of each matching
+ *        subscription is incremented. If there are more than max matches,
+ *        the remaining subscriptions also count the message as dropped.
+ *
+ * @param root Root node of the trie.
+ * @param topic Topic name.
+ * @param match Array where the matching nodes are stored.
+ * @param max Size of the match array.
+ *
+ * @return Number of matching nodes stored in match
+ */
+int mqtt_topic_match(mqtt_topic_t *root, const char *topic, mqtt_topic_t **match, int max);
+
+/**
+ * @brief Free all the nodes of the trie, except the root node.
+ *
+ * @param root Root node of the trie.
+ */
+void mqtt_topic_free(mqtt_topic_t *root);
+
+#endif	/* LMQTT_TOPIC_H */
@@ -54,12 +54,11 @@ extern TM_One_Wire_Devices_t ow_devices[MAX_ONEWIRE_PINS];
 // This variables are defined at linker time
 extern const sensor_t sensors[];
 
-static void callback_func(int callback, sensor_instance_t *instance, sensor_value_t *data, sensor_latch_t *latch) {
+static void callback_func(int callback, sensor_instance_t *instance, sensor_value_t *data, uint32_t mask) {
 	lua_State *TL;
 	lua_State *L;
 	int tref;
 	int idx;
-	int changed;
 	const sensor_t *csensor = instance->sensor;
 
 	if (callback != LUA_NOREF) {
@@ -86,17 +85,8 @@ static void callback_func(int callback, sensor_instance_t *instance, sensor_valu
 			if (csensor->data[idx].id) {
 			    lua_pushstring(TL, (char *)csensor->data[idx].id);
 
-			    // Test if property has changed
-			    changed = 0;
-			    switch (csensor->data[idx].type) {
-			    	case SENSOR_NO_DATA: break;
-					case SENSOR_DATA_INT:    changed = (data[idx].integerd.value != latch[idx].value.integerd.value); break;
-					case SENSOR_DATA_FLOAT:  changed = (data[idx].floatd.value != latch[idx].value.floatd.value); break;
-					case SENSOR_DATA_DOUBLE: changed = (data[idx].doubled.value != latch[idx].value.doubled.value); break;
-					case SENSOR_DATA_STRING: changed = (data[idx].stringd.value != latch[idx].value.stringd.value); break;
-				}
-
-			    if (changed || latch[idx].timeout || latch[idx].repeat) {
+			    // Test if property must be reported
+			    if (mask & (1 << idx)) {
 					switch (csensor->data[idx].type) {
 						case SENSOR_NO_DATA: break;
 						case SENSOR_DATA_INT:    lua_pushinteger(TL, data[idx].integerd.value); break;
@@ -760,6 +750,29 @@ static int lsensor_callback(lua_State* L) {
 	return 0;
 }
 
+static int lsensor_stats(lua_State* L) {
+    sensor_userdata *udata = NULL;
+	uint32_t delivered, dropped, pending;
+
+	udata = (sensor_userdata *)luaL_checkudata(L, 1, "sensor.ins");
+    luaL_argcheck(L, udata, 1, "sensor expected");
+
+    sensor_callback_stats(udata->instance, &delivered, &dropped, &pending);
+
+	lua_createtable(L, 0, 3);
+
+	lua_pushinteger(L, delivered);
+	lua_setfield (L, -2, "delivered");
+
+	lua_pushinteger(L, dropped);
+	lua_setfield (L, -2, "dropped");
+
+	lua_pushinteger(L, pending);
+	lua_setfield (L, -2, "pending");
+
+	return 1;
+}
+
 // Destructor
 static int lsensor_ins_gc (lua_State *L) {
 	lsensor_dettach(L);
@@ -783,6 +796,7 @@ static const LUA_REG_TYPE lsensor_ins_map[] = {
   	{ LSTRKEY( "set"         ),	LFUNCVAL( lsensor_set 	    ) },
   	{ LSTRKEY( "get"         ),	LFUNCVAL( lsensor_get 	    ) },
   	{ LSTRKEY( "callback"    ),	LFUNCVAL( lsensor_callback  ) },
+  	{ LSTRKEY( "stats"       ),	LFUNCVAL( lsensor_stats     ) },
     { LSTRKEY( "__metatable" ),	LROVAL  ( lsensor_ins_map   ) },
 	{ LSTRKEY( "__index"     ), LROVAL  ( lsensor_ins_map   ) },
 	{ LSTRKEY( "__gc"        ), LFUNCVAL( lsensor_ins_gc    ) },
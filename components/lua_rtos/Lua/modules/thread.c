@@ -52,6 +52,10 @@
 #include <drivers/uart.h>
 #include <sys/console.h>
 
+#if CONFIG_LUA_RTOS_LUA_USE_EVENT
+#include "event.h"
+#endif
+
 // Module errors
 #define LUA_THREAD_ERR_NOT_ENOUGH_MEMORY    	(DRIVER_EXCEPTION_BASE(THREAD_DRIVER_ID) |  0)
 #define LUA_THREAD_ERR_NOT_ALLOWED          	(DRIVER_EXCEPTION_BASE(THREAD_DRIVER_ID) |  1)
@@ -62,9 +66,13 @@
 #define LUA_THREAD_ERR_INVALID_CPU_AFFINITY 	(DRIVER_EXCEPTION_BASE(THREAD_DRIVER_ID) |  6)
 #define LUA_THREAD_ERR_CANNOT_MONITOR_AS_TABLE 	(DRIVER_EXCEPTION_BASE(THREAD_DRIVER_ID) |  7)
 #define LUA_THREAD_ERR_INVALID_THREAD_ID	    (DRIVER_EXCEPTION_BASE(THREAD_DRIVER_ID) |  7)
+#define LUA_THREAD_ERR_CANNOT_ISOLATE	        (DRIVER_EXCEPTION_BASE(THREAD_DRIVER_ID) |  8)
+#define LUA_THREAD_ERR_CANNOT_SEND	            (DRIVER_EXCEPTION_BASE(THREAD_DRIVER_ID) |  9)
 
 // Register driver and messages
-DRIVER_REGISTER_BEGIN(THREAD,thread,NULL,NULL,NULL);
+static void lthread_init();
+
+DRIVER_REGISTER_BEGIN(THREAD,thread,NULL,lthread_init,NULL);
 	DRIVER_REGISTER_ERROR(THREAD, thread, NotEnoughtMemory, "not enough memory", LUA_THREAD_ERR_NOT_ENOUGH_MEMORY);
 	DRIVER_REGISTER_ERROR(THREAD, thread, NotAllowed, "not allowed", LUA_THREAD_ERR_NOT_ALLOWED);
 	DRIVER_REGISTER_ERROR(THREAD, thread, NonExistentThread, "non-existent thread", LUA_THREAD_ERR_NON_EXISTENT);
@@ -74,7 +82,15 @@ DRIVER_REGISTER_BEGIN(THREAD,thread,NULL,NULL,NULL);
 	DRIVER_REGISTER_ERROR(THREAD, thread, InvalidCPUAffinity, "invalid CPU affinity", LUA_THREAD_ERR_INVALID_CPU_AFFINITY);
 	DRIVER_REGISTER_ERROR(THREAD, thread, CannotMonitorAsTable, "you can't monitor thread as table", LUA_THREAD_ERR_CANNOT_MONITOR_AS_TABLE);
 	DRIVER_REGISTER_ERROR(THREAD, thread, InvalidThreadId, "invalid thread id", LUA_THREAD_ERR_INVALID_THREAD_ID);
-DRIVER_REGISTER_END(THREAD,thread,NULL,NULL,NULL);
+	DRIVER_REGISTER_ERROR(THREAD, thread, CannotIsolate, "function can't run isolated", LUA_THREAD_ERR_CANNOT_ISOLATE);
+	DRIVER_REGISTER_ERROR(THREAD, thread, CannotSend, "value can't be sent", LUA_THREAD_ERR_CANNOT_SEND);
+DRIVER_REGISTER_END(THREAD,thread,NULL,lthread_init,NULL);
+
+#include "thread_channel.inc"
+
+static void lthread_init() {
+	lthread_channel_init();
+}
 
 void thread_terminated(void *args) {
     // Get pthread
@@ -93,11 +109,58 @@ void thread_terminated(void *args) {
     }
 }
 
+/*
+ * Start an isolated thread. The thread runs on it's own Lua state, created here, so
+ * it don't compete for the Lua lock with the threads of other states. The thread
+ * function is loaded into the new state from the binary chunk generated by new_thread.
+ */
+static void *lthread_start_isolated_task(lthread_t *thread) {
+    lua_State *L;
+    int status;
+
+    L = luaL_newstate();
+    if (!L) {
+        free(thread->chunk);
+        thread->chunk = NULL;
+
+        lua_writestringerror("%s\n", "not enough memory");
+        return NULL;
+    }
+
+    thread->L = L;
+    uxSetLThread(thread);
+
+    luaL_openlibs(L);
+
+    status = luaL_loadbufferx(L, thread->chunk, thread->chunk_len, "=lthread", "b");
+
+    free(thread->chunk);
+    thread->chunk = NULL;
+
+    if (status == LUA_OK) {
+        status = lua_pcall(L, 0, 0, 0);
+    }
+
+    if (status != LUA_OK) {
+        lua_writestringerror("%s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    thread->L = NULL;
+    lua_close(L);
+
+    return NULL;
+}
+
 void *lthread_start_task(void *arg) {
     lthread_t *thread;
     int *thid;
     thread = (struct lthread *)arg;
     
+    if (thread->isolated) {
+    	return lthread_start_isolated_task(thread);
+    }
+
     uxSetLThread(thread);
 
     luaL_checktype(thread->L, 1, LUA_TFUNCTION);
@@ -212,6 +275,31 @@ static int lthread_resume_pthreads(lua_State *L, int thid) {
     return 0;
 }
 
+/*
+ * Free the Lua resources of a stopped thread.
+ *
+ * For isolated threads the thread's Lua state is closed, but only if the stopped thread
+ * was not inside the Lua core (it's state is unlocked), otherwise the state is left as is.
+ */
+static void lthread_release(lua_State *L, lthread_t *lthread) {
+	if (lthread->isolated) {
+		if (lthread->L && LuaTryLock(lthread->L)) {
+			lua_unlock(lthread->L);
+			lua_close(lthread->L);
+		}
+
+		lthread->L = NULL;
+
+		if (lthread->chunk) {
+			free(lthread->chunk);
+			lthread->chunk = NULL;
+		}
+	} else {
+		luaL_unref(L, LUA_REGISTRYINDEX, lthread->function_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, lthread->thread_ref);
+	}
+}
+
 static int lthread_stop_pthreads(lua_State *L, int thid) {
 	task_info_t *info;
 	task_info_t *cinfo;
@@ -240,8 +328,12 @@ static int lthread_stop_pthreads(lua_State *L, int thid) {
 			if (thid && (cinfo->thid == thid)) {
 				_pthread_stop(cinfo->thid);
 
-				luaL_unref(L, LUA_REGISTRYINDEX, cinfo->lthread->function_ref);
-	            luaL_unref(L, LUA_REGISTRYINDEX, cinfo->lthread->thread_ref);
+#if CONFIG_LUA_RTOS_LUA_USE_EVENT
+				// Cleanups are not run for stopped threads
+				event_thread_exit(cinfo->thid);
+#endif
+
+				lthread_release(L, cinfo->lthread);
 
 				_pthread_free(cinfo->thid);
 
@@ -250,8 +342,12 @@ static int lthread_stop_pthreads(lua_State *L, int thid) {
 			} else if (thid == -1) {
 				_pthread_stop(cinfo->thid);
 
-				luaL_unref(L, LUA_REGISTRYINDEX, cinfo->lthread->function_ref);
-	            luaL_unref(L, LUA_REGISTRYINDEX, cinfo->lthread->thread_ref);
+#if CONFIG_LUA_RTOS_LUA_USE_EVENT
+				// Cleanups are not run for stopped threads
+				event_thread_exit(cinfo->thid);
+#endif
+
+				lthread_release(L, cinfo->lthread);
 
 				_pthread_free(cinfo->thid);
 
@@ -323,10 +419,10 @@ monitor_loop:
 	}
 
 	if (!table) {
-		printf("-----------------------------------------------------------------------------------------\n");
-		printf("     |        |                  |        |      |      |            STACK               \n");
-		printf("THID | TYPE   | NAME             | STATUS | CORE | PRIO |   SIZE     FREE     USED       \n");
-		printf("-----------------------------------------------------------------------------------------\n");
+		printf("----------------------------------------------------------------------------------------------------------------------------\n");
+		printf("     |        |                  |        |      |      |            STACK              |      |          |      HEAP       \n");
+		printf("THID | TYPE   | NAME             | STATUS | CORE | PRIO |   SIZE     FREE     USED      | CPU  | SWITCHES |   USED     PEAK \n");
+		printf("----------------------------------------------------------------------------------------------------------------------------\n");
 	} else {
 		lua_createtable(L, 0, 0);
 	}
@@ -357,7 +453,7 @@ monitor_loop:
 
 		if (!table) {
 			printf(
-					"%4d   %-6s   %-16s   %-6s   % 4d   % 4d   % 6d   % 6d   % 6d (% 3d%%)   \n",
+					"%4d   %-6s   %-16s   %-6s   % 4d   % 4d   % 6d   % 6d   % 6d (% 3d%%)  % 3d%%   %8u   %6u   %6u \n",
 					cinfo->thid,
 					type,
 					cinfo->name,
@@ -367,12 +463,16 @@ monitor_loop:
 					cinfo->stack_size,
 					cinfo->free_stack,
 					cinfo->stack_size - cinfo->free_stack,
-					(int)(100 * ((float)(cinfo->stack_size - cinfo->free_stack) / (float)cinfo->stack_size))
+					(int)(100 * ((float)(cinfo->stack_size - cinfo->free_stack) / (float)cinfo->stack_size)),
+					cinfo->cpu,
+					cinfo->switches,
+					(cinfo->heap_alloc > cinfo->heap_freed)?(cinfo->heap_alloc - cinfo->heap_freed):0,
+					cinfo->heap_peak
 			);
 		} else {
-			lua_pushinteger(L, i);
+			lua_pushinteger(L, ++i);
 
-			lua_createtable(L, 0, 9);
+			lua_createtable(L, 0, 16);
 
 			lua_pushinteger(L, cinfo->thid);
 	        lua_setfield (L, -2, "thid");
@@ -401,6 +501,24 @@ monitor_loop:
 	        lua_pushinteger(L, cinfo->stack_size - cinfo->free_stack);
 	        lua_setfield (L, -2, "used_stack");
 
+	        lua_pushinteger(L, cinfo->cpu);
+	        lua_setfield (L, -2, "cpu");
+
+	        lua_pushinteger(L, cinfo->run_time);
+	        lua_setfield (L, -2, "run_time");
+
+	        lua_pushinteger(L, cinfo->switches);
+	        lua_setfield (L, -2, "switches");
+
+	        lua_pushinteger(L, cinfo->heap_alloc);
+	        lua_setfield (L, -2, "heap_alloc");
+
+	        lua_pushinteger(L, cinfo->heap_freed);
+	        lua_setfield (L, -2, "heap_freed");
+
+	        lua_pushinteger(L, cinfo->heap_peak);
+	        lua_setfield (L, -2, "heap_peak");
+
 	        lua_settable(L,-3);
 		}
 
@@ -427,6 +545,45 @@ monitor_loop:
     return table;
 }
 
+// Writer for lua_dump, used to store the binary chunk of an isolated thread
+static int lthread_chunk_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	lthread_t *thread = (lthread_t *)ud;
+	char *chunk;
+
+	chunk = realloc(thread->chunk, thread->chunk_len + sz);
+	if (!chunk) {
+		return 1;
+	}
+
+	memcpy(chunk + thread->chunk_len, p, sz);
+
+	thread->chunk = chunk;
+	thread->chunk_len += sz;
+
+	return 0;
+}
+
+// Check if the function at index 1 can be moved to another Lua state. Only Lua
+// functions without upvalues, apart of _ENV, can be moved.
+static int lthread_can_isolate(lua_State *L) {
+	const char *name;
+	int i;
+
+	if (lua_iscfunction(L, 1)) {
+		return 0;
+	}
+
+	for(i = 1;(name = lua_getupvalue(L, 1, i)); i++) {
+		lua_pop(L, 1);
+
+		if (strcmp(name, "_ENV") != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
 static int new_thread(lua_State* L, int run) {
     struct lthread *thread;
     pthread_attr_t attr;
@@ -440,6 +597,12 @@ static int new_thread(lua_State* L, int run) {
     int priority = luaL_optinteger(L, 3, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY);
     int affinity = luaL_optinteger(L, 4, CONFIG_LUA_RTOS_LUA_THREAD_CPU);
     const char *name = luaL_optstring(L, 5, "lthread");
+    int isolated = 0;
+
+    if (!lua_isnoneornil(L, 6)) {
+        luaL_checktype(L, 6, LUA_TBOOLEAN);
+        isolated = lua_toboolean(L, 6);
+    }
 
     // Sanity checks
     if (stack < PTHREAD_STACK_MIN) {
@@ -466,17 +629,46 @@ static int new_thread(lua_State* L, int run) {
     	return luaL_exception(L, LUA_THREAD_ERR_NOT_ENOUGH_MEMORY);
     }
     
-    // Check for argument is a function, and store it's reference
-    luaL_checktype(L, 1, LUA_TFUNCTION);
-    thread->function_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    
-    // Create a new state, move function to it and store thread reference
-    thread->PL = L;
-    thread->L = lua_newthread(L);
-    thread->thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    
-    lua_rawgeti(L, LUA_REGISTRYINDEX, thread->function_ref);                
-    lua_xmove(L, thread->L, 1);
+    thread->isolated = isolated;
+    thread->chunk = NULL;
+    thread->chunk_len = 0;
+
+    // Check for argument is a function
+    if (lua_type(L, 1) != LUA_TFUNCTION) {
+    	free(thread);
+    	luaL_checktype(L, 1, LUA_TFUNCTION);
+    }
+
+    if (isolated) {
+    	// The function is moved to the isolated thread's Lua state as a binary chunk,
+    	// the state is created by the thread itself
+    	if (!lthread_can_isolate(L)) {
+    		free(thread);
+    		return luaL_exception_extended(L, LUA_THREAD_ERR_CANNOT_ISOLATE, "function can't have upvalues");
+    	}
+
+    	if (lua_dump(L, lthread_chunk_writer, thread, 0) != 0) {
+    		free(thread->chunk);
+    		free(thread);
+        	return luaL_exception(L, LUA_THREAD_ERR_NOT_ENOUGH_MEMORY);
+    	}
+
+        thread->PL = L;
+        thread->L = NULL;
+        thread->function_ref = LUA_NOREF;
+        thread->thread_ref = LUA_NOREF;
+    } else {
+        // Store function reference
+        thread->function_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        // Create a new state, move function to it and store thread reference
+        thread->PL = L;
+        thread->L = lua_newthread(L);
+        thread->thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, thread->function_ref);
+        lua_xmove(L, thread->L, 1);
+    }
 
 	// Init thread attributes
 	pthread_attr_init(&attr);
@@ -514,6 +706,11 @@ retry:
             goto retry;
         }
         
+        if (thread->chunk) {
+        	free(thread->chunk);
+        	thread->chunk = NULL;
+        }
+
         return luaL_exception_extended(L, LUA_THREAD_ERR_CANNOT_START, strerror(errno));
     }
 
@@ -660,17 +857,42 @@ static int lthread_status(lua_State* L) {
 	return 0;
 }
 
+// Statistics of the pool of parked tasks used for start new threads
+static int lthread_pool(lua_State* L) {
+	pthread_pool_stats_t stats;
+
+	_pthread_pool_stats(&stats);
+
+	lua_createtable(L, 0, 4);
+
+	lua_pushinteger(L, stats.hits);
+	lua_setfield(L, -2, "hits");
+
+	lua_pushinteger(L, stats.misses);
+	lua_setfield(L, -2, "misses");
+
+	lua_pushinteger(L, stats.created);
+	lua_setfield(L, -2, "created");
+
+	lua_pushinteger(L, stats.parked);
+	lua_setfield(L, -2, "parked");
+
+	return 1;
+}
+
 #include "modules.h"
 
 static const LUA_REG_TYPE thread[] = {
     { LSTRKEY( "status"      ),			LFUNCVAL( lthread_status        ) },
     { LSTRKEY( "create"      ),			LFUNCVAL( lthread_create        ) },
     { LSTRKEY( "createmutex" ),			LFUNCVAL( lthread_create_mutex  ) },
+    { LSTRKEY( "channel"     ),			LFUNCVAL( lthread_channel       ) },
     { LSTRKEY( "start"       ),			LFUNCVAL( lthread_start         ) },
     { LSTRKEY( "suspend"     ),			LFUNCVAL( lthread_suspend       ) },
     { LSTRKEY( "resume"      ),			LFUNCVAL( lthread_resume        ) },
     { LSTRKEY( "stop"        ),			LFUNCVAL( lthread_stop          ) },
     { LSTRKEY( "list"        ),			LFUNCVAL( lthread_list          ) },
+    { LSTRKEY( "pool"        ),			LFUNCVAL( lthread_pool          ) },
     { LSTRKEY( "sleep"       ),			LFUNCVAL( lthread_sleep         ) },
     { LSTRKEY( "sleepms"     ),			LFUNCVAL( lthread_sleepms       ) },
     { LSTRKEY( "sleepus"     ),			LFUNCVAL( lthread_sleepus       ) },
@@ -692,8 +914,19 @@ static const LUA_REG_TYPE mutex_map[] = {
 	{ LNILKEY, LNILVAL }
 };
 
+static const LUA_REG_TYPE channel_map[] = {
+	{ LSTRKEY( "send"        ),   LFUNCVAL( lthread_channel_send    ) },
+	{ LSTRKEY( "receive"     ),   LFUNCVAL( lthread_channel_receive ) },
+	{ LSTRKEY( "pending"     ),   LFUNCVAL( lthread_channel_pending ) },
+    { LSTRKEY( "__metatable" ),	  LROVAL  ( channel_map             ) },
+	{ LSTRKEY( "__index"     ),   LROVAL  ( channel_map             ) },
+	{ LSTRKEY( "__gc"        ),   LFUNCVAL( lthread_channel_gc      ) },
+	{ LNILKEY, LNILVAL }
+};
+
 int luaopen_thread(lua_State* L) {
 	luaL_newmetarotable(L,"thread.mutex", (void *)mutex_map);
+	luaL_newmetarotable(L,"thread.channel", (void *)channel_map);
 	
 	return 0;
 } 
@@ -32,11 +32,34 @@
 
 #include "lstate.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
 #include <pthread.h>
 
 typedef struct {
 	pthread_mutex_t mtx;
 } mutex_userdata;
 
+// Default number of messages that a channel can hold
+#define LUA_THREAD_CHANNEL_CAPACITY 8
+
+// Initial size of a channel message, grows as needed
+#define LUA_THREAD_CHANNEL_MSG_SIZE 64
+
+// Max nested tables allowed in a channel message
+#define LUA_THREAD_CHANNEL_MAX_DEPTH 8
+
+typedef struct {
+	char *name;     // Channel name
+	int index;      // Index in the channel list
+	int refs;       // Number of references to this channel
+	xQueueHandle q; // Queue of messages
+} lthread_channel_t;
+
+typedef struct {
+	lthread_channel_t *channel;
+} channel_userdata;
+
 #endif	/* LTHREAD_H */
 
@@ -37,6 +37,9 @@
 #include <assert.h>
 #include <signal.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/adds.h"
+
 #include "lua.h"
 #include "lauxlib.h"
 #include "uart.h"
@@ -48,6 +51,9 @@
 
 extern struct uart uart[NUART];
 
+// Reference to the frame callback of each unit
+static int frame_callback[NUART] = {[0 ... NUART - 1] = LUA_NOREF};
+
 static int uart_exists(int id) {
     return ((id >= CPU_FIRST_UART) && (id <= CPU_LAST_UART));
 }
@@ -238,8 +244,9 @@ static int luart_write( lua_State* L ) {
 
 static int luart_read( lua_State* L ) {
     int id = luaL_checkinteger(L, 1);
-    const char  *format = luaL_checkstring(L, 2);
+    const char  *format;
     int timeout, res, c;
+    luaL_Buffer b;
     
     // Some integrity checks
     if (!uart_exists(id)) {
@@ -249,34 +256,45 @@ static int luart_read( lua_State* L ) {
     if (!uart_is_setup(id)) {
         return luaL_error(L, "UART%d is not setup", id);
     }
+
+    if (uart_is_framing(id)) {
+        return luaL_error(L, "UART%d has framing enabled, use uart.readframe", id);
+    }
     
     timeout = luaL_optinteger(L, 3, 0xffffffff);
     if (timeout == 0xffffffff) {
         timeout = portMAX_DELAY;
     }
 
-    // Read ...
-    if (strcmp("*l", format) == 0) {
-        char *str = (char *)malloc(sizeof(char) * LUAL_BUFFERSIZE);
+    // Read a number of bytes
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        int len = luaL_checkinteger(L, 2);
 
-        res = uart_reads(id, str, 0, timeout);
-        if (res) {
-            lua_pushlstring(L, str, strlen(str));
-            free(str);
+        luaL_argcheck(L, len > 0, 2, "must be greater than 0");
+
+        char *buff = luaL_buffinitsize(L, &b, len);
+
+        res = uart_read_bytes(id, buff, len, timeout);
+        if (res > 0) {
+            luaL_pushresultsize(&b, res);
         } else {
             lua_pushnil(L);
         }
-        
+
         return 1;
-    } else if (strcmp("*el", format) == 0) {
-        char *str = (char *)malloc(sizeof(char) * LUAL_BUFFERSIZE);
-        
-        res = uart_reads(id, str, 1, timeout);
-        if (res) {
-            lua_pushlstring(L, str, strlen(str));
-            free(str);
+    }
+
+    format = luaL_checkstring(L, 2);
+
+    // Read ...
+    if ((strcmp("*l", format) == 0) || (strcmp("*el", format) == 0)) {
+        char *buff = luaL_buffinitsize(L, &b, LUAL_BUFFERSIZE);
+
+        res = uart_readline(id, buff, LUAL_BUFFERSIZE, (format[1] == 'e'), timeout);
+        if (res >= 0) {
+            luaL_pushresultsize(&b, res);
         } else {
-            lua_pushnil(L);            
+            lua_pushnil(L);
         }
         
         return 1;
@@ -309,6 +327,145 @@ static int luart_consume( lua_State* L ) {
     return 0;
 }
 
+static int luart_stats( lua_State* L ) {
+	driver_error_t *error;
+	uart_stats_t stats;
+	int id = luaL_checkinteger(L, 1);
+
+    error = uart_get_stats(id, &stats);
+    if (error) {
+        return luaL_driver_error(L, error);
+    }
+
+	lua_createtable(L, 0, 6);
+
+	lua_pushinteger(L, stats.received);
+	lua_setfield (L, -2, "received");
+
+	lua_pushinteger(L, stats.overruns);
+	lua_setfield (L, -2, "overruns");
+
+	lua_pushinteger(L, stats.fifo_overflows);
+	lua_setfield (L, -2, "fifo_overflows");
+
+	lua_pushinteger(L, stats.frame_errors);
+	lua_setfield (L, -2, "frame_errors");
+
+	lua_pushinteger(L, stats.frames);
+	lua_setfield (L, -2, "frames");
+
+	lua_pushinteger(L, stats.frame_drops);
+	lua_setfield (L, -2, "frame_drops");
+
+    return 1;
+}
+
+static void callback_func(int callback, int8_t unit, uart_frame_t *frame) {
+	lua_State *TL;
+	lua_State *L;
+	int tref;
+
+	if (callback != LUA_NOREF) {
+	    L = pvGetLuaState();
+	    TL = lua_newthread(L);
+
+	    tref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	    lua_rawgeti(L, LUA_REGISTRYINDEX, callback);
+	    lua_xmove(L, TL, 1);
+        lua_pushlstring(TL, (const char *)frame->data, frame->len);
+	    lua_pcall(TL, 1, 0, 0);
+        luaL_unref(TL, LUA_REGISTRYINDEX, tref);
+	}
+}
+
+static int framing_field(lua_State* L, const char *name, int def) {
+	int val;
+
+	lua_getfield(L, 2, name);
+	val = luaL_optinteger(L, -1, def);
+	lua_pop(L, 1);
+
+	return val;
+}
+
+static int luart_framing( lua_State* L ) {
+	driver_error_t *error;
+	uart_framing_t framing;
+	int callback = LUA_NOREF;
+	int id = luaL_checkinteger(L, 1);
+
+    if (!uart_exists(id)) {
+        return luaL_error(L, "UART%d does not exist", id);
+    }
+
+	if (lua_isnumber(L, 2)) {
+		// Only the mode, used to disable framing
+		memset(&framing, 0, sizeof(framing));
+		framing.mode = luaL_checkinteger(L, 2);
+	} else {
+		luaL_checktype(L, 2, LUA_TTABLE);
+
+		framing.mode      = framing_field(L, "mode", UART_FRAME_NONE);
+		framing.start     = framing_field(L, "start", -1);
+		framing.delimiter = framing_field(L, "delimiter", '\n');
+		framing.length    = framing_field(L, "length", 0);
+		framing.offset    = framing_field(L, "offset", 0);
+		framing.size      = framing_field(L, "size", 1);
+		framing.adjust    = framing_field(L, "adjust", 0);
+		framing.max       = framing_field(L, "max", LUAL_BUFFERSIZE);
+		framing.idle      = framing_field(L, "idle", 0);
+	}
+
+	if ((framing.mode != UART_FRAME_NONE) && lua_isfunction(L, 3)) {
+		lua_pushvalue(L, 3);
+
+		callback = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	error = uart_framing(id, &framing, (callback != LUA_NOREF)?callback_func:NULL, callback);
+	if (error) {
+		luaL_unref(L, LUA_REGISTRYINDEX, callback);
+		return luaL_driver_error(L, error);
+	}
+
+	// Framing was replaced, release the previous callback
+	luaL_unref(L, LUA_REGISTRYINDEX, frame_callback[id]);
+	frame_callback[id] = callback;
+
+    return 0;
+}
+
+static int luart_readframe( lua_State* L ) {
+	driver_error_t *error;
+	uart_frame_t *frame;
+	int id = luaL_checkinteger(L, 1);
+	int timeout;
+
+    if (!uart_exists(id)) {
+        return luaL_error(L, "UART%d does not exist", id);
+    }
+
+    timeout = luaL_optinteger(L, 2, 0xffffffff);
+    if (timeout == 0xffffffff) {
+        timeout = portMAX_DELAY;
+    }
+
+    error = uart_frame_receive(id, &frame, timeout);
+    if (error) {
+        return luaL_driver_error(L, error);
+    }
+
+    if (frame) {
+    	lua_pushlstring(L, (const char *)frame->data, frame->len);
+    	free(frame);
+    } else {
+    	lua_pushnil(L);
+    }
+
+    return 1;
+}
+
 static int luart_lock( lua_State* L ) {
 	driver_error_t *error;
 	int id = luaL_checkinteger(L, 1);
@@ -343,6 +500,9 @@ static const LUA_REG_TYPE uart_map[] = {
     { LSTRKEY( "write"    ),	 LFUNCVAL( luart_write ) },
     { LSTRKEY( "read"     ),	 LFUNCVAL( luart_read ) },
     { LSTRKEY( "consume"  ),	 LFUNCVAL( luart_consume ) },
+    { LSTRKEY( "stats"    ),	 LFUNCVAL( luart_stats ) },
+    { LSTRKEY( "framing"  ),	 LFUNCVAL( luart_framing ) },
+    { LSTRKEY( "readframe"),	 LFUNCVAL( luart_readframe ) },
     { LSTRKEY( "lock"     ),	 LFUNCVAL( luart_lock ) },
     { LSTRKEY( "unlock"   ),	 LFUNCVAL( luart_unlock ) },
 	{ LSTRKEY( "CONSOLE"  ),	 LINTVAL ( CONSOLE_UART ) },
@@ -352,6 +512,11 @@ static const LUA_REG_TYPE uart_map[] = {
 	{ LSTRKEY( "STOPHALF" ),	 LINTVAL ( 0 ) },
 	{ LSTRKEY( "STOP1"    ),	 LINTVAL ( 1 ) },
 	{ LSTRKEY( "STOP2"    ),	 LINTVAL ( 2 ) },
+	{ LSTRKEY( "FRAMENONE"  ),	 LINTVAL ( UART_FRAME_NONE ) },
+	{ LSTRKEY( "FRAMEDELIM" ),	 LINTVAL ( UART_FRAME_DELIMITER ) },
+	{ LSTRKEY( "FRAMEFIXED" ),	 LINTVAL ( UART_FRAME_FIXED ) },
+	{ LSTRKEY( "FRAMELEN"   ),	 LINTVAL ( UART_FRAME_LENGTH ) },
+	{ LSTRKEY( "FRAMEIDLE"  ),	 LINTVAL ( UART_FRAME_IDLE ) },
     UART_UART0
     UART_UART1
     UART_UART2
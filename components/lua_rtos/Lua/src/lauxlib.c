@@ -1018,13 +1018,21 @@ LUALIB_API const char *luaL_gsub (lua_State *L, const char *s, const char *p,
 
 
 static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
-  (void)ud; (void)osize;  /* not used */
+  void *nptr;
+  (void)ud;
+  if (ptr == NULL) osize = 0;  /* 'osize' is the object type */
   if (nsize == 0) {
     free(ptr);
+#if defined(luai_useralloc)
+    luai_useralloc(osize, 0);
+#endif
     return NULL;
   }
-  else
-    return realloc(ptr, nsize);
+  nptr = realloc(ptr, nsize);
+#if defined(luai_useralloc)
+  if (nptr) luai_useralloc(osize, nsize);
+#endif
+  return nptr;
 }
 
 
@@ -26,10 +26,6 @@
 LUALIB_API void luaL_checkanytable (lua_State *L, int arg);
 // LUA RTOS END
 
-#if LUA_USE_ROTABLE && CONFIG_LUA_RTOS_LUA_USE_ROTABLE_CACHE
-#include <Lua/common/cache.h>
-#endif
-
 static int luaB_print (lua_State *L) {
   int n = lua_gettop(L);  /* number of arguments */
   int i;
@@ -474,9 +470,6 @@ static int luaB_tostring (lua_State *L) {
 #include "modules.h"
 
 static const LUA_REG_TYPE base_funcs[] = {
-#if LUA_USE_ROTABLE && CONFIG_LUA_RTOS_LUA_USE_ROTABLE_CACHE
-  { LSTRKEY( "cache" 		  ),			LFUNCVAL( rotable_cache_dump  	) },
-#endif
   { LSTRKEY( "compile" 		  ),			LFUNCVAL( luaB_compile   		) },
   { LSTRKEY( "try" 			  ),			LFUNCVAL( luaB_try 				) },
   { LSTRKEY( "assert" 		  ),			LFUNCVAL( luaB_assert 			) },
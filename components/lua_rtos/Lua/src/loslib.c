@@ -497,6 +497,9 @@ static const LUA_REG_TYPE syslib[] =
   { LSTRKEY( "logcons" ),     LFUNCVAL( os_logcons ) },
   { LSTRKEY( "loglevel" ),    LFUNCVAL( os_loglevel ) },
   { LSTRKEY( "stats" ),       LFUNCVAL( os_stats ) },
+#if LUA_USE_ROTABLE && CONFIG_LUA_RTOS_LUA_USE_ROTABLE_CACHE
+  { LSTRKEY( "cachestats" ),  LFUNCVAL( os_cache_stats ) },
+#endif
   { LSTRKEY( "format" ),      LFUNCVAL( os_format ) },
   { LSTRKEY( "history" ),     LFUNCVAL( os_history ) },
   { LSTRKEY( "shell" ),       LFUNCVAL( os_shell ) },
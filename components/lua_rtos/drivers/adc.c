@@ -30,8 +30,14 @@
 #include "sdkconfig.h"
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_attr.h"
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <sys/list.h>
 #include <sys/driver.h>
@@ -41,6 +47,7 @@
 #include <drivers/cpu.h>
 #include <drivers/adc.h>
 #include <drivers/adc_internal.h>
+#include <drivers/timer.h>
 #include "adc_mcp3008.h"
 #include "adc_mcp3208.h"
 #include "adc_ads1015.h"
@@ -67,6 +74,36 @@ static const adc_dev_t adc_devs[] = {
 // List of channels
 static struct list channels;
 
+// Max sampling rate, in Hz
+#define ADC_STREAM_MAX_RATE 20000
+
+// Continuous sampling
+typedef struct adc_stream {
+	adc_channel_t *chan;
+	const adc_dev_t *dev;       ///< Device, resolved when sampling starts
+	int8_t timer;               ///< Hardware timer that triggers the acquisition
+	uint8_t filter;
+	uint16_t decimation;
+	uint16_t count;             ///< Samples in the current group
+	uint32_t acc;               ///< Filter accumulator for the current group
+	uint16_t *buff;             ///< Ring buffer
+	uint32_t mask;              ///< Ring buffer size - 1
+	volatile uint32_t head;     ///< Written by the sampler task
+	volatile uint32_t tail;     ///< Written by the reader
+	SemaphoreHandle_t data;     ///< Given when new samples are available
+	SemaphoreHandle_t done;     ///< Given when the sampler task exits
+	TaskHandle_t task;
+	volatile uint8_t stop;
+	uint16_t users;             ///< Threads in adc_stream_read / adc_stream_stats, protected by stream_mux
+	adc_stream_stats_t stats;
+} adc_stream_t;
+
+// Sampler of each hardware timer
+static adc_stream_t *streams[CPU_LAST_TIMER + 1];
+
+// Protects the stream of each channel while it's used
+static portMUX_TYPE stream_mux = portMUX_INITIALIZER_UNLOCKED;
+
 // Register driver and messages
 static void _adc_init();
 
@@ -81,6 +118,10 @@ DRIVER_REGISTER_BEGIN(ADC,adc,NULL,_adc_init,NULL);
 	DRIVER_REGISTER_ERROR(ADC, adc, InvalidMax, "invalid max value", ADC_ERR_INVALID_MAX);
 	DRIVER_REGISTER_ERROR(ADC, adc, CannotCalibrate, "calibration is not allowed for this ADC", ADC_ERR_CANNOT_CALIBRATE);
 	DRIVER_REGISTER_ERROR(ADC, adc, CalibrationError, "calibration error", ADC_ERR_CALIBRATION);
+	DRIVER_REGISTER_ERROR(ADC, adc, InvalidRate, "invalid sampling rate", ADC_ERR_INVALID_RATE);
+	DRIVER_REGISTER_ERROR(ADC, adc, InvalidFilter, "invalid filter", ADC_ERR_INVALID_FILTER);
+	DRIVER_REGISTER_ERROR(ADC, adc, StreamStarted, "sampling is already started", ADC_ERR_STREAM_STARTED);
+	DRIVER_REGISTER_ERROR(ADC, adc, StreamNotStarted, "sampling is not started", ADC_ERR_STREAM_NOT_STARTED);
 DRIVER_REGISTER_END(ADC,adc,NULL,_adc_init,NULL);
 
 /*
@@ -110,6 +151,126 @@ static adc_channel_t *get_channel(int8_t unit, int8_t channel, int *item_index)
     return NULL;
 }
 
+// Timer callback, runs in the timer ISR and wakes up the sampler task
+static void IRAM_ATTR adc_stream_tick(void *arg) {
+	adc_stream_t *stream = streams[(int)arg];
+	portBASE_TYPE high_priority_task_awoken = 0;
+
+	if (stream) {
+		vTaskNotifyGiveFromISR(stream->task, &high_priority_task_awoken);
+	}
+
+	if (high_priority_task_awoken == pdTRUE) {
+		portYIELD_FROM_ISR();
+	}
+}
+
+// Add a raw sample to the current group, and store the filtered value when
+// the group is complete
+static void adc_stream_put(adc_stream_t *stream, uint32_t raw) {
+	switch (stream->filter) {
+		case ADC_FILTER_AVG:
+			stream->acc += raw;
+			break;
+
+		case ADC_FILTER_MIN:
+			if ((stream->count == 0) || (raw < stream->acc)) {
+				stream->acc = raw;
+			}
+			break;
+
+		case ADC_FILTER_MAX:
+			if ((stream->count == 0) || (raw > stream->acc)) {
+				stream->acc = raw;
+			}
+			break;
+
+		default:
+			stream->acc = raw;
+	}
+
+	if (++stream->count < stream->decimation) {
+		return;
+	}
+
+	if (stream->filter == ADC_FILTER_AVG) {
+		stream->acc /= stream->decimation;
+	}
+
+	if (stream->head - stream->tail > stream->mask) {
+		// Ring buffer is full
+		stream->stats.overruns++;
+	} else {
+		stream->buff[stream->head & stream->mask] = stream->acc;
+		stream->head++;
+		stream->stats.samples++;
+
+		xSemaphoreGive(stream->data);
+	}
+
+	stream->count = 0;
+	stream->acc = 0;
+}
+
+static void adc_stream_task(void *arg) {
+	adc_stream_t *stream = (adc_stream_t *)arg;
+	driver_error_t *error;
+	uint32_t ticks;
+	int raw;
+
+	while (!stream->stop) {
+		ticks = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if (stream->stop) {
+			break;
+		}
+
+		// More than one tick means that the last acquisition took more
+		// time than the sampling period
+		if (ticks > 1) {
+			stream->stats.missed += ticks - 1;
+		}
+
+		if ((error = stream->dev->read(stream->chan, &raw, NULL))) {
+			stream->stats.errors++;
+			free(error);
+		} else {
+			adc_stream_put(stream, raw);
+		}
+	}
+
+	xSemaphoreGive(stream->done);
+	vTaskDelete(NULL);
+}
+
+// Get the stream of a channel, and keep it until adc_stream_release
+static adc_stream_t *adc_stream_acquire(adc_channel_t *chan) {
+	adc_stream_t *stream;
+
+	portENTER_CRITICAL(&stream_mux);
+	stream = chan->stream;
+	if (stream) {
+		stream->users++;
+	}
+	portEXIT_CRITICAL(&stream_mux);
+
+	return stream;
+}
+
+// Release a stream. It can be freed as soon as it's released.
+static void adc_stream_release(adc_stream_t *stream) {
+	portENTER_CRITICAL(&stream_mux);
+	stream->users--;
+	portEXIT_CRITICAL(&stream_mux);
+}
+
+static void adc_stream_free(adc_stream_t *stream) {
+	if (stream->data) vSemaphoreDelete(stream->data);
+	if (stream->done) vSemaphoreDelete(stream->done);
+
+	free(stream->buff);
+	free(stream);
+}
+
 /*
  * Operation functions
  */
@@ -222,25 +383,293 @@ driver_error_t *adc_get_channel(adc_channel_h_t *h, adc_channel_t **chan) {
 
 driver_error_t *adc_read_avg(adc_channel_h_t *h, int samples, double *avgr, double *avgm) {
 	driver_error_t *error;
+	adc_channel_t *chan;
+	const adc_dev_t *dev;
 
 	int raw;
 	double mvolts = 0;
+	int64_t sumr = 0;
+	double summ = 0;
 	int i;
 
-	for(i=1; i <= samples;i++) {
+	// Get channel and device once, instead of for each sample
+	if (list_get(&channels, (int)*h, (void **)&chan)) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_CHANNEL, NULL);
+	}
+
+	dev = &adc_devs[chan->unit - CPU_FIRST_ADC];
+
+	if (samples <= 0) {
+		samples = 1;
+	}
+
+	for(i=0; i < samples;i++) {
 		// Read value
-		if ((error = adc_read(h, &raw, &mvolts))) {
+		if ((error = dev->read(chan, &raw, avgm?&mvolts:NULL))) {
 			return error;
 		}
 
-		if (avgr) {
-			*avgr = ((i - 1) * *avgr + raw) / i;
+		sumr += raw;
+		summ += mvolts;
+	}
+
+	if (avgr) {
+		*avgr = (double)sumr / samples;
+	}
+
+	if (avgm) {
+		*avgm = summ / samples;
+	}
+
+	return NULL;
+}
+
+driver_error_t *adc_stream_start(adc_channel_h_t *h, int8_t timer, uint32_t rate, uint16_t decimation, uint8_t filter, uint32_t size) {
+	driver_error_t *error;
+	adc_channel_t *chan;
+	adc_stream_t *stream;
+	uint32_t ring;
+
+	// Get channel
+	if (list_get(&channels, (int)*h, (void **)&chan)) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_CHANNEL, NULL);
+	}
+
+	// Sanity checks
+	if ((rate == 0) || (rate > ADC_STREAM_MAX_RATE)) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_RATE, NULL);
+	}
+
+	if (filter > ADC_FILTER_MAX) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_FILTER, NULL);
+	}
+
+	if ((timer < CPU_FIRST_TIMER) || (timer > CPU_LAST_TIMER)) {
+		return driver_error(TIMER_DRIVER, TIMER_ERR_INVALID_UNIT, NULL);
+	}
+
+	if (chan->stream) {
+		return driver_error(ADC_DRIVER, ADC_ERR_STREAM_STARTED, NULL);
+	}
+
+	if (streams[timer]) {
+		return driver_error(ADC_DRIVER, ADC_ERR_STREAM_STARTED, "timer is in use by other channel");
+	}
+
+	if (decimation == 0) {
+		decimation = 1;
+	}
+
+	// Ring buffer size must be a power of 2
+	ring = 16;
+	while (ring < size) {
+		ring <<= 1;
+	}
+
+	stream = calloc(1, sizeof(adc_stream_t));
+	if (!stream) {
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	stream->chan = chan;
+	stream->dev = &adc_devs[chan->unit - CPU_FIRST_ADC];
+	stream->timer = timer;
+	stream->filter = filter;
+	stream->decimation = decimation;
+	stream->mask = ring - 1;
+
+	stream->buff = malloc(ring * sizeof(uint16_t));
+	stream->data = xSemaphoreCreateBinary();
+	stream->done = xSemaphoreCreateBinary();
+
+	if (!stream->buff || !stream->data || !stream->done) {
+		adc_stream_free(stream);
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	// The sampler task runs at high priority, because the sampling rate
+	// depends on it
+	if (xTaskCreatePinnedToCore(adc_stream_task, "adcs", 2048, stream, configMAX_PRIORITIES - 2, &stream->task, xPortGetCoreID()) != pdPASS) {
+		adc_stream_free(stream);
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	streams[timer] = stream;
+
+	if ((error = tmr_setup(timer, 1000000 / rate, adc_stream_tick, 0))) {
+		streams[timer] = NULL;
+
+		stream->stop = 1;
+		xTaskNotifyGive(stream->task);
+		xSemaphoreTake(stream->done, portMAX_DELAY);
+
+		adc_stream_free(stream);
+		return error;
+	}
+
+	portENTER_CRITICAL(&stream_mux);
+	chan->stream = stream;
+	portEXIT_CRITICAL(&stream_mux);
+
+	tmr_start(timer);
+
+	return NULL;
+}
+
+driver_error_t *adc_stream_stop(adc_channel_h_t *h) {
+	adc_channel_t *chan;
+	adc_stream_t *stream;
+	uint16_t users;
+
+	// Get channel
+	if (list_get(&channels, (int)*h, (void **)&chan)) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_CHANNEL, NULL);
+	}
+
+	portENTER_CRITICAL(&stream_mux);
+	stream = chan->stream;
+	chan->stream = NULL;
+	portEXIT_CRITICAL(&stream_mux);
+
+	if (!stream) {
+		return driver_error(ADC_DRIVER, ADC_ERR_STREAM_NOT_STARTED, NULL);
+	}
+
+	// Stop the timer, and then the sampler task
+	tmr_unsetup(stream->timer);
+
+	streams[stream->timer] = NULL;
+
+	stream->stop = 1;
+	xTaskNotifyGive(stream->task);
+	xSemaphoreTake(stream->done, portMAX_DELAY);
+
+	// Wake up the threads waiting for samples, and wait for them to leave
+	// before freeing the stream
+	for(;;) {
+		portENTER_CRITICAL(&stream_mux);
+		users = stream->users;
+		portEXIT_CRITICAL(&stream_mux);
+
+		if (users == 0) {
+			break;
 		}
 
-		if (avgm) {
-			*avgm = ((i - 1) * *avgm + mvolts) / i;
+		xSemaphoreGive(stream->data);
+		vTaskDelay(1);
+	}
+
+	adc_stream_free(stream);
+
+	return NULL;
+}
+
+driver_error_t *adc_stream_read(adc_channel_h_t *h, uint16_t *buff, int samples, uint32_t timeout, int *read) {
+	adc_channel_t *chan;
+	adc_stream_t *stream;
+	TickType_t ticks, start, elapsed;
+	uint32_t head, tail, avail, chunk;
+	uint8_t stopped = 0;
+	int n = 0;
+
+	// Get channel
+	if (list_get(&channels, (int)*h, (void **)&chan)) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_CHANNEL, NULL);
+	}
+
+	// Get the stream, and keep it while reading
+	stream = adc_stream_acquire(chan);
+	if (!stream) {
+		return driver_error(ADC_DRIVER, ADC_ERR_STREAM_NOT_STARTED, NULL);
+	}
+
+	ticks = (timeout == portMAX_DELAY)?portMAX_DELAY:(timeout / portTICK_PERIOD_MS);
+
+	while (n < samples) {
+		head = stream->head;
+		tail = stream->tail;
+
+		avail = head - tail;
+		if (avail > samples - n) {
+			avail = samples - n;
+		}
+
+		// Copy in at most two spans, before and after the ring wrap
+		while (avail > 0) {
+			chunk = stream->mask + 1 - (tail & stream->mask);
+			if (chunk > avail) {
+				chunk = avail;
+			}
+
+			memcpy(buff + n, stream->buff + (tail & stream->mask), chunk * sizeof(uint16_t));
+
+			n += chunk;
+			tail += chunk;
+			avail -= chunk;
 		}
+
+		stream->tail = tail;
+
+		if (n == samples) {
+			break;
+		}
+
+		// Wait for new samples
+		if (ticks == 0) {
+			break;
+		}
+
+		start = xTaskGetTickCount();
+
+		if (xSemaphoreTake(stream->data, ticks) != pdTRUE) {
+			break;
+		}
+
+		// Sampling stopped while waiting
+		if (stream->stop) {
+			stopped = 1;
+			break;
+		}
+
+		if (ticks != portMAX_DELAY) {
+			elapsed = xTaskGetTickCount() - start;
+			ticks = (elapsed >= ticks)?0:(ticks - elapsed);
+		}
+	}
+
+	adc_stream_release(stream);
+
+	*read = n;
+
+	// Sampling stopped while waiting, and there are no samples
+	if ((n == 0) && (samples > 0) && stopped) {
+		return driver_error(ADC_DRIVER, ADC_ERR_STREAM_NOT_STARTED, NULL);
 	}
 
 	return NULL;
 }
+
+driver_error_t *adc_stream_stats(adc_channel_h_t *h, adc_stream_stats_t *stats, int *pending) {
+	adc_channel_t *chan;
+	adc_stream_t *stream;
+
+	// Get channel
+	if (list_get(&channels, (int)*h, (void **)&chan)) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_CHANNEL, NULL);
+	}
+
+	stream = adc_stream_acquire(chan);
+	if (!stream) {
+		return driver_error(ADC_DRIVER, ADC_ERR_STREAM_NOT_STARTED, NULL);
+	}
+
+	*stats = stream->stats;
+
+	if (pending) {
+		*pending = stream->head - stream->tail;
+	}
+
+	adc_stream_release(stream);
+
+	return NULL;
+}
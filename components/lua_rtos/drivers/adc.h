@@ -40,6 +40,22 @@
 // Channel handler
 typedef uint32_t *adc_channel_h_t;
 
+// Stream filters, applied over each group of decimation samples
+#define ADC_FILTER_NONE 0 ///< Keep the last sample of the group
+#define ADC_FILTER_AVG  1 ///< Average of the group
+#define ADC_FILTER_MIN  2 ///< Minimum of the group
+#define ADC_FILTER_MAX  3 ///< Maximum of the group
+
+// Stream statistics
+typedef struct {
+	uint32_t samples;        ///< Samples stored in the ring buffer
+	uint32_t overruns;       ///< Samples lost, because the ring buffer is full
+	uint32_t missed;         ///< Timer periods missed, because the sampler is busy
+	uint32_t errors;         ///< Samples lost, because the device returned an error
+} adc_stream_stats_t;
+
+struct adc_stream;
+
 // ADC channel
 typedef struct {
 	uint8_t unit;            ///< ADC unit
@@ -50,6 +66,7 @@ typedef struct {
 	uint16_t max_val;        ///< Max value, depends on resolution
 	int16_t vref;             ///< VREF voltage attached in mvolts
 	int16_t max;             ///< Max voltage attached in mvolts
+	struct adc_stream *stream; ///< Continuous sampling, if started
 } adc_channel_t;
 
 // Adc devices
@@ -70,6 +87,10 @@ typedef struct {
 #define ADC_ERR_INVALID_MAX				 (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) |  7)
 #define ADC_ERR_CANNOT_CALIBRATE	     (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) |  8)
 #define ADC_ERR_CALIBRATION	             (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) |  9)
+#define ADC_ERR_INVALID_RATE	         (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) | 10)
+#define ADC_ERR_INVALID_FILTER	         (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) | 11)
+#define ADC_ERR_STREAM_STARTED	         (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) | 12)
+#define ADC_ERR_STREAM_NOT_STARTED	     (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) | 13)
 
 extern const int adc_errors;
 extern const int adc_error_map;
@@ -132,4 +153,68 @@ driver_error_t *adc_read_avg(adc_channel_h_t *h, int samples, double *avgr, doub
  */
 driver_error_t *adc_get_channel(adc_channel_h_t *h, adc_channel_t **chan);
 
+/**
+ * @brief Start the continuous sampling of an adc channel. A hardware timer triggers
+ *        the acquisition at a fixed rate, and the raw samples are filtered and stored
+ *        in a ring buffer, that is read with adc_stream_read.
+ *
+ * @param h A pointer to a channel handler.
+ * @param timer Hardware timer used for trigger the acquisition, from 0 to 3.
+ * @param rate Sampling rate in Hz.
+ * @param decimation Number of samples that are filtered to get one stored sample.
+ *                   1 = no decimation.
+ * @param filter Filter applied over decimation samples (ADC_FILTER_XXX).
+ * @param size Number of samples of the ring buffer. It's rounded up to a power of 2.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs. Error can be an operation error or a lock error.
+ */
+driver_error_t *adc_stream_start(adc_channel_h_t *h, int8_t timer, uint32_t rate, uint16_t decimation, uint8_t filter, uint32_t size);
+
+/**
+ * @brief Stop the continuous sampling of an adc channel, and free the ring buffer.
+ *        Threads waiting in adc_stream_read are woken up, and the ring buffer is
+ *        freed when they have returned.
+ *
+ * @param h A pointer to a channel handler.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs.
+ */
+driver_error_t *adc_stream_stop(adc_channel_h_t *h);
+
+/**
+ * @brief Read raw samples from the ring buffer of a channel, waiting until the requested
+ *        number of samples are available, or the timeout expires. If sampling is stopped
+ *        while waiting, the samples read so far are returned, or a not started error if
+ *        there are none.
+ *
+ * @param h A pointer to a channel handler.
+ * @param buff Buffer for the samples.
+ * @param samples Number of samples to read.
+ * @param timeout Timeout in milliseconds. portMAX_DELAY = wait forever.
+ * @param read A pointer to an int variable that holds the number of samples read.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs.
+ */
+driver_error_t *adc_stream_read(adc_channel_h_t *h, uint16_t *buff, int samples, uint32_t timeout, int *read);
+
+/**
+ * @brief Get the statistics of the continuous sampling of an adc channel.
+ *
+ * @param h A pointer to a channel handler.
+ * @param stats A pointer to the statistics.
+ * @param pending A pointer to an int variable that holds the number of samples in the
+ *                ring buffer. Can be NULL.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs.
+ */
+driver_error_t *adc_stream_stats(adc_channel_h_t *h, adc_stream_stats_t *stats, int *pending);
+
 #endif	/* ADC_H */
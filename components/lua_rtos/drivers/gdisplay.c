@@ -7,11 +7,14 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
+#include "soc/soc.h"
+
 #include <stdlib.h>
 
 #include <machine/endian.h>
 
 #include <gdisplay/gdisplay.h>
+#include <gdisplay/dirty.h>
 #include <drivers/gdisplay.h>
 #include <drivers/gpio.h>
 #include <drivers/spi.h>
@@ -43,6 +46,62 @@ static int buff_y1 = 0;
 // Pixels in buffer
 static int buff_pixels  = 0;
 
+// Can a block be sent with DMA? It must be in internal memory, and 4-byte aligned
+#if defined(SOC_DMA_LOW) && defined(SOC_DMA_HIGH)
+#define dma_capable(p) (((uint32_t)(p) >= SOC_DMA_LOW) && ((uint32_t)(p) < SOC_DMA_HIGH) && !((uint32_t)(p) & 3))
+#else
+#define dma_capable(p) 0
+#endif
+
+// Max number of rectangles sent in a flush. If there are more dirty
+// rectangles, the remaining ones are merged.
+#define GDISPLAY_FLUSH_RECTS 16
+
+#if CONFIG_LUA_RTOS_GDISPLAY_DMA_FLUSH
+/*
+ * Background flush
+ *
+ * Dirty rectangles of the frame buffer are copied into a free buffer of the
+ * display's SPI stream, and sent by the stream task using DMA. Each rectangle
+ * is stored in the buffer as a gdisplay_rect_t followed by its pixels, padded
+ * to 4 bytes.
+ *
+ */
+static uint8_t flush = 0; // Background flush is setup?
+
+static void gdisplay_ll_flush_cb(int deviceid, uint8_t *buffer, uint32_t len, void *arg) {
+	uint8_t *end = buffer + len;
+	gdisplay_rect_t *rect;
+	uint32_t bytes;
+
+	while (buffer < end) {
+		rect = (gdisplay_rect_t *)buffer;
+		buffer += sizeof(gdisplay_rect_t);
+
+		bytes = (rect->x1 - rect->x0 + 1) * (rect->y1 - rect->y0 + 1) * 2;
+
+		caps.addr_window(1, rect->x0, rect->y0, rect->x1, rect->y1);
+
+		// Set DC to 1 (data mode)
+		gpio_ll_pin_set(CONFIG_LUA_RTOS_GDISPLAY_CMD);
+		spi_ll_select(deviceid);
+		spi_ll_dma_write(deviceid, bytes, buffer);
+		spi_ll_deselect(deviceid);
+
+		buffer += (bytes + 3) & ~3;
+	}
+}
+
+// Wait until the background flush ends, before send anything else to the display
+static void gdisplay_ll_flush_wait() {
+	if (flush) {
+		spi_ll_stream_wait(caps.device);
+	}
+}
+#else
+#define gdisplay_ll_flush_wait()
+#endif
+
 void IRAM_ATTR gdisplay_ll_command(uint8_t command) {
 	gpio_ll_pin_clr(CONFIG_LUA_RTOS_GDISPLAY_CMD);
 	spi_ll_select(caps.device);
@@ -129,7 +188,98 @@ uint32_t gdisplay_ll_get_buffer_size() {
 	return buff_size;
 }
 
+void gdisplay_ll_flush_setup() {
+#if CONFIG_LUA_RTOS_GDISPLAY_DMA_FLUSH
+	if (flush || (caps.interface != GDisplaySPIInterface) || (caps.bytes_per_pixel != 2)) {
+		return;
+	}
+
+	// A buffer must hold at least one row of any orientation
+	if ((CONFIG_LUA_RTOS_GDISPLAY_FLUSH_BUFFER & ~3) < sizeof(gdisplay_rect_t) + max(caps.phys_width, caps.phys_height) * 2) {
+		return;
+	}
+
+	// If there is not enough memory for the stream, the dirty rectangles
+	// are sent from the calling thread
+	flush = (spi_ll_stream_setup(caps.device, CONFIG_LUA_RTOS_GDISPLAY_FLUSH_BUFFER & ~3, CONFIG_LUA_RTOS_GDISPLAY_FLUSH_STACK_SIZE, gdisplay_ll_flush_cb, NULL) == 0);
+#endif
+}
+
+void gdisplay_ll_flush(uint8_t *buffer) {
+	gdisplay_rect_t rects[GDISPLAY_FLUSH_RECTS];
+	int n, i;
+
+	n = gdisplay_dirty_take(rects, GDISPLAY_FLUSH_RECTS);
+
+#if CONFIG_LUA_RTOS_GDISPLAY_DMA_FLUSH
+	if (flush) {
+		gdisplay_rect_t *rect;
+		uint8_t *out = NULL;
+		uint32_t size = 0;
+		uint32_t used = 0;
+		int width, rows, y, row;
+
+		for(i = 0;i < n;i++) {
+			width = rects[i].x1 - rects[i].x0 + 1;
+			y = rects[i].y0;
+
+			// Rectangles that don't fit in the free space of the buffer are
+			// split by rows
+			while (y <= rects[i].y1) {
+				if (!out) {
+					// Only waits if all the buffers are in flight
+					out = spi_ll_stream_get(caps.device, &size);
+					used = 0;
+				}
+
+				rows = 0;
+				if (used + sizeof(gdisplay_rect_t) < size) {
+					rows = (size - used - sizeof(gdisplay_rect_t)) / (width * 2);
+				}
+
+				if (rows <= 0) {
+					spi_ll_stream_commit(caps.device, out, used);
+					out = NULL;
+					continue;
+				}
+
+				if (rows > rects[i].y1 - y + 1) {
+					rows = rects[i].y1 - y + 1;
+				}
+
+				rect = (gdisplay_rect_t *)(out + used);
+				rect->x0 = rects[i].x0;
+				rect->x1 = rects[i].x1;
+				rect->y0 = y;
+				rect->y1 = y + rows - 1;
+
+				used += sizeof(gdisplay_rect_t);
+
+				for(row = 0;row < rows;row++) {
+					memcpy(out + used + row * width * 2, buffer + ((y + row) * caps.width + rects[i].x0) * 2, width * 2);
+				}
+
+				used += (rows * width * 2 + 3) & ~3;
+				y += rows;
+			}
+		}
+
+		if (out) {
+			spi_ll_stream_commit(caps.device, out, used);
+		}
+
+		return;
+	}
+#endif
+
+	for(i = 0;i < n;i++) {
+		gdisplay_ll_update(rects[i].x0, rects[i].y0, rects[i].x1, rects[i].y1, buffer);
+	}
+}
+
 void gdisplay_ll_update(int x0, int y0, int x1, int y1, uint8_t *buffer) {
+	gdisplay_ll_flush_wait();
+
 	if ((buffer == (uint8_t *)buff) || (buffer == NULL)) {
 		if (buff_pixels > 0) {
 			if (buffer) {
@@ -332,6 +482,168 @@ void IRAM_ATTR gdisplay_ll_set_pixel(int x, int y, uint32_t color, uint8_t *buff
 	}
 }
 
+/*
+ * Spans
+ *
+ * A span is a horizontal or vertical run of pixels of the same color, already
+ * clipped by the caller. In a frame buffer spans are filled with 32-bit writes
+ * where possible, instead of setting pixels one by one.
+ *
+ */
+
+// Fill count 16-bit pixels with the same value
+static void IRAM_ATTR fill16(uint16_t *p, int count, uint16_t value) {
+	uint32_t pattern = ((uint32_t)value << 16) | value;
+	uint32_t *w;
+
+	if (((uint32_t)p & 2) && (count > 0)) {
+		*p++ = value;
+		count--;
+	}
+
+	w = (uint32_t *)p;
+
+	while (count >= 8) {
+		w[0] = pattern;
+		w[1] = pattern;
+		w[2] = pattern;
+		w[3] = pattern;
+		w += 4;
+		count -= 8;
+	}
+
+	while (count >= 2) {
+		*w++ = pattern;
+		count -= 2;
+	}
+
+	if (count) {
+		*((uint16_t *)w) = value;
+	}
+}
+
+// Apply a bit mask to a byte of a 1-bit buffer
+#define mono_apply(p, mask, on) {if (on) *(p) |= (mask); else *(p) &= ~(mask);}
+
+// Horizontal span in physical coordinates of a 1-bit buffer (8 vertical pixels per byte)
+static void IRAM_ATTR mono_hspan(uint8_t *buffer, int x0, int x1, int y, uint8_t on) {
+	uint8_t *p = buffer + (y >> 3) * caps.phys_width + x0;
+	uint8_t mask = (1 << (y & 7));
+	uint32_t mask32 = (uint32_t)mask * 0x01010101;
+	int count = x1 - x0 + 1;
+	uint32_t *w;
+
+	while (count && ((uint32_t)p & 3)) {
+		mono_apply(p, mask, on);
+		p++;
+		count--;
+	}
+
+	w = (uint32_t *)p;
+	while (count >= 4) {
+		mono_apply(w, mask32, on);
+		w++;
+		count -= 4;
+	}
+
+	p = (uint8_t *)w;
+	while (count--) {
+		mono_apply(p, mask, on);
+		p++;
+	}
+}
+
+// Vertical span in physical coordinates of a 1-bit buffer, a byte per 8 pixels
+static void IRAM_ATTR mono_vspan(uint8_t *buffer, int x, int y0, int y1, uint8_t on) {
+	uint8_t mask;
+	int page;
+
+	for(page = (y0 >> 3);page <= (y1 >> 3);page++) {
+		mask = 0xff;
+		if (page == (y0 >> 3)) mask &= (0xff << (y0 & 7));
+		if (page == (y1 >> 3)) mask &= (0xff >> (7 - (y1 & 7)));
+
+		mono_apply(&buffer[page * caps.phys_width + x], mask, on);
+	}
+}
+
+// Rotate a point of a 1-bit buffer according to current orientation (see gdisplay_ll_set_pixel)
+static void IRAM_ATTR mono_rotate(int *x, int *y) {
+	if (caps.orient == LANDSCAPE_FLIP) {
+		*x = caps.phys_width - 1 - *x;
+		*y = caps.phys_height - 1 - *y;
+	} else if (caps.orient == PORTRAIT) {
+		*x = caps.phys_height - 1 - *x;
+		swap(*x, *y);
+	} else if (caps.orient == PORTRAIT_FLIP) {
+		*y = caps.phys_width - 1 - *y;
+		swap(*x, *y);
+	}
+}
+
+// Span from (x0,y0) to (x1,y1), where x0 == x1 or y0 == y1, into a 1-bit buffer
+static void IRAM_ATTR mono_span(uint8_t *buffer, int x0, int y0, int x1, int y1, uint32_t color) {
+	uint8_t on = ((color != 0) == (caps.monochrome_white != 0));
+
+	mono_rotate(&x0, &y0);
+	mono_rotate(&x1, &y1);
+
+	if (x0 > x1) swap(x0, x1);
+	if (y0 > y1) swap(y0, y1);
+
+	if (y0 == y1) {
+		mono_hspan(buffer, x0, x1, y0, on);
+	} else {
+		mono_vspan(buffer, x0, y0, y1, on);
+	}
+}
+
+// Display color to frame buffer pixel, taking care about endianness
+static inline uint16_t pixel16(uint32_t color) {
+	if (BYTE_ORDER == LITTLE_ENDIAN) {
+		return (uint16_t)(((color >> 8) & 0xff) | ((color & 0xff) << 8));
+	}
+
+	return (uint16_t)color;
+}
+
+void IRAM_ATTR gdisplay_ll_hspan(int x0, int x1, int y, uint32_t color, uint8_t *buffer) {
+	int x;
+
+	if (!buffer) {
+		// Unbuffered, consecutive pixels are sent in a single transfer
+		for(x = x0;x <= x1;x++) {
+			gdisplay_ll_set_pixel(x, y, color, NULL, -1, -1);
+		}
+	} else if (caps.bytes_per_pixel == 0) {
+		mono_span(buffer, x0, y, x1, y, color);
+	} else {
+		fill16(&((uint16_t *)buffer)[y * caps.width + x0], x1 - x0 + 1, pixel16(color));
+	}
+}
+
+void IRAM_ATTR gdisplay_ll_vspan(int x, int y0, int y1, uint32_t color, uint8_t *buffer) {
+	uint16_t *p;
+	uint16_t wd;
+	int y;
+
+	if (!buffer) {
+		for(y = y0;y <= y1;y++) {
+			gdisplay_ll_set_pixel(x, y, color, NULL, -1, -1);
+		}
+	} else if (caps.bytes_per_pixel == 0) {
+		mono_span(buffer, x, y0, x, y1, color);
+	} else {
+		p = &((uint16_t *)buffer)[y0 * caps.width + x];
+		wd = pixel16(color);
+
+		for(y = y0;y <= y1;y++) {
+			*p = wd;
+			p += caps.width;
+		}
+	}
+}
+
 uint32_t gdisplay_ll_get_pixel(int x, int y, uint8_t *buffer, int buffw, int buffh) {
 	uint32_t color = 0;
 
@@ -354,13 +666,56 @@ uint32_t gdisplay_ll_get_pixel(int x, int y, uint8_t *buffer, int buffw, int buf
 	return color;
 }
 
+// Send a block of pixels, in native format, straight to a window of the display in a
+// single transfer, using DMA if possible
+static void gdisplay_ll_write(int x0, int y0, int x1, int y1, uint8_t *pixels) {
+	uint32_t bytes = (x1 - x0 + 1) * (y1 - y0 + 1) * 2;
+	int x, y;
+
+	if ((caps.interface != GDisplaySPIInterface) || (caps.bytes_per_pixel != 2)) {
+		for(y = y0;y <= y1;y++) {
+			for(x = x0;x <= x1;x++) {
+				gdisplay_ll_set_pixel(x, y, gdisplay_ll_get_pixel(x - x0, y - y0, pixels, x1 - x0 + 1, y1 - y0 + 1), NULL, -1, -1);
+			}
+		}
+
+		return;
+	}
+
+	// Pending pixels go first
+	if (buff_pixels > 0) {
+		gdisplay_ll_update(buff_x0, buff_y0, buff_x1, buff_y1, (uint8_t *)buff);
+	}
+
+	gdisplay_ll_flush_wait();
+
+	caps.addr_window(1, x0, y0, x1, y1);
+
+	// Set DC to 1 (data mode)
+	gpio_ll_pin_set(CONFIG_LUA_RTOS_GDISPLAY_CMD);
+	spi_ll_select(caps.device);
+
+	if (dma_capable(pixels)) {
+		spi_ll_dma_write(caps.device, bytes, pixels);
+	} else {
+		spi_ll_bulk_write16(caps.device, bytes / 2, (uint16_t *)pixels);
+	}
+
+	spi_ll_deselect(caps.device);
+}
+
 void gdisplay_ll_set_bitmap(int x, int y, uint8_t *buffer, uint8_t *buff, int buffw, int buffh) {
-	int i, j;
+	int i;
 
+	if (!buffer) {
+		// Without frame buffer, the bitmap is sent to the display
+		gdisplay_ll_write(x, y, x + buffw - 1, y + buffh - 1, buff);
+		return;
+	}
+
+	// Copy row by row
 	for(i=0;i < buffh;i++) {
-		for(j=0;j < buffw;j++) {
-			((uint16_t *)buffer)[(y + i) * caps.width + (x + j)] = ((uint16_t *)buff)[i * buffw + j];
-		}
+		memcpy(&((uint16_t *)buffer)[(y + i) * caps.width + x], &((uint16_t *)buff)[i * buffw], buffw * sizeof(uint16_t));
 	}
 }
 
@@ -375,18 +730,22 @@ void gdisplay_ll_get_bitmap(int x, int y, uint8_t *buffer, uint8_t *buff, int bu
 }
 
 void gdisplay_ll_on() {
+	gdisplay_ll_flush_wait();
 	caps.on();
 }
 
 void gdisplay_ll_off() {
+	gdisplay_ll_flush_wait();
 	caps.off();
 }
 
 void gdisplay_ll_invert(uint8_t on) {
+	gdisplay_ll_flush_wait();
 	caps.invert(on);
 }
 
 void gdisplay_ll_set_orientation(uint8_t orientation) {
+	gdisplay_ll_flush_wait();
 	caps.orientation(orientation);
 	caps.orient = orientation;
 
@@ -74,7 +74,49 @@ uint8_t *gdisplay_ll_allocate_buffer(uint32_t size);
 uint8_t *gdisplay_ll_get_buffer();
 uint32_t gdisplay_ll_get_buffer_size();
 void gdisplay_ll_update(int x0, int y0, int x1, int y1, uint8_t *buffer);
+
+/**
+ * @brief Setup the background flush of the frame buffer, if enabled and supported
+ *        by the display. If background flush can't be setup, gdisplay_ll_flush
+ *        sends the dirty rectangles from the calling thread.
+ *
+ */
+void gdisplay_ll_flush_setup();
+
+/**
+ * @brief Send the dirty tiles of the frame buffer to the display (see gdisplay/dirty.h).
+ *        With background flush, this function returns when the dirty rectangles
+ *        are copied to the stream buffers, and only waits if all the buffers are
+ *        in flight.
+ *
+ * @param buffer Frame buffer.
+ *
+ */
+void gdisplay_ll_flush(uint8_t *buffer);
 void gdisplay_ll_set_pixel(int x, int y, uint32_t color, uint8_t *buffer, int buffw, int buffh);
+
+/**
+ * @brief Fill a horizontal span of pixels. No clipping is done.
+ *
+ * @param x0, x1 First and last x coordinates (x0 <= x1).
+ * @param y Y coordinate.
+ * @param color Color.
+ * @param buffer Frame buffer, or NULL if the display is not buffered.
+ *
+ */
+void gdisplay_ll_hspan(int x0, int x1, int y, uint32_t color, uint8_t *buffer);
+
+/**
+ * @brief Fill a vertical span of pixels. No clipping is done.
+ *
+ * @param x X coordinate.
+ * @param y0, y1 First and last y coordinates (y0 <= y1).
+ * @param color Color.
+ * @param buffer Frame buffer, or NULL if the display is not buffered.
+ *
+ */
+void gdisplay_ll_vspan(int x, int y0, int y1, uint32_t color, uint8_t *buffer);
+
 uint32_t gdisplay_ll_get_pixel(int x, int y, uint8_t *buffer, int buffw, int buffh);
 void gdisplay_ll_set_bitmap(int x, int y, uint8_t *buffer, uint8_t *buff, int buffw, int buffh);
 void gdisplay_ll_get_bitmap(int x, int y, uint8_t *buffer, uint8_t *buff, int buffw, int buffh);
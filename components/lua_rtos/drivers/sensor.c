@@ -33,7 +33,6 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
 
 #include <time.h>
 #include <string.h>
@@ -56,7 +55,9 @@
 extern const sensor_t sensors[];
 
 // Register drivers and errors
-DRIVER_REGISTER_BEGIN(SENSOR,sensor,NULL,NULL,NULL);
+static void _sensor_init();
+
+DRIVER_REGISTER_BEGIN(SENSOR,sensor,NULL,_sensor_init,NULL);
 	DRIVER_REGISTER_ERROR(SENSOR, sensor, CannotSetup, "can't setup", SENSOR_ERR_CANT_INIT);
 	DRIVER_REGISTER_ERROR(SENSOR, sensor, Timeout, "timeout", SENSOR_ERR_TIMEOUT);
 	DRIVER_REGISTER_ERROR(SENSOR, sensor, NotEnoughtMemory, "not enough memory", SENSOR_ERR_NOT_ENOUGH_MEMORY);
@@ -71,26 +72,127 @@ DRIVER_REGISTER_BEGIN(SENSOR,sensor,NULL,NULL,NULL);
 	DRIVER_REGISTER_ERROR(SENSOR, sensor, InvalidData, "invalid data", SENSOR_ERR_INVALID_DATA);
 	DRIVER_REGISTER_ERROR(SENSOR, sensor, NoCallbacksAlowed, "callbacks not allowed for this sensor", SENSOR_ERR_CALLBACKS_NOT_ALLOWED);
 	DRIVER_REGISTER_ERROR(SENSOR, sensor, InvalidValue, "invalid value", SENSOR_ERR_INVALID_VALUE);
-DRIVER_REGISTER_END(SENSOR,sensor,NULL,NULL,NULL);
+DRIVER_REGISTER_END(SENSOR,sensor,NULL,_sensor_init,NULL);
 
-static xQueueHandle queue = NULL;
 static TaskHandle_t task = NULL;
 static uint8_t attached = 0;
 static uint8_t counter = 0;
 
+// Instances with callbacks, protected by instances_mtx
+static sensor_instance_t *instances = NULL;
+static struct mtx instances_mtx;
+
+// Instance which callbacks are being called by the sensor task, and if it
+// has been detached meanwhile, protected by instances_mtx
+static sensor_instance_t *busy = NULL;
+static volatile uint8_t busy_detached = 0;
+
 /*
  * Helper functions
  */
 
-static void sensor_task(void *arg) {
-	sensor_deferred_data_t *data;
+static void _sensor_init() {
+	mtx_init(&instances_mtx, NULL, NULL, 0);
+}
+
+// Dequeue the next record of the deferred callback ring. Returns the mask of the
+// properties in the record, or 0 if there are no records.
+static uint32_t sensor_ring_get(sensor_ring_t *ring, sensor_value_t *data) {
+	sensor_ring_entry_t *entry;
+	uint32_t tail = ring->tail;
+	uint32_t head = ring->head;
+	uint32_t mask = 0;
+
+	// Read entries after head
+	__sync_synchronize();
+
+	while (tail != head) {
+		entry = &ring->entry[tail & (SENSOR_RING_SIZE - 1)];
+		tail++;
+
+		data[entry->property].raw.value = entry->value;
+		mask |= (1 << entry->property);
+
+		if (entry->flags & SENSOR_RING_LAST) {
+			// Release entries
+			ring->tail = tail;
+			ring->delivered++;
 
-	data = calloc(1,sizeof(sensor_deferred_data_t));
-	assert(data);
+			return mask;
+		}
+	}
+
+	return 0;
+}
+
+static void sensor_task(void *arg) {
+	struct {
+		sensor_callback_t callback;
+		int callback_id;
+	} callbacks[SENSOR_MAX_CALLBACKS];
+
+	sensor_value_t data[SENSOR_MAX_PROPERTIES];
+	sensor_instance_t *unit, *first;
+	sensor_instance_t *last = NULL;
+	uint32_t mask;
+	int i;
 
     for(;;) {
-        xQueueReceive(queue, data, portMAX_DELAY);
-        data->callback(data->callback_id, data->instance, data->data, data->latch);
+    	ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    	do {
+    		// Get the next record, and the callbacks to call. Callbacks are called without
+    		// holding the lock, because they can detach the sensor.
+    		mask = 0;
+
+    		mtx_lock(&instances_mtx);
+
+    		// Start after the last serviced instance, so an instance that reports
+    		// continuously doesn't starve the others
+    		for(first = instances;first && (first != last);first = first->next);
+    		first = (first && first->next)?first->next:instances;
+
+    		unit = first;
+    		while (unit) {
+    			mask = sensor_ring_get(&unit->ring, data);
+    			if (mask) {
+    				memcpy(callbacks, unit->callbacks, sizeof(callbacks));
+    				break;
+    			}
+
+    			unit = unit->next?unit->next:instances;
+    			if (unit == first) {
+    				unit = NULL;
+    			}
+    		}
+
+    		if (mask) {
+    			busy = unit;
+    			busy_detached = 0;
+    			last = unit;
+    		}
+
+    		mtx_unlock(&instances_mtx);
+
+    		if (mask) {
+    			// Stop when a callback detaches the instance
+    			for(i=0;(i < SENSOR_MAX_CALLBACKS) && !busy_detached;i++) {
+    				if (callbacks[i].callback) {
+    					callbacks[i].callback(callbacks[i].callback_id, unit, data, mask);
+    				}
+    			}
+
+    			// Free the instance, if detached
+    			mtx_lock(&instances_mtx);
+    			if (busy_detached) {
+    				free(unit);
+    				last = NULL;
+    			}
+
+    			busy = NULL;
+    			mtx_unlock(&instances_mtx);
+    		}
+    	} while (mask);
     }
 }
 
@@ -354,6 +456,9 @@ driver_error_t *sensor_setup(const sensor_t *sensor, sensor_setup_t *setup, sens
 	// Create mutex
 	mtx_init(&instance->mtx, NULL, NULL, 0);
 
+	// Init deferred callback ring
+	vPortCPUInitializeMutex(&instance->ring.mux);
+
 	// Store reference to sensor into instance
 	instance->sensor = sensor;
 
@@ -438,14 +543,17 @@ driver_error_t *sensor_setup(const sensor_t *sensor, sensor_setup_t *setup, sens
 }
 
 driver_error_t *sensor_unsetup(sensor_instance_t *unit) {
+	sensor_instance_t *cunit, *prev;
 	driver_error_t *error;
 	int i;
 
+	mtx_lock(&instances_mtx);
 	portDISABLE_INTERRUPTS();
 
 	if (attached == 0) {
 		// No sensors attached, nothing to do
 		portENABLE_INTERRUPTS();
+		mtx_unlock(&instances_mtx);
 		return NULL;
 	}
 
@@ -454,6 +562,7 @@ driver_error_t *sensor_unsetup(sensor_instance_t *unit) {
 		error = unit->sensor->unsetup(unit);
 		if (error) {
 			portENABLE_INTERRUPTS();
+			mtx_unlock(&instances_mtx);
 			return error;
 		}
 	}
@@ -469,24 +578,42 @@ driver_error_t *sensor_unsetup(sensor_instance_t *unit) {
 	    }
 	}
 
-	if (attached == 1) {
-		if (task) {
-			vTaskDelete(task);
-			task = NULL;
-		}
+	// Remove from instances with callbacks
+	prev = NULL;
+	for(cunit = instances;cunit;cunit = cunit->next) {
+		if (cunit == unit) {
+			if (prev) {
+				prev->next = unit->next;
+			} else {
+				instances = unit->next;
+			}
 
-		if (queue) {
-			vQueueDelete(queue);
-			queue = NULL;
+			break;
 		}
+
+		prev = cunit;
+	}
+
+	// Delete task, if not called from a callback
+	if ((attached == 1) && task && (task != xTaskGetCurrentTaskHandle())) {
+		vTaskDelete(task);
+		task = NULL;
 	}
 
 	attached--;
 
 	mtx_destroy(&unit->mtx);
-	free(unit);
+
+	// If the sensor task is calling the instance callbacks, the instance is
+	// freed by the task when they return
+	if ((unit == busy) && task) {
+		busy_detached = 1;
+	} else {
+		free(unit);
+	}
 
 	portENABLE_INTERRUPTS();
+	mtx_unlock(&instances_mtx);
 
 	return NULL;
 }
@@ -646,6 +773,7 @@ driver_error_t *sensor_register_callback(sensor_instance_t *unit, sensor_callbac
 		return driver_error(SENSOR_DRIVER, SENSOR_ERR_CALLBACKS_NOT_ALLOWED, NULL);
 	}
 
+	mtx_lock(&instances_mtx);
 	portDISABLE_INTERRUPTS();
 
 	// Find for a free callback
@@ -659,79 +787,130 @@ driver_error_t *sensor_register_callback(sensor_instance_t *unit, sensor_callbac
 
 	if (i == SENSOR_MAX_CALLBACKS) {
 		portENABLE_INTERRUPTS();
+		mtx_unlock(&instances_mtx);
 		return driver_error(SENSOR_DRIVER, SENSOR_ERR_NO_MORE_CALLBACKS, NULL);
 	}
 
-	// Create queue if needed
-	if (!queue) {
-		queue = xQueueCreate(10, sizeof(sensor_deferred_data_t));
-		if (!queue) {
-			portENABLE_INTERRUPTS();
-			return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_ENOUGH_MEMORY, NULL);
-		}
-	}
-
 	// Create task if needed
 	if (!task) {
 		BaseType_t xReturn;
 
 		xReturn = xTaskCreatePinnedToCore(sensor_task, "sensor", CONFIG_LUA_RTOS_LUA_THREAD_STACK_SIZE, NULL, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY, &task, xPortGetCoreID());
 		if (xReturn != pdPASS) {
+			unit->callbacks[i].callback = NULL;
+			unit->callbacks[i].callback_id = 0;
+
 			portENABLE_INTERRUPTS();
+			mtx_unlock(&instances_mtx);
 			return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_ENOUGH_MEMORY, NULL);
 		}
 	}
 
+	// Add to instances with callbacks, if it's the first callback
+	sensor_instance_t *cunit;
+
+	for(cunit = instances;cunit && (cunit != unit);cunit = cunit->next);
+	if (!cunit) {
+		unit->next = instances;
+		instances = unit;
+	}
+
 	portENABLE_INTERRUPTS();
+	mtx_unlock(&instances_mtx);
 
 	return NULL;
 }
 
 void IRAM_ATTR sensor_queue_callbacks(sensor_instance_t *unit, uint8_t from, uint8_t to) {
-    portBASE_TYPE high_priority_task_awoken = 0;
-	sensor_deferred_data_t *data;
-    portBASE_TYPE yield = 0;
-
-    int i, j;
-
-    data = calloc(1,sizeof(sensor_deferred_data_t));
-    assert(data);
+	sensor_ring_t *ring = &unit->ring;
+	sensor_ring_entry_t *entry = NULL;
+	uint8_t report[SENSOR_MAX_PROPERTIES];
+	uint32_t head;
+	int i, n;
 
+	// Check for callbacks
 	for(i=0;i < SENSOR_MAX_CALLBACKS;i++) {
 		if (unit->callbacks[i].callback) {
-			data->instance = unit;
-			data->callback = unit->callbacks[i].callback;
-			data->callback_id = unit->callbacks[i].callback_id;
+			break;
+		}
+	}
 
-			memcpy(data->data, unit->data, sizeof(sensor_value_t) * SENSOR_MAX_PROPERTIES);
-			memcpy(data->latch, unit->latch, sizeof(sensor_latch_t) * SENSOR_MAX_PROPERTIES);
+	if ((i == SENSOR_MAX_CALLBACKS) || !task) {
+		return;
+	}
 
-			for(j=0; j < SENSOR_MAX_PROPERTIES;j++) {
-				if (data->latch[j].timeout || data->latch[j].repeat || (data->data[j].raw.value != data->latch[j].value.raw.value))  {
-					if (xPortInIsrContext()) {
-						xQueueSendFromISR(queue, data, &high_priority_task_awoken);
-						yield |= high_priority_task_awoken;
-					} else {
-						xQueueSend(queue, data, 0);
-					}
+	// Get the properties to report
+	for(i=0, n=0;i < SENSOR_MAX_PROPERTIES;i++) {
+		if (unit->latch[i].timeout || unit->latch[i].repeat || (unit->data[i].raw.value != unit->latch[i].value.raw.value)) {
+			report[n++] = i;
+		}
+	}
 
-					free(data);
+	if (n == 0) {
+		return;
+	}
 
-				    if (yield == pdTRUE) {
-				        portYIELD_FROM_ISR();
-				    }
+	portENTER_CRITICAL(&ring->mux);
 
-					return;
-				}
-			}
-		}
+	head = ring->head;
+	if (SENSOR_RING_SIZE - (head - ring->tail) < n) {
+		// Not enough room, drop
+		ring->dropped++;
+		portEXIT_CRITICAL(&ring->mux);
+		return;
 	}
 
-	free(data);
+	for(i=0;i < n;i++) {
+		entry = &ring->entry[head++ & (SENSOR_RING_SIZE - 1)];
 
-    if (yield == pdTRUE) {
-        portYIELD_FROM_ISR();
-    }
+		entry->value = unit->data[report[i]].raw.value;
+		entry->property = report[i];
+		entry->flags = 0;
+	}
+
+	entry->flags = SENSOR_RING_LAST;
+
+	// Publish record after it's entries are written
+	__sync_synchronize();
+	ring->head = head;
+
+	portEXIT_CRITICAL(&ring->mux);
+
+	// Wake up sensor task
+	if (xPortInIsrContext()) {
+		BaseType_t high_priority_task_awoken = pdFALSE;
+
+		vTaskNotifyGiveFromISR(task, &high_priority_task_awoken);
+	    if (high_priority_task_awoken == pdTRUE) {
+	        portYIELD_FROM_ISR();
+	    }
+	} else {
+		xTaskNotifyGive(task);
+	}
+}
+
+void sensor_callback_stats(sensor_instance_t *unit, uint32_t *delivered, uint32_t *dropped, uint32_t *pending) {
+	sensor_ring_t *ring = &unit->ring;
+	uint32_t head, tail;
+	int i;
+
+	portENTER_CRITICAL(&ring->mux);
+
+	*delivered = ring->delivered;
+	*dropped = ring->dropped;
+
+	// Count records in ring
+	*pending = 0;
+
+	head = ring->head;
+	for(tail = ring->tail;tail != head;tail++) {
+		i = tail & (SENSOR_RING_SIZE - 1);
+		if (ring->entry[i].flags & SENSOR_RING_LAST) {
+			(*pending)++;
+		}
+	}
+
+	portEXIT_CRITICAL(&ring->mux);
 }
 
 void IRAM_ATTR sensor_init_data(sensor_instance_t *unit) {
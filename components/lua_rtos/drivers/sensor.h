@@ -64,6 +64,10 @@ extern const int sensor_error_map;
 #define SENSOR_MAX_PROPERTIES 16
 #define SENSOR_MAX_CALLBACKS  8
 
+// Number of entries in the deferred callback ring of each sensor instance.
+// Must be a power of 2, and at least SENSOR_MAX_PROPERTIES.
+#define SENSOR_RING_SIZE      32
+
 /*
  * Sensor flags. Each sensor has a definition flag that stores information about
  * how sensor acquires it's information.
@@ -241,8 +245,35 @@ typedef struct {
 
 struct sensor_instance;
 
-// Sensor callback
-typedef void (*sensor_callback_t)(int, struct sensor_instance *, sensor_value_t *, sensor_latch_t *);
+// Sensor callback. Only the properties with it's bit set in the mask argument
+// are valid in the data array.
+typedef void (*sensor_callback_t)(int, struct sensor_instance *, sensor_value_t *, uint32_t);
+
+/*
+ * Deferred callback ring. Each time a sensor must report data to it's callbacks
+ * a record is queued into the ring from the ISR / task that updates the sensor
+ * data, and the sensor task dequeues it later to call the callbacks.
+ *
+ * A record is a sequence of entries, one for each property to report, being
+ * the last one marked with the SENSOR_RING_LAST flag. When there isn't enough
+ * room in the ring for the record it's dropped.
+ */
+#define SENSOR_RING_LAST (1 << 0)
+
+typedef struct {
+	int64_t value;    // Raw property value
+	uint8_t property; // Property index
+	uint8_t flags;    // Entry flags
+} sensor_ring_entry_t;
+
+typedef struct {
+	volatile uint32_t head;      // Next entry to write, only updated by producer
+	volatile uint32_t tail;      // Next entry to read, only updated by consumer
+	volatile uint32_t delivered; // Number of delivered records
+	volatile uint32_t dropped;   // Number of dropped records
+	portMUX_TYPE mux;            // Serializes producers
+	sensor_ring_entry_t entry[SENSOR_RING_SIZE];
+} sensor_ring_t;
 
 // Sensor instance
 typedef struct sensor_instance {
@@ -261,15 +292,10 @@ typedef struct sensor_instance {
 	const sensor_t *sensor;
 	sensor_setup_t setup[SENSOR_MAX_INTERFACES];
 	void *args;
-} sensor_instance_t;
 
-typedef struct {
-	sensor_instance_t *instance;
-	sensor_callback_t callback;
-	sensor_value_t data[SENSOR_MAX_PROPERTIES];
-	sensor_latch_t latch[SENSOR_MAX_PROPERTIES];
-	int callback_id;
-} sensor_deferred_data_t;
+	sensor_ring_t ring;
+	struct sensor_instance *next; // Next instance with callbacks
+} sensor_instance_t;
 
 const sensor_t *get_sensor(const char *id);
 const sensor_data_t *sensor_get_property(const sensor_t *sensor, const char *property);
@@ -281,6 +307,7 @@ driver_error_t *sensor_set(sensor_instance_t *unit, const char *id, sensor_value
 driver_error_t *sensor_get(sensor_instance_t *unit, const char *id, sensor_value_t **value);
 driver_error_t *sensor_register_callback(sensor_instance_t *unit, sensor_callback_t callback, int id, uint8_t deferred);
 void sensor_queue_callbacks(sensor_instance_t *unit, uint8_t from, uint8_t to);
+void sensor_callback_stats(sensor_instance_t *unit, uint32_t *delivered, uint32_t *dropped, uint32_t *pending);
 void sensor_init_data(sensor_instance_t *unit);
 void sensor_update_data(sensor_instance_t *unit, uint8_t from, uint8_t to, sensor_value_t *new_data, uint64_t delay, uint64_t rate, uint8_t ignore, uint64_t ignore_val);
 void IRAM_ATTR sensor_lock(sensor_instance_t *unit);
@@ -54,17 +54,23 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 
 #include "esp_attr.h"
+#include "esp_intr_alloc.h"
 
+#include "soc/soc.h"
 #include "soc/io_mux_reg.h"
 #include "soc/spi_reg.h"
 #include "soc/gpio_sig_map.h"
 #include "soc/gpio_reg.h"
+#include "soc/dport_reg.h"
 
 #include "driver/periph_ctrl.h"
 #include "driver/spi_master.h"
 
+#include "esp_heap_caps.h"
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -80,6 +86,26 @@
 #define PIN_FUNC_SPI 1
 #define SPI_MAX_SIZE (4096 - 4)
 
+// Number of DMA descriptors used in each low-level DMA transfer
+#define SPI_DMA_DESCS 8
+
+// Background stream
+struct spi_stream {
+	int deviceid;
+	uint32_t size;                           // Size of each buffer
+	uint8_t *buffer[SPI_STREAM_BUFFERS];     // Buffers, in DMA capable memory
+	QueueHandle_t free;                      // Free buffers
+	QueueHandle_t pending;                   // Committed buffers, in commit order
+	spi_stream_cb_t cb;                      // Callback that sends a committed buffer
+	void *arg;                               // Callback argument
+	TaskHandle_t task;                       // Stream task
+};
+
+typedef struct {
+	uint8_t *buffer;
+	uint32_t len;
+} spi_stream_item_t;
+
 extern uint32_t _rodata_start;
 extern uint32_t _lit4_end;
 
@@ -771,6 +797,259 @@ void IRAM_ATTR spi_ll_deselect(int deviceid) {
 	spi_unlock(unit);
 }
 
+// Transfer done interrupt, only enabled while a low-level DMA transfer is in progress
+static void IRAM_ATTR spi_ll_dma_isr(void *arg) {
+	int unit = (int)arg;
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+	CLEAR_PERI_REG_MASK(SPI_SLAVE_REG(unit), SPI_TRANS_DONE);
+
+	xSemaphoreGiveFromISR(spi_bus[spi_idx(unit)].ll_dma_done, &xHigherPriorityTaskWoken);
+
+	if (xHigherPriorityTaskWoken) {
+		portYIELD_FROM_ISR();
+	}
+}
+
+/*
+ * Setup the DMA channel of a SPI unit for the Lua RTOS low-level driver. The
+ * channel is the same used by the esp-idf driver for the unit (see spi_setup_bus).
+ */
+static void spi_ll_dma_setup(int unit) {
+	if (spi_bus[spi_idx(unit)].ll_dma) {
+		return;
+	}
+
+	periph_module_enable(PERIPH_SPI_DMA_MODULE);
+	DPORT_SET_PERI_REG_BITS(DPORT_SPI_DMA_CHAN_SEL_REG, 3, unit - 1, ((unit - 1) * 2));
+
+	// If the interrupt can't be allocated, the end of the transfer is polled
+	spi_bus[spi_idx(unit)].ll_dma_done = xSemaphoreCreateBinary();
+	if (spi_bus[spi_idx(unit)].ll_dma_done) {
+		CLEAR_PERI_REG_MASK(SPI_SLAVE_REG(unit), SPI_TRANS_INTEN | SPI_TRANS_DONE);
+
+		if (esp_intr_alloc(ETS_SPI0_INTR_SOURCE + unit, ESP_INTR_FLAG_IRAM, spi_ll_dma_isr, (void *)unit, NULL) != ESP_OK) {
+			vSemaphoreDelete(spi_bus[spi_idx(unit)].ll_dma_done);
+			spi_bus[spi_idx(unit)].ll_dma_done = NULL;
+		}
+	}
+
+	spi_bus[spi_idx(unit)].ll_dma = 1;
+}
+
+void IRAM_ATTR spi_ll_dma_write(int deviceid, uint32_t nbytes, uint8_t *data) {
+	int unit = (deviceid & 0xff00) >> 8;
+	int device = (deviceid & 0x00ff);
+	lldesc_t desc[SPI_DMA_DESCS];
+	SemaphoreHandle_t done;
+	uint32_t len;
+
+	// If the DMA channel is owned by the esp-idf driver, use it
+	if (spi_bus[spi_idx(unit)].device[device].dma || (spi_bus[spi_idx(unit)].setup & SPI_DMA_SETUP)) {
+		spi_master_op(deviceid, 1, nbytes, data, NULL);
+		return;
+	}
+
+	spi_ll_dma_setup(unit);
+
+	done = spi_bus[spi_idx(unit)].ll_dma_done;
+
+	// Nothing is read
+	CLEAR_PERI_REG_MASK(SPI_USER_REG(unit), SPI_USR_MISO);
+
+	while (nbytes > 0) {
+		len = ((nbytes > SPI_DMA_DESCS * SPI_MAX_SIZE)?SPI_DMA_DESCS * SPI_MAX_SIZE:nbytes);
+
+		// Wait for SPI bus ready
+		while (READ_PERI_REG(SPI_CMD_REG(unit))&SPI_USR);
+
+		// Reset DMA
+		SET_PERI_REG_MASK(SPI_DMA_CONF_REG(unit), SPI_OUT_RST | SPI_AHBM_FIFO_RST | SPI_AHBM_RST);
+		CLEAR_PERI_REG_MASK(SPI_DMA_CONF_REG(unit), SPI_OUT_RST | SPI_AHBM_FIFO_RST | SPI_AHBM_RST);
+		SET_PERI_REG_MASK(SPI_DMA_CONF_REG(unit), SPI_OUT_DATA_BURST_EN | SPI_OUTDSCR_BURST_EN);
+
+		// Link descriptors, and start transfer
+		spicommon_setup_dma_desc_links(desc, len, data, false);
+
+		SET_PERI_REG_BITS(SPI_MOSI_DLEN_REG(unit), SPI_USR_MOSI_DBITLEN, (len << 3) - 1, SPI_USR_MOSI_DBITLEN_S);
+		WRITE_PERI_REG(SPI_DMA_OUT_LINK_REG(unit), (((uint32_t)desc) & SPI_OUTLINK_ADDR) | SPI_OUTLINK_START);
+
+		if (done) {
+			xSemaphoreTake(done, 0);
+
+			CLEAR_PERI_REG_MASK(SPI_SLAVE_REG(unit), SPI_TRANS_DONE);
+			SET_PERI_REG_MASK(SPI_SLAVE_REG(unit), SPI_TRANS_INTEN);
+		}
+
+		SET_PERI_REG_MASK(SPI_CMD_REG(unit), SPI_USR);
+
+		// Block until the transfer done interrupt. The timeout only protects
+		// against a lost interrupt.
+		while (READ_PERI_REG(SPI_CMD_REG(unit))&SPI_USR) {
+			if (done) {
+				xSemaphoreTake(done, 1);
+			} else {
+				taskYIELD();
+			}
+		}
+
+		if (done) {
+			CLEAR_PERI_REG_MASK(SPI_SLAVE_REG(unit), SPI_TRANS_INTEN);
+		}
+
+		nbytes = nbytes - len;
+		data = data + len;
+	}
+
+	WRITE_PERI_REG(SPI_DMA_OUT_LINK_REG(unit), 0);
+	SET_PERI_REG_MASK(SPI_USER_REG(unit), SPI_USR_MISO);
+}
+
+static void spi_stream_task(void *arg) {
+	struct spi_stream *stream = (struct spi_stream *)arg;
+	spi_stream_item_t item;
+
+	for(;;) {
+		xQueueReceive(stream->pending, &item, portMAX_DELAY);
+
+		stream->cb(stream->deviceid, item.buffer, item.len, stream->arg);
+
+		xQueueSend(stream->free, &item.buffer, portMAX_DELAY);
+	}
+}
+
+static void spi_stream_free(struct spi_stream *stream) {
+	int i;
+
+	if (stream->task) vTaskDelete(stream->task);
+	if (stream->pending) vQueueDelete(stream->pending);
+	if (stream->free) vQueueDelete(stream->free);
+
+	for(i=0;i < SPI_STREAM_BUFFERS;i++) {
+		if (stream->buffer[i]) heap_caps_free(stream->buffer[i]);
+	}
+
+	free(stream);
+}
+
+int spi_ll_stream_setup(int deviceid, uint32_t size, uint32_t stack, spi_stream_cb_t cb, void *arg) {
+	int unit = (deviceid & 0xff00) >> 8;
+	int device = (deviceid & 0x00ff);
+	struct spi_stream *stream;
+	int i;
+
+	// Remove current stream, if any
+	spi_ll_stream_unsetup(deviceid);
+
+	stream = calloc(1, sizeof(struct spi_stream));
+	if (!stream) {
+		return -1;
+	}
+
+	stream->deviceid = deviceid;
+	stream->size = size;
+	stream->cb = cb;
+	stream->arg = arg;
+
+	stream->free = xQueueCreate(SPI_STREAM_BUFFERS, sizeof(uint8_t *));
+	stream->pending = xQueueCreate(SPI_STREAM_BUFFERS, sizeof(spi_stream_item_t));
+	if (!stream->free || !stream->pending) {
+		spi_stream_free(stream);
+		return -1;
+	}
+
+	for(i=0;i < SPI_STREAM_BUFFERS;i++) {
+		stream->buffer[i] = heap_caps_malloc(size, MALLOC_CAP_DMA);
+		if (!stream->buffer[i]) {
+			spi_stream_free(stream);
+			return -1;
+		}
+
+		xQueueSend(stream->free, &stream->buffer[i], 0);
+	}
+
+	if (xTaskCreatePinnedToCore(spi_stream_task, "spistrm", stack, stream, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY, &stream->task, xPortGetCoreID()) != pdPASS) {
+		stream->task = NULL;
+		spi_stream_free(stream);
+		return -1;
+	}
+
+	spi_bus[spi_idx(unit)].device[device].stream = stream;
+
+	return 0;
+}
+
+void spi_ll_stream_unsetup(int deviceid) {
+	int unit = (deviceid & 0xff00) >> 8;
+	int device = (deviceid & 0x00ff);
+	struct spi_stream *stream = spi_bus[spi_idx(unit)].device[device].stream;
+
+	if (!stream) {
+		return;
+	}
+
+	spi_ll_stream_wait(deviceid);
+
+	spi_bus[spi_idx(unit)].device[device].stream = NULL;
+
+	spi_stream_free(stream);
+}
+
+uint8_t *spi_ll_stream_get(int deviceid, uint32_t *size) {
+	int unit = (deviceid & 0xff00) >> 8;
+	int device = (deviceid & 0x00ff);
+	struct spi_stream *stream = spi_bus[spi_idx(unit)].device[device].stream;
+	uint8_t *buffer;
+
+	if (!stream) {
+		return NULL;
+	}
+
+	xQueueReceive(stream->free, &buffer, portMAX_DELAY);
+	*size = stream->size;
+
+	return buffer;
+}
+
+void spi_ll_stream_commit(int deviceid, uint8_t *buffer, uint32_t len) {
+	int unit = (deviceid & 0xff00) >> 8;
+	int device = (deviceid & 0x00ff);
+	struct spi_stream *stream = spi_bus[spi_idx(unit)].device[device].stream;
+	spi_stream_item_t item;
+
+	if (len == 0) {
+		// Nothing to send, buffer is free again
+		xQueueSend(stream->free, &buffer, portMAX_DELAY);
+		return;
+	}
+
+	item.buffer = buffer;
+	item.len = len;
+
+	xQueueSend(stream->pending, &item, portMAX_DELAY);
+}
+
+void spi_ll_stream_wait(int deviceid) {
+	int unit = (deviceid & 0xff00) >> 8;
+	int device = (deviceid & 0x00ff);
+	struct spi_stream *stream = spi_bus[spi_idx(unit)].device[device].stream;
+	uint8_t *buffer[SPI_STREAM_BUFFERS];
+	int i;
+
+	if (!stream) {
+		return;
+	}
+
+	// All the buffers are free when all the committed buffers are sent
+	for(i=0;i < SPI_STREAM_BUFFERS;i++) {
+		xQueueReceive(stream->free, &buffer[i], portMAX_DELAY);
+	}
+
+	for(i=0;i < SPI_STREAM_BUFFERS;i++) {
+		xQueueSend(stream->free, &buffer[i], 0);
+	}
+}
+
 /*
  * Operation functions
  *
@@ -1322,6 +1601,8 @@ void spi_ll_unsetup(int deviceid) {
 	int unit = (deviceid & 0xff00) >> 8;
 	int device = (deviceid & 0x00ff);
 
+	spi_ll_stream_unsetup(deviceid);
+
 	spi_lock(unit);
 
 	if (spi_bus[spi_idx(unit)].device[device].setup) {
@@ -76,6 +76,18 @@ extern const int spi_error_map;
 #define SPI_FLAG_NO_DMA (1 << 2)
 #define SPI_FLAG_3WIRE  (1 << 3)
 
+// Number of buffers used by a background stream
+#define SPI_STREAM_BUFFERS 2
+
+/*
+ * Callback used by a background stream for send a committed buffer to the device.
+ * It's called from the stream task, and it's responsible for select / deselect
+ * the device.
+ */
+typedef void (*spi_stream_cb_t)(int deviceid, uint8_t *buffer, uint32_t len, void *arg);
+
+struct spi_stream;
+
 typedef struct {
 	uint8_t  setup;
 	int8_t   cs;
@@ -83,6 +95,7 @@ typedef struct {
 	uint8_t  dma;
 	uint32_t regs[14];
 	spi_device_handle_t h;
+	struct spi_stream *stream; // Background stream, if used
 } spi_device_t;
 
 typedef struct {
@@ -96,6 +109,9 @@ typedef struct {
 	int8_t mosi;
 	int8_t clk;
 
+	uint8_t ll_dma;        // DMA channel is setup for the Lua RTOS low-level driver?
+	SemaphoreHandle_t ll_dma_done; // Given when a low-level DMA transfer ends, NULL if polled
+
 	// Spi devices attached to the bus
 	spi_device_t device[SPI_BUS_DEVICES];
 } spi_bus_t;
@@ -267,6 +283,74 @@ void spi_ll_bulk_read32(int deviceid, uint32_t nelements, uint32_t *data);
  */
 int spi_ll_bulk_rw32(int deviceid, uint32_t nelements, uint32_t *data);
 
+/**
+ * @brief Write to the SPI device using DMA. The calling task yields the CPU while
+ *        the transfer is in progress. Device must be selected before. If the DMA
+ *        channel of the bus is used by the esp-idf driver the transfer is done
+ *        by spi_ll_bulk_write. No sanity checks are done (use only in driver develop).
+ *
+ * @param deviceid Device identifier.
+ * @param nbytes Number of bytes to write.
+ * @param data A pointer to the buffer with the data to write. The buffer must be
+ *        in DMA capable memory, and 4-byte aligned.
+ */
+void spi_ll_dma_write(int deviceid, uint32_t nbytes, uint8_t *data);
+
+/**
+ * @brief Setup a background stream for a SPI device. The stream has SPI_STREAM_BUFFERS
+ *        buffers in DMA capable memory: the caller fills a free buffer while the
+ *        stream task sends the committed ones to the device, through a callback.
+ *        No sanity checks are done (use only in driver develop).
+ *
+ * @param deviceid Device identifier.
+ * @param size Size of each buffer, in bytes.
+ * @param stack Stack size of the stream task, in bytes. The callback runs in this task.
+ * @param cb Callback that sends a committed buffer.
+ * @param arg Argument passed to the callback.
+ *
+ * @return -1 if not enough memory, 0 if ok
+ */
+int spi_ll_stream_setup(int deviceid, uint32_t size, uint32_t stack, spi_stream_cb_t cb, void *arg);
+
+/**
+ * @brief Remove the background stream of a SPI device, if any, waiting for the
+ *        committed buffers first. No sanity checks are done (use only in driver develop).
+ *
+ * @param deviceid Device identifier.
+ */
+void spi_ll_stream_unsetup(int deviceid);
+
+/**
+ * @brief Get a free buffer of the background stream of a SPI device, waiting until
+ *        one is available. No sanity checks are done (use only in driver develop).
+ *
+ * @param deviceid Device identifier.
+ * @param size A pointer to a variable where the buffer size is stored.
+ *
+ * @return A pointer to the buffer, or NULL if the device has not a stream.
+ */
+uint8_t *spi_ll_stream_get(int deviceid, uint32_t *size);
+
+/**
+ * @brief Commit a buffer obtained with spi_ll_stream_get, for be sent in background.
+ *        Buffers are sent in commit order. No sanity checks are done (use only in
+ *        driver develop).
+ *
+ * @param deviceid Device identifier.
+ * @param buffer Buffer to commit.
+ * @param len Number of bytes used in the buffer.
+ */
+void spi_ll_stream_commit(int deviceid, uint8_t *buffer, uint32_t len);
+
+/**
+ * @brief Wait until all committed buffers of the background stream of a SPI device
+ *        are sent. The caller must not hold a buffer obtained with spi_ll_stream_get.
+ *        No sanity checks are done (use only in driver develop).
+ *
+ * @param deviceid Device identifier.
+ */
+void spi_ll_stream_wait(int deviceid);
+
 /**
  * @brief Change the SPI pin map. Pin map is hard coded in Kconfig, but it can be
  *        change in development environments. This function is thread safe.
@@ -55,6 +55,7 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/task.h"
 #include "freertos/timers.h"
 #include "freertos/xtensa_api.h"
 
@@ -69,8 +70,10 @@
 #include "driver/gpio.h"
 
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <signal.h>
 
 #include <sys/macros.h>
@@ -98,6 +101,9 @@ DRIVER_REGISTER_BEGIN(UART,uart,uart_locks,NULL,uart_lock_resources);
 	DRIVER_REGISTER_ERROR(UART, uart, NotSetup, "is not setup", UART_ERR_IS_NOT_SETUP);
 	DRIVER_REGISTER_ERROR(UART, uart, PinNowAllowed, "pin not allowed", UART_ERR_PIN_NOT_ALLOWED);
 	DRIVER_REGISTER_ERROR(UART, uart, CannotChangePinMap, "cannot change pin map once the UART unit has an attached device", UART_ERR_CANNOT_CHANGE_PINMAP);
+	DRIVER_REGISTER_ERROR(UART, uart, InvalidFraming, "invalid framing", UART_ERR_INVALID_FRAMING);
+	DRIVER_REGISTER_ERROR(UART, uart, FramingNotEnabled, "framing is not enabled", UART_ERR_FRAMING_NOT_ENABLED);
+	DRIVER_REGISTER_ERROR(UART, uart, FramingEnabled, "framing is enabled", UART_ERR_FRAMING_ENABLED);
 DRIVER_REGISTER_END(UART,uart,uart_locks,NULL,uart_lock_resources);
 
 // Flags for determine some UART states
@@ -105,6 +111,27 @@ DRIVER_REGISTER_END(UART,uart,uart_locks,NULL,uart_lock_resources);
 #define UART_FLAG_IRQ_INIT	(1 << 1)
 
 #define ETS_UART_INUM  5
+
+// Number of frames that can be queued when framing is enabled without callback
+#define UART_FRAME_QUEUE_SIZE 8
+
+// Framing engine
+typedef struct uart_framer {
+	int8_t unit;
+	uart_framing_t cfg;
+	uart_frame_callback_t callback;
+	int callback_id;
+	QueueHandle_t q;          // Complete frames, if there is not callback
+	TaskHandle_t task;
+	volatile uint8_t stop;    // Set to stop the framing task
+	uint8_t detached;         // Stopped from the framing task, that must free resources
+	SemaphoreHandle_t done;   // Given by the framing task when stopped
+	uint16_t users;           // Threads in uart_frame_receive, protected by framer_mux
+	uint8_t overflow;         // Frame too long, discard until frame end
+	uint16_t len;             // Length of the frame being assembled
+	uint16_t need;            // Frame length, if known
+	uint8_t buf[];            // Frame being assembled
+} uart_framer_t;
 #define UART_INTR_SOURCE(u) ((u==0)?ETS_UART0_INTR_SOURCE:( (u==1)?ETS_UART1_INTR_SOURCE:((u==2)?ETS_UART2_INTR_SOURCE:0)))
 
 // UART names
@@ -132,6 +159,9 @@ struct uart uart[NUART] = {
  */
 static xQueueHandle signal_q = NULL;
 
+// Protects the framer of each unit while uart_frame_receive gets it
+static portMUX_TYPE framer_mux = portMUX_INITIALIZER_UNLOCKED;
+
 static uint8_t console_raw = 0;
 
 typedef struct {
@@ -302,69 +332,108 @@ void IRAM_ATTR uart_ll_set_raw(uint8_t raw) {
 	console_raw = raw;
 }
 
-void IRAM_ATTR uart_rx_intr_handler(void *args) {
-    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-    uint32_t uart_intr_status = 0;
+// Drain the RX FIFO into the RX ring. The ring head is published once, when the
+// FIFO is empty, and waiting tasks are woken up once.
+static void IRAM_ATTR uart_rx_drain(int unit, BaseType_t *xHigherPriorityTaskWoken) {
+	struct uart *u = &uart[unit];
     console_deferred_data data;
 
+	uint32_t head = u->rx_head;
+	uint32_t tail = u->rx_tail;
+	uint32_t cnt, received = 0;
 	uint8_t byte, status;
 	int signal = 0;
-	int unit = (int)args;
+	int queue;
 
-	uart_intr_status = READ_PERI_REG(UART_INT_ST_REG(unit));
+	// For units other than the console, bytes are queued or not depending only on
+	// the system status, so check it once
+	queue = status_get(STATUS_LUA_RUNNING) || console_raw;
 
-	while (uart_intr_status != 0x0) {
-		if (UART_FRM_ERR_INT_ST == (uart_intr_status & UART_FRM_ERR_INT_ST)) {
-			WRITE_PERI_REG(UART_INT_CLR_REG(unit), UART_FRM_ERR_INT_CLR);
-		} else if (UART_RXFIFO_FULL_INT_ST == (uart_intr_status & UART_RXFIFO_FULL_INT_ST)) {
-			WRITE_PERI_REG(UART_INT_CLR_REG(unit), UART_RXFIFO_FULL_INT_CLR);
+	while ((cnt = ((READ_PERI_REG(UART_STATUS_REG(unit)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT))) {
+		while (cnt--) {
+			byte = READ_PERI_REG(UART_FIFO_REG(unit)) & 0xFF;
 
-			while ((READ_PERI_REG(UART_STATUS_REG(unit)) >> UART_RXFIFO_CNT_S)&UART_RXFIFO_CNT) {
-				byte = READ_PERI_REG(UART_FIFO_REG(unit)) & 0xFF;
-				if (queue_byte(unit, byte, &status, &signal)) {
-					// Put byte to UART queue
-					xQueueSendFromISR(uart[unit].q, &byte, &xHigherPriorityTaskWoken);
-				} else {
+			if (unit == CONSOLE_UART) {
+				if (!queue_byte(unit, byte, &status, &signal)) {
 					if (signal) {
 						data.type = 0;
 						data.data = signal;
 
-						xQueueSendFromISR(signal_q, &data, &xHigherPriorityTaskWoken);
+						xQueueSendFromISR(signal_q, &data, xHigherPriorityTaskWoken);
 					}
 
 					if (status) {
 						data.type = 1;
 						data.data = status;
 
-						xQueueSendFromISR(signal_q, &data, &xHigherPriorityTaskWoken);
+						xQueueSendFromISR(signal_q, &data, xHigherPriorityTaskWoken);
 					}
+
+					continue;
 				}
+			} else if (!queue) {
+				continue;
 			}
-		} else if (UART_RXFIFO_TOUT_INT_ST == (uart_intr_status & UART_RXFIFO_TOUT_INT_ST)) {
-			WRITE_PERI_REG(UART_INT_CLR_REG(unit), UART_RXFIFO_TOUT_INT_CLR);
-
-			while ((READ_PERI_REG(UART_STATUS_REG(unit)) >> UART_RXFIFO_CNT_S)&UART_RXFIFO_CNT) {
-				byte = READ_PERI_REG(UART_FIFO_REG(unit)) & 0xFF;
-				if (queue_byte(unit, byte, &status, &signal)) {
-					// Put byte to UART queue
-					xQueueSendFromISR(uart[unit].q, &byte, &xHigherPriorityTaskWoken);
-				} else {
-					if (signal) {
-						data.type = 0;
-						data.data = signal;
 
-						xQueueSendFromISR(signal_q, &data, &xHigherPriorityTaskWoken);
-					}
+			if (!u->rx_buf) {
+				u->stats.overruns++;
+				continue;
+			}
 
-					if (status) {
-						data.type = 1;
-						data.data = status;
+			// If ring seems to be full, get the tail again, may be some bytes
+			// were read since we started
+			if ((head - tail) > u->rx_mask) {
+				tail = u->rx_tail;
+			}
 
-						xQueueSendFromISR(signal_q, &data, &xHigherPriorityTaskWoken);
-					}
-				}
+			if ((head - tail) > u->rx_mask) {
+				u->stats.overruns++;
+			} else {
+				u->rx_buf[head++ & u->rx_mask] = byte;
+				received++;
 			}
 		}
+	}
+
+	if (received) {
+		u->stats.received += received;
+
+		// Publish bytes
+		__sync_synchronize();
+		u->rx_head = head;
+
+		xSemaphoreGiveFromISR(u->rx_sem, xHigherPriorityTaskWoken);
+	}
+}
+
+void IRAM_ATTR uart_rx_intr_handler(void *args) {
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    uint32_t uart_intr_status = 0;
+
+	int unit = (int)args;
+
+	uart_intr_status = READ_PERI_REG(UART_INT_ST_REG(unit));
+
+	while (uart_intr_status != 0x0) {
+		if (UART_FRM_ERR_INT_ST == (uart_intr_status & UART_FRM_ERR_INT_ST)) {
+			WRITE_PERI_REG(UART_INT_CLR_REG(unit), UART_FRM_ERR_INT_CLR);
+			uart[unit].stats.frame_errors++;
+		} else if (UART_RXFIFO_OVF_INT_ST == (uart_intr_status & UART_RXFIFO_OVF_INT_ST)) {
+			WRITE_PERI_REG(UART_INT_CLR_REG(unit), UART_RXFIFO_OVF_INT_CLR);
+			uart[unit].stats.fifo_overflows++;
+
+			uart_rx_drain(unit, &xHigherPriorityTaskWoken);
+		} else if (UART_RXFIFO_FULL_INT_ST == (uart_intr_status & UART_RXFIFO_FULL_INT_ST)) {
+			WRITE_PERI_REG(UART_INT_CLR_REG(unit), UART_RXFIFO_FULL_INT_CLR);
+
+			uart_rx_drain(unit, &xHigherPriorityTaskWoken);
+		} else if (UART_RXFIFO_TOUT_INT_ST == (uart_intr_status & UART_RXFIFO_TOUT_INT_ST)) {
+			WRITE_PERI_REG(UART_INT_CLR_REG(unit), UART_RXFIFO_TOUT_INT_CLR);
+
+			uart_rx_drain(unit, &xHigherPriorityTaskWoken);
+		} else {
+			WRITE_PERI_REG(UART_INT_CLR_REG(unit), uart_intr_status);
+		}
 
 		uart_intr_status = READ_PERI_REG(UART_INT_ST_REG(unit));
 	}
@@ -495,17 +564,45 @@ driver_error_t *uart_init(int8_t unit, uint32_t brg, uint8_t databits, uint8_t p
     	case 2: periph_module_enable(PERIPH_UART2_MODULE); break;
     }
 
-    // If the requested queue size is greater than current queue size,
-	// delete it and create a new one
+    // Create the RX semaphore, if needed
+    if (!uart[unit].rx_sem) {
+    	uart[unit].rx_sem = xSemaphoreCreateBinary();
+    	if (!uart[unit].rx_sem) {
+			return driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
+    	}
+    }
+
+    // If the requested queue size is greater than current RX ring size,
+	// free it and create a new one. Ring size is rounded to a power of 2.
     if (qs > uart[unit].qs) {
-		if (uart[unit].q) {
-			vQueueDelete(uart[unit].q);
+    	uint32_t size = 1;
+    	uint8_t *buf, *old;
+
+    	while (size < qs) {
+    		size <<= 1;
+    	}
+
+		buf = malloc(size);
+		if (!buf) {
+			return driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
 		}
 
-		uart[unit].q  = xQueueCreate(qs, sizeof(uint8_t));
-		if (!uart[unit].q) {
-			driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
+		portDISABLE_INTERRUPTS();
+		old = uart[unit].rx_buf;
+
+		uart[unit].rx_buf  = buf;
+		uart[unit].rx_mask = size - 1;
+		uart[unit].rx_head = 0;
+		uart[unit].rx_tail = 0;
+		portENABLE_INTERRUPTS();
+
+		if (old) {
+			free(old);
 		}
+
+		qs = size;
+	} else {
+		qs = uart[unit].qs;
 	}
 
     // Init mutex, if needed
@@ -565,7 +662,7 @@ driver_error_t *uart_setup_interrupts(int8_t unit) {
     }
 
     uint32_t reg_val = 0;
-	uint32_t mask = UART_RXFIFO_TOUT_INT_ENA_M | UART_FRM_ERR_INT_ENA_M | UART_RXFIFO_FULL_INT_ENA_M;
+	uint32_t mask = UART_RXFIFO_TOUT_INT_ENA_M | UART_FRM_ERR_INT_ENA_M | UART_RXFIFO_FULL_INT_ENA_M | UART_RXFIFO_OVF_INT_ENA_M;
 
 	esp_intr_alloc(UART_INTR_SOURCE(unit), ESP_INTR_FLAG_IRAM, uart_rx_intr_handler, (void *)((uint32_t)unit), NULL);
 
@@ -609,23 +706,111 @@ void IRAM_ATTR uart_writes(int8_t unit, char *s) {
    }
 }
 
-// Reads a byte from uart
-uint8_t IRAM_ATTR uart_read(int8_t unit, char *c, uint32_t timeout) {
+// Waits until there are new bytes in the RX ring, or the timeout expires. Timeout
+// is in ticks, and is updated with the remaining time. Returns 0 on timeout.
+static int uart_rx_wait(int8_t unit, TickType_t *timeout) {
+	TickType_t start, elapsed;
+
+	if (*timeout == 0) {
+		return 0;
+	}
+
+	start = xTaskGetTickCount();
+
+	if (xSemaphoreTake(uart[unit].rx_sem, *timeout) != pdTRUE) {
+		*timeout = 0;
+		return 0;
+	}
+
+	if (*timeout != portMAX_DELAY) {
+		elapsed = xTaskGetTickCount() - start;
+		*timeout = (elapsed >= *timeout)?0:(*timeout - elapsed);
+	}
+
+	return 1;
+}
+
+static TickType_t uart_timeout_ticks(uint32_t timeout) {
     if (timeout != portMAX_DELAY) {
-        timeout = timeout / portTICK_PERIOD_MS;
-    }
-	
-    if (xQueueReceive(uart[unit].q, c, (TickType_t)(timeout)) == pdTRUE) {
-        return 1;
-    } else {
-        return 0;
+        return timeout / portTICK_PERIOD_MS;
     }
+
+    return portMAX_DELAY;
+}
+
+// Gets up to len bytes from the RX ring. If all is 1 waits until len bytes are
+// received, if not only waits if the ring is empty. Timeout is in ticks, and is
+// updated with the remaining time. Returns the number of bytes read.
+static int uart_rx_get(int8_t unit, char *buff, int len, uint8_t all, TickType_t *ticks) {
+	struct uart *u = &uart[unit];
+	uint32_t head, tail, avail, chunk;
+	int n = 0;
+
+	while (n < len) {
+		head = u->rx_head;
+		tail = u->rx_tail;
+
+		__sync_synchronize();
+
+		avail = head - tail;
+		if (avail > 0) {
+			if (avail > len - n) {
+				avail = len - n;
+			}
+
+			// Copy in at most two spans, before and after the ring wrap
+			while (avail > 0) {
+				chunk = u->rx_mask + 1 - (tail & u->rx_mask);
+				if (chunk > avail) {
+					chunk = avail;
+				}
+
+				memcpy(buff + n, u->rx_buf + (tail & u->rx_mask), chunk);
+
+				n += chunk;
+				tail += chunk;
+				avail -= chunk;
+			}
+
+			u->rx_tail = tail;
+
+			if (!all) {
+				break;
+			}
+		} else if (!uart_rx_wait(unit, ticks)) {
+			break;
+		}
+	}
+
+	return n;
+}
+
+// Reads up to len bytes from the UART, waiting until len bytes are received or
+// the timeout (in milliseconds) expires. Returns the number of bytes read, or -1
+// if framing is enabled, because the received bytes belong to the framing task.
+int uart_read_bytes(int8_t unit, char *buff, int len, uint32_t timeout) {
+	TickType_t ticks = uart_timeout_ticks(timeout);
+
+	if (uart[unit].framer) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	return uart_rx_get(unit, buff, len, 1, &ticks);
+}
+
+// Returns the number of bytes available in the RX ring, without waiting
+int uart_rx_available(int8_t unit) {
+	return (int)(uart[unit].rx_head - uart[unit].rx_tail);
+}
+
+// Reads a byte from uart
+uint8_t IRAM_ATTR uart_read(int8_t unit, char *c, uint32_t timeout) {
+	return (uart_read_bytes(unit, c, 1, timeout) == 1);
 }
 
 // Consume all received bytes, and do not nothing with them
 driver_error_t *uart_consume(int8_t unit) {
-    char tmp;
-
 	// Sanity checks
 	if ((unit > CPU_LAST_UART) || (unit < CPU_FIRST_UART)) {
 		return driver_error(UART_DRIVER, UART_ERR_INVALID_UNIT, NULL);
@@ -635,47 +820,509 @@ driver_error_t *uart_consume(int8_t unit) {
 		return driver_error(UART_DRIVER, UART_ERR_IS_NOT_SETUP, NULL);
 	}
 
-    while(uart_read(unit,&tmp,1));
+	if (uart[unit].framer) {
+		return driver_error(UART_DRIVER, UART_ERR_FRAMING_ENABLED, NULL);
+	}
+
+	uart[unit].rx_tail = uart[unit].rx_head;
 
 	return NULL;
 } 
 
+// Reads a line from the UART, ended by the LF character, or by the CR character
+// if crlf is 0. If crlf is 1, CR characters are discarded. The line terminator is
+// not stored, and the line is truncated to size - 1 characters. Returns the line
+// length, or -1 if the timeout (in milliseconds) expires without receiving data,
+// or if framing is enabled.
+int uart_readline(int8_t unit, char *buff, int size, uint8_t crlf, uint32_t timeout) {
+	struct uart *u = &uart[unit];
+	TickType_t ticks = uart_timeout_ticks(timeout);
+	uint32_t head, tail;
+	int received = 0;
+	int n = 0;
+	char c;
+
+	if (u->framer) {
+		buff[0] = 0;
+		return -1;
+	}
+
+	for(;;) {
+		head = u->rx_head;
+		tail = u->rx_tail;
+
+		__sync_synchronize();
+
+		// Scan the received span for the line terminator
+		while (tail != head) {
+			c = u->rx_buf[tail++ & u->rx_mask];
+			received = 1;
+
+			if ((c == '\0') || (c == '\n') || ((c == '\r') && !crlf)) {
+				u->rx_tail = tail;
+				buff[n] = 0;
+
+				return n;
+			}
+
+			if ((c != '\r') && (n < size - 1)) {
+				buff[n++] = c;
+			}
+		}
+
+		u->rx_tail = tail;
+
+		if (!uart_rx_wait(unit, &ticks)) {
+			buff[n] = 0;
+
+			return received?n:-1;
+		}
+	}
+}
+
 // Reads a string from the UART, ended by the CR + LF character
 uint8_t uart_reads(int8_t unit, char *buff, uint8_t crlf, uint32_t timeout) {
-    char c;
-    int n = 0;
-
-    for (;;) {
-        if (uart_read(unit, &c, timeout)) {
-            if (c == '\0') {
-            	*buff = 0;
-                return 1;
-            } else if (c == '\n') {
-            	n++;
-                *buff = 0;
-                return 1;
-            } else {
-                if ((c == '\r') && !crlf) {
-                	n++;
-                    *buff = 0;
-                    return 1;
-                } else {
-                    if (c != '\r') {
-                    	n++;
-                        *buff++ = c;
-                    }
-                }
-            }
-        } else {
-        	*buff = 0;
-            return (n > 0);
-        }
-    }
+	return (uart_readline(unit, buff, INT_MAX, crlf, timeout) >= 0);
+}
+
+/*
+ * Framing engine
+ */
+
+// Deliver the assembled frame, and start a new one
+static void uart_framer_deliver(uart_framer_t *f) {
+	uart_frame_t *frame;
+
+	frame = malloc(sizeof(uart_frame_t) + f->len);
+	if (!frame) {
+		uart[f->unit].stats.frame_drops++;
+		f->len = 0;
+		return;
+	}
+
+	frame->len = f->len;
+	memcpy(frame->data, f->buf, f->len);
 
-    return 0;
+	f->len = 0;
+	f->need = 0;
+
+	uart[f->unit].stats.frames++;
+
+	if (f->callback) {
+		f->callback(f->callback_id, f->unit, frame);
+		free(frame);
+	} else if (xQueueSend(f->q, &frame, 0) != pdTRUE) {
+		uart[f->unit].stats.frame_drops++;
+		free(frame);
+	}
 }
 
-// Read from the UART and waits for a response
+// Discard the frame being assembled
+static void uart_framer_discard(uart_framer_t *f) {
+	if (f->len > 0) {
+		uart[f->unit].stats.frame_drops++;
+	}
+
+	f->len = 0;
+	f->need = 0;
+}
+
+// Append bytes to the frame being assembled
+static void uart_framer_append(uart_framer_t *f, const uint8_t *data, int len) {
+	if (f->overflow) {
+		return;
+	}
+
+	if (f->len + len > f->cfg.max) {
+		// Too long
+		uart[f->unit].stats.frame_drops++;
+		f->len = 0;
+		f->overflow = 1;
+		return;
+	}
+
+	memcpy(f->buf + f->len, data, len);
+	f->len += len;
+}
+
+// Process received bytes
+static void uart_framer_feed(uart_framer_t *f, const uint8_t *data, int n) {
+	const uint8_t *p;
+	int chunk, hdr;
+
+	while ((n > 0) && !f->stop) {
+		// Synchronize with the start of frame
+		if ((f->len == 0) && !f->overflow && (f->cfg.start >= 0)) {
+			p = memchr(data, f->cfg.start, n);
+			if (!p) {
+				return;
+			}
+
+			n -= p - data;
+			data = p;
+		}
+
+		switch (f->cfg.mode) {
+			case UART_FRAME_DELIMITER:
+				p = memchr(data, f->cfg.delimiter, n);
+				chunk = p?(p - data):n;
+
+				uart_framer_append(f, data, chunk);
+
+				if (p) {
+					if (f->overflow) {
+						f->overflow = 0;
+					} else {
+						uart_framer_deliver(f);
+					}
+
+					// Skip delimiter
+					chunk++;
+				}
+				break;
+
+			case UART_FRAME_FIXED:
+				chunk = f->cfg.length - f->len;
+				if (chunk > n) {
+					chunk = n;
+				}
+
+				uart_framer_append(f, data, chunk);
+
+				if (f->len == f->cfg.length) {
+					uart_framer_deliver(f);
+				}
+				break;
+
+			case UART_FRAME_LENGTH:
+				hdr = f->cfg.offset + f->cfg.size;
+
+				if (f->len < hdr) {
+					// Get header
+					chunk = hdr - f->len;
+				} else {
+					chunk = f->need - f->len;
+				}
+
+				if (chunk > n) {
+					chunk = n;
+				}
+
+				uart_framer_append(f, data, chunk);
+
+				if ((f->need == 0) && (f->len == hdr)) {
+					// Header complete, get frame length
+					int len = f->buf[f->cfg.offset];
+					if (f->cfg.size == 2) {
+						len = (len << 8) | f->buf[f->cfg.offset + 1];
+					}
+
+					len += f->cfg.adjust;
+					if ((len < hdr) || (len > f->cfg.max)) {
+						// Invalid length, resynchronize
+						uart_framer_discard(f);
+						break;
+					}
+
+					f->need = len;
+				}
+
+				if ((f->need > 0) && (f->len == f->need)) {
+					uart_framer_deliver(f);
+				}
+				break;
+
+			case UART_FRAME_IDLE:
+				chunk = f->cfg.max - f->len;
+				if (chunk > n) {
+					chunk = n;
+				}
+
+				uart_framer_append(f, data, chunk);
+
+				if (f->len == f->cfg.max) {
+					uart_framer_deliver(f);
+				}
+				break;
+
+			default:
+				return;
+		}
+
+		data += chunk;
+		n -= chunk;
+	}
+}
+
+static void uart_framer_task(void *arg) {
+	uart_framer_t *f = (uart_framer_t *)arg;
+	uart_frame_t *frame;
+	TickType_t ticks, idle;
+	uint8_t chunk[64];
+	int n;
+
+	idle = f->cfg.idle?(f->cfg.idle / portTICK_PERIOD_MS):portMAX_DELAY;
+	if (idle == 0) {
+		idle = 1;
+	}
+
+	for(;;) {
+		// Wait for data, up to the idle time if a frame is being assembled
+		ticks = ((f->len > 0) || f->overflow)?idle:portMAX_DELAY;
+		while (!f->stop && (uart[f->unit].rx_head == uart[f->unit].rx_tail)) {
+			if (!uart_rx_wait(f->unit, &ticks)) {
+				break;
+			}
+		}
+
+		if (f->stop) {
+			break;
+		}
+
+		if (uart[f->unit].rx_head == uart[f->unit].rx_tail) {
+			// Idle time expired
+			if ((f->cfg.mode == UART_FRAME_IDLE) && (f->len > 0)) {
+				uart_framer_deliver(f);
+			} else {
+				uart_framer_discard(f);
+			}
+
+			f->overflow = 0;
+			continue;
+		}
+
+		// Get all received bytes
+		ticks = 0;
+		while (!f->stop && ((n = uart_rx_get(f->unit, (char *)chunk, sizeof(chunk), 0, &ticks)) > 0)) {
+			uart_framer_feed(f, chunk, n);
+		}
+	}
+
+	// Free queued frames
+	if (f->q) {
+		while (xQueueReceive(f->q, &frame, 0) == pdTRUE) {
+			free(frame);
+		}
+	}
+
+	if (f->detached) {
+		vSemaphoreDelete(f->done);
+		if (f->q) {
+			vQueueDelete(f->q);
+		}
+
+		free(f);
+	} else {
+		xSemaphoreGive(f->done);
+	}
+
+	vTaskDelete(NULL);
+}
+
+// Stop the framing engine of an unit
+static void uart_framer_stop(int8_t unit) {
+	uart_framer_t *f;
+	uart_frame_t *none = NULL;
+	uint16_t users;
+
+	portENTER_CRITICAL(&framer_mux);
+	f = uart[unit].framer;
+	uart[unit].framer = NULL;
+	portEXIT_CRITICAL(&framer_mux);
+
+	if (!f) {
+		return;
+	}
+
+	f->stop = 1;
+	xSemaphoreGive(uart[unit].rx_sem);
+
+	if (xTaskGetCurrentTaskHandle() == f->task) {
+		// Called from a callback, the framing task stops when the
+		// callback returns, and frees it's resources
+		f->detached = 1;
+		return;
+	}
+
+	xSemaphoreTake(f->done, portMAX_DELAY);
+
+	// Wake up the threads waiting for a frame, and wait for them to leave
+	// before freeing the queue
+	if (f->q) {
+		for(;;) {
+			portENTER_CRITICAL(&framer_mux);
+			users = f->users;
+			portEXIT_CRITICAL(&framer_mux);
+
+			if (users == 0) {
+				break;
+			}
+
+			xQueueSend(f->q, &none, 0);
+			vTaskDelay(1);
+		}
+	}
+
+	vSemaphoreDelete(f->done);
+	if (f->q) {
+		vQueueDelete(f->q);
+	}
+
+	free(f);
+}
+
+// Set the framing mode of an unit. Complete frames are delivered to the callback,
+// called from the framing task, or queued for uart_frame_receive if callback is NULL.
+driver_error_t *uart_framing(int8_t unit, uart_framing_t *framing, uart_frame_callback_t callback, int callback_id) {
+	uart_framer_t *f;
+
+	// Sanity checks
+	if ((unit > CPU_LAST_UART) || (unit < CPU_FIRST_UART)) {
+		return driver_error(UART_DRIVER, UART_ERR_INVALID_UNIT, NULL);
+	}
+
+	if (!((uart[unit].flags & UART_FLAG_INIT) && (uart[unit].flags & UART_FLAG_IRQ_INIT))) {
+		return driver_error(UART_DRIVER, UART_ERR_IS_NOT_SETUP, NULL);
+	}
+
+	switch (framing->mode) {
+		case UART_FRAME_NONE:
+			break;
+
+		case UART_FRAME_DELIMITER:
+		case UART_FRAME_IDLE:
+			if (framing->max == 0) {
+				return driver_error(UART_DRIVER, UART_ERR_INVALID_FRAMING, "max length must be greater than 0");
+			}
+
+			if ((framing->mode == UART_FRAME_IDLE) && (framing->idle == 0)) {
+				return driver_error(UART_DRIVER, UART_ERR_INVALID_FRAMING, "idle time must be greater than 0");
+			}
+			break;
+
+		case UART_FRAME_FIXED:
+			if (framing->length == 0) {
+				return driver_error(UART_DRIVER, UART_ERR_INVALID_FRAMING, "length must be greater than 0");
+			}
+
+			framing->max = framing->length;
+			break;
+
+		case UART_FRAME_LENGTH:
+			if ((framing->size != 1) && (framing->size != 2)) {
+				return driver_error(UART_DRIVER, UART_ERR_INVALID_FRAMING, "length field size must be 1 or 2");
+			}
+
+			if (framing->max < framing->offset + framing->size) {
+				return driver_error(UART_DRIVER, UART_ERR_INVALID_FRAMING, "max length is lower than the header length");
+			}
+			break;
+
+		default:
+			return driver_error(UART_DRIVER, UART_ERR_INVALID_FRAMING, "invalid mode");
+	}
+
+	// Stop current framing, if any
+	uart_framer_stop(unit);
+
+	if (framing->mode == UART_FRAME_NONE) {
+		return NULL;
+	}
+
+	// Create the framing engine
+	f = calloc(1, sizeof(uart_framer_t) + framing->max);
+	if (!f) {
+		return driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	f->unit = unit;
+	f->cfg = *framing;
+	f->callback = callback;
+	f->callback_id = callback_id;
+
+	f->done = xSemaphoreCreateBinary();
+	if (!f->done) {
+		free(f);
+		return driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	if (!callback) {
+		f->q = xQueueCreate(UART_FRAME_QUEUE_SIZE, sizeof(uart_frame_t *));
+		if (!f->q) {
+			vSemaphoreDelete(f->done);
+			free(f);
+			return driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
+		}
+	}
+
+	portENTER_CRITICAL(&framer_mux);
+	uart[unit].framer = f;
+	portEXIT_CRITICAL(&framer_mux);
+
+	if (xTaskCreatePinnedToCore(uart_framer_task, "uartfrm", CONFIG_LUA_RTOS_LUA_THREAD_STACK_SIZE, f, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY, &f->task, xPortGetCoreID()) != pdPASS) {
+		portENTER_CRITICAL(&framer_mux);
+		uart[unit].framer = NULL;
+		portEXIT_CRITICAL(&framer_mux);
+
+		if (f->q) {
+			vQueueDelete(f->q);
+		}
+
+		vSemaphoreDelete(f->done);
+		free(f);
+		return driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	return NULL;
+}
+
+// Waits for a complete frame, up to timeout msecs. The frame must be freed by the
+// caller. Only available if framing is enabled without callback.
+driver_error_t *uart_frame_receive(int8_t unit, uart_frame_t **frame, uint32_t timeout) {
+	uart_framer_t *f;
+	uint8_t stopped;
+
+	// Sanity checks
+	if ((unit > CPU_LAST_UART) || (unit < CPU_FIRST_UART)) {
+		return driver_error(UART_DRIVER, UART_ERR_INVALID_UNIT, NULL);
+	}
+
+	// Get the framer, and keep it while waiting
+	portENTER_CRITICAL(&framer_mux);
+	f = uart[unit].framer;
+	if (f && f->q) {
+		f->users++;
+	} else {
+		f = NULL;
+	}
+	portEXIT_CRITICAL(&framer_mux);
+
+	if (!f) {
+		return driver_error(UART_DRIVER, UART_ERR_FRAMING_NOT_ENABLED, NULL);
+	}
+
+	*frame = NULL;
+
+	if (xQueueReceive(f->q, frame, uart_timeout_ticks(timeout)) != pdTRUE) {
+		*frame = NULL;
+	}
+
+	// The framer can be freed as soon as it's released
+	portENTER_CRITICAL(&framer_mux);
+	stopped = f->stop;
+	f->users--;
+	portEXIT_CRITICAL(&framer_mux);
+
+	// Framing stopped while waiting
+	if (!*frame && stopped) {
+		return driver_error(UART_DRIVER, UART_ERR_FRAMING_NOT_ENABLED, NULL);
+	}
+
+	return NULL;
+}
+
+// Read from the UART and waits for a response. Responses are read as lines, so
+// this doesn't work if framing is enabled.
 static uint8_t _uart_wait_response(int8_t unit, char *command, uint8_t echo, char *ret, uint8_t substring, uint32_t timeout, int nargs, va_list pargs) {
     int ok = 1;
 
@@ -773,9 +1420,22 @@ const char *uart_name(int8_t unit) {
     return names[unit - 1];
 }
 
-// Gets the UART queue
-QueueHandle_t *uart_get_queue(int8_t unit) {
-    return  uart[unit].q;
+// Gets the UART statistics
+driver_error_t *uart_get_stats(int8_t unit, uart_stats_t *stats) {
+	// Sanity checks
+	if ((unit > CPU_LAST_UART) || (unit < CPU_FIRST_UART)) {
+		return driver_error(UART_DRIVER, UART_ERR_INVALID_UNIT, NULL);
+	}
+
+	if (!((uart[unit].flags & UART_FLAG_INIT) && (uart[unit].flags & UART_FLAG_IRQ_INIT))) {
+		return driver_error(UART_DRIVER, UART_ERR_IS_NOT_SETUP, NULL);
+	}
+
+	portDISABLE_INTERRUPTS();
+	memcpy(stats, &uart[unit].stats, sizeof(uart_stats_t));
+	portENABLE_INTERRUPTS();
+
+	return NULL;
 }
 
 int uart_get_br(int unit) {
@@ -793,6 +1453,10 @@ int uart_is_setup(int unit) {
     return ((uart[unit].flags & UART_FLAG_INIT) && (uart[unit].flags & UART_FLAG_IRQ_INIT));
 }
 
+int uart_is_framing(int unit) {
+    return (uart[unit].framer != NULL);
+}
+
 void uart_stop(int unit) {
 	int cunit = 0;
 
@@ -55,7 +55,7 @@
 #define __UART_H__
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include "rom/uart.h"
 #include "rom/ets_sys.h"
@@ -66,14 +66,69 @@
 #include <pthread.h>
 #include <sys/driver.h>
 
+// UART statistics
+typedef struct {
+	uint32_t received;       // Bytes stored in the RX ring
+	uint32_t overruns;       // Bytes lost because the RX ring was full
+	uint32_t fifo_overflows; // Hardware RX FIFO overflows
+	uint32_t frame_errors;   // Frame errors
+	uint32_t frames;         // Received frames (framing enabled)
+	uint32_t frame_drops;    // Discarded frames, because are too long, or can't be delivered
+} uart_stats_t;
+
+/*
+ * Framing modes. When framing is enabled on a unit, a task assembles the received
+ * bytes into frames, and delivers complete frames to a callback, or to a queue
+ * read with uart_frame_receive. While framing is enabled the received bytes can't
+ * be read with other functions: uart_read_bytes returns -1 (errno is EBUSY),
+ * uart_read / uart_reads / uart_readline fail as on timeout, and uart_consume
+ * returns an error. uart_wait_response and uart_send_command read lines, and
+ * don't work while framing is enabled.
+ */
+#define UART_FRAME_NONE      0 // Framing disabled
+#define UART_FRAME_DELIMITER 1 // Frame ends with the delimiter byte (not stored in frame)
+#define UART_FRAME_FIXED     2 // Frame has a fixed length
+#define UART_FRAME_LENGTH    3 // Frame length is in a length field of the frame
+#define UART_FRAME_IDLE      4 // Frame ends when no bytes are received during idle time
+
+typedef struct {
+	uint8_t  mode;      // Framing mode (UART_FRAME_*)
+	int16_t  start;     // Start of frame byte, -1 if frames don't have a start byte
+	uint8_t  delimiter; // End of frame byte (UART_FRAME_DELIMITER)
+	uint16_t length;    // Frame length (UART_FRAME_FIXED)
+	uint8_t  offset;    // Offset of the length field in frame (UART_FRAME_LENGTH)
+	uint8_t  size;      // Size of the length field, 1 or 2 bytes big endian (UART_FRAME_LENGTH)
+	int16_t  adjust;    // Added to the length field to get the frame length (UART_FRAME_LENGTH)
+	uint16_t max;       // Max frame length
+	uint32_t idle;      // Idle time in msecs. In UART_FRAME_IDLE mode ends the frame, in
+	                    // other modes discards the partial frame. 0 for no idle time.
+} uart_framing_t;
+
+typedef struct {
+	uint16_t len;
+	uint8_t  data[];
+} uart_frame_t;
+
+typedef void (*uart_frame_callback_t)(int, int8_t, uart_frame_t *);
+
 struct uart {
     uint8_t          flags;
-    QueueHandle_t    q;         // RX queue
-    uint16_t         qs;        // Queue size
+    uint8_t         *rx_buf;    // RX ring buffer
+    uint32_t         qs;        // RX ring size
     uint32_t         brg;       // Baud rate
     pthread_mutex_t  mtx;		// Mutex
     int8_t           rx;
     int8_t           tx;
+
+    // RX ring. Written by the interrupt handler (head), and read by tasks (tail).
+    // The ring size is a power of 2, and head / tail are free running counters.
+    uint32_t          rx_mask;
+    volatile uint32_t rx_head;
+    volatile uint32_t rx_tail;
+    SemaphoreHandle_t rx_sem;   // Given when new data is in the RX ring
+
+    uart_stats_t     stats;
+    struct uart_framer *framer; // Framing engine, if framing is enabled
 };
 
 // Resources used by the UART
@@ -95,6 +150,9 @@ typedef struct {
 #define UART_ERR_IS_NOT_SETUP 			  (DRIVER_EXCEPTION_BASE(UART_DRIVER_ID) |  6)
 #define UART_ERR_PIN_NOT_ALLOWED		  (DRIVER_EXCEPTION_BASE(UART_DRIVER_ID) |  7)
 #define UART_ERR_CANNOT_CHANGE_PINMAP	  (DRIVER_EXCEPTION_BASE(UART_DRIVER_ID) |  8)
+#define UART_ERR_INVALID_FRAMING		  (DRIVER_EXCEPTION_BASE(UART_DRIVER_ID) |  9)
+#define UART_ERR_FRAMING_NOT_ENABLED	  (DRIVER_EXCEPTION_BASE(UART_DRIVER_ID) | 10)
+#define UART_ERR_FRAMING_ENABLED		  (DRIVER_EXCEPTION_BASE(UART_DRIVER_ID) | 11)
 
 // Flags
 #define UART_FLAG_WRITE 0x01
@@ -123,13 +181,19 @@ void     uart_write(int8_t unit, char byte);
 void     uart_writes(int8_t unit, char *s);
 uint8_t uart_read(int8_t unit, char *c, uint32_t timeout);
 uint8_t  uart_reads(int8_t unit, char *buff, uint8_t crlf, uint32_t timeout);
+int      uart_read_bytes(int8_t unit, char *buff, int len, uint32_t timeout);
+int      uart_rx_available(int8_t unit);
+int      uart_readline(int8_t unit, char *buff, int size, uint8_t crlf, uint32_t timeout);
+driver_error_t *uart_get_stats(int8_t unit, uart_stats_t *stats);
+driver_error_t *uart_framing(int8_t unit, uart_framing_t *framing, uart_frame_callback_t callback, int callback_id);
+driver_error_t *uart_frame_receive(int8_t unit, uart_frame_t **frame, uint32_t timeout);
 uint8_t  uart_wait_response(int8_t unit, char *command, uint8_t echo, char *ret, uint8_t substring, uint32_t timeout, int nargs, ...);
 uint8_t  uart_send_command(int8_t unit, char *command, uint8_t echo, uint8_t crlf, char *ret, uint8_t substring, uint32_t timeout, int nargs, ...);
 const char  *uart_name(int8_t unit);
 int      uart_get_br(int unit);
 int      uart_is_setup(int unit);
+int      uart_is_framing(int unit);
 void     uart_stop(int unit);
-QueueHandle_t *uart_get_queue(int8_t unit);
 driver_error_t *uart_lock_resources(int unit, uint8_t flags, void *resources);
 
 #endif
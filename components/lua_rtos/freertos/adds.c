@@ -42,6 +42,22 @@
 // Global state
 static lua_State *gL = NULL;
 
+#if configGENERATE_RUN_TIME_STATS
+// Run-time counters sampled in the previous GetTaskInfo call, used for
+// compute the CPU usage of each task in the last period
+typedef struct {
+	TaskHandle_t task;
+	uint32_t run_time;
+} run_time_sample_t;
+
+// The previous sample is taken by GetTaskInfo while it's in use, so concurrent
+// calls never see it freed. A concurrent call computes the usage from boot.
+static portMUX_TYPE prev_mux = portMUX_INITIALIZER_UNLOCKED;
+static run_time_sample_t *prev_sample = NULL;
+static UBaseType_t prev_samples = 0;
+static uint32_t prev_total = 0;
+#endif
+
 static int compare(const void *a, const void *b) {
 	if (((task_info_t *)a)->task_type < ((task_info_t *)b)->task_type) {
 		return 1;
@@ -187,6 +203,56 @@ int uxGetStack(TaskHandle_t h) {
 	return task->pxEndOfStack - task->pxStack + 4;
 }
 
+/*
+ * Account a Lua allocator operation to the current task. osize is the size of
+ * the block being reallocated or freed, and nsize the size requested. Blocks can
+ * be freed by a task other than the one that allocated it (threads share the
+ * Lua state), so the in-use amount is clamped at 0.
+ */
+void IRAM_ATTR uxAccountAlloc(size_t osize, size_t nsize) {
+	lua_rtos_tcb_t *lua_rtos_tcb;
+	uint32_t used;
+
+	if (!(lua_rtos_tcb = pvTaskGetThreadLocalStoragePointer(NULL, THREAD_LOCAL_STORAGE_POINTER_ID))) {
+		return;
+	}
+
+	if (nsize > osize) {
+		lua_rtos_tcb->alloc += nsize - osize;
+	} else {
+		lua_rtos_tcb->freed += osize - nsize;
+	}
+
+	if (lua_rtos_tcb->alloc > lua_rtos_tcb->freed) {
+		used = lua_rtos_tcb->alloc - lua_rtos_tcb->freed;
+		if (used > lua_rtos_tcb->heap_peak) {
+			lua_rtos_tcb->heap_peak = used;
+		}
+	}
+}
+
+// Account that the current task has taken a Lua state's lock from another task
+void IRAM_ATTR uxAccountSwitch() {
+	lua_rtos_tcb_t *lua_rtos_tcb;
+
+	if ((lua_rtos_tcb = pvTaskGetThreadLocalStoragePointer(NULL, THREAD_LOCAL_STORAGE_POINTER_ID))) {
+		lua_rtos_tcb->switches++;
+	}
+}
+
+#if configGENERATE_RUN_TIME_STATS
+// Get the run-time counter of a task in a sample
+static uint32_t sample_run_time(run_time_sample_t *sample, UBaseType_t samples, TaskHandle_t task) {
+	for(int i = 0; i < samples; i++) {
+		if (sample[i].task == task) {
+			return sample[i].run_time;
+		}
+	}
+
+	return 0;
+}
+#endif
+
 task_info_t *GetTaskInfo() {
 	tskTCB_t *ctask;
 	task_info_t *info;
@@ -195,6 +261,14 @@ task_info_t *GetTaskInfo() {
 	TaskStatus_t *status_array;
 	UBaseType_t task_num = 0;
 	UBaseType_t start_task_num = 0;
+	uint32_t total = 0;
+#if configGENERATE_RUN_TIME_STATS
+	run_time_sample_t *sample, *last_sample;
+	UBaseType_t last_samples;
+	uint32_t last_total;
+	uint32_t period;
+	uint64_t cpu;
+#endif
 
 	//Allocate status_array
 	start_task_num = uxTaskGetNumberOfTasks();
@@ -204,7 +278,7 @@ task_info_t *GetTaskInfo() {
 		return NULL;
 	}
 
-	task_num = uxTaskGetSystemState(status_array, (start_task_num), NULL);
+	task_num = uxTaskGetSystemState(status_array, (start_task_num), &total);
 
 	info = (task_info_t *)calloc(task_num + 1, sizeof(task_info_t));
 	if (!info) {
@@ -212,6 +286,24 @@ task_info_t *GetTaskInfo() {
 		return NULL;
 	}
 
+#if configGENERATE_RUN_TIME_STATS
+	// Take the previous sample
+	portENTER_CRITICAL(&prev_mux);
+	last_sample = prev_sample;
+	last_samples = prev_samples;
+	last_total = prev_total;
+
+	prev_sample = NULL;
+	prev_samples = 0;
+	prev_total = 0;
+	portEXIT_CRITICAL(&prev_mux);
+
+	// The run-time counter is shared by all cores, so the period is
+	// accounted once per core
+	period = (total - last_total) * portNUM_PROCESSORS;
+	sample = (run_time_sample_t *)calloc(task_num, sizeof(run_time_sample_t));
+#endif
+
 	for(int i = 0; i <task_num; i++){
 		// Get the task TCB
 		ctask = (tskTCB_t *)status_array[i].xHandle;
@@ -239,8 +331,25 @@ task_info_t *GetTaskInfo() {
 			info[i].thid = lua_rtos_tcb->threadid;
 			info[i].lthread = lua_rtos_tcb->lthread;
 			info[i].status = lua_rtos_tcb->status;
+			info[i].switches = lua_rtos_tcb->switches;
+			info[i].heap_alloc = lua_rtos_tcb->alloc;
+			info[i].heap_freed = lua_rtos_tcb->freed;
+			info[i].heap_peak = lua_rtos_tcb->heap_peak;
+		}
+
+#if configGENERATE_RUN_TIME_STATS
+		info[i].run_time = status_array[i].ulRunTimeCounter;
+		if (period > 0) {
+			cpu = (100ULL * (info[i].run_time - sample_run_time(last_sample, last_samples, status_array[i].xHandle))) / period;
+			info[i].cpu = (cpu > 100)?100:cpu;
 		}
 
+		if (sample) {
+			sample[i].task = status_array[i].xHandle;
+			sample[i].run_time = info[i].run_time;
+		}
+#endif
+
 		// Populate info item
 		info[i].prio = status_array[i].uxCurrentPriority;
 		info[i].task_type = task_type;
@@ -258,6 +367,32 @@ task_info_t *GetTaskInfo() {
 
 	free(status_array);
 
+#if configGENERATE_RUN_TIME_STATS
+	// Store the new sample, or give back the previous one if there is no new
+	// sample. If a concurrent call stored a newer sample meanwhile, it's kept.
+	if (sample) {
+		free(last_sample);
+
+		last_sample = sample;
+		last_samples = task_num;
+		last_total = total;
+	}
+
+	portENTER_CRITICAL(&prev_mux);
+	if (!prev_sample || ((int32_t)(last_total - prev_total) > 0)) {
+		sample = prev_sample;
+
+		prev_sample = last_sample;
+		prev_samples = last_samples;
+		prev_total = last_total;
+
+		last_sample = sample;
+	}
+	portEXIT_CRITICAL(&prev_mux);
+
+	free(last_sample);
+#endif
+
 	qsort (info, task_num, sizeof (task_info_t), compare);
 
 	return info;
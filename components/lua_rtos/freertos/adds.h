@@ -102,6 +102,9 @@ typedef struct lthread {
     int thread_ref;
     int status;
     pthread_t thread;
+    uint8_t isolated; // If 1 the thread runs on it's own Lua state
+    char *chunk;      // Function's binary chunk, for isolated threads
+    size_t chunk_len; // Function's binary chunk length, for isolated threads
 } lthread_t;
 
 typedef struct {
@@ -114,6 +117,12 @@ typedef struct {
     int thid;
     lthread_t *lthread;
     pthread_status_t status;
+    uint32_t run_time;   // Run-time counter, 0 if run-time stats are disabled
+    uint8_t cpu;         // % of CPU used since the previous GetTaskInfo call
+    uint32_t switches;   // Number of times the task has acquired a Lua state's lock
+    uint32_t heap_alloc; // Bytes allocated by the Lua allocator on behalf of the task
+    uint32_t heap_freed; // Bytes released by the Lua allocator on behalf of the task
+    uint32_t heap_peak;  // Heap high-water mark (heap_alloc - heap_freed)
 } task_info_t;
 
 typedef struct {
@@ -121,6 +130,10 @@ typedef struct {
  	uint32_t   signaled;
  	pthread_status_t status;
  	struct lthread *lthread;
+ 	uint32_t   switches;
+ 	uint32_t   alloc;
+ 	uint32_t   freed;
+ 	uint32_t   heap_peak;
 } lua_rtos_tcb_t;
 
 // This macro is not present in all FreeRTOS ports. In Lua RTOS is used in some places
@@ -143,6 +156,8 @@ TaskHandle_t xGetCurrentTask();
 uint8_t ucGetCoreID(TaskHandle_t h);
 int uxGetStack(TaskHandle_t h);
 task_info_t *GetTaskInfo();
+void uxAccountAlloc(size_t osize, size_t nsize);
+void uxAccountSwitch();
 void uxSetLuaState(lua_State* L);
 lua_State* pvGetLuaState();
 
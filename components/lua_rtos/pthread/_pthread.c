@@ -36,11 +36,14 @@
 #include "thread.h"
 #include "_pthread.h"
 
+#include "esp_newlib.h"
+
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+#include <sys/reent.h>
 #include <sys/mutex.h>
 #include <sys/queue.h>
 
@@ -60,8 +63,30 @@ struct pthreadTaskArg {
     int id;
     int initial_state;
     int stack;
+    int cpu;
+};
+
+// A parked worker. It lives in the stack of the worker's task while the task
+// is waiting for a new thread to run.
+struct pthread_worker {
+    xTaskHandle task;
+    int stack;
+    struct pthreadTaskArg *volatile args;
+    struct pthread_worker *next;
 };
-  
+
+// Parked workers, one pool for each CPU, and one for tasks without affinity
+#define PTHREAD_POOLS (portNUM_PROCESSORS + 1)
+
+static struct {
+    struct pthread_worker *parked;
+    int count;
+} pool[PTHREAD_POOLS];
+
+static struct mtx pool_mtx;
+static pthread_pool_stats_t pool_stats;
+static uint8_t pool_inited = 0;
+
 void pthreadTask(void *task_arguments);
 
 void _pthread_init() {
@@ -74,10 +99,156 @@ void _pthread_init() {
 	    list_init(&thread_list, 1);
 	    list_init(&key_list, 1);
 
+	    mtx_init(&pool_mtx, NULL, NULL, 0);
+
 	    inited = 1;
 	}
 }
 
+static inline int pthread_pool_index(int cpu) {
+	return (cpu == tskNO_AFFINITY)?portNUM_PROCESSORS:cpu;
+}
+
+/*
+ * Create the workers that are parked in advance, so the first threads
+ * started with the default stack size don't need to create a task. They
+ * are created on the default CPU of Lua threads, because a worker is only
+ * reused by threads with the same affinity.
+ */
+static void pthread_pool_init() {
+	struct pthreadTaskArg *taskArgs;
+	xTaskHandle xCreatedTask;
+	int i;
+
+#if CONFIG_FREERTOS_UNICORE
+	int cpu = 0;
+#else
+	int cpu = CONFIG_LUA_RTOS_LUA_THREAD_CPU;
+#endif
+
+	// Threads can be started at the same time, only the first one creates the workers
+	mtx_lock(&pool_mtx);
+	if (pool_inited) {
+		mtx_unlock(&pool_mtx);
+		return;
+	}
+
+	pool_inited = 1;
+	mtx_unlock(&pool_mtx);
+
+	for(i = 0;i < CONFIG_LUA_RTOS_LUA_THREAD_POOL_PRECREATE;i++) {
+		taskArgs = (struct pthreadTaskArg *)calloc(1, sizeof(struct pthreadTaskArg));
+		if (!taskArgs) {
+			return;
+		}
+
+		// A worker without a function goes to park directly
+		taskArgs->stack = CONFIG_LUA_RTOS_LUA_THREAD_STACK_SIZE;
+		taskArgs->cpu = cpu;
+
+		if (xTaskCreatePinnedToCore(pthreadTask, "lpool", taskArgs->stack, taskArgs, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY, &xCreatedTask, cpu) != pdPASS) {
+			free(taskArgs);
+			return;
+		}
+
+		mtx_lock(&pool_mtx);
+		pool_stats.created++;
+		mtx_unlock(&pool_mtx);
+	}
+}
+
+/*
+ * Take a parked worker with the required stack size and CPU affinity, or
+ * NULL if there is none.
+ */
+static struct pthread_worker *pthread_pool_take(int cpu, int stacksize) {
+	struct pthread_worker *worker, *prev = NULL;
+	int idx = pthread_pool_index(cpu);
+
+	mtx_lock(&pool_mtx);
+
+	worker = pool[idx].parked;
+	while (worker) {
+		if (worker->stack == stacksize) {
+			if (prev) {
+				prev->next = worker->next;
+			} else {
+				pool[idx].parked = worker->next;
+			}
+
+			pool[idx].count--;
+			pool_stats.parked--;
+			pool_stats.hits++;
+
+			mtx_unlock(&pool_mtx);
+
+			return worker;
+		}
+
+		prev = worker;
+		worker = worker->next;
+	}
+
+	pool_stats.misses++;
+
+	mtx_unlock(&pool_mtx);
+
+	return NULL;
+}
+
+/*
+ * Park the current task, when it's thread is finished. Returns the arguments
+ * of the next thread to run, or NULL if the pool is full, and the task must
+ * be deleted. The stack is not cleared, so the high water mark of the task
+ * carries over to the next thread.
+ */
+static struct pthreadTaskArg *pthread_pool_park(int cpu, int stacksize, lua_rtos_tcb_t *lua_rtos_tcb) {
+	struct pthread_worker worker;
+	int idx = pthread_pool_index(cpu);
+
+	// Reset the newlib state (errno, strtok, stdio buffers, ...) as in a new
+	// task, so it doesn't leak to the next thread
+	_reclaim_reent(__getreent());
+	esp_reent_init(__getreent());
+
+	mtx_lock(&pool_mtx);
+
+	if (pool[idx].count >= CONFIG_LUA_RTOS_LUA_THREAD_POOL_SIZE) {
+		mtx_unlock(&pool_mtx);
+		return NULL;
+	}
+
+	// A parked worker is not a thread
+	memset(lua_rtos_tcb, 0, sizeof(lua_rtos_tcb_t));
+	strncpy(((tskTCB_t *)xTaskGetCurrentTaskHandle())->pcTaskName, "lpool", configMAX_TASK_NAME_LEN - 1);
+
+	worker.task = xTaskGetCurrentTaskHandle();
+	worker.stack = stacksize;
+	worker.args = NULL;
+	worker.next = pool[idx].parked;
+
+	pool[idx].parked = &worker;
+	pool[idx].count++;
+	pool_stats.parked++;
+
+	mtx_unlock(&pool_mtx);
+
+	// Wait for a new thread
+	while (!worker.args) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	}
+
+	strncpy(((tskTCB_t *)xTaskGetCurrentTaskHandle())->pcTaskName, "lthread", configMAX_TASK_NAME_LEN - 1);
+
+	return worker.args;
+}
+
+void _pthread_pool_stats(pthread_pool_stats_t *stats) {
+	mtx_lock(&pool_mtx);
+	*stats = pool_stats;
+	mtx_unlock(&pool_mtx);
+}
+
 int _pthread_create(pthread_t *id, int priority, int stacksize, int cpu, int initial_state,
                     void *(*start_routine)(void *), void *args
 ) {
@@ -141,6 +312,7 @@ int _pthread_create(pthread_t *id, int priority, int stacksize, int cpu, int ini
 
     taskArgs->id = *id;
     taskArgs->stack = stacksize;
+    taskArgs->cpu = cpu;
     thread->thread = *id;
     
     // This is the parent thread. After the creation of the new task related to new thread
@@ -155,8 +327,23 @@ int _pthread_create(pthread_t *id, int priority, int stacksize, int cpu, int ini
     // This is done by pthreadTask function, who releases the lock when this information is set
     mtx_lock(&thread->init_mtx);
 
-    // Create related task
-    if (cpu == tskNO_AFFINITY) {
+    if (!pool_inited) {
+    	pthread_pool_init();
+    }
+
+    // Reuse a parked worker if there is one, or create a new task
+    struct pthread_worker *worker = pthread_pool_take(cpu, stacksize);
+    if (worker) {
+    	xCreatedTask = worker->task;
+
+    	vTaskPrioritySet(xCreatedTask, priority);
+
+    	// Worker can't be used after this, it's in the worker's stack
+    	worker->args = taskArgs;
+    	xTaskNotifyGive(xCreatedTask);
+
+    	res = pdPASS;
+    } else if (cpu == tskNO_AFFINITY) {
         res = xTaskCreate(pthreadTask, "lthread", stacksize, taskArgs, priority, &xCreatedTask);
     } else {
         res = xTaskCreatePinnedToCore(pthreadTask, "lthread", stacksize, taskArgs,priority, &xCreatedTask, cpu);
@@ -177,6 +364,12 @@ int _pthread_create(pthread_t *id, int priority, int stacksize, int cpu, int ini
         }
     }
 
+    if (!worker) {
+    	mtx_lock(&pool_mtx);
+    	pool_stats.created++;
+    	mtx_unlock(&pool_mtx);
+    }
+
     // Wait for the initialization of Lua RTOS specific TCB parts
     mtx_lock(&thread->init_mtx);
     
@@ -436,31 +629,18 @@ static void pthreadLocaleStoragePointerCallback(int index, void* data) {
 	}
 }
 
-void pthreadTask(void *taskArgs) {
-    struct pthreadTaskArg *args; 		  // Task arguments
+// Run a thread in the current task
+static void pthreadRun(struct pthreadTaskArg *args) {
     struct pthread_join *join;   		  // Current join
     struct pthread_clean *clean; 	  	  // Current clean
     struct pthread *thread;      		  // Current thread
-	lua_rtos_tcb_t *lua_rtos_tcb;         // Lua RTOS specific TCB parts
 
     char c = '1';
     int index;
 
-    // This is the new thread
-    args = (struct pthreadTaskArg *)taskArgs;
-	
     // Get thread
     list_get(&thread_list, args->id, (void **)&thread);
 
-	// Allocate and init Lua RTOS specific TCB parts, and store into a FreeRTOS
-	// local storage pointer
-	lua_rtos_tcb = (lua_rtos_tcb_t *)calloc(1, sizeof(lua_rtos_tcb_t));
-	if (!lua_rtos_tcb) {
-		abort();
-	}
-		
-	vTaskSetThreadLocalStoragePointerAndDelCallback(NULL, THREAD_LOCAL_STORAGE_POINTER_ID, (void *)lua_rtos_tcb, pthreadLocaleStoragePointerCallback);
-
     // Assume that the default thread is not a Lua thread
 	uxSetLThread(NULL);
 
@@ -526,7 +706,42 @@ void pthreadTask(void *taskArgs) {
     _pthread_free(args->id);
 
     // Free args
-	free(taskArgs);
+	free(args);
+}
+
+void pthreadTask(void *taskArgs) {
+    struct pthreadTaskArg *args; 		  // Task arguments
+	lua_rtos_tcb_t *lua_rtos_tcb;         // Lua RTOS specific TCB parts
+
+    // This is the new thread
+    args = (struct pthreadTaskArg *)taskArgs;
+
+    // Stack size and CPU affinity are fixed for the task, and are used
+    // for park the task in the right pool
+    int stack = args->stack;
+    int cpu = args->cpu;
+
+	// Allocate and init Lua RTOS specific TCB parts, and store into a FreeRTOS
+	// local storage pointer
+	lua_rtos_tcb = (lua_rtos_tcb_t *)calloc(1, sizeof(lua_rtos_tcb_t));
+	if (!lua_rtos_tcb) {
+		abort();
+	}
+		
+	vTaskSetThreadLocalStoragePointerAndDelCallback(NULL, THREAD_LOCAL_STORAGE_POINTER_ID, (void *)lua_rtos_tcb, pthreadLocaleStoragePointerCallback);
+
+	// A worker created in advance has not a thread to run
+	if (!args->pthread_function) {
+		free(args);
+		args = pthread_pool_park(cpu, stack, lua_rtos_tcb);
+	}
+
+	// Run threads until the pool is full
+	while (args) {
+		pthreadRun(args);
+
+		args = pthread_pool_park(cpu, stack, lua_rtos_tcb);
+	}
 
     // End related task
     vTaskDelete(NULL);
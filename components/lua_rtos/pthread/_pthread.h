@@ -131,6 +131,14 @@ struct pthread {
     xTaskHandle task;
 };
 
+// Statistics of the pool of parked tasks used for run new threads
+typedef struct {
+    uint32_t hits;    // Threads started on a parked task
+    uint32_t misses;  // Threads that required the creation of a new task
+    uint32_t created; // Tasks created
+    int parked;       // Tasks currently parked
+} pthread_pool_stats_t;
+
 struct pthread_attr {
     int stack_size;
     int initial_state;
@@ -161,6 +169,7 @@ int   _pthread_get_prio();
 int   _pthread_stack_free(pthread_t id);
 int   _pthread_stack(pthread_t id);
 struct pthread *_pthread_get(pthread_t id);
+void  _pthread_pool_stats(pthread_pool_stats_t *stats);
 
 // API functions
 int  pthread_attr_init(pthread_attr_t *attr);
@@ -36,6 +36,7 @@
 #include "nmea0183.h"
 
 #include <math.h>
+#include <string.h>
 
 #include <sys/driver.h>
 
@@ -57,24 +58,34 @@ static const sensor_t __attribute__((used,unused,section(".sensors"))) gps_senso
 	.acquire = gps_acquire
 };
 
-static void gps(void *args) {
-	int uart = (int)args;
+// Called by the UART framing engine with each NMEA sentence
+static void gps_sentence(int id, int8_t unit, uart_frame_t *frame) {
+	char sentence[MAX_NMA_SIZE + 1];
+	int len = frame->len;
 
-	char sentence[MAX_NMA_SIZE];
-
-	for(;;) {
-		uart_reads(uart, sentence, 1, portMAX_DELAY);
-		nmea_parse(sentence);
+	// Strip CR
+	if ((len > 0) && (frame->data[len - 1] == '\r')) {
+		len--;
 	}
+
+	memcpy(sentence, frame->data, len);
+	sentence[len] = '\0';
+
+	nmea_parse(sentence);
 }
 
 /*
  * Operation functions
  */
 driver_error_t *gps_setup(sensor_instance_t *unit) {
-	xTaskCreatePinnedToCore(gps, "gps", configMINIMAL_STACK_SIZE, (void *)((int)unit->setup[0].uart.id), 21, NULL, 0);
+	uart_framing_t framing = {
+		.mode = UART_FRAME_DELIMITER,
+		.start = '$',
+		.delimiter = '\n',
+		.max = MAX_NMA_SIZE,
+	};
 
-	return NULL;
+	return uart_framing(unit->setup[0].uart.id, &framing, gps_sentence, 0);
 }
 
 driver_error_t *gps_acquire(sensor_instance_t *unit, sensor_value_t *values) {
@@ -53,40 +53,28 @@ static const sensor_t __attribute__((used,unused,section(".sensors"))) gps_senso
 	.acquire = NULL
 };
 
-static void sds011_task(void *args) {
-	sensor_instance_t *unit = (sensor_instance_t *)args;
-	uint8_t buff[10];
-	uint8_t i, j, c, checksum;
-
-	// SDS011 sends the information in a 10-byte packet:
-	// AA CO XX XX XX XX XX XX XX AB
-	i = 0;
-	for(;;) {
-		uart_read(unit->setup[0].uart.id, (char *)&c, portMAX_DELAY);
-		if (i == 10) {
-			for(j=1;j < 10;j++) {
-				buff[j-1] = buff[j];
-			}
-
-			i = 9;
-		}
-
-		buff[i++] = c;
-
-		if ((buff[0] == 0xaa) && (buff[1] == 0xc0) && (buff[9] == 0xab)) {
-			// Checksum
-			checksum = 0;
-			for(j = 2;j <= 7;j++) {
-				checksum = checksum + buff[j];
-			}
-
-			if (buff[8] == checksum) {
-				sensor_lock(unit);
-				unit->data[0].doubled.value = ((double)((buff[3] << 8) + buff[2]))/(double)10.0;
-				unit->data[1].doubled.value = ((double)((buff[5] << 8) + buff[4]))/(double)10.0;
-				sensor_unlock(unit);
-			}
-		}
+// Called by the UART framing engine with each 10-byte packet:
+// AA CO XX XX XX XX XX XX XX AB
+static void sds011_frame(int id, int8_t uart_unit, uart_frame_t *frame) {
+	sensor_instance_t *unit = (sensor_instance_t *)id;
+	uint8_t *buff = frame->data;
+	uint8_t j, checksum;
+
+	if ((buff[1] != 0xc0) || (buff[9] != 0xab)) {
+		return;
+	}
+
+	// Checksum
+	checksum = 0;
+	for(j = 2;j <= 7;j++) {
+		checksum = checksum + buff[j];
+	}
+
+	if (buff[8] == checksum) {
+		sensor_lock(unit);
+		unit->data[0].doubled.value = ((double)((buff[3] << 8) + buff[2]))/(double)10.0;
+		unit->data[1].doubled.value = ((double)((buff[5] << 8) + buff[4]))/(double)10.0;
+		sensor_unlock(unit);
 	}
 }
 
@@ -103,9 +91,14 @@ driver_error_t *sds011_presetup(sensor_instance_t *unit) {
 }
 
 driver_error_t *sds011_setup(sensor_instance_t *unit) {
-	xTaskCreatePinnedToCore(sds011_task, "sds011", configMINIMAL_STACK_SIZE, (void *)(unit), 21, NULL, 0);
-
-	return NULL;
+	uart_framing_t framing = {
+		.mode = UART_FRAME_FIXED,
+		.start = 0xaa,
+		.length = 10,
+		.idle = 100,
+	};
+
+	return uart_framing(unit->setup[0].uart.id, &framing, sds011_frame, (int)unit);
 }
 
 #endif
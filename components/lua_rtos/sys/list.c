@@ -27,6 +27,26 @@
  * this software.
  */
 
+/*
+ * This is a table of handles, used for store items and get a handle to access
+ * them later.
+ *
+ * Slots are allocated in chunks that are never moved, so the table can grow
+ * without copying the slots. Chunk k has LIST_CHUNK_BASE << k slots, so a slot
+ * is located in it's chunk with a few bit operations, and the chunk directory
+ * has a fixed size. Free slots are reused through a free list.
+ *
+ * Writers (list_add, list_remove, list_destroy) are serialized by the list mutex.
+ * Readers (list_get, list_first, list_next) don't take any lock: chunks and slots
+ * are published with memory barriers, and the state of each slot is a tag, that
+ * contains an in-use bit and a generation, incremented each time that the slot is
+ * released. A reader reads the tag before and after reading the item, and retries
+ * if the tag has changed.
+ *
+ * In generational lists the handle includes the slot generation, so a handle
+ * of a removed item is never valid again, even if it's slot is reused.
+ */
+
 #include "esp_attr.h"
 
 #include <errno.h>
@@ -36,216 +56,303 @@
 #include <sys/list.h>
 #include <sys/mutex.h>
 
-void list_init(struct list *list, int first_index) {
+#define LIST_TAG_USED            0x01
+#define LIST_TAG_GENERATION(tag) ((tag) >> 1)
+
+// Get the chunk of a slot
+static inline int IRAM_ATTR list_chunk(int slot) {
+	return (31 - __builtin_clz(slot + LIST_CHUNK_BASE)) - LIST_CHUNK_BASE_BITS;
+}
+
+// Get the first slot of a chunk
+static inline int IRAM_ATTR list_chunk_start(int chunk) {
+	return (LIST_CHUNK_BASE << chunk) - LIST_CHUNK_BASE;
+}
+
+// Get a slot, that must be published
+static inline struct list_index * IRAM_ATTR list_slot(struct list *list, int slot) {
+	int chunk = list_chunk(slot);
+
+	return list->chunk[chunk] + (slot - list_chunk_start(chunk));
+}
+
+// Build a handle from a slot and it's generation
+static inline int IRAM_ATTR list_handle(struct list *list, int slot, uint32_t generation) {
+	if (list->flags & LIST_GENERATIONAL) {
+		slot |= (generation & LIST_GENERATION_MASK) << LIST_SLOT_BITS;
+	}
+
+	return slot + list->first_index;
+}
+
+// Get the slot and generation from a handle
+static inline int IRAM_ATTR list_decode(struct list *list, int index, int *slot, uint32_t *generation) {
+	if (index < list->first_index) {
+		return EINVAL;
+	}
+
+	index -= list->first_index;
+
+	*slot = index & ((1 << LIST_SLOT_BITS) - 1);
+	*generation = (index >> LIST_SLOT_BITS) & LIST_GENERATION_MASK;
+
+	if (!(list->flags & LIST_GENERATIONAL) && (*generation != 0)) {
+		return EINVAL;
+	}
+
+	if (*slot >= list->slots) {
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+// Read the tag and the item of a slot in a consistent way
+static inline uint32_t IRAM_ATTR list_read(struct list_index *cindex, void **item) {
+	uint32_t tag;
+
+	do {
+		tag = cindex->tag;
+		__sync_synchronize();
+		*item = cindex->item;
+		__sync_synchronize();
+	} while (tag != cindex->tag);
+
+	return tag;
+}
+
+// Get the handle of the first used slot, starting from a slot
+static int IRAM_ATTR list_scan(struct list *list, int slot) {
+	struct list_index *cindex;
+	int slots = list->slots;
+	int chunk;
+
+	__sync_synchronize();
+
+	while (slot < slots) {
+		chunk = list_chunk(slot);
+
+		// Skip chunks without used slots
+		if (list->used[chunk] == 0) {
+			slot = list_chunk_start(chunk + 1);
+			continue;
+		}
+
+		cindex = list_slot(list, slot);
+		uint32_t tag = cindex->tag;
+
+		if (tag & LIST_TAG_USED) {
+			return list_handle(list, slot, LIST_TAG_GENERATION(tag));
+		}
+
+		slot++;
+	}
+
+	return -1;
+}
+
+void list_init_flags(struct list *list, int first_index, uint8_t flags) {
     // Create the mutex
     mtx_init(&list->mutex, NULL, NULL, 0);
-    
+
     mtx_lock(&list->mutex);
-    
-    list->indexes =  0;
-    list->free = NULL;
-    list->index = NULL;
+
+    for(int chunk = 0;chunk < LIST_CHUNKS;chunk++) {
+        list->chunk[chunk] = NULL;
+        list->used[chunk] = 0;
+    }
+
+    list->slots = 0;
+    list->free = -1;
     list->first_index = first_index;
-    
-    mtx_unlock(&list->mutex);    
+    list->flags = flags;
+
+    mtx_unlock(&list->mutex);
+}
+
+void list_init(struct list *list, int first_index) {
+	list_init_flags(list, first_index, 0);
 }
 
 int list_add(struct list *list, void *item, int *item_index) {
-    struct list_index *index = NULL;
-    struct list_index *indexa = NULL;
-    int grow = 0;
-        
+    struct list_index *cindex;
+    uint32_t generation;
+    int chunk;
+    int slot;
+
     mtx_lock(&list->mutex);
-    
-    // Get an index
-    if (list->free) {
-        // Get first free element
-        index = list->free;
-        list->free = index->next;
+
+    if (list->free >= 0) {
+        // Reuse the first free slot
+        slot = list->free;
+        cindex = list_slot(list, slot);
+        list->free = cindex->next;
     } else {
-        // Must grow index array
-        grow = 1;
-    }
-    
-    if (grow) {        
-        // Increment index count
-        list->indexes++;
-
-        // Create a new index array for allocate new index
-        indexa = (struct list_index *)malloc(sizeof(struct list_index) * list->indexes);     
-        if (!indexa) {
+        // Use a new slot
+        slot = list->slots;
+        if (slot >= LIST_MAX_SLOTS) {
             mtx_unlock(&list->mutex);
-            return ENOMEM;            
+            return ENOMEM;
         }
-        
-        if (list->index) {
-            // Copy current index array to new created
-            bcopy(list->index, indexa, sizeof(struct list_index) * (list->indexes - 1));
 
-            // Free current index array
-            free(list->index);
+        chunk = list_chunk(slot);
+        if (!list->chunk[chunk]) {
+            // Allocate a new chunk, and publish it
+            cindex = (struct list_index *)calloc(LIST_CHUNK_BASE << chunk, sizeof(struct list_index));
+            if (!cindex) {
+                mtx_unlock(&list->mutex);
+                return ENOMEM;
+            }
+
+            __sync_synchronize();
+            list->chunk[chunk] = cindex;
         }
 
-        // Store new index array
-        list->index = indexa;
+        cindex = list_slot(list, slot);
 
-        // Current index
-        index = list->index + list->indexes - 1;
-        
-        // Initialize new index
-        index->index = list->indexes - 1;
-        
+        // Publish the new slot
+        __sync_synchronize();
+        list->slots = slot + 1;
     }
-    
-    index->next = NULL;
-    index->item = item;        
-    index->deleted = 0;
-    
+
+    generation = LIST_TAG_GENERATION(cindex->tag);
+
+    cindex->next = -1;
+    cindex->item = item;
+
+    // Publish the item
+    __sync_synchronize();
+    cindex->tag = (generation << 1) | LIST_TAG_USED;
+
+    list->used[list_chunk(slot)]++;
+
     // Return index
-    *item_index = index->index + list->first_index;
-            
+    *item_index = list_handle(list, slot, generation);
+
     mtx_unlock(&list->mutex);
-    
+
     return 0;
 }
 
 int IRAM_ATTR list_get(struct list *list, int index, void **item) {
-    struct list_index *cindex = NULL;
-    int iindex;
-
-    mtx_lock(&list->mutex);
+    uint32_t generation;
+    uint32_t tag;
+    void *citem;
+    int slot;
 
-    if (!list->indexes) {
-        mtx_unlock(&list->mutex);
+    if (list_decode(list, index, &slot, &generation)) {
         return EINVAL;
     }
 
-    // Check index
-    if (index < list->first_index) {
-        mtx_unlock(&list->mutex);
-        return EINVAL;
-    }
+    tag = list_read(list_slot(list, slot), &citem);
 
-    // Get new internal index
-    iindex = index - list->first_index;
-    
-    // Test for a valid index
-    if (iindex > list->indexes) {
-        mtx_unlock(&list->mutex);
+    if (!(tag & LIST_TAG_USED)) {
         return EINVAL;
     }
 
-    cindex = list->index + iindex;
-
-    if (cindex->deleted) {
-        mtx_unlock(&list->mutex);
+    if ((list->flags & LIST_GENERATIONAL) && ((LIST_TAG_GENERATION(tag) & LIST_GENERATION_MASK) != generation)) {
         return EINVAL;
     }
-    
-    *item = cindex->item;
-    
-    mtx_unlock(&list->mutex);
+
+    *item = citem;
 
     return 0;
 }
 
 int list_remove(struct list *list, int index, int destroy) {
-    struct list_index *cindex = NULL;
-    int iindex;
+    struct list_index *cindex;
+    uint32_t generation;
+    uint32_t tag;
+    void *item;
+    int slot;
 
     mtx_lock(&list->mutex);
 
-    // Check index
-    if (index < list->first_index) {
+    if (list_decode(list, index, &slot, &generation)) {
         mtx_unlock(&list->mutex);
         return EINVAL;
     }
-    
-    // Get new internal index
-    iindex = index - list->first_index;
-    
-    // Test for a valid index
-    if ((iindex < 0) || (iindex > list->indexes)) {
+
+    cindex = list_slot(list, slot);
+    tag = cindex->tag;
+
+    if (!(tag & LIST_TAG_USED)) {
         mtx_unlock(&list->mutex);
         return EINVAL;
     }
-    
-    cindex = &list->index[iindex];
-    
-    if (destroy) {
-    	free(cindex->item);
+
+    if ((list->flags & LIST_GENERATIONAL) && ((LIST_TAG_GENERATION(tag) & LIST_GENERATION_MASK) != generation)) {
+        mtx_unlock(&list->mutex);
+        return EINVAL;
     }
-    
+
+    item = cindex->item;
+
+    // Release the slot, incrementing it's generation
+    cindex->tag = (LIST_TAG_GENERATION(tag) + 1) << 1;
+    __sync_synchronize();
+    cindex->item = NULL;
+
     cindex->next = list->free;
-    cindex->deleted = 1;
-    list->free = cindex;
-    
+    list->free = slot;
+
+    list->used[list_chunk(slot)]--;
+
+    if (destroy) {
+    	free(item);
+    }
+
     mtx_unlock(&list->mutex);
-    
+
     return 0;
 }
 
 int IRAM_ATTR list_first(struct list *list) {
-    int index;
-    int res = -1;
-    
-    mtx_lock(&list->mutex);
-    
-    for(index=0;index < list->indexes;index++) {
-        if (!list->index[index].deleted) {
-            res = index + list->first_index;
-            break;
-        }
-    }
-    
-    mtx_unlock(&list->mutex);
-
-    return res;
+    return list_scan(list, 0);
 }
 
 int IRAM_ATTR list_next(struct list *list, int index) {
-    int res = -1;
-    int iindex;
-    
-    mtx_lock(&list->mutex);
+    uint32_t generation;
+    int slot;
 
-    // Check index
     if (index < list->first_index) {
-        mtx_unlock(&list->mutex);    
         return -1;
     }
-    
-    // Get new internal index
-    iindex = index - list->first_index + 1;
-
-    // Get next non deleted item on list
-    for(;iindex < list->indexes;iindex++) {
-        if (!list->index[iindex].deleted) {
-           res = iindex + list->first_index;
-           break;
-        }
+
+    if (list_decode(list, index, &slot, &generation)) {
+    	if (slot >= list->slots) {
+    		return -1;
+    	}
     }
-    
-    mtx_unlock(&list->mutex);
-    
-    return res;
+
+    return list_scan(list, slot + 1);
 }
 
 void list_destroy(struct list *list, int items) {
-    int index;
-    
+    struct list_index *cindex;
+    int chunk;
+    int slot;
+
     mtx_lock(&list->mutex);
-    
+
     if (items) {
-        for(index=0;index < list->indexes;index++) {
-            if (!list->index[index].deleted) {
-                free(list->index[index].item);
+        for(slot = 0;slot < list->slots;slot++) {
+            cindex = list_slot(list, slot);
+
+            if (cindex->tag & LIST_TAG_USED) {
+                free(cindex->item);
             }
-        }        
+        }
+    }
+
+    for(chunk = 0;chunk < LIST_CHUNKS;chunk++) {
+        free(list->chunk[chunk]);
+        list->chunk[chunk] = NULL;
     }
-    
-    free(list->index);
-    
-    mtx_unlock(&list->mutex);    
+
+    list->slots = 0;
+    list->free = -1;
+
+    mtx_unlock(&list->mutex);
     mtx_destroy(&list->mutex);
 }
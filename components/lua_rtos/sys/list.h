@@ -33,22 +33,41 @@
 #include <stdint.h>
 #include <sys/mutex.h>
 
-struct list {
-    struct mtx mutex;
-    struct list_index *index;
-    struct list_index *free;
-    uint8_t indexes;
-    uint8_t first_index;
-};
+// Number of slots of the first chunk (LIST_CHUNK_BASE = 1 << LIST_CHUNK_BASE_BITS).
+// Each chunk doubles the size of the previous one.
+#define LIST_CHUNK_BASE_BITS 2
+#define LIST_CHUNK_BASE      (1 << LIST_CHUNK_BASE_BITS)
+
+// Number of chunks, and max number of slots of a list
+#define LIST_CHUNKS          12
+#define LIST_MAX_SLOTS       ((LIST_CHUNK_BASE << LIST_CHUNKS) - LIST_CHUNK_BASE)
+
+// In generational lists, handles are composed by the slot (lower LIST_SLOT_BITS
+// bits) and the slot generation
+#define LIST_SLOT_BITS       16
+#define LIST_GENERATION_MASK 0x7fff
+
+// List flags
+#define LIST_GENERATIONAL    0x01
 
 struct list_index {
     void *item;
-    uint8_t index;
-    uint8_t deleted;
-    struct list_index *next;
+    volatile uint32_t tag; // Generation << 1 | used
+    int16_t next;          // Next free slot, -1 if none
+};
+
+struct list {
+    struct mtx mutex;                              // Mutex for serialize writers
+    struct list_index *volatile chunk[LIST_CHUNKS]; // Chunks of slots
+    uint16_t used[LIST_CHUNKS];                    // Number of used slots in each chunk
+    volatile uint16_t slots;                       // Number of published slots
+    int16_t free;                                  // First free slot, -1 if none
+    uint8_t flags;
+    uint8_t first_index;
 };
 
 void list_init(struct list *list, int first_index);
+void list_init_flags(struct list *list, int first_index, uint8_t flags);
 int list_add(struct list *list, void *item, int *item_index);
 int list_get(struct list *list, int index, void **item);
 int list_remove(struct list *list, int index, int destroy);
@@ -57,4 +76,3 @@ int list_next(struct list *list, int index);
 void list_destroy(struct list *list, int items);
 
 #endif	/* LIST_H */
-
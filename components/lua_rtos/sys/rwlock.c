@@ -0,0 +1,78 @@
+/*
+ * Lua RTOS, reader / writer lock api implementation over FreeRTOS
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L. & CSS IBÉRICA, S.L.
+ * 
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ * 
+ * All rights reserved.  
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+#include <stddef.h>
+
+#include <sys/rwlock.h>
+
+void rw_init(struct rwlock *rw, const char *name) {
+	mtx_init(&rw->turn, name, NULL, 0);
+	mtx_init(&rw->state, name, NULL, 0);
+	mtx_init(&rw->room, name, NULL, 0);
+
+	rw->readers = 0;
+}
+
+void rw_rlock(struct rwlock *rw) {
+	// Wait if a writer is waiting
+	mtx_lock(&rw->turn);
+	mtx_unlock(&rw->turn);
+
+	mtx_lock(&rw->state);
+	if (++rw->readers == 1) {
+		// First reader locks the room for all readers
+		mtx_lock(&rw->room);
+	}
+	mtx_unlock(&rw->state);
+}
+
+void rw_runlock(struct rwlock *rw) {
+	mtx_lock(&rw->state);
+	if (--rw->readers == 0) {
+		// Last reader unlocks the room
+		mtx_unlock(&rw->room);
+	}
+	mtx_unlock(&rw->state);
+}
+
+void rw_wlock(struct rwlock *rw) {
+	mtx_lock(&rw->turn);
+	mtx_lock(&rw->room);
+	mtx_unlock(&rw->turn);
+}
+
+void rw_wunlock(struct rwlock *rw) {
+	mtx_unlock(&rw->room);
+}
+
+void rw_destroy(struct rwlock *rw) {
+	mtx_destroy(&rw->turn);
+	mtx_destroy(&rw->state);
+	mtx_destroy(&rw->room);
+}
@@ -0,0 +1,54 @@
+/*
+ * Lua RTOS, reader / writer lock api implementation over FreeRTOS
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * 
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ * 
+ * All rights reserved.  
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+#ifndef _RWLOCK_H
+#define	_RWLOCK_H
+
+#include <sys/mutex.h>
+
+/*
+ * A reader / writer lock. Many readers can hold the lock at the same time,
+ * writers have exclusive access. Writers have preference over new readers,
+ * so writers can't starve.
+ */
+struct rwlock {
+    struct mtx turn;  // Turnstile, taken by a waiting writer to block new readers
+    struct mtx state; // Protects the readers counter
+    struct mtx room;  // Held by the writer, or by the readers as a group
+    int readers;      // Number of readers holding the lock
+};
+
+void rw_init(struct rwlock *rw, const char *name);
+void rw_rlock(struct rwlock *rw);
+void rw_runlock(struct rwlock *rw);
+void rw_wlock(struct rwlock *rw);
+void rw_wunlock(struct rwlock *rw);
+void rw_destroy(struct rwlock *rw);
+
+#endif	/* _RWLOCK_H */
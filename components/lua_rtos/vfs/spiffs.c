@@ -34,6 +34,7 @@
 #include "esp_partition.h"
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -52,8 +53,11 @@
 #include <sys/mount.h>
 #include <sys/list.h>
 #include <sys/fcntl.h>
+#include <sys/rwlock.h>
 #include <dirent.h>
 
+#include "spiffs_index.h"
+
 static int IRAM_ATTR vfs_spiffs_open(const char *path, int flags, int mode);
 static ssize_t IRAM_ATTR vfs_spiffs_write(int fd, const void *data, size_t size);
 static ssize_t IRAM_ATTR vfs_spiffs_read(int fd, void * dst, size_t size);
@@ -77,7 +81,7 @@ typedef struct {
 
 typedef struct {
 	DIR dir;
-	spiffs_DIR spiffs_dir;
+	spiffs_index_iter_t iter;
 	char path[MAXNAMLEN + 1];
 	struct dirent ent;
 	uint8_t read_mount;
@@ -87,17 +91,28 @@ typedef struct {
 	spiffs_file spiffs_file;
 	char path[MAXNAMLEN + 1];
 	uint8_t is_dir;
+	uint8_t is_writable;
 } vfs_spiffs_file_t;
 
 
 static spiffs fs;
 static struct list files;
 
+// File system lock. Operations that only read the file system (read, lseek,
+// stat, readdir, ...) take the lock in shared mode, and can run concurrently.
+// Operations that modify the file system, or that can start a garbage
+// collection, take it in exclusive mode.
+static struct rwlock fs_lock;
+static uint8_t fs_lock_init = 0;
+
+static uint8_t fs_mounted = 0;
+static volatile TickType_t fs_last_write = 0;
+
 static u8_t *my_spiffs_work_buf;
 static u8_t *my_spiffs_fds;
 static u8_t *my_spiffs_cache;
 
-static void dir_path(char *npath, uint8_t base) {
+static void dir_path(char *npath, size_t size, uint8_t base) {
 	int len = strlen(npath);
 
 	if (base) {
@@ -132,52 +147,41 @@ static void dir_path(char *npath, uint8_t base) {
     	}
     }
 
-    strlcat(npath,"/.", PATH_MAX);
+    strlcat(npath,"/.", size);
 }
 
 static void check_path(const char *path, uint8_t *base_is_dir, uint8_t *full_is_dir, uint8_t *is_file, int *files) {
-    char bpath[PATH_MAX + 1]; // Base path
-    char fpath[PATH_MAX + 1]; // Full path
-    struct spiffs_dirent e;
-    spiffs_DIR d;
-    int file_num = 0;
+    char bpath[SPIFFS_INDEX_PATH_SIZE]; // Base path
+    spiffs_index_entry_t *entry;
 
     *files = 0;
     *base_is_dir = 0;
     *full_is_dir = 0;
     *is_file = 0;
 
-    // Get base directory name
-    strlcpy(bpath, path, PATH_MAX);
-    dir_path(bpath, 1);
-
-    // Get full directory name
-    strlcpy(fpath, path, PATH_MAX);
-    dir_path(fpath, 0);
-
-    SPIFFS_opendir(&fs, "/", &d);
-	while (SPIFFS_readdir(&d, &e)) {
-		if (!strcmp(bpath, (const char *)e.name)) {
-			*base_is_dir = 1;
-		}
+    // Get base directory name. A path that doesn't fit can't exist.
+    if (spiffs_index_canon(bpath, path, 1) < 0) {
+    	return;
+    }
 
-		if (!strcmp(fpath, (const char *)e.name)) {
-			*full_is_dir = 1;
-		}
+    spiffs_index_lock();
 
-		if (!strcmp(path, (const char *)e.name)) {
-			*is_file = 1;
-		}
+    entry = spiffs_index_find(bpath);
+    if (entry && entry->is_dir) {
+    	*base_is_dir = 1;
+    }
 
-		if (!strncmp(fpath, (const char *)e.name, min(strlen((char *)e.name), strlen(fpath) - 1))) {
-			if (strcmp(fpath, (const char *)e.name)) {
-				file_num++;
-			}
-		}
-	}
-	SPIFFS_closedir(&d);
+    entry = spiffs_index_find(path);
+    if (entry) {
+    	if (entry->is_dir) {
+    		*full_is_dir = 1;
+    		*files = entry->children;
+    	} else {
+    		*is_file = 1;
+    	}
+    }
 
-	*files = file_num;
+    spiffs_index_unlock();
 }
 
 /*
@@ -206,8 +210,8 @@ static int spiffs_result(int res) {
     }
 }
 
-static int IRAM_ATTR vfs_spiffs_open(const char *path, int flags, int mode) {
-    char npath[PATH_MAX + 1];
+static int vfs_spiffs_do_open(const char *path, int flags, int mode) {
+    char npath[SPIFFS_INDEX_PATH_SIZE + 2];
 	int fd, result = 0;
 
 	// Allocate new file
@@ -250,6 +254,8 @@ static int IRAM_ATTR vfs_spiffs_open(const char *path, int flags, int mode) {
     if (flags & O_TRUNC)
     	spiffs_mode |= SPIFFS_TRUNC;
 
+    file->is_writable = (flags != O_RDONLY);
+
     // Check path
     uint8_t base_is_dir = 0;
     uint8_t full_is_dir = 0;
@@ -268,14 +274,14 @@ static int IRAM_ATTR vfs_spiffs_open(const char *path, int flags, int mode) {
     		return -1;
     	}
 
-    	// Open the directory
-        strlcpy(npath, path, PATH_MAX);
-        dir_path((char *)npath, 0);
+    	// Open the directory. It's in the index, so it's canonical path fits.
+        spiffs_index_canon(npath, path, 0);
+        dir_path((char *)npath, sizeof(npath), 0);
 
         // Open SPIFFS file
         file->spiffs_file = SPIFFS_open(&fs, npath, SPIFFS_RDONLY, 0);
         if (file->spiffs_file < 0) {
-            result = spiffs_result(fs.err_code);
+            result = spiffs_result(file->spiffs_file);
         }
 
     	file->is_dir = 1;
@@ -289,7 +295,16 @@ static int IRAM_ATTR vfs_spiffs_open(const char *path, int flags, int mode) {
             // Open SPIFFS file
             file->spiffs_file = SPIFFS_open(&fs, path, spiffs_mode, 0);
             if (file->spiffs_file < 0) {
-                result = spiffs_result(fs.err_code);
+                result = spiffs_result(file->spiffs_file);
+            } else if (!is_file && (spiffs_mode & SPIFFS_CREAT)) {
+            	// New file
+            	spiffs_index_lock();
+            	spiffs_index_add(path, 0, 0);
+            	spiffs_index_unlock();
+            } else if (spiffs_mode & SPIFFS_TRUNC) {
+            	spiffs_index_lock();
+            	spiffs_index_set_size(path, 0, 0);
+            	spiffs_index_unlock();
             }
     	}
     }
@@ -303,6 +318,23 @@ static int IRAM_ATTR vfs_spiffs_open(const char *path, int flags, int mode) {
     return fd;
 }
 
+static int IRAM_ATTR vfs_spiffs_open(const char *path, int flags, int mode) {
+	int fd;
+
+	if (flags == O_RDONLY) {
+		rw_rlock(&fs_lock);
+		fd = vfs_spiffs_do_open(path, flags, mode);
+		rw_runlock(&fs_lock);
+	} else {
+		rw_wlock(&fs_lock);
+		fs_last_write = xTaskGetTickCount();
+		fd = vfs_spiffs_do_open(path, flags, mode);
+		rw_wunlock(&fs_lock);
+	}
+
+	return fd;
+}
+
 static ssize_t IRAM_ATTR vfs_spiffs_write(int fd, const void *data, size_t size) {
 	vfs_spiffs_file_t *file;
 	int res;
@@ -319,11 +351,26 @@ static ssize_t IRAM_ATTR vfs_spiffs_write(int fd, const void *data, size_t size)
     }
 
     // Write SPIFFS file
+    rw_wlock(&fs_lock);
+
+    fs_last_write = xTaskGetTickCount();
+
 	res = SPIFFS_write(&fs, file->spiffs_file, (void *)data, size);
 	if (res >= 0) {
+		// Update file size in index
+		s32_t pos = SPIFFS_tell(&fs, file->spiffs_file);
+		if (pos >= 0) {
+			spiffs_index_lock();
+			spiffs_index_set_size(file->path, pos, 1);
+			spiffs_index_unlock();
+		}
+
+		rw_wunlock(&fs_lock);
+
 		return res;
 	} else {
 		res = spiffs_result(fs.err_code);
+		rw_wunlock(&fs_lock);
 		if (res != 0) {
 			errno = res;
 			return -1;
@@ -349,11 +396,16 @@ static ssize_t IRAM_ATTR vfs_spiffs_read(int fd, void * dst, size_t size) {
     }
 
     // Read SPIFFS file
+    rw_rlock(&fs_lock);
+
 	res = SPIFFS_read(&fs, file->spiffs_file, dst, size);
 	if (res >= 0) {
+		rw_runlock(&fs_lock);
 		return res;
 	} else {
-		res = spiffs_result(fs.err_code);
+		// fs.err_code is shared with other readers, use the result
+		res = spiffs_result(res);
+		rw_runlock(&fs_lock);
 		if (res != 0) {
 			errno = res;
 			return -1;
@@ -367,6 +419,7 @@ static ssize_t IRAM_ATTR vfs_spiffs_read(int fd, void * dst, size_t size) {
 }
 
 static int IRAM_ATTR vfs_spiffs_fstat(int fd, struct stat * st) {
+	spiffs_index_entry_t *entry;
 	vfs_spiffs_file_t *file;
     spiffs_stat stat;
 	int res;
@@ -377,6 +430,8 @@ static int IRAM_ATTR vfs_spiffs_fstat(int fd, struct stat * st) {
 		return -1;
     }
 
+    memset(st, 0, sizeof(struct stat));
+
 	// Set block size for this file system
     st->st_blksize = CONFIG_LUA_RTOS_SPIFFS_LOG_PAGE_SIZE;
 
@@ -388,17 +443,29 @@ static int IRAM_ATTR vfs_spiffs_fstat(int fd, struct stat * st) {
     }
 
     // If is not a directory get file statistics
-    res = SPIFFS_stat(&fs, file->path, &stat);
+    rw_rlock(&fs_lock);
+
+    res = SPIFFS_fstat(&fs, file->spiffs_file, &stat);
     if (res == SPIFFS_OK) {
     	st->st_size = stat.size;
+
+    	// Same as stat
+    	spiffs_index_lock();
+    	entry = spiffs_index_find(file->path);
+    	if (entry) {
+    		st->st_ino = entry->version;
+    	}
+    	spiffs_index_unlock();
 	} else {
 		st->st_size = 0;
-	    res = spiffs_result(fs.err_code);
+	    res = spiffs_result(res);
     }
 
+    rw_runlock(&fs_lock);
+
     st->st_mode = S_IFREG;
 
-    if (res < 0) {
+    if (res != 0) {
     	errno = res;
     	return -1;
     }
@@ -416,12 +483,26 @@ static int IRAM_ATTR vfs_spiffs_close(int fd) {
 		return -1;
     }
 
-	res = SPIFFS_close(&fs, file->spiffs_file);
-	if (res) {
-		res = spiffs_result(fs.err_code);
+	// Closing a writable file flushes its cache to flash
+	if (file->is_writable) {
+		rw_wlock(&fs_lock);
+		fs_last_write = xTaskGetTickCount();
+	} else {
+		rw_rlock(&fs_lock);
 	}
 
+	res = SPIFFS_close(&fs, file->spiffs_file);
 	if (res < 0) {
+		res = spiffs_result(res);
+	}
+
+	if (file->is_writable) {
+		rw_wunlock(&fs_lock);
+	} else {
+		rw_runlock(&fs_lock);
+	}
+
+	if (res != 0) {
 		errno = res;
 		return -1;
 	}
@@ -454,38 +535,59 @@ static off_t IRAM_ATTR vfs_spiffs_lseek(int fd, off_t size, int mode) {
         case SEEK_END: whence = SPIFFS_SEEK_END;break;
     }
 
+    rw_rlock(&fs_lock);
+
     res = SPIFFS_lseek(&fs, file->spiffs_file, size, whence);
     if (res < 0) {
-        res = spiffs_result(fs.err_code);
+        res = spiffs_result(res);
+        rw_runlock(&fs_lock);
         errno = res;
         return -1;
     }
 
+    rw_runlock(&fs_lock);
+
     return res;
 }
 
 static int IRAM_ATTR vfs_spiffs_stat(const char * path, struct stat * st) {
-	int fd;
-	int res;
+	spiffs_index_entry_t *entry;
 
-	fd = vfs_spiffs_open(path, 0, 0);
-	if (fd < 0) {
-    	errno = spiffs_result(fs.err_code);
-    	return -1;
-	}
+	memset(st, 0, sizeof(struct stat));
 
-	res = vfs_spiffs_fstat(fd, st);
-	if (fd < 0) {
-    	errno = spiffs_result(fs.err_code);
+	// Set block size for this file system
+    st->st_blksize = CONFIG_LUA_RTOS_SPIFFS_LOG_PAGE_SIZE;
+
+    rw_rlock(&fs_lock);
+    spiffs_index_lock();
+
+    entry = spiffs_index_find(path);
+    if (!entry) {
+    	spiffs_index_unlock();
+    	rw_runlock(&fs_lock);
+    	errno = ENOENT;
     	return -1;
-	}
+    }
 
-	vfs_spiffs_close(fd);
+    if (entry->is_dir) {
+        st->st_mode = S_IFDIR;
+        st->st_size = 0;
+    } else {
+        st->st_mode = S_IFREG;
+        st->st_size = entry->size;
+    }
 
-	return res;
+    // There is no modification time, st_ino is the index version of the
+    // entry, that changes each time the file is modified
+    st->st_ino = entry->version;
+
+    spiffs_index_unlock();
+    rw_runlock(&fs_lock);
+
+	return 0;
 }
 
-static int IRAM_ATTR vfs_spiffs_unlink(const char *path) {
+static int vfs_spiffs_do_unlink(const char *path) {
     char npath[PATH_MAX + 1];
 
     // Check path
@@ -520,16 +622,85 @@ static int IRAM_ATTR vfs_spiffs_unlink(const char *path) {
             }
 
         	SPIFFS_close(&fs, FP);
+
+        	spiffs_index_lock();
+        	spiffs_index_remove(npath);
+        	spiffs_index_unlock();
     	}
     }
 
 	return 0;
 }
 
-static int IRAM_ATTR vfs_spiffs_rename(const char *src, const char *dst) {
-    char dpath[PATH_MAX + 1];
-    char *csrc;
-    char *cname;
+static int IRAM_ATTR vfs_spiffs_unlink(const char *path) {
+	int res;
+
+	rw_wlock(&fs_lock);
+	fs_last_write = xTaskGetTickCount();
+	res = vfs_spiffs_do_unlink(path);
+	rw_wunlock(&fs_lock);
+
+	return res;
+}
+
+// Rename the SPIFFS objects of a directory tree
+static int vfs_spiffs_rename_tree_entry(spiffs_index_entry_t *entry, const char *src, const char *dst) {
+    char spath[SPIFFS_INDEX_PATH_SIZE];
+    char dpath[SPIFFS_INDEX_PATH_SIZE];
+    spiffs_index_entry_t *child;
+
+    // Get SPIFFS object names
+    if (entry->is_dir) {
+    	snprintf(spath, sizeof(spath), "%s/.", entry->path);
+    } else {
+    	strlcpy(spath, entry->path, sizeof(spath));
+    }
+
+    if (snprintf(dpath, sizeof(dpath), "%s%s", dst, spath + strlen(src)) >= sizeof(dpath)) {
+    	errno = ENAMETOOLONG;
+    	return -1;
+    }
+
+	if (SPIFFS_rename(&fs, spath, dpath) < 0) {
+    	errno = spiffs_result(fs.err_code);
+    	return -1;
+    }
+
+	for(child = entry->child;child;child = child->sibling) {
+		if (vfs_spiffs_rename_tree_entry(child, src, dst) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int vfs_spiffs_rename_tree(const char *src, const char *dst) {
+    char csrc[SPIFFS_INDEX_PATH_SIZE];
+    char cdst[SPIFFS_INDEX_PATH_SIZE];
+    spiffs_index_entry_t *entry;
+    int res = -1;
+
+    if ((spiffs_index_canon(csrc, src, 0) < 0) || (spiffs_index_canon(cdst, dst, 0) < 0)) {
+    	errno = ENAMETOOLONG;
+    	return -1;
+    }
+
+    spiffs_index_lock();
+
+    entry = spiffs_index_find(csrc);
+    if (entry) {
+    	res = vfs_spiffs_rename_tree_entry(entry, csrc, cdst);
+    } else {
+    	errno = ENOENT;
+    }
+
+    spiffs_index_unlock();
+
+	return res;
+}
+
+static int vfs_spiffs_do_rename(const char *src, const char *dst) {
 
     // Check paths
     uint8_t src_base_is_dir = 0;
@@ -557,32 +728,11 @@ static int IRAM_ATTR vfs_spiffs_rename(const char *src, const char *dst) {
     }
 
     if (src_full_is_dir) {
-    	// We need to rename all tree
-        struct spiffs_dirent e;
-        spiffs_DIR d;
-
-    	SPIFFS_opendir(&fs, "/", &d);
-    	while (SPIFFS_readdir(&d, &e)) {
-//    		if (!strncmp(src, (const char *)e.name, min(strlen((char *)e.name), strlen(src)))) {
-    		if ( !strncmp(src, (const char *)e.name, strlen(src) ) && e.name[strlen(src)] == '/' ) {
-    			strlcpy(dpath, dst, PATH_MAX);
-    			csrc = (char *)src;
-    			cname = (char *)e.name;
-
-    			while (*csrc && *cname && (*csrc == *cname)) {
-    				++csrc;
-    				++cname;
-    			}
-
-    			strlcat(dpath, cname, PATH_MAX);
-
-    	    	if (SPIFFS_rename(&fs, (char *)e.name, dpath) < 0) {
-    	        	errno = spiffs_result(fs.err_code);
-    	        	return -1;
-    	        }
-    		}
+    	// We need to rename all tree. Get the objects to rename from the index,
+    	// and rename them in the file system.
+    	if (vfs_spiffs_rename_tree(src, dst) < 0) {
+    		return -1;
     	}
-    	SPIFFS_closedir(&d);
     } else {
     	if (SPIFFS_rename(&fs, src, dst) < 0) {
         	errno = spiffs_result(fs.err_code);
@@ -590,9 +740,24 @@ static int IRAM_ATTR vfs_spiffs_rename(const char *src, const char *dst) {
         }
     }
 
+    spiffs_index_lock();
+    spiffs_index_rename(src, dst);
+    spiffs_index_unlock();
+
 	return 0;
 }
 
+static int IRAM_ATTR vfs_spiffs_rename(const char *src, const char *dst) {
+	int res;
+
+	rw_wlock(&fs_lock);
+	fs_last_write = xTaskGetTickCount();
+	res = vfs_spiffs_do_rename(src, dst);
+	rw_wunlock(&fs_lock);
+
+	return res;
+}
+
 static DIR* vfs_spiffs_opendir(const char* name) {
     char npath[PATH_MAX + 1];
 	vfs_spiffs_dir_t *dir = calloc(1, sizeof(vfs_spiffs_dir_t));
@@ -608,27 +773,41 @@ static DIR* vfs_spiffs_opendir(const char* name) {
     uint8_t is_file = 0;
     int file_num = 0;
 
+    rw_rlock(&fs_lock);
+
     check_path(name, &base_is_dir, &full_is_dir, &is_file, &file_num);
 
 	strlcpy(npath, name, PATH_MAX);
     if (full_is_dir) {
-    	if (!SPIFFS_opendir(&fs, name, &dir->spiffs_dir)) {
+    	spiffs_index_entry_t *entry;
+
+    	spiffs_index_lock();
+
+    	entry = spiffs_index_find(name);
+    	if (!entry) {
+    		spiffs_index_unlock();
+    		rw_runlock(&fs_lock);
             free(dir);
-            errno = spiffs_result(fs.err_code);
+            errno = ENOENT;
             return NULL;
-        }
+    	}
+
+    	spiffs_index_iter_open(&dir->iter, entry);
+    	spiffs_index_unlock();
+    	rw_runlock(&fs_lock);
 
     	strlcpy(dir->path, name, MAXNAMLEN);
 
     	return (DIR *)dir;
     } else {
+    	rw_runlock(&fs_lock);
     	free(dir);
     	errno = ENOENT;
     	return NULL;
     }
 }
 
-static int vfs_spiffs_rmdir(const char* name) {
+static int vfs_spiffs_do_rmdir(const char* name) {
     char npath[PATH_MAX + 1];
 	vfs_spiffs_dir_t *dir = calloc(1, sizeof(vfs_spiffs_dir_t));
 
@@ -652,7 +831,7 @@ static int vfs_spiffs_rmdir(const char* name) {
     		return -1;
     	} else {
     	    strlcpy(npath, name, PATH_MAX);
-    	    dir_path(npath, 0);
+    	    dir_path(npath, sizeof(npath), 0);
 
 	        // Open SPIFFS file
 	    	spiffs_file FP = SPIFFS_open(&fs, npath, SPIFFS_RDWR, 0);
@@ -672,6 +851,11 @@ static int vfs_spiffs_rmdir(const char* name) {
 
         	SPIFFS_close(&fs, FP);
         	free(dir);
+
+        	spiffs_index_lock();
+        	spiffs_index_remove(npath);
+        	spiffs_index_unlock();
+
         	return 0;
     	}
     } else {
@@ -681,17 +865,23 @@ static int vfs_spiffs_rmdir(const char* name) {
     }
 }
 
+static int vfs_spiffs_rmdir(const char* name) {
+	int res;
+
+	rw_wlock(&fs_lock);
+	fs_last_write = xTaskGetTickCount();
+	res = vfs_spiffs_do_rmdir(name);
+	rw_wunlock(&fs_lock);
+
+	return res;
+}
+
 static struct dirent* vfs_spiffs_readdir(DIR* pdir) {
-    int res = 0, len = 0, entries = 0;
+    int entries = 0;
 	vfs_spiffs_dir_t* dir = (vfs_spiffs_dir_t*) pdir;
 
-	struct spiffs_dirent e;
-    struct spiffs_dirent *pe = &e;
-
     struct dirent *ent = &dir->ent;
 
-    char *fn;
-
     // Clear current dirent
     memset(ent,0,sizeof(struct dirent));
 
@@ -714,83 +904,25 @@ static struct dirent* vfs_spiffs_readdir(DIR* pdir) {
     	dir->read_mount = 1;
     }
 
-    // Search for next entry
-    for(;;) {
-        // Read directory
-        pe = SPIFFS_readdir(&dir->spiffs_dir, pe);
-        if (!pe) {
-            res = spiffs_result(fs.err_code);
-            errno = res;
-            break;
-        }
-
-        // Break condition
-        if (pe->name[0] == 0) break;
-
-        // Get name and length
-        fn = (char *)pe->name;
-        len = strlen(fn);
-
-        // Get entry type and size
-        ent->d_type = DT_REG;
-
-        if (len >= 2) {
-            if (fn[len - 1] == '.') {
-                if (fn[len - 2] == '/') {
-                    ent->d_type = DT_DIR;
-
-                    fn[len - 2] = '\0';
-
-                    len = strlen(fn);
-
-                    // Skip root dir
-                    if (len == 0) {
-                        continue;
-                    }
-                }
-            }
-        }
-
-        // Skip entries not belonged to path
-        if (strncmp(fn, dir->path, strlen(dir->path)) != 0) {
-            continue;
-        }
-
-        if (strlen(dir->path) > 1) {
-            if (*(fn + strlen(dir->path)) != '/') {
-                continue;
-            }
-        }
+    // Get next entry
+    spiffs_index_entry_t *entry;
 
-        // Skip root directory
-        fn = fn + strlen(dir->path);
-        len = strlen(fn);
-        if (len == 0) {
-            continue;
-        }
+    rw_rlock(&fs_lock);
+    spiffs_index_lock();
 
-        // Skip initial /
-        if (len > 1) {
-            if (*fn == '/') {
-                fn = fn + 1;
-                len--;
-            }
-        }
-
-        // Skip subdirectories
-        if (strchr(fn,'/')) {
-            continue;
-        }
+    entry = spiffs_index_iter_next(&dir->iter);
+    if (entry) {
+    	ent->d_type = entry->is_dir ? DT_DIR : DT_REG;
+    	ent->d_fsize = entry->is_dir ? 0 : entry->size;
 
-        ent->d_fsize = pe->size;
+    	strlcpy(ent->d_name, strrchr(entry->path, '/') + 1, MAXNAMLEN);
 
-        strlcpy(ent->d_name, fn, MAXNAMLEN);
-
-        entries++;
-
-        break;
+    	entries++;
     }
 
+    spiffs_index_unlock();
+    rw_runlock(&fs_lock);
+
     if (entries > 0) {
     	return ent;
     } else {
@@ -800,24 +932,22 @@ static struct dirent* vfs_spiffs_readdir(DIR* pdir) {
 
 static int IRAM_ATTR vfs_piffs_closedir(DIR* pdir) {
 	vfs_spiffs_dir_t* dir = (vfs_spiffs_dir_t*) pdir;
-	int res;
 
 	if (!pdir) {
 		errno = EBADF;
 		return -1;
 	}
 
-	if ((res = SPIFFS_closedir(&dir->spiffs_dir)) < 0) {
-		errno = spiffs_result(fs.err_code);;
-		return -1;
-	}
+	spiffs_index_lock();
+	spiffs_index_iter_close(&dir->iter);
+	spiffs_index_unlock();
 
 	free(dir);
 
     return 0;
 }
 
-static int IRAM_ATTR vfs_spiffs_mkdir(const char *path, mode_t mode) {
+static int vfs_spiffs_do_mkdir(const char *path, mode_t mode) {
     char npath[PATH_MAX + 1];
     //vfs_spiffs_meta_t meta;
     int res;
@@ -848,7 +978,7 @@ static int IRAM_ATTR vfs_spiffs_mkdir(const char *path, mode_t mode) {
 
     // Create directory
     strlcpy(npath, path, PATH_MAX);
-    dir_path(npath, 0);
+    dir_path(npath, sizeof(npath), 0);
 
     //meta.flags = 0;
 
@@ -871,9 +1001,73 @@ static int IRAM_ATTR vfs_spiffs_mkdir(const char *path, mode_t mode) {
         return -1;
     }
 
+    spiffs_index_lock();
+    spiffs_index_add(npath, 1, 0);
+    spiffs_index_unlock();
+
     return 0;
 }
 
+static int IRAM_ATTR vfs_spiffs_mkdir(const char *path, mode_t mode) {
+	int res;
+
+	rw_wlock(&fs_lock);
+	fs_last_write = xTaskGetTickCount();
+	res = vfs_spiffs_do_mkdir(path, mode);
+	rw_wunlock(&fs_lock);
+
+	return res;
+}
+
+#if CONFIG_LUA_RTOS_SPIFFS_GC_TASK
+// Background garbage collector. When nothing has been written for a while,
+// blocks are reclaimed one at a time until there is nothing left to do, or
+// the latency budget is exhausted. The file system lock is released after
+// each block, so a foreground write never waits for more than one block.
+//
+// When a pass finds nothing to reclaim, the file system is not scanned again
+// until there is a new write.
+static void vfs_spiffs_gc_task(void *arg) {
+	TickType_t idle = CONFIG_LUA_RTOS_SPIFFS_GC_IDLE_TIME / portTICK_PERIOD_MS;
+	TickType_t budget = CONFIG_LUA_RTOS_SPIFFS_GC_BUDGET / portTICK_PERIOD_MS;
+	TickType_t start, last_write, done_write = 0;
+	uint8_t done = 0;
+	int res;
+
+	for(;;) {
+		vTaskDelay(idle);
+
+		start = xTaskGetTickCount();
+		last_write = fs_last_write;
+		if ((start - last_write) < idle) {
+			continue;
+		}
+
+		if (done && (last_write == done_write)) {
+			// Nothing written since last pass found nothing to do
+			continue;
+		}
+
+		do {
+			rw_wlock(&fs_lock);
+
+			if (fs_mounted) {
+				res = SPIFFS_gc_step(&fs, CONFIG_LUA_RTOS_SPIFFS_GC_FREE_BLOCKS);
+			} else {
+				res = -1;
+			}
+
+			rw_wunlock(&fs_lock);
+		} while ((res == SPIFFS_OK) && ((xTaskGetTickCount() - start) < budget) && (fs_last_write == last_write));
+
+		if ((res == SPIFFS_ERR_NO_DELETED_BLOCKS) && (fs_last_write == last_write)) {
+			done = 1;
+			done_write = last_write;
+		}
+	}
+}
+#endif
+
 void vfs_spiffs_register() {
     esp_vfs_t vfs = {
         .flags = ESP_VFS_FLAG_DEFAULT,
@@ -894,6 +1088,16 @@ void vfs_spiffs_register() {
 		.rmdir = &vfs_spiffs_rmdir,
     };
 	
+    if (!fs_lock_init) {
+    	rw_init(&fs_lock, "spiffs");
+    	esp32_spiffs_lock_init();
+    	fs_lock_init = 1;
+
+#if CONFIG_LUA_RTOS_SPIFFS_GC_TASK
+    	xTaskCreatePinnedToCore(vfs_spiffs_gc_task, "spiffsgc", CONFIG_LUA_RTOS_SPIFFS_GC_STACK_SIZE, NULL, tskIDLE_PRIORITY + 1, NULL, xPortGetCoreID());
+#endif
+    }
+
     ESP_ERROR_CHECK(esp_vfs_register("/spiffs", &vfs, NULL));
 
     // Mount spiffs file system
@@ -1013,6 +1217,21 @@ void vfs_spiffs_register() {
 	    }
 	}
 
+    // Build the directory index. Directory operations depend on it, so without
+    // a complete index the file system can't be mounted.
+    if (spiffs_index_build(&fs) < 0) {
+        esp_vfs_unregister("/spiffs");
+        mount_set_mounted("spiffs", 0);
+        SPIFFS_unmount(&fs);
+        free(my_spiffs_work_buf);
+        free(my_spiffs_fds);
+        free(my_spiffs_cache);
+        syslog(LOG_ERR, "spiffs%d can't allocate memory for directory index", unit);
+        return;
+    }
+
+    fs_mounted = 1;
+
     syslog(LOG_INFO, "spiffs%d mounted", unit);
 }
 
@@ -1024,10 +1243,16 @@ void vfs_spiffs_format() {
 	esp_vfs_unregister("/spiffs");
 	mount_set_mounted("spiffs", 0);
 
+	// Wait for pending operations
+	rw_wlock(&fs_lock);
+	fs_mounted = 0;
+
 	// Unmount
     SPIFFS_unmount(&fs);
 
     res = SPIFFS_format(&fs);
+    rw_wunlock(&fs_lock);
+
     if (res < 0) {
         free(my_spiffs_work_buf);
         free(my_spiffs_fds);
@@ -1057,6 +1282,10 @@ void vfs_spiffs_format() {
         syslog(LOG_ERR, "spiffs%d can't create root folder (%s)",unit, strerror(spiffs_result(fs.err_code)));
         return;
     }
+
+    spiffs_index_lock();
+    spiffs_index_add("/", 1, 0);
+    spiffs_index_unlock();
 }
 
 #endif
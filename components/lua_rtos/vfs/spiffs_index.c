@@ -0,0 +1,555 @@
+/*
+ * Lua RTOS, spiffs directory index
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L. & CSS IBÉRICA, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+/*
+ * SPIFFS has a flat namespace, and directories are emulated with objects
+ * named "<dir>/.". This index keeps in RAM a hash table of the full paths
+ * of all the objects, and the list of children of each directory, so path
+ * resolution is O(1), and readdir is O(children), without scan the flash.
+ *
+ * The index is built at mount time, and is updated incrementally when files
+ * and directories are created, removed or renamed.
+ *
+ * SPIFFS doesn't keep a modification time, so each entry has a version that
+ * is changed when the file is created, written, truncated or renamed. Versions
+ * aren't stored in flash, they are unique only until the system restarts.
+ *
+ * All functions, except spiffs_index_build / spiffs_index_destroy, must be
+ * called with the index locked.
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_USE_SPIFFS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sys/types.h>
+
+#include <sys/mutex.h>
+
+#include "spiffs_index.h"
+
+static struct mtx index_mtx;
+static spiffs_index_entry_t **buckets = NULL;
+static uint32_t nbuckets = 0;
+static uint32_t nentries = 0;
+static uint32_t nversion = 0;
+static spiffs_index_iter_t *iters = NULL;
+
+// FNV-1a hash of a path
+static uint32_t spiffs_index_hash(const char *path) {
+	uint32_t hash = 2166136261u;
+
+	while (*path) {
+		hash = (hash ^ (uint8_t)*path++) * 16777619u;
+	}
+
+	return hash;
+}
+
+// Get a new entry version. Versions are reported in st_ino, that can be
+// narrower than 32 bits, so values that are 0 once truncated are skipped.
+static uint32_t spiffs_index_version() {
+	if ((ino_t)++nversion == 0) {
+		nversion++;
+	}
+
+	return nversion;
+}
+
+// Double the number of buckets, when the load factor is > 2
+static void spiffs_index_grow() {
+	spiffs_index_entry_t **nb;
+	spiffs_index_entry_t *entry;
+	uint32_t size, i;
+
+	if (nentries <= (nbuckets << 1)) {
+		return;
+	}
+
+	size = nbuckets << 1;
+	nb = (spiffs_index_entry_t **)calloc(size, sizeof(spiffs_index_entry_t *));
+	if (!nb) {
+		// Continue with current buckets
+		return;
+	}
+
+	for(i = 0;i < nbuckets;i++) {
+		while ((entry = buckets[i])) {
+			buckets[i] = entry->hnext;
+
+			entry->hnext = nb[entry->hash & (size - 1)];
+			nb[entry->hash & (size - 1)] = entry;
+		}
+	}
+
+	free(buckets);
+
+	buckets = nb;
+	nbuckets = size;
+}
+
+static spiffs_index_entry_t *spiffs_index_lookup(const char *cpath) {
+	spiffs_index_entry_t *entry;
+	uint32_t hash;
+
+	if (!buckets) {
+		return NULL;
+	}
+
+	hash = spiffs_index_hash(cpath);
+
+	entry = buckets[hash & (nbuckets - 1)];
+	while (entry) {
+		if ((entry->hash == hash) && (strcmp(entry->path, cpath) == 0)) {
+			return entry;
+		}
+
+		entry = entry->hnext;
+	}
+
+	return NULL;
+}
+
+static void spiffs_index_link(spiffs_index_entry_t *entry) {
+	char ppath[SPIFFS_INDEX_PATH_SIZE];
+	spiffs_index_entry_t *parent;
+
+	if (strcmp(entry->path, "/") == 0) {
+		return;
+	}
+
+	spiffs_index_canon(ppath, entry->path, 1);
+
+	parent = spiffs_index_lookup(ppath);
+	if (parent && parent->is_dir) {
+		entry->parent = parent;
+		entry->sibling = parent->child;
+		parent->child = entry;
+		parent->children++;
+	}
+}
+
+static void spiffs_index_unlink(spiffs_index_entry_t *entry) {
+	spiffs_index_entry_t **cur;
+	spiffs_index_iter_t *iter;
+
+	// Advance iterators pointing to the entry
+	for(iter = iters;iter;iter = iter->next) {
+		if (iter->cur == entry) {
+			iter->cur = entry->sibling;
+		}
+
+		if (iter->dir == entry) {
+			iter->dir = NULL;
+			iter->cur = NULL;
+		}
+	}
+
+	// Remove from parent
+	if (entry->parent) {
+		cur = &entry->parent->child;
+		while (*cur) {
+			if (*cur == entry) {
+				*cur = entry->sibling;
+				break;
+			}
+
+			cur = &(*cur)->sibling;
+		}
+
+		entry->parent->children--;
+		entry->parent = NULL;
+	}
+
+	// Orphan children
+	while (entry->child) {
+		spiffs_index_entry_t *child = entry->child;
+
+		entry->child = child->sibling;
+		child->parent = NULL;
+		child->sibling = NULL;
+	}
+
+	entry->children = 0;
+
+	// Remove from hash
+	cur = &buckets[entry->hash & (nbuckets - 1)];
+	while (*cur) {
+		if (*cur == entry) {
+			*cur = entry->hnext;
+			break;
+		}
+
+		cur = &(*cur)->hnext;
+	}
+
+	nentries--;
+}
+
+void spiffs_index_lock() {
+	mtx_lock(&index_mtx);
+}
+
+void spiffs_index_unlock() {
+	mtx_unlock(&index_mtx);
+}
+
+/*
+ * Get the canonical path of a path: no trailing "/" or "/.", and "/" for the
+ * root directory. If base is 1, the canonical path of the parent directory
+ * is returned. cpath must have SPIFFS_INDEX_PATH_SIZE bytes. Returns -1 if the
+ * path is too long to be in the file system.
+ *
+ */
+int spiffs_index_canon(char *cpath, const char *path, int base) {
+	int len;
+
+	if (strlcpy(cpath, path, SPIFFS_INDEX_PATH_SIZE) >= SPIFFS_INDEX_PATH_SIZE) {
+		strcpy(cpath, "/");
+		return -1;
+	}
+
+	len = strlen(cpath);
+
+	// Remove trailing "/" and "/."
+	for(;;) {
+		if ((len > 0) && (cpath[len - 1] == '/')) {
+			cpath[--len] = '\0';
+		} else if ((len > 1) && (cpath[len - 1] == '.') && (cpath[len - 2] == '/')) {
+			len -= 2;
+			cpath[len] = '\0';
+		} else if ((len == 1) && (cpath[0] == '.')) {
+			cpath[--len] = '\0';
+		} else {
+			break;
+		}
+	}
+
+	if (base) {
+		while ((len > 0) && (cpath[len - 1] != '/')) {
+			cpath[--len] = '\0';
+		}
+
+		while ((len > 0) && (cpath[len - 1] == '/')) {
+			cpath[--len] = '\0';
+		}
+	}
+
+	if (len == 0) {
+		strcpy(cpath, "/");
+	}
+
+	return 0;
+}
+
+spiffs_index_entry_t *spiffs_index_find(const char *path) {
+	char cpath[SPIFFS_INDEX_PATH_SIZE];
+
+	if (spiffs_index_canon(cpath, path, 0) < 0) {
+		return NULL;
+	}
+
+	return spiffs_index_lookup(cpath);
+}
+
+spiffs_index_entry_t *spiffs_index_add(const char *path, int is_dir, uint32_t size) {
+	char cpath[SPIFFS_INDEX_PATH_SIZE];
+	spiffs_index_entry_t *entry;
+
+	if (spiffs_index_canon(cpath, path, 0) < 0) {
+		return NULL;
+	}
+
+	entry = spiffs_index_lookup(cpath);
+	if (entry) {
+		// Already in index
+		entry->size = size;
+		entry->version = spiffs_index_version();
+		return entry;
+	}
+
+	if (!buckets) {
+		return NULL;
+	}
+
+	entry = (spiffs_index_entry_t *)calloc(1, sizeof(spiffs_index_entry_t) + strlen(cpath) + 1);
+	if (!entry) {
+		return NULL;
+	}
+
+	strcpy(entry->path, cpath);
+	entry->hash = spiffs_index_hash(cpath);
+	entry->is_dir = is_dir;
+	entry->size = size;
+	entry->version = spiffs_index_version();
+
+	entry->hnext = buckets[entry->hash & (nbuckets - 1)];
+	buckets[entry->hash & (nbuckets - 1)] = entry;
+	nentries++;
+
+	spiffs_index_link(entry);
+	spiffs_index_grow();
+
+	return entry;
+}
+
+void spiffs_index_remove(const char *path) {
+	spiffs_index_entry_t *entry;
+
+	entry = spiffs_index_find(path);
+	if (entry) {
+		spiffs_index_unlink(entry);
+		free(entry);
+	}
+}
+
+void spiffs_index_set_size(const char *path, uint32_t size, int grow) {
+	spiffs_index_entry_t *entry;
+
+	entry = spiffs_index_find(path);
+	if (!entry) {
+		return;
+	}
+
+	if (!grow || (size > entry->size)) {
+		entry->size = size;
+	}
+
+	// Content has changed, even if size hasn't
+	entry->version = spiffs_index_version();
+}
+
+// Rename an entry, and all it's descendants if it's a directory
+static int spiffs_index_rename_entry(spiffs_index_entry_t *entry, const char *dst) {
+	char cpath[SPIFFS_INDEX_PATH_SIZE];
+	spiffs_index_entry_t *child, *next;
+	int is_dir = entry->is_dir;
+	uint32_t size = entry->size;
+	int res = 0;
+	int len;
+
+	// Detach children, they are renamed when the new entry exists
+	child = entry->child;
+	for(next = child;next;next = next->sibling) {
+		next->parent = NULL;
+	}
+
+	entry->child = NULL;
+
+	spiffs_index_unlink(entry);
+	free(entry);
+
+	if (!spiffs_index_add(dst, is_dir, size)) {
+		res = -1;
+	}
+
+	while (child) {
+		const char *name = strrchr(child->path, '/') + 1;
+
+		next = child->sibling;
+		child->sibling = NULL;
+
+		if (strcmp(dst, "/") == 0) {
+			len = snprintf(cpath, sizeof(cpath), "/%s", name);
+		} else {
+			len = snprintf(cpath, sizeof(cpath), "%s/%s", dst, name);
+		}
+
+		if ((len >= sizeof(cpath)) || (spiffs_index_rename_entry(child, cpath) < 0)) {
+			res = -1;
+		}
+
+		child = next;
+	}
+
+	return res;
+}
+
+int spiffs_index_rename(const char *src, const char *dst) {
+	char cdst[SPIFFS_INDEX_PATH_SIZE];
+	spiffs_index_entry_t *entry;
+
+	entry = spiffs_index_find(src);
+	if (!entry) {
+		return -1;
+	}
+
+	if (spiffs_index_canon(cdst, dst, 0) < 0) {
+		return -1;
+	}
+
+	// If destination exists it's replaced
+	spiffs_index_remove(cdst);
+
+	return spiffs_index_rename_entry(entry, cdst);
+}
+
+void spiffs_index_iter_open(spiffs_index_iter_t *iter, spiffs_index_entry_t *dir) {
+	iter->dir = dir;
+	iter->cur = dir->child;
+
+	iter->next = iters;
+	iters = iter;
+}
+
+spiffs_index_entry_t *spiffs_index_iter_next(spiffs_index_iter_t *iter) {
+	spiffs_index_entry_t *entry = iter->cur;
+
+	if (entry) {
+		iter->cur = entry->sibling;
+	}
+
+	return entry;
+}
+
+void spiffs_index_iter_close(spiffs_index_iter_t *iter) {
+	spiffs_index_iter_t **cur = &iters;
+
+	while (*cur) {
+		if (*cur == iter) {
+			*cur = iter->next;
+			break;
+		}
+
+		cur = &(*cur)->next;
+	}
+}
+
+void spiffs_index_destroy() {
+	spiffs_index_entry_t *entry;
+	uint32_t i;
+
+	if (!index_mtx.sem) {
+		mtx_init(&index_mtx, NULL, NULL, 0);
+	}
+
+	mtx_lock(&index_mtx);
+
+	for(i = 0;i < nbuckets;i++) {
+		while ((entry = buckets[i])) {
+			buckets[i] = entry->hnext;
+			free(entry);
+		}
+	}
+
+	free(buckets);
+
+	buckets = NULL;
+	nbuckets = 0;
+	nentries = 0;
+
+	for(;iters;iters = iters->next) {
+		iters->dir = NULL;
+		iters->cur = NULL;
+	}
+
+	mtx_unlock(&index_mtx);
+}
+
+/*
+ * Build the index, scanning all the objects of the file system.
+ *
+ */
+int spiffs_index_build(spiffs *fs) {
+	struct spiffs_dirent e;
+	spiffs_index_entry_t *entry;
+	spiffs_DIR d;
+	int len;
+	uint32_t i;
+
+	spiffs_index_destroy();
+
+	mtx_lock(&index_mtx);
+
+	nbuckets = SPIFFS_INDEX_MIN_BUCKETS;
+	buckets = (spiffs_index_entry_t **)calloc(nbuckets, sizeof(spiffs_index_entry_t *));
+	if (!buckets) {
+		nbuckets = 0;
+		mtx_unlock(&index_mtx);
+		return -1;
+	}
+
+	// Add all objects. Parents can be found after their children, so entries are
+	// linked to their parents later.
+	SPIFFS_opendir(fs, "/", &d);
+	while (SPIFFS_readdir(&d, &e)) {
+		char *name = (char *)e.name;
+		char cpath[SPIFFS_INDEX_PATH_SIZE];
+		int is_dir = 0;
+
+		len = strlen(name);
+		if ((len >= 2) && (name[len - 1] == '.') && (name[len - 2] == '/')) {
+			is_dir = 1;
+		}
+
+		spiffs_index_canon(cpath, name, 0);
+
+		if (spiffs_index_lookup(cpath)) {
+			continue;
+		}
+
+		entry = (spiffs_index_entry_t *)calloc(1, sizeof(spiffs_index_entry_t) + strlen(cpath) + 1);
+		if (!entry) {
+			SPIFFS_closedir(&d);
+			mtx_unlock(&index_mtx);
+			spiffs_index_destroy();
+			return -1;
+		}
+
+		strcpy(entry->path, cpath);
+		entry->hash = spiffs_index_hash(cpath);
+		entry->is_dir = is_dir;
+		entry->size = is_dir ? 0 : e.size;
+
+		entry->hnext = buckets[entry->hash & (nbuckets - 1)];
+		buckets[entry->hash & (nbuckets - 1)] = entry;
+		nentries++;
+
+		spiffs_index_grow();
+	}
+	SPIFFS_closedir(&d);
+
+	// Link entries to their parents
+	for(i = 0;i < nbuckets;i++) {
+		for(entry = buckets[i];entry;entry = entry->hnext) {
+			spiffs_index_link(entry);
+		}
+	}
+
+	mtx_unlock(&index_mtx);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Lua RTOS, spiffs directory index
+ *
+ * Copyright (C) 2015 - 2017
+ * IBEROXARXA SERVICIOS INTEGRALES, S.L. & CSS IBÉRICA, S.L.
+ *
+ * Author: Jaume Olivé (jolive@iberoxarxa.com / jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaim all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ */
+
+#ifndef _SPIFFS_INDEX_H
+#define _SPIFFS_INDEX_H
+
+#include <stdint.h>
+
+#include <spiffs.h>
+
+#define SPIFFS_INDEX_MIN_BUCKETS 32
+
+// Size of a path buffer. SPIFFS object names are full paths, so no path in the
+// file system is longer than an object name.
+#define SPIFFS_INDEX_PATH_SIZE   SPIFFS_OBJ_NAME_LEN
+
+// An entry of the index, a file or a directory
+typedef struct spiffs_index_entry {
+	struct spiffs_index_entry *hnext;   // Next entry in the hash bucket
+	struct spiffs_index_entry *parent;  // Parent directory
+	struct spiffs_index_entry *child;   // First child (directories only)
+	struct spiffs_index_entry *sibling; // Next child of parent
+	uint32_t hash;                      // Path hash
+	uint32_t size;                      // File size
+	uint32_t version;                   // Changed each time the entry is modified
+	uint16_t children;                  // Number of children (directories only)
+	uint8_t is_dir;
+	char path[];                        // Canonical path ("/" for root, no trailing "/" or "/.")
+} spiffs_index_entry_t;
+
+// An iterator over the children of a directory
+typedef struct spiffs_index_iter {
+	struct spiffs_index_iter *next;     // Next open iterator
+	spiffs_index_entry_t *dir;          // Directory
+	spiffs_index_entry_t *cur;          // Next child to return
+} spiffs_index_iter_t;
+
+int spiffs_index_build(spiffs *fs);
+void spiffs_index_destroy();
+
+void spiffs_index_lock();
+void spiffs_index_unlock();
+
+int spiffs_index_canon(char *cpath, const char *path, int base);
+spiffs_index_entry_t *spiffs_index_find(const char *path);
+spiffs_index_entry_t *spiffs_index_add(const char *path, int is_dir, uint32_t size);
+void spiffs_index_remove(const char *path);
+int spiffs_index_rename(const char *src, const char *dst);
+void spiffs_index_set_size(const char *path, uint32_t size, int grow);
+
+void spiffs_index_iter_open(spiffs_index_iter_t *iter, spiffs_index_entry_t *dir);
+spiffs_index_entry_t *spiffs_index_iter_next(spiffs_index_iter_t *iter);
+void spiffs_index_iter_close(spiffs_index_iter_t *iter);
+
+#endif /* _SPIFFS_INDEX_H */
@@ -36,6 +36,27 @@
 
 #include <esp_spi_flash.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// SPIFFS core lock. All SPIFFS api calls are serialized, because the core
+// shares the work buffers, caches and file descriptors between calls.
+static SemaphoreHandle_t spiffs_mtx = NULL;
+
+void esp32_spiffs_lock_init() {
+	if (!spiffs_mtx) {
+		spiffs_mtx = xSemaphoreCreateRecursiveMutex();
+	}
+}
+
+void esp32_spiffs_lock(struct spiffs_t *fs) {
+	xSemaphoreTakeRecursive(spiffs_mtx, portMAX_DELAY);
+}
+
+void esp32_spiffs_unlock(struct spiffs_t *fs) {
+	xSemaphoreGiveRecursive(spiffs_mtx);
+}
+
 s32_t esp32_spi_flash_read(u32_t addr, u32_t size, u8_t *dst) {
 	u32_t aaddr;
 	u8_t *buff = NULL;
@@ -36,6 +36,8 @@ s32_t esp32_spi_flash_read(u32_t addr, u32_t size, u8_t *dst);
 s32_t esp32_spi_flash_write(u32_t addr, u32_t size, const u8_t *src);
 s32_t esp32_spi_flash_erase(u32_t addr, u32_t size);
 
+void esp32_spiffs_lock_init();
+
 #define low_spiffs_read  (spiffs_read *)esp32_spi_flash_read
 #define low_spiffs_write (spiffs_write *)esp32_spi_flash_write
 #define low_spiffs_erase (spiffs_erase *)esp32_spi_flash_erase
@@ -671,6 +671,23 @@ s32_t SPIFFS_gc_quick(spiffs *fs, u16_t max_free_pages);
  */
 s32_t SPIFFS_gc(spiffs *fs, u32_t size);
 
+/**
+ * Reclaims at most one block, so that garbage collecting can be done in
+ * small steps when the system is idle. A block where all pages are deleted
+ * is erased if found. If not, and the file system has min_free_blocks free
+ * blocks or less, the best candidate block is cleansed and erased, using the
+ * same heuristics as the garbage collector run from writes.
+ *
+ * Returns SPIFFS_OK if a block was erased, and SPIFFS_ERR_NO_DELETED_BLOCKS
+ * if there is nothing to reclaim. Nothing to reclaim is not an error, and
+ * doesn't set err_no.
+ *
+ * @param fs              the file system struct
+ * @param min_free_blocks candidate blocks are only cleansed when there are
+ *                        this amount of free blocks or less
+ */
+s32_t SPIFFS_gc_step(spiffs *fs, u32_t min_free_blocks);
+
 /**
  * Check if EOF reached.
  * @param fs            the file system struct
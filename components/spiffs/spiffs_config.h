@@ -192,6 +192,15 @@ typedef unsigned char u8_t;
 // SPIFFS_LOCK and SPIFFS_UNLOCK protects spiffs from reentrancy on api level
 // These should be defined on a multithreaded system
 
+#ifdef ESP_PLATFORM
+struct spiffs_t;
+void esp32_spiffs_lock(struct spiffs_t *fs);
+void esp32_spiffs_unlock(struct spiffs_t *fs);
+
+#define SPIFFS_LOCK(fs)   esp32_spiffs_lock(fs)
+#define SPIFFS_UNLOCK(fs) esp32_spiffs_unlock(fs)
+#endif
+
 // define this to enter a mutex if you're running on a multithreaded system
 #ifndef SPIFFS_LOCK
 #define SPIFFS_LOCK(fs)
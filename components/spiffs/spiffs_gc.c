@@ -195,6 +195,56 @@ s32_t spiffs_gc_check(
   return res;
 }
 
+// Reclaims at most one block, for incremental garbage collecting when the
+// file system is idle. Fully deleted blocks are erased first, as no page
+// needs to be moved. Otherwise, if there are min_free_blocks free blocks or
+// less, the best candidate block is cleansed and erased.
+// Returns SPIFFS_ERR_NO_DELETED_BLOCKS if there is nothing to reclaim.
+s32_t spiffs_gc_step(
+    spiffs *fs,
+    u32_t min_free_blocks) {
+  s32_t res;
+  spiffs_block_ix *cands;
+  int count;
+  spiffs_block_ix cand;
+
+  if (fs->stats_p_deleted == 0) {
+    return SPIFFS_ERR_NO_DELETED_BLOCKS;
+  }
+
+  res = spiffs_gc_quick(fs, 0);
+  if (res != SPIFFS_ERR_NO_DELETED_BLOCKS) {
+    return res;
+  }
+
+  if (fs->free_blocks > min_free_blocks) {
+    return SPIFFS_ERR_NO_DELETED_BLOCKS;
+  }
+
+  res = spiffs_gc_find_candidate(fs, &cands, &count, 0);
+  SPIFFS_CHECK_RES(res);
+  if (count == 0) {
+    return SPIFFS_ERR_NO_DELETED_BLOCKS;
+  }
+
+  SPIFFS_GC_DBG("gc_step: cleaning block "_SPIPRIbl", free blocks "_SPIPRIi"\n", cands[0], fs->free_blocks);
+
+#if SPIFFS_GC_STATS
+  fs->stats_gc_runs++;
+#endif
+  cand = cands[0];
+  fs->cleaning = 1;
+  res = spiffs_gc_clean(fs, cand);
+  fs->cleaning = 0;
+  SPIFFS_CHECK_RES(res);
+
+  res = spiffs_gc_erase_page_stats(fs, cand);
+  SPIFFS_CHECK_RES(res);
+
+  res = spiffs_gc_erase_block(fs, cand);
+  return res;
+}
+
 // Updates page statistics for a block that is about to be erased
 s32_t spiffs_gc_erase_page_stats(
     spiffs *fs,
@@ -0,0 +1,90 @@
+#include "luartos.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_ADC
+
+#include "unity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include <sys/delay.h>
+#include <sys/driver.h>
+
+#include <drivers/adc.h>
+
+#define STREAM_TIMER 0
+#define STREAM_SAMPLES 16
+
+static adc_channel_h_t chan;
+static uint32_t read_exception;
+static volatile int reading = 0;
+static int samples_read;
+
+// Wait for samples that never arrive, until the stream is stopped
+static void *reader(void *args) {
+	uint16_t buff[STREAM_SAMPLES];
+	driver_error_t *error;
+
+	reading = 1;
+
+	error = adc_stream_read(&chan, buff, STREAM_SAMPLES, portMAX_DELAY, &samples_read);
+	if (error) {
+		read_exception = error->exception;
+		free(error);
+	}
+
+	reading = 0;
+
+	pthread_exit(NULL);
+}
+
+TEST_CASE("adc stream stop while reading", "[adc]") {
+	adc_stream_stats_t stats;
+	driver_error_t *error;
+	pthread_t thread;
+	int pending;
+
+	error = adc_setup(CPU_ADC1, 0, 0, 0, 0, 12, &chan);
+	TEST_ASSERT_MESSAGE(error == NULL, driver_get_err_msg(error));
+
+	// One stored sample each 10 seconds, the reader is blocked until the
+	// stream is stopped
+	error = adc_stream_start(&chan, STREAM_TIMER, 10, 100, ADC_FILTER_AVG, STREAM_SAMPLES);
+	TEST_ASSERT_MESSAGE(error == NULL, driver_get_err_msg(error));
+
+	read_exception = 0;
+	samples_read = -1;
+
+	TEST_ASSERT(pthread_create(&thread, NULL, reader, NULL) == 0);
+
+	delay(100);
+	TEST_ASSERT(reading);
+
+	error = adc_stream_stats(&chan, &stats, &pending);
+	TEST_ASSERT_MESSAGE(error == NULL, driver_get_err_msg(error));
+	TEST_ASSERT(pending == 0);
+
+	// Stop returns when the reader has left the stream
+	error = adc_stream_stop(&chan);
+	TEST_ASSERT_MESSAGE(error == NULL, driver_get_err_msg(error));
+
+	pthread_join(thread, NULL);
+
+	TEST_ASSERT(samples_read == 0);
+	TEST_ASSERT(read_exception == ADC_ERR_STREAM_NOT_STARTED);
+
+	// Stream is gone
+	error = adc_stream_stats(&chan, &stats, &pending);
+	TEST_ASSERT(error != NULL);
+	TEST_ASSERT(error->exception == ADC_ERR_STREAM_NOT_STARTED);
+	free(error);
+
+	error = adc_stream_stop(&chan);
+	TEST_ASSERT(error != NULL);
+	free(error);
+}
+
+#endif
@@ -0,0 +1,193 @@
+#include "luartos.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_GDISPLAY
+
+#include "unity.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "esp_timer.h"
+
+#include <gdisplay/gdisplay.h>
+
+#define BENCH_SCENES 20
+#define BENCH_TEXTS  200
+
+#define TEXT_W 160
+#define TEXT_H 24
+
+static char text[] = "Temp 23.5 C  ";
+
+// Attach a buffered display. Nothing needs to be connected, all the tests
+// only work on the frame buffer.
+static void display_attach() {
+	driver_error_t *error;
+
+	error = gdisplay_init(CHIPSET_ILI9341, LANDSCAPE, 1, 0);
+	TEST_ASSERT_MESSAGE(error == NULL, driver_get_err_msg(error));
+
+	gdisplay_reset_clip_window();
+	gdisplay_set_transparency(0);
+}
+
+static uint32_t pixel(int x, int y) {
+	uint32_t color;
+
+	TEST_ASSERT(gdisplay_get_pixel(x, y, &color) == NULL);
+
+	return color;
+}
+
+// Get the pixels of the text area after writing text
+static void text_render(uint16_t *pixels, uint8_t transparent) {
+	gdisplay_lock();
+	gdisplay_clear(GDISPLAY_BLACK);
+	gdisplay_set_transparency(transparent);
+	gdisplay_print(0, 0, text, GDISPLAY_WHITE, GDISPLAY_BLACK);
+	gdisplay_get_bitmap(0, 0, (uint8_t *)pixels, TEXT_W, TEXT_H);
+	gdisplay_unlock();
+}
+
+TEST_CASE("gdisplay spans", "[gdisplay]") {
+	display_attach();
+
+	gdisplay_lock();
+	gdisplay_clear(GDISPLAY_BLACK);
+
+	// Filled rectangle
+	gdisplay_rect_fill(10, 10, 20, 5, GDISPLAY_RED, GDISPLAY_RED);
+
+	TEST_ASSERT(pixel(10, 10) == GDISPLAY_RED);
+	TEST_ASSERT(pixel(29, 14) == GDISPLAY_RED);
+	TEST_ASSERT(pixel(9, 10) == GDISPLAY_BLACK);
+	TEST_ASSERT(pixel(30, 14) == GDISPLAY_BLACK);
+	TEST_ASSERT(pixel(10, 15) == GDISPLAY_BLACK);
+
+	// Filled circle
+	gdisplay_circle_fill(100, 100, 10, GDISPLAY_BLUE, GDISPLAY_BLUE);
+
+	TEST_ASSERT(pixel(100, 100) == GDISPLAY_BLUE);
+	TEST_ASSERT(pixel(100, 90) == GDISPLAY_BLUE);
+	TEST_ASSERT(pixel(100, 110) == GDISPLAY_BLUE);
+	TEST_ASSERT(pixel(90, 100) == GDISPLAY_BLUE);
+	TEST_ASSERT(pixel(110, 100) == GDISPLAY_BLUE);
+	TEST_ASSERT(pixel(100, 89) == GDISPLAY_BLACK);
+	TEST_ASSERT(pixel(111, 100) == GDISPLAY_BLACK);
+
+	// Spans are clipped
+	gdisplay_set_clip_window(0, 0, 49, 49);
+	gdisplay_hline(40, 40, 20, GDISPLAY_GREEN);
+	gdisplay_vline(45, 45, 20, GDISPLAY_GREEN);
+	gdisplay_reset_clip_window();
+
+	TEST_ASSERT(pixel(49, 40) == GDISPLAY_GREEN);
+	TEST_ASSERT(pixel(50, 40) == GDISPLAY_BLACK);
+	TEST_ASSERT(pixel(45, 49) == GDISPLAY_GREEN);
+	TEST_ASSERT(pixel(45, 50) == GDISPLAY_BLACK);
+
+	gdisplay_unlock();
+}
+
+TEST_CASE("gdisplay text cache", "[gdisplay]") {
+	uint16_t *plain, *cached;
+
+	plain = malloc(TEXT_W * TEXT_H * sizeof(uint16_t));
+	cached = malloc(TEXT_W * TEXT_H * sizeof(uint16_t));
+	TEST_ASSERT(plain != NULL);
+	TEST_ASSERT(cached != NULL);
+
+	display_attach();
+	TEST_ASSERT(gdisplay_set_font(DEJAVU18_FONT, NULL) == NULL);
+
+	// Transparent text is always drawn pixel by pixel. On a black
+	// background, opaque text must give the same pixels, when it's
+	// composed for the first time and when it's taken from the cache.
+	text_render(plain, 1);
+
+	text_render(cached, 0);
+	TEST_ASSERT(memcmp(plain, cached, TEXT_W * TEXT_H * sizeof(uint16_t)) == 0);
+
+	text_render(cached, 0);
+	TEST_ASSERT(memcmp(plain, cached, TEXT_W * TEXT_H * sizeof(uint16_t)) == 0);
+
+	gdisplay_set_transparency(0);
+
+	free(plain);
+	free(cached);
+}
+
+TEST_CASE("gdisplay span benchmark", "[gdisplay][benchmark]") {
+	int64_t start, elapsed;
+	uint64_t pixels = 0;
+	int w, h, i, r;
+
+	display_attach();
+
+	gdisplay_width(&w);
+	gdisplay_height(&h);
+
+	// A fixed scene of filled rectangles and circles
+	gdisplay_lock();
+
+	start = esp_timer_get_time();
+	for(i = 0;i < BENCH_SCENES;i++) {
+		gdisplay_rect_fill(0, 0, w, h, GDISPLAY_WHITE, GDISPLAY_BLACK);
+		pixels += w * h;
+
+		for(r = 4;r <= h / 2;r += 8) {
+			gdisplay_circle_fill(w / 2, h / 2, r, GDISPLAY_RED, GDISPLAY_BLUE);
+			pixels += (uint64_t)(M_PI * r * r);
+		}
+	}
+	elapsed = esp_timer_get_time() - start;
+
+	gdisplay_unlock();
+
+	printf("gdisplay: spans %llu pixels in %lld usecs, %llu pixels/s\n",
+		pixels, elapsed, (pixels * 1000000) / elapsed
+	);
+}
+
+TEST_CASE("gdisplay text benchmark", "[gdisplay][benchmark]") {
+	gdisplay_glyph_stats_t stats;
+	int64_t start, transparent, opaque;
+	int i;
+
+	display_attach();
+	TEST_ASSERT(gdisplay_set_font(DEJAVU18_FONT, NULL) == NULL);
+
+	gdisplay_lock();
+
+	// Transparent text is drawn pixel by pixel
+	gdisplay_set_transparency(1);
+
+	start = esp_timer_get_time();
+	for(i = 0;i < BENCH_TEXTS;i++) {
+		gdisplay_print(0, 0, text, GDISPLAY_WHITE, GDISPLAY_BLACK);
+	}
+	transparent = esp_timer_get_time() - start;
+
+	// Opaque text, after the first write it's taken from the text cache
+	gdisplay_set_transparency(0);
+
+	start = esp_timer_get_time();
+	for(i = 0;i < BENCH_TEXTS;i++) {
+		gdisplay_print(0, 0, text, GDISPLAY_WHITE, GDISPLAY_BLACK);
+	}
+	opaque = esp_timer_get_time() - start;
+
+	gdisplay_unlock();
+
+	gdisplay_glyph_stats(&stats);
+
+	printf("gdisplay: text per pixel %lld ns/op, cached %lld ns/op, text hits %u, misses %u\n",
+		transparent * 1000 / BENCH_TEXTS, opaque * 1000 / BENCH_TEXTS,
+		stats.text_hits, stats.text_misses
+	);
+}
+
+#endif
@@ -0,0 +1,124 @@
+#include "unity.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "esp_timer.h"
+
+#include <sys/list.h>
+
+#define BENCH_ITEMS  1000
+#define BENCH_ROUNDS 100
+
+TEST_CASE("list handles", "[list]") {
+	struct list list;
+	int index[100];
+	void *item;
+	int i, count, stale;
+
+	list_init(&list, 1);
+
+	for(i = 0;i < 100;i++) {
+		TEST_ASSERT(list_add(&list, (void *)(intptr_t)(i + 1), &index[i]) == 0);
+	}
+
+	for(i = 0;i < 100;i++) {
+		TEST_ASSERT(list_get(&list, index[i], &item) == 0);
+		TEST_ASSERT((intptr_t)item == i + 1);
+	}
+
+	// Remove even items, and iterate
+	for(i = 0;i < 100;i += 2) {
+		TEST_ASSERT(list_remove(&list, index[i], 0) == 0);
+		TEST_ASSERT(list_get(&list, index[i], &item) != 0);
+	}
+
+	count = 0;
+	for(i = list_first(&list);i >= 0;i = list_next(&list, i)) {
+		TEST_ASSERT(list_get(&list, i, &item) == 0);
+		TEST_ASSERT(((intptr_t)item & 1) == 0);
+		count++;
+	}
+
+	TEST_ASSERT(count == 50);
+
+	// Freed slots are reused
+	TEST_ASSERT(list_add(&list, (void *)1, &i) == 0);
+	TEST_ASSERT(list_get(&list, i, &item) == 0);
+
+	list_destroy(&list, 0);
+
+	// In generational lists, a stale handle is rejected when it's slot is reused
+	list_init_flags(&list, 0, LIST_GENERATIONAL);
+
+	TEST_ASSERT(list_add(&list, (void *)1, &stale) == 0);
+	TEST_ASSERT(list_remove(&list, stale, 0) == 0);
+	TEST_ASSERT(list_add(&list, (void *)2, &i) == 0);
+	TEST_ASSERT(i != stale);
+	TEST_ASSERT(list_get(&list, stale, &item) != 0);
+	TEST_ASSERT(list_get(&list, i, &item) == 0);
+	TEST_ASSERT((intptr_t)item == 2);
+
+	list_destroy(&list, 0);
+}
+
+TEST_CASE("list benchmark", "[list][benchmark]") {
+	struct list list;
+	int *index;
+	void *item;
+	int64_t start, add, get, iterate, remove;
+	int i, j, count;
+
+	index = malloc(sizeof(int) * BENCH_ITEMS);
+	TEST_ASSERT(index != NULL);
+
+	list_init(&list, 0);
+
+	start = esp_timer_get_time();
+	for(i = 0;i < BENCH_ITEMS;i++) {
+		TEST_ASSERT(list_add(&list, (void *)(intptr_t)(i + 1), &index[i]) == 0);
+	}
+	add = esp_timer_get_time() - start;
+
+	start = esp_timer_get_time();
+	for(j = 0;j < BENCH_ROUNDS;j++) {
+		for(i = 0;i < BENCH_ITEMS;i++) {
+			list_get(&list, index[i], &item);
+		}
+	}
+	get = esp_timer_get_time() - start;
+
+	// Iterate with half of the slots free
+	for(i = 0;i < BENCH_ITEMS;i += 2) {
+		list_remove(&list, index[i], 0);
+	}
+
+	count = 0;
+	start = esp_timer_get_time();
+	for(j = 0;j < BENCH_ROUNDS;j++) {
+		for(i = list_first(&list);i >= 0;i = list_next(&list, i)) {
+			count++;
+		}
+	}
+	iterate = esp_timer_get_time() - start;
+
+	TEST_ASSERT(count == BENCH_ROUNDS * BENCH_ITEMS / 2);
+
+	start = esp_timer_get_time();
+	for(i = 1;i < BENCH_ITEMS;i += 2) {
+		list_remove(&list, index[i], 0);
+	}
+	remove = esp_timer_get_time() - start;
+
+	list_destroy(&list, 0);
+	free(index);
+
+	printf("list: add %lld ns/op, get %lld ns/op, iterate %lld ns/item, remove %lld ns/op\n",
+		add * 1000 / BENCH_ITEMS,
+		get * 1000 / (BENCH_ROUNDS * BENCH_ITEMS),
+		iterate * 1000 / (BENCH_ROUNDS * BENCH_ITEMS / 2),
+		remove * 2000 / BENCH_ITEMS
+	);
+}
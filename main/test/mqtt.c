@@ -0,0 +1,132 @@
+#include "luartos.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_MQTT
+
+#include "unity.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mqtt_topic.h"
+
+#define MAX_MATCHES 8
+
+static const char *filters[] = {
+	"a/b", "a/+", "a/#", "#", "+/b", "$SYS/x", "a/+/c", "", "sport/tennis/#", NULL
+};
+
+// Topics, and the filters that they must match, separated by spaces
+static const char *topics[][2] = {
+	{"a/b",          "a/b a/+ a/# # +/b"},
+	{"a",            "a/# #"},
+	{"a/b/c",        "a/# # a/+/c"},
+	{"$SYS/x",       "$SYS/x"},
+	{"x/b",          "# +/b"},
+	{"a/",           "a/+ a/# #"},
+	{"sport/tennis", "# sport/tennis/#"},
+	{"sport",        "#"},
+	{"",             "# "},
+	{NULL, NULL}
+};
+
+// Check that each filter in the expected list is matched once, and that
+// there are no other matches
+static void check_matches(const char *topic, const char *expected, mqtt_topic_t **match, int matches) {
+	char msg[80];
+	const char *filter;
+	int i, len, count, found;
+
+	count = 0;
+	filter = expected;
+
+	for(;;) {
+		len = strcspn(filter, " ");
+
+		found = 0;
+		for(i = 0;i < matches;i++) {
+			if ((strlen(match[i]->filter) == len) && (strncmp(match[i]->filter, filter, len) == 0)) {
+				found++;
+			}
+		}
+
+		snprintf(msg, sizeof(msg), "topic '%s', filter '%.*s'", topic, len, filter);
+		TEST_ASSERT_MESSAGE(found == 1, msg);
+		count++;
+
+		if (filter[len] == '\0') {
+			break;
+		}
+
+		filter += len + 1;
+	}
+
+	snprintf(msg, sizeof(msg), "topic '%s', %d matches", topic, matches);
+	TEST_ASSERT_MESSAGE(matches == count, msg);
+}
+
+// Add the counters of all the nodes of the trie
+static void count_topics(mqtt_topic_t *node, uint32_t *received, uint32_t *dropped) {
+	mqtt_topic_t *child;
+
+	for(child = node->child;child;child = child->next) {
+		*received += child->received;
+		*dropped += child->dropped;
+
+		count_topics(child, received, dropped);
+	}
+}
+
+TEST_CASE("mqtt topic match", "[mqtt]") {
+	mqtt_topic_t *match[MAX_MATCHES];
+	mqtt_topic_t root;
+	int i, matches;
+
+	memset(&root, 0, sizeof(root));
+
+	for(i = 0;filters[i];i++) {
+		TEST_ASSERT(mqtt_topic_add(&root, filters[i]) == 0);
+	}
+
+	// Adding a filter twice doesn't duplicate it
+	TEST_ASSERT(mqtt_topic_add(&root, "a/b") == 0);
+
+	for(i = 0;topics[i][0];i++) {
+		matches = mqtt_topic_match(&root, topics[i][0], match, MAX_MATCHES);
+		check_matches(topics[i][0], topics[i][1], match, matches);
+	}
+
+	mqtt_topic_free(&root);
+	TEST_ASSERT(root.child == NULL);
+}
+
+TEST_CASE("mqtt topic match overflow", "[mqtt]") {
+	mqtt_topic_t *match[2];
+	mqtt_topic_t root;
+	uint32_t received, dropped;
+	int matches;
+
+	memset(&root, 0, sizeof(root));
+
+	TEST_ASSERT(mqtt_topic_add(&root, "a/b") == 0);
+	TEST_ASSERT(mqtt_topic_add(&root, "a/+") == 0);
+	TEST_ASSERT(mqtt_topic_add(&root, "a/#") == 0);
+	TEST_ASSERT(mqtt_topic_add(&root, "#") == 0);
+
+	// There is only room for 2 matches, the other subscriptions must count
+	// the message as received and dropped
+	matches = mqtt_topic_match(&root, "a/b", match, 2);
+	TEST_ASSERT(matches == 2);
+
+	received = dropped = 0;
+	count_topics(&root, &received, &dropped);
+
+	TEST_ASSERT(received == 4);
+	TEST_ASSERT(dropped == 2);
+
+	TEST_ASSERT(match[0]->dropped == 0);
+	TEST_ASSERT(match[1]->dropped == 0);
+
+	mqtt_topic_free(&root);
+}
+
+#endif
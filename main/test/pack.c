@@ -0,0 +1,77 @@
+#include "unity.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "esp_timer.h"
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define BENCH_ROUNDS 10000
+
+// Returns the round trip functions to compare: pack.pack / pack.unpack, and the
+// same format compiled, as hex and as binary
+static const char *pack_bench =
+	"local fmt = pack.compile('<hHif')\n"
+	"return\n"
+	"  function(n) for i=1,n do pack.unpack(pack.pack(-1, 2, 3, 4.5)) end end,\n"
+	"  function(n) for i=1,n do fmt:unpackhex(fmt:packhex(-1, 2, 3, 4.5)) end end,\n"
+	"  function(n) for i=1,n do fmt:unpack(fmt:pack(-1, 2, 3, 4.5)) end end\n";
+
+static const char *pack_check =
+	"local fmt = pack.compile('<hHif')\n"
+	"local a, b, c, d = fmt:unpack(fmt:pack(-1, 2, 3, 4.5))\n"
+	"assert(a == -1 and b == 2 and c == 3 and d == 4.5)\n"
+	"a, b, c, d = fmt:unpackhex(fmt:packhex(-1, 2, 3, 4.5))\n"
+	"assert(a == -1 and b == 2 and c == 3 and d == 4.5)\n"
+	"a, b, c, d = pack.unpack(pack.pack(-1, 2, 3, 4.5))\n"
+	"assert(a == -1 and b == 2 and c == 3 and d == 4.5)\n"
+	"assert(fmt:size() == 12)\n";
+
+// Call the function at the top of the stack with n, and return the elapsed time
+static int64_t pack_time(lua_State *L, int n) {
+	int64_t start;
+
+	lua_pushinteger(L, n);
+
+	start = esp_timer_get_time();
+	TEST_ASSERT(lua_pcall(L, 1, 0, 0) == LUA_OK);
+
+	return esp_timer_get_time() - start;
+}
+
+TEST_CASE("pack compiled formats", "[pack]") {
+	lua_State *L = luaL_newstate();
+
+	TEST_ASSERT(L != NULL);
+	luaL_openlibs(L);
+
+	TEST_ASSERT(luaL_dostring(L, pack_check) == LUA_OK);
+
+	lua_close(L);
+}
+
+TEST_CASE("pack benchmark", "[pack][benchmark]") {
+	lua_State *L = luaL_newstate();
+	int64_t plain, hex, bin;
+
+	TEST_ASSERT(L != NULL);
+	luaL_openlibs(L);
+
+	TEST_ASSERT(luaL_loadstring(L, pack_bench) == LUA_OK);
+	TEST_ASSERT(lua_pcall(L, 0, 3, 0) == LUA_OK);
+
+	bin = pack_time(L, BENCH_ROUNDS);
+	hex = pack_time(L, BENCH_ROUNDS);
+	plain = pack_time(L, BENCH_ROUNDS);
+
+	lua_close(L);
+
+	printf("pack: pack / unpack %lld ns/op, compiled hex %lld ns/op, compiled %lld ns/op\n",
+		plain * 1000 / BENCH_ROUNDS,
+		hex * 1000 / BENCH_ROUNDS,
+		bin * 1000 / BENCH_ROUNDS
+	);
+}
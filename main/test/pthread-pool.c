@@ -0,0 +1,81 @@
+#include "unity.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "esp_timer.h"
+
+#include <pthread.h>
+
+#include <sys/delay.h>
+
+#include <pthread/_pthread.h>
+
+#define BENCH_THREADS 100
+
+static void *thread_errno(void *args) {
+	// The errno of a previous thread that ran on the same task must be reset
+	if (errno != 0) {
+		*((int *)args) = errno;
+	}
+
+	errno = EINVAL;
+
+	pthread_exit(NULL);
+}
+
+static void *thread_empty(void *args) {
+	pthread_exit(NULL);
+}
+
+TEST_CASE("pthread pool reuse", "[pthread]") {
+	pthread_pool_stats_t before, after;
+	pthread_t thread;
+	int leaked = 0;
+	int i;
+
+	_pthread_pool_stats(&before);
+
+	for(i = 0;i < 10;i++) {
+		TEST_ASSERT(pthread_create(&thread, NULL, thread_errno, &leaked) == 0);
+		TEST_ASSERT(pthread_join(thread, NULL) == 0);
+
+		// Let the thread finish, so it's task is parked
+		delay(5);
+	}
+
+	_pthread_pool_stats(&after);
+
+	TEST_ASSERT(leaked == 0);
+
+#if CONFIG_LUA_RTOS_LUA_THREAD_POOL_SIZE > 0
+	TEST_ASSERT(after.hits - before.hits >= 9);
+#endif
+}
+
+TEST_CASE("pthread pool benchmark", "[pthread][benchmark]") {
+	pthread_pool_stats_t before, after;
+	pthread_t thread;
+	int64_t start, total = 0;
+	int i;
+
+	_pthread_pool_stats(&before);
+
+	for(i = 0;i < BENCH_THREADS;i++) {
+		start = esp_timer_get_time();
+		TEST_ASSERT(pthread_create(&thread, NULL, thread_empty, NULL) == 0);
+		total += esp_timer_get_time() - start;
+
+		TEST_ASSERT(pthread_join(thread, NULL) == 0);
+		delay(5);
+	}
+
+	_pthread_pool_stats(&after);
+
+	printf("pthread: start %lld usecs, hits %u, misses %u\n",
+		total / BENCH_THREADS,
+		after.hits - before.hits,
+		after.misses - before.misses
+	);
+}
@@ -0,0 +1,156 @@
+#include "unity.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+#define NUM_FILES   2
+#define NUM_READERS 2
+#define FILE_SIZE   1024
+#define ROUNDS      50
+
+static const char *files[NUM_FILES] = {
+	"/spiffs/stress0.txt",
+	"/spiffs/stress1.txt"
+};
+
+static int errors = 0;
+static pthread_mutex_t errors_mutex;
+
+static void error(void) {
+	pthread_mutex_lock(&errors_mutex);
+	errors++;
+	pthread_mutex_unlock(&errors_mutex);
+}
+
+// Rewrites a file with a block of the same byte, changing the byte
+// in each round
+static void *writer(void *args) {
+	const char *path = files[(int)args];
+	char *buffer;
+	int i, fd;
+
+	buffer = malloc(FILE_SIZE);
+	if (!buffer) {
+		error();
+		pthread_exit(NULL);
+	}
+
+	for(i = 0;i < ROUNDS;i++) {
+		memset(buffer, 'a' + (i % 26), FILE_SIZE);
+
+		fd = open(path, O_WRONLY | O_TRUNC);
+		if (fd < 0) {
+			error();
+			continue;
+		}
+
+		if (write(fd, buffer, FILE_SIZE) != FILE_SIZE) {
+			error();
+		}
+
+		if (close(fd) != 0) {
+			error();
+		}
+	}
+
+	free(buffer);
+
+	pthread_exit(NULL);
+}
+
+// Reads all the files while they are rewritten. A reader can see a truncated
+// file, but never a read error, or a content mixed from two writes
+static void *reader(void *args) {
+	struct stat st;
+	char *buffer;
+	int i, j, k, fd, len;
+
+	buffer = malloc(FILE_SIZE);
+	if (!buffer) {
+		error();
+		pthread_exit(NULL);
+	}
+
+	for(i = 0;i < ROUNDS;i++) {
+		for(j = 0;j < NUM_FILES;j++) {
+			fd = open(files[j], O_RDONLY);
+			if (fd < 0) {
+				error();
+				continue;
+			}
+
+			if ((fstat(fd, &st) != 0) || (st.st_size > FILE_SIZE)) {
+				error();
+			}
+
+			len = read(fd, buffer, FILE_SIZE);
+			if (len < 0) {
+				error();
+			}
+
+			for(k = 1;k < len;k++) {
+				if (buffer[k] != buffer[0]) {
+					error();
+					break;
+				}
+			}
+
+			if (lseek(fd, 0, SEEK_SET) != 0) {
+				error();
+			}
+
+			if (close(fd) != 0) {
+				error();
+			}
+		}
+	}
+
+	free(buffer);
+
+	pthread_exit(NULL);
+}
+
+TEST_CASE("spiffs concurrent read / write", "[spiffs]") {
+	pthread_t threads[NUM_FILES + NUM_READERS];
+	int i, fd, ret;
+
+	errors = 0;
+
+	TEST_ASSERT(pthread_mutex_init(&errors_mutex, NULL) == 0);
+
+	for(i = 0;i < NUM_FILES;i++) {
+		fd = open(files[i], O_WRONLY | O_CREAT | O_TRUNC);
+		TEST_ASSERT(fd >= 0);
+		TEST_ASSERT(close(fd) == 0);
+	}
+
+	for(i = 0;i < NUM_FILES;i++) {
+		ret = pthread_create(&threads[i], NULL, writer, (void *)i);
+		TEST_ASSERT(ret == 0);
+	}
+
+	for(i = 0;i < NUM_READERS;i++) {
+		ret = pthread_create(&threads[NUM_FILES + i], NULL, reader, NULL);
+		TEST_ASSERT(ret == 0);
+	}
+
+	for(i = 0;i < NUM_FILES + NUM_READERS;i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	TEST_ASSERT(errors == 0);
+
+	for(i = 0;i < NUM_FILES;i++) {
+		TEST_ASSERT(unlink(files[i]) == 0);
+	}
+
+	pthread_mutex_destroy(&errors_mutex);
+}
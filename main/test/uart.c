@@ -0,0 +1,174 @@
+#include "unity.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "soc/uart_reg.h"
+
+#include <sys/delay.h>
+#include <sys/driver.h>
+
+#include <drivers/uart.h>
+
+#define UART_UNIT 2
+
+// Send bytes to the UART. The unit is in loopback mode, so they are received
+// by the same unit, and go to the framing task.
+static void send(const char *data, int len) {
+	int i;
+
+	for(i = 0;i < len;i++) {
+		uart_write(UART_UNIT, data[i]);
+	}
+}
+
+static void framing(uart_framing_t *framing) {
+	driver_error_t *error;
+
+	error = uart_framing(UART_UNIT, framing, NULL, 0);
+	TEST_ASSERT_MESSAGE(error == NULL, driver_get_err_msg(error));
+}
+
+// Check that next frame is data
+static void expect(const char *data, int len) {
+	driver_error_t *error;
+	uart_frame_t *frame;
+
+	error = uart_frame_receive(UART_UNIT, &frame, 500);
+	TEST_ASSERT_MESSAGE(error == NULL, driver_get_err_msg(error));
+	TEST_ASSERT(frame != NULL);
+
+	TEST_ASSERT(frame->len == len);
+	TEST_ASSERT(memcmp(frame->data, data, len) == 0);
+
+	free(frame);
+}
+
+// Check that there are no more frames
+static void expect_none() {
+	driver_error_t *error;
+	uart_frame_t *frame;
+
+	error = uart_frame_receive(UART_UNIT, &frame, 100);
+	TEST_ASSERT_MESSAGE(error == NULL, driver_get_err_msg(error));
+	TEST_ASSERT(frame == NULL);
+}
+
+TEST_CASE("uart framing", "[uart]") {
+	uart_framing_t cfg;
+	driver_error_t *error;
+	uart_stats_t stats;
+	uint32_t drops;
+	char c;
+
+	error = uart_init(UART_UNIT, 115200, 8, 0, 1, UART_FLAG_ALL, 1024);
+	TEST_ASSERT_MESSAGE(error == NULL, driver_get_err_msg(error));
+
+	error = uart_setup_interrupts(UART_UNIT);
+	TEST_ASSERT_MESSAGE(error == NULL, driver_get_err_msg(error));
+
+	SET_PERI_REG_MASK(UART_CONF0_REG(UART_UNIT), UART_LOOPBACK);
+
+	// Delimiter, frames longer than max are dropped
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.mode = UART_FRAME_DELIMITER;
+	cfg.start = -1;
+	cfg.delimiter = '\n';
+	cfg.max = 8;
+	framing(&cfg);
+
+	TEST_ASSERT(uart_get_stats(UART_UNIT, &stats) == NULL);
+	drops = stats.frame_drops;
+
+	send("abc\nde\n", 7);
+	expect("abc", 3);
+	expect("de", 2);
+
+	send("0123456789\nok\n", 14);
+	expect("ok", 2);
+	expect_none();
+
+	TEST_ASSERT(uart_get_stats(UART_UNIT, &stats) == NULL);
+	TEST_ASSERT(stats.frame_drops == drops + 1);
+
+	// The received bytes belong to the framing task
+	TEST_ASSERT(uart_read_bytes(UART_UNIT, &c, 1, 0) == -1);
+	TEST_ASSERT(errno == EBUSY);
+	TEST_ASSERT(uart_read(UART_UNIT, &c, 0) == 0);
+
+	error = uart_consume(UART_UNIT);
+	TEST_ASSERT(error != NULL);
+	TEST_ASSERT(error->exception == UART_ERR_FRAMING_ENABLED);
+	free(error);
+
+	// Delimiter with a start byte, bytes before the start byte are skipped
+	cfg.start = '$';
+	framing(&cfg);
+
+	send("xx$ab\n", 6);
+	expect("$ab", 3);
+
+	// Fixed length
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.mode = UART_FRAME_FIXED;
+	cfg.start = -1;
+	cfg.length = 4;
+	framing(&cfg);
+
+	send("12345678", 8);
+	expect("1234", 4);
+	expect("5678", 4);
+
+	// Length field after the start byte, with the length of the whole frame.
+	// A frame with an invalid length is discarded, and the next start byte
+	// is searched.
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.mode = UART_FRAME_LENGTH;
+	cfg.start = 0x7e;
+	cfg.offset = 1;
+	cfg.size = 1;
+	cfg.max = 16;
+	framing(&cfg);
+
+	send("\x7e\x04" "ab", 4);
+	expect("\x7e\x04" "ab", 4);
+
+	send("\x7e\x01" "\x7e\x03" "z", 5);
+	expect("\x7e\x03" "z", 3);
+	expect_none();
+
+	// Idle time ends the frame
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.mode = UART_FRAME_IDLE;
+	cfg.start = -1;
+	cfg.max = 16;
+	cfg.idle = 20;
+	framing(&cfg);
+
+	send("hello", 5);
+	expect("hello", 5);
+
+	send("world", 5);
+	delay(100);
+	send("!", 1);
+	expect("world", 5);
+	expect("!", 1);
+
+	// Disable framing, bytes can be read again
+	cfg.mode = UART_FRAME_NONE;
+	framing(&cfg);
+
+	error = uart_frame_receive(UART_UNIT, NULL, 0);
+	TEST_ASSERT(error != NULL);
+	TEST_ASSERT(error->exception == UART_ERR_FRAMING_NOT_ENABLED);
+	free(error);
+
+	send("A", 1);
+	TEST_ASSERT(uart_read(UART_UNIT, &c, 500) == 1);
+	TEST_ASSERT(c == 'A');
+
+	CLEAR_PERI_REG_MASK(UART_CONF0_REG(UART_UNIT), UART_LOOPBACK);
+}